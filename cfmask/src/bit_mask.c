@@ -0,0 +1,473 @@
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#include "const.h"
+#include "error.h"
+#include "bit_mask.h"
+
+
+/* Number of words in each block of the column pass of dilate_bit_mask */
+#define DILATE_BLOCK_WORDS 8
+
+
+/*****************************************************************************
+MODULE:  allocate_bit_mask
+
+PURPOSE: Allocate a bit mask with all of the pixel bits cleared
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int allocate_bit_mask
+(
+    int nrows,       /* I: number of rows */
+    int ncols,       /* I: number of columns */
+    Bit_mask_t *mask /* O: cleared bit mask */
+)
+{
+    char *FUNC_NAME = "allocate_bit_mask";
+
+    mask->nrows = nrows;
+    mask->ncols = ncols;
+    mask->row_words = (ncols + BIT_MASK_WORD_BITS - 1) / BIT_MASK_WORD_BITS;
+    mask->words = calloc((size_t)nrows * mask->row_words, sizeof(uint64_t));
+    if (mask->words == NULL)
+    {
+        RETURN_ERROR("Allocating bit mask memory", FUNC_NAME, FAILURE);
+    }
+    mask->own_words = true;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  bit_mask_bytes
+
+PURPOSE: Calculate the memory needed for the words of a bit mask
+
+RETURN: number of bytes
+*****************************************************************************/
+size_t bit_mask_bytes
+(
+    int nrows,       /* I: number of rows */
+    int ncols        /* I: number of columns */
+)
+{
+    int row_words = (ncols + BIT_MASK_WORD_BITS - 1) / BIT_MASK_WORD_BITS;
+
+    return (size_t)nrows * row_words * sizeof(uint64_t);
+}
+
+
+/*****************************************************************************
+MODULE:  attach_bit_mask
+
+PURPOSE: Set up a bit mask in memory owned by the caller, with all of the
+         pixel bits cleared
+
+NOTES:
+1. The memory isn't freed by free_bit_mask, it has to stay valid while the
+   mask is used.
+*****************************************************************************/
+void attach_bit_mask
+(
+    int nrows,       /* I: number of rows */
+    int ncols,       /* I: number of columns */
+    uint64_t *words, /* I: memory of bit_mask_bytes bytes, borrowed */
+    Bit_mask_t *mask /* O: cleared bit mask */
+)
+{
+    mask->nrows = nrows;
+    mask->ncols = ncols;
+    mask->row_words = (ncols + BIT_MASK_WORD_BITS - 1) / BIT_MASK_WORD_BITS;
+    mask->words = words;
+    mask->own_words = false;
+    memset(words, 0, bit_mask_bytes(nrows, ncols));
+}
+
+
+/*****************************************************************************
+MODULE:  free_bit_mask
+
+PURPOSE: Release the memory of a bit mask
+*****************************************************************************/
+void free_bit_mask
+(
+    Bit_mask_t *mask /* I/O: bit mask to release */
+)
+{
+    if (mask->own_words)
+        free(mask->words);
+    mask->words = NULL;
+}
+
+
+/*****************************************************************************
+MODULE:  set_bit_mask_pixel
+
+PURPOSE: Set the bit of a pixel.  The word is updated atomically, so threads
+         can set pixels of the same mask concurrently.
+*****************************************************************************/
+void set_bit_mask_pixel
+(
+    Bit_mask_t *mask, /* I/O: bit mask */
+    int row,          /* I: row of the pixel */
+    int col           /* I: column of the pixel */
+)
+{
+    uint64_t *word = &mask->words[(size_t)row * mask->row_words
+                                  + col / BIT_MASK_WORD_BITS];
+    uint64_t bit = (uint64_t)1 << (col % BIT_MASK_WORD_BITS);
+
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    *word |= bit;
+}
+
+
+/*****************************************************************************
+MODULE:  set_bit_mask_run
+
+PURPOSE: Set the bits of a run of pixels on a row
+*****************************************************************************/
+void set_bit_mask_run
+(
+    Bit_mask_t *mask, /* I/O: bit mask */
+    int row,          /* I: row of the run */
+    int start_col,    /* I: first column of the run */
+    int col_count     /* I: number of pixels in the run */
+)
+{
+    uint64_t *row_words = &mask->words[(size_t)row * mask->row_words];
+    int col = start_col;
+    int end_col = start_col + col_count;
+
+    while (col < end_col)
+    {
+        int bit = col % BIT_MASK_WORD_BITS;
+        int bits = BIT_MASK_WORD_BITS - bit;
+        uint64_t run_bits;
+
+        if (bits > end_col - col)
+            bits = end_col - col;
+
+        if (bits == BIT_MASK_WORD_BITS)
+            run_bits = ~(uint64_t)0;
+        else
+            run_bits = (((uint64_t)1 << bits) - 1) << bit;
+
+        row_words[col / BIT_MASK_WORD_BITS] |= run_bits;
+        col += bits;
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  or_shifted_bits
+
+PURPOSE: OR the source bits into the destination, with destination bit c
+         taken from source bit c + offset.  Source bits outside of the
+         source words are zero.
+
+NOTES:
+1. The source and destination can be the same words when the offset isn't
+   negative, since each word only reads source words at or above it.
+*****************************************************************************/
+static void or_shifted_bits
+(
+    uint64_t *dst,       /* I/O: destination words */
+    int dst_words,       /* I: number of destination words */
+    const uint64_t *src, /* I: source words */
+    int src_words,       /* I: number of source words */
+    int offset           /* I: source bit offset of destination bit 0 */
+)
+{
+    int word_offset;     /* source word of destination word 0 */
+    int bit;             /* bit offset within the source word */
+    int word;
+
+    word_offset = offset / BIT_MASK_WORD_BITS;
+    bit = offset % BIT_MASK_WORD_BITS;
+    if (bit < 0)
+    {
+        word_offset--;
+        bit += BIT_MASK_WORD_BITS;
+    }
+
+    for (word = 0; word < dst_words; word++)
+    {
+        int s = word + word_offset;
+        uint64_t low = (s >= 0 && s < src_words) ? src[s] : 0;
+        uint64_t value = low >> bit;
+
+        if (bit != 0 && s + 1 >= 0 && s + 1 < src_words)
+            value |= src[s + 1] << (BIT_MASK_WORD_BITS - bit);
+
+        dst[word] |= value;
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  dilate_bit_mask
+
+PURPOSE: Dilate the bit mask with a n x n rectangular buffer
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The rectangle is separable, so the rows are dilated first and then the
+   columns of the row result, 64 pixels at a time.
+2. A row is copied into a buffer padded by idx pixels on each side.  The
+   window of n = 2 * idx + 1 pixels starting at each position is built by
+   doubling windows, OR-ing the buffer with itself shifted by 1, 2, 4, ...
+   pixels, and the windows starting idx pixels back are the result.
+3. The columns use the van Herk/Gil-Werman method.  The rows are split into
+   blocks of n rows, and the OR of the rows from the start of the block and
+   to the end of the block are kept for each row.  The window of a row then
+   covers the end of one block and the start of the next, so it is the OR
+   of two values whatever the size of the buffer.
+*****************************************************************************/
+int dilate_bit_mask
+(
+    const Bit_mask_t *in_mask, /* I: bit mask to dilate */
+    int idx,                   /* I: pixel buffer 2 * idx + 1 */
+    Bit_mask_t *out_mask       /* O: dilated bit mask, same size */
+)
+{
+    char *FUNC_NAME = "dilate_bit_mask";
+    int nrows = in_mask->nrows;
+    int row_words = in_mask->row_words;
+    int window = 2 * idx + 1;  /* size of the buffer */
+    int pad_words;             /* padding words on each side of a row */
+    int line_words;            /* number of words in a padded row */
+    uint64_t last_word_bits;   /* valid bits of the last word of a row */
+    uint64_t *row_dilated;     /* row pass result */
+    int block_count;           /* number of word blocks in the column pass */
+    int block;
+    int row;
+    bool failed = false;
+
+    pad_words = (idx + BIT_MASK_WORD_BITS - 1) / BIT_MASK_WORD_BITS;
+    line_words = row_words + 2 * pad_words;
+    if (in_mask->ncols % BIT_MASK_WORD_BITS == 0)
+        last_word_bits = ~(uint64_t)0;
+    else
+    {
+        last_word_bits = ((uint64_t)1
+                          << (in_mask->ncols % BIT_MASK_WORD_BITS)) - 1;
+    }
+
+    row_dilated = calloc((size_t)nrows * row_words, sizeof(uint64_t));
+    if (row_dilated == NULL)
+    {
+        RETURN_ERROR("Allocating dilate memory", FUNC_NAME, FAILURE);
+    }
+
+    /* Row pass */
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        uint64_t *power;   /* windows of a power of two pixels */
+        uint64_t *starts;  /* windows of the buffer size */
+
+        power = malloc(line_words * sizeof(uint64_t));
+        starts = malloc(line_words * sizeof(uint64_t));
+        if (power == NULL || starts == NULL)
+            failed = true;
+
+#ifdef _OPENMP
+        #pragma omp for
+#endif
+        for (row = 0; row < nrows; row++)
+        {
+            const uint64_t *in_row = &in_mask->words[(size_t)row * row_words];
+            uint64_t *out_row = &row_dilated[(size_t)row * row_words];
+            int remaining = window;
+            int power_width = 1;   /* pixels in each power window */
+            int starts_width = 0;  /* pixels in each starts window */
+
+            if (failed)
+                continue;
+
+            memset(power, 0, line_words * sizeof(uint64_t));
+            memset(starts, 0, line_words * sizeof(uint64_t));
+            memcpy(&power[pad_words], in_row, row_words * sizeof(uint64_t));
+
+            while (1)
+            {
+                if (remaining & 1)
+                {
+                    or_shifted_bits(starts, line_words, power, line_words,
+                                    starts_width);
+                    starts_width += power_width;
+                }
+                remaining >>= 1;
+                if (remaining == 0)
+                    break;
+
+                or_shifted_bits(power, line_words, power, line_words,
+                                power_width);
+                power_width *= 2;
+            }
+
+            /* Output column c is the window starting at c - idx */
+            or_shifted_bits(out_row, row_words, starts, line_words,
+                            pad_words * BIT_MASK_WORD_BITS - idx);
+            out_row[row_words - 1] &= last_word_bits;
+        }
+
+        free(power);
+        free(starts);
+    }
+
+    if (failed)
+    {
+        free(row_dilated);
+        RETURN_ERROR("Allocating dilate row memory", FUNC_NAME, FAILURE);
+    }
+
+    /* Column pass, building the block starts in the output and the block
+       ends in place of the row result */
+    block_count = (row_words + DILATE_BLOCK_WORDS - 1) / DILATE_BLOCK_WORDS;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (block = 0; block < block_count; block++)
+    {
+        int s_word = block * DILATE_BLOCK_WORDS;
+        int e_word = s_word + DILATE_BLOCK_WORDS;
+        int last_block_row = ((nrows - 1) / window) * window;
+        int col_row;
+        int word;
+
+        if (e_word > row_words)
+            e_word = row_words;
+
+        for (col_row = 0; col_row < nrows; col_row++)
+        {
+            uint64_t *from_start = &out_mask->words[(size_t)col_row
+                                                    * row_words];
+            const uint64_t *in_row = &row_dilated[(size_t)col_row
+                                                  * row_words];
+
+            for (word = s_word; word < e_word; word++)
+            {
+                if (col_row % window == 0)
+                    from_start[word] = in_row[word];
+                else
+                    from_start[word] = from_start[word - row_words]
+                                       | in_row[word];
+            }
+        }
+
+        for (col_row = nrows - 2; col_row >= 0; col_row--)
+        {
+            uint64_t *to_end = &row_dilated[(size_t)col_row * row_words];
+
+            if ((col_row + 1) % window == 0)
+                continue;
+
+            for (word = s_word; word < e_word; word++)
+                to_end[word] |= to_end[word + row_words];
+        }
+
+        /* Each window reads the block start values at or below its row,
+           so they can be replaced by the result in order */
+        for (col_row = 0; col_row < nrows; col_row++)
+        {
+            uint64_t *out_row = &out_mask->words[(size_t)col_row * row_words];
+            const uint64_t *to_end = NULL;
+            const uint64_t *from_start = NULL;
+            int end_row = col_row + idx;
+
+            if (col_row - idx >= 0)
+            {
+                to_end = &row_dilated[(size_t)(col_row - idx) * row_words];
+            }
+            if (end_row < nrows)
+            {
+                from_start = &out_mask->words[(size_t)end_row * row_words];
+            }
+            else if (end_row - end_row % window == last_block_row)
+            {
+                /* Past the last row, in the same block as the last row */
+                from_start = &out_mask->words[(size_t)(nrows - 1)
+                                              * row_words];
+            }
+
+            for (word = s_word; word < e_word; word++)
+            {
+                uint64_t value = 0;
+
+                if (to_end != NULL)
+                    value = to_end[word];
+                if (from_start != NULL)
+                    value |= from_start[word];
+
+                out_row[word] = value;
+            }
+        }
+    }
+
+    free(row_dilated);
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  apply_bit_mask
+
+PURPOSE: Set the search type bit of the pixel mask where the bit mask is set
+         and clear it elsewhere, leaving the fill pixels unchanged
+*****************************************************************************/
+void apply_bit_mask
+(
+    const Bit_mask_t *mask,    /* I: bit mask to apply */
+    unsigned char search_type, /* I: pixel mask bit to set from the mask */
+    unsigned char *pixel_mask  /* I/O: pixel mask */
+)
+{
+    int nrows = mask->nrows;
+    int ncols = mask->ncols;
+    int row;
+
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (row = 0; row < nrows; row++)
+    {
+        const uint64_t *row_words = &mask->words[(size_t)row
+                                                 * mask->row_words];
+        unsigned char *mask_row = &pixel_mask[(size_t)row * ncols];
+        int col;
+
+        for (col = 0; col < ncols; col++)
+        {
+            uint64_t word = row_words[col / BIT_MASK_WORD_BITS];
+
+            /* Skip processing output that is a fill pixel */
+            if (mask_row[col] & CF_FILL_BIT)
+                continue;
+
+            if ((word >> (col % BIT_MASK_WORD_BITS)) & 1)
+                mask_row[col] |= search_type;
+            else
+                mask_row[col] &= ~search_type;
+        }
+    }
+}
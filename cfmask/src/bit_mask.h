@@ -0,0 +1,96 @@
+#ifndef BIT_MASK_H
+#define BIT_MASK_H
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/* Number of pixels in each word of a bit mask */
+#define BIT_MASK_WORD_BITS 64
+
+/* Image sized plane with one bit for each pixel.  The columns of each row
+   are packed into words, lowest column in the lowest bit, and the bits past
+   the last column are always zero. */
+typedef struct
+{
+    uint64_t *words;    /* packed pixel bits, row by row */
+    int nrows;          /* number of rows */
+    int ncols;          /* number of columns */
+    int row_words;      /* number of words in each row */
+    bool own_words;     /* the words are freed with the mask */
+} Bit_mask_t;
+
+
+/* Test the bit of a pixel */
+#define BIT_MASK_TEST(mask, row, col) \
+    (((mask)->words[(size_t)(row) * (mask)->row_words \
+                    + (col) / BIT_MASK_WORD_BITS] \
+      >> ((col) % BIT_MASK_WORD_BITS)) & 1)
+
+
+int allocate_bit_mask
+(
+    int nrows,       /* I: number of rows */
+    int ncols,       /* I: number of columns */
+    Bit_mask_t *mask /* O: cleared bit mask */
+);
+
+
+size_t bit_mask_bytes
+(
+    int nrows,       /* I: number of rows */
+    int ncols        /* I: number of columns */
+);
+
+
+void attach_bit_mask
+(
+    int nrows,       /* I: number of rows */
+    int ncols,       /* I: number of columns */
+    uint64_t *words, /* I: memory of bit_mask_bytes bytes, borrowed */
+    Bit_mask_t *mask /* O: cleared bit mask */
+);
+
+
+void free_bit_mask
+(
+    Bit_mask_t *mask /* I/O: bit mask to release */
+);
+
+
+void set_bit_mask_pixel
+(
+    Bit_mask_t *mask, /* I/O: bit mask */
+    int row,          /* I: row of the pixel */
+    int col           /* I: column of the pixel */
+);
+
+
+void set_bit_mask_run
+(
+    Bit_mask_t *mask, /* I/O: bit mask */
+    int row,          /* I: row of the run */
+    int start_col,    /* I: first column of the run */
+    int col_count     /* I: number of pixels in the run */
+);
+
+
+int dilate_bit_mask
+(
+    const Bit_mask_t *in_mask, /* I: bit mask to dilate */
+    int idx,                   /* I: pixel buffer 2 * idx + 1 */
+    Bit_mask_t *out_mask       /* O: dilated bit mask, same size */
+);
+
+
+void apply_bit_mask
+(
+    const Bit_mask_t *mask,    /* I: bit mask to apply */
+    unsigned char search_type, /* I: pixel mask bit to set from the mask */
+    unsigned char *pixel_mask  /* I/O: pixel mask */
+);
+
+
+#endif
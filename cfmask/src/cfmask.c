@@ -2,6 +2,7 @@
 
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 
 #include "espa_metadata.h"
@@ -17,98 +18,234 @@
 #include "input.h"
 #include "output.h"
 #include "misc.h"
-#include "potential_cloud_shadow_snow_mask.h"
-#include "object_cloud_shadow_match.h"
-#include "convert_and_generate_statistics.h"
+#include "profile.h"
+#include "threads.h"
+#include "stage_cache.h"
+#include "libcfmask.h"
 #include "cfmask.h"
 
 
+/* Name of the stage cache file of a scene, after its XML file name */
+#define STAGE_CACHE_SUFFIX "_cfmask_stages.cache"
+
+
+/* Processing options shared by all of the scenes */
+typedef struct
+{
+    Cfmask_params_t params;  /* masking parameters */
+    bool cache_bands;        /* should the input bands be kept in memory? */
+    bool use_mmap;           /* should the input bands be memory mapped? */
+    int memory_cap;          /* memory cap in megabytes, 0 for no cap */
+    int output_format;       /* OUTPUT_FORMAT_ENVI or OUTPUT_FORMAT_TIFF */
+    int estimate_stride;     /* sample stride of the cloud cover estimate,
+                                0 for the full masking */
+    bool estimate_preview;   /* write the preview mask of the estimate */
+    bool stage_cache;        /* keep the stage intermediates of each scene
+                                in a sidecar file next to its XML file */
+} Cfmask_options_t;
+
+/* Scene sized masks and scratch buffers, kept from one scene to the next of
+   a batch so scenes of the same size don't allocate them again */
+typedef struct
+{
+    unsigned char *pixel_mask; /* pixel mask */
+    unsigned char *conf_mask;  /* confidence mask */
+    int pixel_count;           /* number of pixels allocated */
+    Scratch_pool_t pool;       /* scratch buffers of the stages */
+} Scene_buffers_t;
+
+
+/* Write of an output band on its own thread */
+typedef struct
+{
+    Output_t *output;                   /* opened output band */
+    unsigned char *mask;                /* mask to write */
+    Espa_internal_meta_t *xml_metadata; /* input metadata */
+    const char *stage_name;             /* profile stage of the write */
+    int status;                         /* SUCCESS or FAILURE of the write */
+} Band_writer_t;
+
+
 /*****************************************************************************
-METHOD:  cfmask
+MODULE:  write_output_band
 
-PURPOSE:  The main routine for fmask written in C
+PURPOSE: Write a mask to an opened output band and close it, with its ENVI
+         header when the band is raw binary
 
-RETURN VALUE: Type = int
-    Value           Description
-    -----           -----------
-    ERROR           An error occurred during processing of cfmask
-    SUCCESS         Processing was successful
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The band isn't appended to the XML file here, so the bands of the scene
+   can be appended with one XML update.  The output structure is left for
+   the caller to free.
 *****************************************************************************/
-int
-main (int argc, char *argv[])
+static int write_output_band
+(
+    Output_t *output,                   /* I: opened output band */
+    unsigned char *mask,                /* I: mask to write */
+    Espa_internal_meta_t *xml_metadata, /* I: input metadata */
+    const char *stage_name              /* I: profile stage of the write */
+)
 {
-    char *FUNC_NAME = "main";
+    char *FUNC_NAME = "write_output_band";
     char *ext = NULL;            /* pointer to the file extension */
-    char *xml_name = NULL;       /* input XML filename */
     char envi_file[MAX_STR_LEN]; /* output ENVI file name */
     char temp_file[MAX_STR_LEN]; /* temp file name */
+    Envi_header_t envi_hdr;      /* output ENVI header information */
+    int stage;                   /* profile stage */
+    bool put_ok;
 
-    int status;
-    int band_index;
+    stage = profile_begin(stage_name);
+    put_ok = PutOutput(output, mask);
 
-    bool verbose;            /* verbose flag for printing messages */
-    bool use_cirrus;         /* should we use Cirrus during determination? */
-    bool use_thermal;        /* should we use Thermal during determination? */
+    /* Close the output file */
+    if (!CloseOutput(output))
+    {
+        RETURN_ERROR("closing output file", FUNC_NAME, FAILURE);
+    }
+    if (!put_ok)
+    {
+        RETURN_ERROR("Writing output fmask files", FUNC_NAME, FAILURE);
+    }
+    profile_end(stage);
 
-    Input_t *input = NULL;    /* input data and meta data */
-    Output_t *output = NULL;  /* output structure and metadata */
-    Espa_internal_meta_t xml_metadata; /* XML metadata structure */
-    Envi_header_t envi_hdr;            /* output ENVI header information */
+    /* The TIFF bands describe themselves */
+    if (output->format == OUTPUT_FORMAT_TIFF)
+        return SUCCESS;
 
-    unsigned char *pixel_mask = NULL; /* pixel mask */
-    unsigned char *conf_mask = NULL;  /* confidence mask */
+    /* Create the ENVI header file this band */
+    if (create_envi_struct(&output->metadata.band[0], &xml_metadata->global,
+                           &envi_hdr) != SUCCESS)
+    {
+        RETURN_ERROR("Creating ENVI header structure.", FUNC_NAME, FAILURE);
+    }
 
-    float clear_ptm;          /* percent of clear-sky pixels */
-    float t_templ = 0.0;      /* percentile of low background temperature */
-    float t_temph = 0.0;      /* percentile of high background temperature */
+    /* Write the ENVI header */
+    snprintf(temp_file, sizeof(temp_file), "%s",
+             output->metadata.band[0].file_name);
+    ext = strrchr(temp_file, '.');
+    if (ext == NULL)
+    {
+        RETURN_ERROR("error in ENVI header filename", FUNC_NAME, FAILURE);
+    }
 
-    int cldpix = 2;           /* Default buffer for cloud pixel dilate */
-    int sdpix = 2;            /* Default buffer for shadow pixel dilate */
-    float cloud_prob;         /* Default cloud probability */
-    float sun_azi_temp = 0.0; /* Keep the original sun azimuth angle */
+    ext[0] = '\0';
+    snprintf(envi_file, sizeof(envi_file), "%s.hdr", temp_file);
+    if (write_envi_hdr(envi_file, &envi_hdr) != SUCCESS)
+    {
+        RETURN_ERROR("Writing ENVI header file.", FUNC_NAME, FAILURE);
+    }
 
-    int pixel_count;
-    int pixel_index;
+    return SUCCESS;
+}
 
-    time_t now;
-    time(&now);
 
-    /* Read the command-line arguments, including the name of the input
-       Landsat TOA reflectance product and the DEM */
-    status = get_args(argc, argv, &xml_name, &cloud_prob, &cldpix,
-                      &sdpix, &use_cirrus, &use_thermal, &verbose);
-    if (status != SUCCESS)
-    {
-        RETURN_ERROR("calling get_args", FUNC_NAME, EXIT_FAILURE);
-    }
+/*****************************************************************************
+MODULE:  band_writer_thread
 
-    printf("CFmask start_time=%s\n", ctime(&now));
+PURPOSE: Thread routine running write_output_band for a Band_writer_t
 
-    /* Validate the input metadata file */
-    if (validate_xml_file(xml_name) != SUCCESS)
+RETURN: NULL, the status of the write is kept in the Band_writer_t
+*****************************************************************************/
+static void *band_writer_thread
+(
+    void *arg /* I/O: Band_writer_t of the band */
+)
+{
+    Band_writer_t *writer = arg;
+
+    writer->status = write_output_band(writer->output, writer->mask,
+                                       writer->xml_metadata,
+                                       writer->stage_name);
+
+    return NULL;
+}
+
+
+/*****************************************************************************
+MODULE:  append_output_bands
+
+PURPOSE: Append the bands of the outputs to the XML file with one update
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int append_output_bands
+(
+    Output_t *first_output,  /* I: first output, appended first */
+    Output_t *second_output, /* I: second output */
+    char *xml_name           /* I: XML file to append to */
+)
+{
+    char *FUNC_NAME = "append_output_bands";
+    Espa_band_meta_t *bands = NULL; /* bands of both outputs */
+    int band_count = first_output->nband + second_output->nband;
+    int band_index;
+    int status;
+
+    bands = malloc(band_count * sizeof(*bands));
+    if (bands == NULL)
     {
-        RETURN_ERROR("XML validation error", FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Allocating the output band list", FUNC_NAME, FAILURE);
     }
 
-    /* Initialize the metadata structure */
-    init_metadata_struct(&xml_metadata);
-
-    /* Parse the metadata file into our internal metadata structure; also
-       allocates space as needed for various pointers in the global and band
-       metadata */
-    if (parse_metadata(xml_name, &xml_metadata) != SUCCESS)
+    for (band_index = 0; band_index < first_output->nband; band_index++)
+        bands[band_index] = first_output->metadata.band[band_index];
+    for (band_index = 0; band_index < second_output->nband; band_index++)
     {
-        RETURN_ERROR("XML parsing error", FUNC_NAME, EXIT_FAILURE);
+        bands[first_output->nband + band_index]
+            = second_output->metadata.band[band_index];
     }
 
-    /* Open input file, read metadata, and set up buffers */
-    input = OpenInput(&xml_metadata, use_thermal);
-    if (input == NULL)
+    status = append_metadata(band_count, bands, xml_name);
+    free(bands);
+    if (status != SUCCESS)
     {
-        RETURN_ERROR("opening input data specified in input XML",
-                     FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Appending spectral index bands to XML file.",
+                     FUNC_NAME, FAILURE);
     }
 
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  mask_scene
+
+PURPOSE: Build the cloud, shadow, snow and water masks of an opened scene and
+         write the cfmask and confidence bands
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int mask_scene
+(
+    Input_t *input,                     /* I: opened input scene */
+    Espa_internal_meta_t *xml_metadata, /* I: input metadata */
+    char *xml_name,                     /* I: XML file of the scene */
+    const Cfmask_options_t *options,    /* I: processing options */
+    Scene_buffers_t *buffers            /* I/O: scene sized masks */
+)
+{
+    char *FUNC_NAME = "mask_scene";
+    Output_t *output = NULL;  /* cfmask output structure and metadata */
+    Output_t *conf_output = NULL; /* confidence output structure */
+    Band_writer_t conf_writer; /* write of the confidence band */
+    pthread_t writer_thread;  /* thread writing the confidence band */
+    bool writer_started;      /* the writer thread is running */
+    Cfmask_context_t context; /* masking of the scene */
+    Stage_cache_t stage_cache; /* stages kept for the scene */
+    unsigned char *pixel_mask = NULL; /* pixel mask */
+    unsigned char *conf_mask = NULL;  /* confidence mask */
+    bool cache_bands = options->cache_bands; /* keep the bands in memory */
+    bool verbose = options->params.verbose; /* verbose flag for printing
+                                               messages */
+    int status;
+    int stage;
+    int band_index;
+    int pixel_count;
+
     if (verbose)
     {
         /* Print some info to show how the input metadata works */
@@ -136,228 +273,620 @@ main (int argc, char *argv[])
         printf("SUN ZENITH is %f\n", input->meta.sun_zen);
     }
 
-    /* If the scene is an ascending polar scene (flipped upside down), then
-       the solar azimuth needs to be adjusted by 180 degrees.  The scene in
-       this case would be north down and the solar azimuth is based on north
-       being up clock-wise direction. Flip the south to be up will not change
-       the actual sun location, with the below relations, the solar azimuth
-       angle will need add in 180.0 for correct sun location */
-    if (input->meta.ul_corner.lat < input->meta.lr_corner.lat)
+    /* Check the scene buffers fit in the memory cap, and only keep the
+       bands in memory if they fit as well */
+    if (options->memory_cap > 0)
     {
-        /* Keep the original solar azimuth angle */
-        sun_azi_temp = input->meta.sun_az;
-        input->meta.sun_az += 180.0;
-        if (input->meta.sun_az > 360.0)
+        long mega = 1024 * 1024;
+        long scene_pixels = (long)input->size.l * input->size.s;
+        long scene_mb = (scene_pixels * SCENE_BYTES_PER_PIXEL + mega - 1)
+                        / mega;
+        long cache_mb;
+        int cache_band_count = 0;
+
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
         {
-            input->meta.sun_az -= 360.0;
+            if (input->open[band_index])
+                cache_band_count++;
         }
+        cache_mb = (scene_pixels * cache_band_count * sizeof(int16)
+                    + mega - 1) / mega;
+
         if (verbose)
         {
-            printf("Polar or ascending scene."
-                    "  Readjusting solar azimuth by 180 degrees.\n"
-                    "  New value: %f degrees\n", input->meta.sun_az);
+            printf("Scene buffers: %ld MB, band cache: %ld MB,"
+                   " memory cap: %d MB\n", scene_mb, cache_mb,
+                   options->memory_cap);
+        }
+
+        if (scene_mb > options->memory_cap)
+        {
+            char errstr[MAX_STR_LEN];
+            snprintf(errstr, sizeof(errstr), "The scene buffers need %ld MB,"
+                     " more than the memory cap of %d MB", scene_mb,
+                     options->memory_cap);
+            RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+        }
+
+        if (cache_bands && scene_mb + cache_mb > options->memory_cap)
+        {
+            printf("The band cache doesn't fit in the memory cap,"
+                   " reading the bands line by line\n");
+            cache_bands = false;
         }
     }
 
+    /* Read each band once and keep it in memory for all of the passes */
+    if (cache_bands)
+    {
+        stage = profile_begin("CacheInput");
+        if (!CacheInput(input))
+        {
+            RETURN_ERROR("caching the input bands", FUNC_NAME, FAILURE);
+        }
+        profile_end(stage);
+    }
+
     pixel_count = input->size.l * input->size.s;
 
-    /* Dynamic allocate the 2d mask memory */
-    pixel_mask = calloc(pixel_count, sizeof(unsigned char));
-    if (pixel_mask == NULL)
+    /* Dynamic allocate the 2d mask memory, unless the previous scene had the
+       same size */
+    if (buffers->pixel_count != pixel_count)
     {
-        RETURN_ERROR("Allocating pixel mask memory", FUNC_NAME, EXIT_FAILURE);
+        free(buffers->pixel_mask);
+        free(buffers->conf_mask);
+        buffers->pixel_count = 0;
+
+        buffers->pixel_mask = calloc(pixel_count, sizeof(unsigned char));
+        if (buffers->pixel_mask == NULL)
+        {
+            RETURN_ERROR("Allocating pixel mask memory", FUNC_NAME, FAILURE);
+        }
+
+        buffers->conf_mask = calloc(pixel_count, sizeof(unsigned char));
+        if (buffers->conf_mask == NULL)
+        {
+            RETURN_ERROR("Allocating confidence mask memory",
+                         FUNC_NAME, FAILURE);
+        }
+        buffers->pixel_count = pixel_count;
     }
+    pixel_mask = buffers->pixel_mask;
+    conf_mask = buffers->conf_mask;
 
-    conf_mask = calloc(pixel_count, sizeof(unsigned char));
-    if (conf_mask == NULL)
+    /* Build the masks */
+    if (cfmask_init_context(input, &options->params, &context) != SUCCESS)
     {
-        RETURN_ERROR("Allocating confidence mask memory",
-                     FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Setting up the masking", FUNC_NAME, FAILURE);
     }
+    cfmask_use_scratch_pool(&context, &buffers->pool);
 
-    /* Initialize the mask to clear data */
-    for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+    /* The stage cache is next to the XML file, named after it */
+    memset(&stage_cache, 0, sizeof(stage_cache));
+    if (options->stage_cache)
     {
-        pixel_mask[pixel_index] = CF_NO_BITS;
-        conf_mask[pixel_index] = CLOUD_CONFIDENCE_NONE;
+        char cache_name[MAX_STR_LEN]; /* stage cache file name */
+        int name_length = strlen(xml_name);
+
+        if (name_length > 4 && strcmp(&xml_name[name_length - 4], ".xml") == 0)
+            name_length -= 4;
+        snprintf(cache_name, sizeof(cache_name), "%.*s%s", name_length,
+                 xml_name, STAGE_CACHE_SUFFIX);
+
+        if (open_stage_cache(cache_name, input,
+                             options->params.use_cirrus,
+                             options->params.use_thermal, &stage_cache)
+            != SUCCESS)
+        {
+            cfmask_free_context(&context);
+            RETURN_ERROR("Opening the stage cache", FUNC_NAME, FAILURE);
+        }
+        cfmask_use_stage_cache(&context, &stage_cache);
     }
 
-    /* Build the potential cloud, shadow, snow, water mask */
-    status = potential_cloud_shadow_snow_mask(input, cloud_prob, &clear_ptm,
-                                              &t_templ, &t_temph, pixel_mask,
-                                              conf_mask, use_cirrus,
-                                              use_thermal, verbose);
-    if (status != SUCCESS)
+    if (cfmask_potential_mask(&context, pixel_mask, conf_mask) != SUCCESS)
     {
-        RETURN_ERROR("processing potential_cloud_shadow_snow_mask",
-                     FUNC_NAME, EXIT_FAILURE);
+        cfmask_free_context(&context);
+        free_stage_cache(&stage_cache);
+        RETURN_ERROR("Building the potential masks", FUNC_NAME, FAILURE);
     }
-    printf("Potential Cloud Shadow: Done\n");
 
-    /* Build the final cloud shadow based on geometry matching and
-       combine the final cloud, shadow, snow, water masks into fmask
-       the pixel_mask is a bit mask as input and a value mask as output */
-    int data_count = 0;
-    status = object_cloud_shadow_match(input, clear_ptm, t_templ, t_temph,
-                                       cldpix, sdpix, pixel_mask, &data_count,
-                                       use_thermal, verbose);
-    if (status != SUCCESS)
+    /* The confidence mask is final, so it is written by another thread
+       while the shadows are matched.  The output is opened here since it
+       reads the input metadata the shadow matching adjusts. */
+    conf_output = OpenOutputConfidence(xml_metadata, input,
+                                       options->output_format);
+    if (conf_output == NULL)
     {
-        RETURN_ERROR("processing object_cloud_and_shadow_match",
-                     FUNC_NAME, EXIT_FAILURE);
+        cfmask_free_context(&context);
+        free_stage_cache(&stage_cache);
+        RETURN_ERROR("Opening output file", FUNC_NAME, FAILURE);
     }
-    printf("Object Cloud Shadow Matching: Done\n");
 
-    /* Convert the pixel_mask to a value mask
-       Also retrieve and report statistics */
-    float clear_percent = 0; /* Percent of clear pixels in the image data */
-    float cloud_percent = 0; /* Percent of cloud pixels in the image data */
-    float cloud_shadow_percent = 0; /* Percent of cloud shadow pixels in the
-                                       image data */
-    float water_percent = 0; /* Percent of water pixels in the image data */
-    float snow_percent = 0;  /* Percent of snow pixels in the image data */
-    convert_and_generate_statistics(verbose, pixel_mask,
-                                    input->size.l * input->size.s,
-                                    data_count, &clear_percent,
-                                    &cloud_percent, &cloud_shadow_percent,
-                                    &water_percent, &snow_percent);
-    printf("Statistics Generation: Done\n");
+    conf_writer.output = conf_output;
+    conf_writer.mask = conf_mask;
+    conf_writer.xml_metadata = xml_metadata;
+    conf_writer.stage_name = "PutOutput confidence";
+    conf_writer.status = FAILURE;
+    writer_started = (pthread_create(&writer_thread, NULL,
+                                     band_writer_thread, &conf_writer) == 0);
+    if (!writer_started)
+    {
+        /* Write the band in this thread instead */
+        band_writer_thread(&conf_writer);
+    }
 
-    /* Reassign solar azimuth angle for output purpose if south up north
-       down scene is involved */
-    if (input->meta.ul_corner.lat < input->meta.lr_corner.lat)
+    status = cfmask_shadow_match(&context, pixel_mask);
+    if (status == SUCCESS)
     {
-        input->meta.sun_az = sun_azi_temp;
+        /* Open the output file */
+        output = OpenOutputCFmask(xml_metadata, input, context.clear_percent,
+                                  context.cloud_percent,
+                                  context.cloud_shadow_percent,
+                                  context.water_percent,
+                                  context.snow_percent,
+                                  options->output_format);
+        if (output == NULL)
+        {
+            ERROR_MESSAGE("Opening output file", FUNC_NAME);
+            status = FAILURE;
+        }
+        else if (write_output_band(output, pixel_mask, xml_metadata,
+                                   "PutOutput cfmask") != SUCCESS)
+        {
+            ERROR_MESSAGE("Writing the cfmask band", FUNC_NAME);
+            status = FAILURE;
+        }
     }
+    cfmask_free_context(&context);
 
-    /* Open the output file */
-    output = OpenOutputCFmask(&xml_metadata, input, clear_percent,
-                              cloud_percent, cloud_shadow_percent,
-                              water_percent, snow_percent);
-    if (output == NULL)
+    if (writer_started)
+        pthread_join(writer_thread, NULL);
+    if (conf_writer.status != SUCCESS)
     {
-        RETURN_ERROR("Opening output file", FUNC_NAME, EXIT_FAILURE);
+        ERROR_MESSAGE("Writing the confidence band", FUNC_NAME);
+        status = FAILURE;
     }
 
-    if (!PutOutput(output, pixel_mask))
+    /* Append both bands with one update of the XML file */
+    if (status == SUCCESS
+        && append_output_bands(output, conf_output, xml_name) != SUCCESS)
     {
-        RETURN_ERROR("Writing output fmask files", FUNC_NAME, EXIT_FAILURE);
+        status = FAILURE;
     }
 
-    /* Close the output file */
-    if (!CloseOutput(output))
+    /* The stages are only kept for a scene that was masked */
+    if (status == SUCCESS && options->stage_cache
+        && write_stage_cache(&stage_cache) != SUCCESS)
     {
-        RETURN_ERROR("closing output file", FUNC_NAME, EXIT_FAILURE);
+        ERROR_MESSAGE("Writing the stage cache", FUNC_NAME);
+        status = FAILURE;
     }
+    free_stage_cache(&stage_cache);
 
-    /* Create the ENVI header file this band */
-    if (create_envi_struct(&output->metadata.band[0], &xml_metadata.global,
-                           &envi_hdr) != SUCCESS)
+    /* Free the structures */
+    if (output != NULL)
     {
-        RETURN_ERROR("Creating ENVI header structure.", FUNC_NAME,
-                     EXIT_FAILURE);
+        if (output->open)
+            CloseOutput(output);
+        FreeOutput(output);
     }
+    if (conf_output->open)
+        CloseOutput(conf_output);
+    FreeOutput(conf_output);
 
-    /* Write the ENVI header */
-    snprintf(temp_file, sizeof(temp_file), "%s",
-             output->metadata.band[0].file_name);
-    ext = strrchr(temp_file, '.');
-    if (ext == NULL)
+    if (status != SUCCESS)
     {
-        RETURN_ERROR("error in ENVI header filename", FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Masking the scene", FUNC_NAME, FAILURE);
     }
 
-    ext[0] = '\0';
-    snprintf(envi_file, sizeof(envi_file), "%s.hdr", temp_file);
-    if (write_envi_hdr(envi_file, &envi_hdr) != SUCCESS)
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  estimate_scene
+
+PURPOSE: Estimate the cloud cover of an opened scene from a grid of samples
+         and report it, for triage without the full masking
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The estimate is printed as one line of name=value pairs.  The percents
+   are those of the potential mask, the clear and cloud percents are
+   followed by the 95% bounds of their sampling error only.  No band is
+   written or added to the XML file, only the preview mask when it is asked
+   for.
+*****************************************************************************/
+static int estimate_scene
+(
+    Input_t *input,                     /* I: opened input scene */
+    Espa_internal_meta_t *xml_metadata, /* I: input metadata */
+    char *xml_name,                     /* I: XML file of the scene */
+    const Cfmask_options_t *options     /* I: processing options */
+)
+{
+    char *FUNC_NAME = "estimate_scene";
+    Cfmask_context_t context;   /* masking of the scene */
+    Cloud_estimate_t estimate;  /* estimated cloud cover */
+    int status;
+
+    if (cfmask_init_context(input, &options->params, &context) != SUCCESS)
     {
-        RETURN_ERROR("Writing ENVI header file.", FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Setting up the masking", FUNC_NAME, FAILURE);
     }
 
-    /* Append the cfmask band to the XML file */
-    if (append_metadata(output->nband, output->metadata.band, xml_name)
-        != SUCCESS)
+    status = cfmask_estimate_cover(&context, options->estimate_stride,
+                                   &estimate);
+    cfmask_free_context(&context);
+    if (status != SUCCESS)
     {
-        RETURN_ERROR("Appending spectral index bands to XML file.",
-                     FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Estimating the cloud cover", FUNC_NAME, FAILURE);
     }
 
-    /* Free the structure */
-    if (!FreeOutput(output))
+    printf("CFmask estimate: xml=%s stride=%d samples=%d"
+           " potential_clear_percent=%.2f clear_sampling_low=%.2f"
+           " clear_sampling_high=%.2f potential_cloud_percent=%.2f"
+           " cloud_sampling_low=%.2f cloud_sampling_high=%.2f"
+           " potential_shadow_percent=%.2f water_percent=%.2f"
+           " snow_percent=%.2f\n", xml_name, estimate.stride,
+           estimate.data_count, estimate.potential_clear_percent,
+           estimate.clear_sampling_low, estimate.clear_sampling_high,
+           estimate.potential_cloud_percent, estimate.cloud_sampling_low,
+           estimate.cloud_sampling_high, estimate.potential_shadow_percent,
+           estimate.water_percent, estimate.snow_percent);
+
+    if (options->estimate_preview
+        && !WritePreviewCFmask(xml_metadata, estimate.preview_mask,
+                               estimate.grid_rows, estimate.grid_cols))
     {
-        RETURN_ERROR("freeing output file structure", FUNC_NAME, EXIT_FAILURE);
+        status = FAILURE;
     }
+    cfmask_free_estimate(&estimate);
 
-    output = OpenOutputConfidence(&xml_metadata, input);
-    if (output == NULL)
+    if (status != SUCCESS)
     {
-        RETURN_ERROR("Opening output file", FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Writing the preview mask", FUNC_NAME, FAILURE);
     }
 
-    if (!PutOutput(output, conf_mask))
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  process_scene
+
+PURPOSE: Read the metadata of a scene, open its bands and mask it
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The input and the metadata are released before returning, also when the
+   scene fails, so a batch can go on with the next scene.
+*****************************************************************************/
+static int process_scene
+(
+    char *xml_name,                  /* I: XML file of the scene */
+    const Cfmask_options_t *options, /* I: processing options */
+    Scene_buffers_t *buffers         /* I/O: scene sized masks */
+)
+{
+    char *FUNC_NAME = "process_scene";
+    Input_t *input = NULL;    /* input data and meta data */
+    Espa_internal_meta_t xml_metadata; /* XML metadata structure */
+    int status;
+
+    /* Validate the input metadata file */
+    if (validate_xml_file(xml_name) != SUCCESS)
     {
-        RETURN_ERROR("Writing output fmask files", FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("XML validation error", FUNC_NAME, FAILURE);
     }
 
-    /* Close the output file */
-    if (!CloseOutput(output))
+    /* Initialize the metadata structure */
+    init_metadata_struct(&xml_metadata);
+
+    /* Parse the metadata file into our internal metadata structure; also
+       allocates space as needed for various pointers in the global and band
+       metadata */
+    if (parse_metadata(xml_name, &xml_metadata) != SUCCESS)
     {
-        RETURN_ERROR("closing output file", FUNC_NAME, EXIT_FAILURE);
+        free_metadata(&xml_metadata);
+        RETURN_ERROR("XML parsing error", FUNC_NAME, FAILURE);
     }
 
-    /* Create the ENVI header file this band */
-    if (create_envi_struct(&output->metadata.band[0], &xml_metadata.global,
-                           &envi_hdr) != SUCCESS)
+    /* Open input file, read metadata, and set up buffers */
+    input = OpenInput(&xml_metadata, options->params.use_thermal,
+                      options->use_mmap);
+    if (input == NULL)
     {
-        RETURN_ERROR("Creating ENVI header structure.", FUNC_NAME,
-                     EXIT_FAILURE);
+        free_metadata(&xml_metadata);
+        RETURN_ERROR("opening input data specified in input XML",
+                     FUNC_NAME, FAILURE);
     }
 
-    /* Write the ENVI header */
-    snprintf(temp_file, sizeof(temp_file), "%s",
-             output->metadata.band[0].file_name);
-    ext = strrchr(temp_file, '.');
-    if (ext == NULL)
+    if (options->estimate_stride > 0)
+        status = estimate_scene(input, &xml_metadata, xml_name, options);
+    else
+        status = mask_scene(input, &xml_metadata, xml_name, options, buffers);
+
+    /* Free the metadata structure */
+    free_metadata(&xml_metadata);
+
+    /* Close the input file and free the structure */
+    CloseInput(input);
+    FreeInput(input);
+
+    if (status != SUCCESS)
     {
-        RETURN_ERROR("error in ENVI header filename", FUNC_NAME, EXIT_FAILURE);
+        RETURN_ERROR("Masking the scene", FUNC_NAME, FAILURE);
     }
 
-    ext[0] = '\0';
-    snprintf(envi_file, sizeof(envi_file), "%s.hdr", temp_file);
-    if (write_envi_hdr(envi_file, &envi_hdr) != SUCCESS)
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  scene_profile_name
+
+PURPOSE: Make the name of the profile report of a scene of a batch, the
+         report name with the base name of the XML file before its .json
+         extension, e.g. batch.LC80.json from batch.json and dir/LC80.xml
+*****************************************************************************/
+static void scene_profile_name
+(
+    const char *profile_name, /* I: profile report filename */
+    const char *xml_name,     /* I: XML file of the scene */
+    char *scene_name,         /* O: profile report filename of the scene */
+    size_t name_size          /* I: size of scene_name */
+)
+{
+    const char *base;        /* XML file name without the directory */
+    int profile_length;      /* length of the report name, without .json */
+    int base_length;         /* length of the base name, without .xml */
+
+    profile_length = strlen(profile_name);
+    if (profile_length > 5
+        && strcmp(profile_name + profile_length - 5, ".json") == 0)
     {
-        RETURN_ERROR("Writing ENVI header file.", FUNC_NAME, EXIT_FAILURE);
+        profile_length -= 5;
     }
 
-    /* Append the cfmask band to the XML file */
-    if (append_metadata(output->nband, output->metadata.band,
-                        xml_name) != SUCCESS)
+    base = strrchr(xml_name, '/');
+    base = (base == NULL) ? xml_name : base + 1;
+    base_length = strlen(base);
+    if (base_length > 4 && strcmp(base + base_length - 4, ".xml") == 0)
+        base_length -= 4;
+
+    snprintf(scene_name, name_size, "%.*s.%.*s.json", profile_length,
+             profile_name, base_length, base);
+}
+
+
+/*****************************************************************************
+MODULE:  process_batch
+
+PURPOSE: Mask each scene listed in a batch file, one XML file name per line,
+         in one process
+
+RETURN: SUCCESS
+        FAILURE when the batch file can't be read or a scene failed
+
+NOTES:
+1. A batch file of "-" reads the XML file names from the standard input as
+   they arrive, so another process can feed the scenes as a job queue.
+2. Blank lines and lines starting with '#' are skipped.  A scene that fails
+   is reported and the batch goes on with the next one.
+3. With a profile report, each scene gets its own report, named by
+   scene_profile_name, and the profile is reset between the scenes.
+*****************************************************************************/
+static int process_batch
+(
+    const char *batch_name,          /* I: batch file, "-" for stdin */
+    const char *profile_name,        /* I: profile report filename, NULL for
+                                           no report */
+    const Cfmask_options_t *options, /* I: processing options */
+    Scene_buffers_t *buffers         /* I/O: scene sized masks */
+)
+{
+    char *FUNC_NAME = "process_batch";
+    char errstr[MAX_STR_LEN];     /* error string */
+    char batch_line[MAX_STR_LEN]; /* line of the batch file */
+    char scene_report[MAX_STR_LEN]; /* profile report of the scene */
+    int scene_stage = -1;         /* profile stage of the scene */
+    FILE *batch_fd = NULL;        /* batch file pointer */
+    int scene_count = 0;          /* number of scenes processed */
+    int failed_count = 0;         /* number of scenes that failed */
+
+    if (strcmp(batch_name, "-") == 0)
+        batch_fd = stdin;
+    else
+        batch_fd = fopen(batch_name, "r");
+    if (batch_fd == NULL)
     {
-        RETURN_ERROR("Appending spectral index bands to XML file.",
-                     FUNC_NAME, EXIT_FAILURE);
+        snprintf(errstr, sizeof(errstr), "Opening the batch file %s",
+                 batch_name);
+        RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
     }
 
-    /* Free the structure */
-    if (!FreeOutput(output))
+    while (fgets(batch_line, sizeof(batch_line), batch_fd) != NULL)
     {
-        RETURN_ERROR("freeing output file structure", FUNC_NAME, EXIT_FAILURE);
+        char *xml_name = batch_line;
+        char *end;
+
+        /* Trim the white space around the file name */
+        while (*xml_name == ' ' || *xml_name == '\t')
+            xml_name++;
+        end = xml_name + strlen(xml_name);
+        while (end > xml_name && (end[-1] == '\n' || end[-1] == '\r'
+                                  || end[-1] == ' ' || end[-1] == '\t'))
+        {
+            end--;
+        }
+        *end = '\0';
+
+        if (*xml_name == '\0' || *xml_name == '#')
+            continue;
+
+        scene_count++;
+        printf("Batch scene %d: %s\n", scene_count, xml_name);
+        if (profile_name != NULL)
+        {
+            reset_profile();
+            scene_stage = profile_begin("total");
+        }
+        if (process_scene(xml_name, options, buffers) != SUCCESS)
+        {
+            snprintf(errstr, sizeof(errstr), "Processing scene %s",
+                     xml_name);
+            ERROR_MESSAGE(errstr, FUNC_NAME);
+            failed_count++;
+        }
+        else if (profile_name != NULL)
+        {
+            profile_end(scene_stage);
+            scene_profile_name(profile_name, xml_name, scene_report,
+                               sizeof(scene_report));
+            if (write_profile_json(scene_report) != SUCCESS)
+            {
+                snprintf(errstr, sizeof(errstr), "Writing the profile"
+                         " report of scene %s", xml_name);
+                ERROR_MESSAGE(errstr, FUNC_NAME);
+                failed_count++;
+            }
+        }
+        fflush(stdout);
     }
 
-    /* Free the metadata structure */
-    free_metadata(&xml_metadata);
+    if (batch_fd != stdin)
+        fclose(batch_fd);
+
+    printf("Batch complete: %d scenes, %d failed\n", scene_count,
+           failed_count);
+
+    if (failed_count > 0)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+METHOD:  cfmask
+
+PURPOSE:  The main routine for fmask written in C
+
+RETURN VALUE: Type = int
+    Value           Description
+    -----           -----------
+    ERROR           An error occurred during processing of cfmask
+    SUCCESS         Processing was successful
+*****************************************************************************/
+int
+main (int argc, char *argv[])
+{
+    char *FUNC_NAME = "main";
+    char *xml_name = NULL;       /* input XML filename */
+    char *batch_name = NULL;     /* batch file of XML filenames */
+    char *profile_name = NULL;   /* profile report filename */
+
+    int status;
+    int total_stage;         /* profile stages */
+    int thread_count;        /* number of threads, 0 for the default */
+    bool pin_threads;        /* pin the threads to the CPUs */
+
+    Cfmask_options_t options;  /* processing options */
+    Scene_buffers_t buffers;   /* scene sized masks */
+
+    time_t now;
+    time(&now);
+
+    /* Read the command-line arguments, including the name of the input
+       Landsat TOA reflectance product and the DEM */
+    status = get_args(argc, argv, &xml_name, &batch_name,
+                      &options.params.cloud_prob, &options.params.cldpix,
+                      &options.params.sdpix, &options.params.use_cirrus,
+                      &options.params.use_thermal, &options.cache_bands,
+                      &options.use_mmap, &options.params.fast_height_search,
+                      &options.params.pyramid_factor,
+                      &options.params.huge_pages, &thread_count,
+                      &pin_threads, &options.estimate_stride,
+                      &options.estimate_preview, &options.stage_cache,
+                      &options.memory_cap, &options.output_format,
+                      &profile_name,
+                      &options.params.verbose);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("calling get_args", FUNC_NAME, EXIT_FAILURE);
+    }
+
+    /* A batch records and reports each scene on its own */
+    if (profile_name != NULL)
+        enable_profile();
+    if (batch_name == NULL)
+        total_stage = profile_begin("total");
+    else
+        total_stage = -1;
+
+    printf("CFmask start_time=%s\n", ctime(&now));
+
+    /* The threads are placed before any scene buffer is touched */
+    if (configure_threads(thread_count, pin_threads,
+                          options.params.verbose) != SUCCESS)
+    {
+        RETURN_ERROR("Setting up the threads", FUNC_NAME, EXIT_FAILURE);
+    }
+
+    buffers.pixel_mask = NULL;
+    buffers.conf_mask = NULL;
+    buffers.pixel_count = 0;
+    init_scratch_pool(&buffers.pool, options.params.huge_pages);
+
+    if (batch_name != NULL)
+    {
+        status = process_batch(batch_name, profile_name, &options,
+                               &buffers);
+        free(batch_name);
+        batch_name = NULL;
+    }
+    else
+    {
+        status = process_scene(xml_name, &options, &buffers);
+        free(xml_name);
+        xml_name = NULL;
+    }
 
     /* Free the pixel mask */
-    free(pixel_mask);
-    pixel_mask = NULL;
-    free(conf_mask);
-    conf_mask = NULL;
+    free(buffers.pixel_mask);
+    buffers.pixel_mask = NULL;
+    free(buffers.conf_mask);
+    buffers.conf_mask = NULL;
+    if (options.params.verbose)
+    {
+        printf("Scratch pool peak: %.1f MB\n",
+               buffers.pool.peak_bytes / (1024.0 * 1024.0));
+    }
+    free_scratch_pool(&buffers.pool);
 
-    /* Close the input file and free the structure */
-    CloseInput(input);
-    FreeInput(input);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Processing the scenes", FUNC_NAME, EXIT_FAILURE);
+    }
 
-    free(xml_name);
-    xml_name = NULL;
+    /* Write the profile report, a batch wrote one for each scene */
+    profile_end(total_stage);
+    if (profile_name != NULL)
+    {
+        if (total_stage >= 0 && write_profile_json(profile_name) != SUCCESS)
+        {
+            RETURN_ERROR("Writing the profile report", FUNC_NAME,
+                         EXIT_FAILURE);
+        }
+        free(profile_name);
+        profile_name = NULL;
+    }
 
     printf("Processing complete.\n");
     time(&now);
@@ -384,10 +913,16 @@ usage()
            " reflection and Brightness Temperature derived from the L1T.\n");
     printf("\n");
     printf("Usage: ./%s --xml <xml filename> [options]\n", CFMASK_APP_NAME);
+    printf("       ./%s --batch <batch filename> [options]\n",
+           CFMASK_APP_NAME);
     printf("\n");
     printf("where the following parameters are required:\n");
     printf("    --xml: name of the input XML file which contains the TOA"
            " reflectance and brightness temperature files\n");
+    printf("    or\n");
+    printf("    --batch: name of a file listing one input XML file per line,"
+           " all of the scenes are processed in one run; \"-\" reads the"
+           " XML file names from the standard input as they arrive\n");
     printf("\n");
     printf("where the following parameters are optional:\n");
     printf("    --prob: cloud_probability,"
@@ -402,6 +937,66 @@ usage()
     printf("    --without-thermal: don't use thermal data during cloud"
            " detection and height determination for shadows"
            " (default is false, meaning always use thermal)\n");
+    printf("    --cache-bands: read each input band once and keep it in"
+           " memory for all of the processing passes, which requires two"
+           " bytes per pixel for each band (default is false, meaning the"
+           " bands are re-read line by line for each pass)\n");
+    printf("    --mmap-input: memory map the input band files read-only and"
+           " use the lines in place instead of seeking and reading each line"
+           " (default is false)\n");
+    printf("    --fast-height-search: search the shadow height of the large"
+           " clouds with a subsample of the cloud pixels and refine the best"
+           " height with all of them, which is faster but can match a"
+           " different height (default is false, meaning every height is"
+           " matched with all of the cloud pixels)\n");
+    printf("    --pyramid: factor of 2 or 4 to search the shadow height of"
+           " the large clouds at a reduced resolution first, a factor of"
+           " heights apart with one of each factor by factor cloud pixels,"
+           " and refine the best height at full resolution, which is faster"
+           " but can match a different height (default value is 1, meaning"
+           " full resolution)\n");
+    printf("    --huge-pages: ask for transparent huge pages for the scene"
+           " sized scratch buffers (default is false)\n");
+    printf("    --threads: number of threads of the parallel loops when"
+           " threading is enabled (default is the OpenMP default, which"
+           " follows OMP_NUM_THREADS)\n");
+    printf("    --numa: pin each thread to a CPU, spread over the CPUs the"
+           " process may use, so the scene memory each thread first writes"
+           " stays local to its socket (default is false)\n");
+    printf("    --estimate: only estimate the potential cloud cover for"
+           " triage, from the spectral tests and cloud probability"
+           " thresholds of a grid of samples without the minima fill, the"
+           " shadow matching and the dilate; the potential clear percent"
+           " includes the shadows and the cloud buffers, so it is usually"
+           " above the clear percent of the full masking and the potential"
+           " cloud percent below its cloud percent; the 95%% bounds printed"
+           " only cover the sampling error, not this difference, and no band"
+           " is written (default is false)\n");
+    printf("    --estimate-stride: lines and samples between the samples of"
+           " the estimate (default value is 4)\n");
+    printf("    --estimate-preview: write the cfmask values of the samples"
+           " of the estimate as a <scene>_cfmask_preview.tif file"
+           " (default is false)\n");
+    printf("    --stage-cache: keep the intermediates of the stages in a"
+           " <scene>_cfmask_stages.cache file next to the XML file and"
+           " only run the stages whose inputs changed since it was written;"
+           " changing only --cldpix or --sdpix skips the shadow matching and"
+           " changing --prob also skips the band passes and the minima fill,"
+           " which uses about five bytes per pixel in memory and in the file"
+           " (default is false)\n");
+    printf("    --memory-cap: memory cap in megabytes for the scene"
+           " buffers; the scene is refused if its masks and minima fill"
+           " buffers, seven bytes per pixel, don't fit and --cache-bands is"
+           " ignored if the band cache doesn't fit as well (default is 0,"
+           " meaning no cap)\n");
+    printf("    --output-format: format of the output bands, envi for raw"
+           " binary bands with ENVI headers or tiff for 256x256 tiled,"
+           " deflate compressed TIFF bands (default is envi)\n");
+    printf("    --profile-json: name of a JSON file to write the wall time,"
+           " CPU time, bytes read and written, and peak resident memory of"
+           " each processing stage to; with --batch each scene gets its own"
+           " report, the XML base name inserted before .json"
+           " (default is no report)\n");
     printf("    --verbose: display intermediate messages"
            " (default is false)\n");
     printf("\n");
@@ -410,6 +1005,10 @@ usage()
            " --sdpix=3 --verbose\n\n", CFMASK_APP_NAME);
     printf("    ./%s --xml LC80330372013141LGN01.xml --without-thermal"
            " --with-cirrus --verbose\n\n", CFMASK_APP_NAME);
+    printf("    ls */*.xml | ./%s --batch - --cldpix=3 --sdpix=3\n\n",
+           CFMASK_APP_NAME);
+    printf("    ls */*.xml | ./%s --batch - --estimate"
+           " --estimate-stride=8\n\n", CFMASK_APP_NAME);
 
     printf("    ./%s --version    (prints the version information"
            " for this application)\n", CFMASK_APP_NAME);
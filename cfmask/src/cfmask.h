@@ -48,6 +48,13 @@ typedef signed short int16;
 #define CLOUD_CONFIDENCE_HIGH 3
 
 
+/* Bytes of scene sized buffers held for each pixel at the peak of the
+   processing: the pixel and confidence masks and the scratch pool, which
+   holds the clear mask and the two minima fill buffers.  The other scene
+   data are histograms, cloud run lists and the bit plane of the dilate. */
+#define SCENE_BYTES_PER_PIXEL (2 + SCRATCH_BYTES_PER_PIXEL)
+
+
 void usage ();
 
 void version ();
@@ -0,0 +1,1254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+
+#include "espa_metadata.h"
+#include "espa_geoloc.h"
+#include "write_metadata.h"
+#include "envi_header.h"
+#include "raw_binary_io.h"
+
+
+#include "const.h"
+#include "error.h"
+#include "input.h"
+#include "profile.h"
+#include "libcfmask.h"
+#include "cfmask.h"
+
+
+#define BENCH_APP_NAME "cfmask_bench"
+
+/* Values of the synthetic bands */
+#define BENCH_SATURATE_VALUE 20000  /* saturation of the TOA bands */
+#define BENCH_REFL_SCALE 0.0001     /* scale of the TOA reflectance */
+#define BENCH_THERM_SCALE 0.1       /* scale of the brightness temperature */
+#define BENCH_PIXEL_SIZE 30.0       /* pixel size in meters */
+#define BENCH_SUN_ZENITH 35.0       /* solar zenith of the scenes */
+#define BENCH_DAY_OF_YEAR 141       /* day of year of the acquisition date */
+#define BENCH_ACQUISITION_DATE "2013-05-21"
+#define BENCH_LAPSE_RATE 6.5        /* cloud top cooling, degrees per km */
+
+
+/* Description of one synthetic scene */
+typedef struct
+{
+    const char *sensor_name; /* tm, etm or oli */
+    int nrows;               /* number of lines */
+    int ncols;               /* number of samples */
+    float cloud_fraction;    /* fraction of the image covered by the clouds */
+    int cloud_count;         /* number of cloud objects */
+    unsigned int seed;       /* seed of the random numbers */
+    bool use_thermal;        /* use the thermal band, OLI scenes without it
+                                don't have a thermal band */
+    bool use_cirrus;         /* use the cirrus band, OLI only */
+} Bench_scene_t;
+
+/* Bands and metadata of a generated scene */
+typedef struct
+{
+    int satellite;                 /* IS_LANDSAT_5 to IS_LANDSAT_8 */
+    int sensor;                    /* IS_TM to IS_OLITIRS */
+    Input_meta_t meta;             /* metadata for OpenInputMemory */
+    int16 *bands[MAX_BAND_COUNT];  /* TOA bands, thermal in Celsius * 100 */
+    int16 *thermal_file;           /* thermal band in Kelvin * 10, as the
+                                      brightness temperature files store it */
+    float cloud_fraction;          /* fraction of the image which is cloud */
+} Bench_data_t;
+
+/* Scenes of the --suite run */
+static const Bench_scene_t bench_suite[] =
+{
+    {"tm",  2000, 2000, 0.30,  40, 1, true,  false},
+    {"etm", 2000, 2000, 0.50,  80, 2, true,  false},
+    {"etm", 2000, 2000, 0.30,  40, 3, false, false},
+    {"oli", 2000, 2000, 0.30,  40, 4, true,  true},
+    {"oli", 2000, 2000, 0.10, 200, 5, false, false},
+    {"oli", 4000, 4000, 0.40, 150, 6, true,  false}
+};
+
+
+/*****************************************************************************
+MODULE:  bench_random
+
+PURPOSE: Draw the next number of a xorshift generator, the same on every
+         platform so the scenes can be reproduced
+
+RETURN: a number in [0, 1)
+*****************************************************************************/
+static double bench_random
+(
+    unsigned long long *state /* I/O: generator state */
+)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*****************************************************************************
+MODULE:  scene_key
+
+PURPOSE: Build the name of a scene, which identifies it in the golden file
+*****************************************************************************/
+static void scene_key
+(
+    const Bench_scene_t *scene, /* I: scene description */
+    char *key,                  /* O: name of the scene */
+    size_t key_size             /* I: size of key */
+)
+{
+    snprintf(key, key_size, "%s%s%s_%dx%d_f%.2f_n%d_s%u",
+             scene->sensor_name, scene->use_thermal ? "_thermal" : "",
+             scene->use_cirrus ? "_cirrus" : "", scene->nrows, scene->ncols,
+             scene->cloud_fraction, scene->cloud_count, scene->seed);
+}
+
+
+/*****************************************************************************
+MODULE:  set_scene_metadata
+
+PURPOSE: Set the satellite, sensor and metadata of a scene
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int set_scene_metadata
+(
+    const Bench_scene_t *scene, /* I: scene description */
+    Bench_data_t *data          /* O: satellite, sensor and metadata */
+)
+{
+    char *FUNC_NAME = "set_scene_metadata";
+    Input_meta_t *meta = &data->meta;
+    int band_index;
+
+    memset(meta, 0, sizeof(*meta));
+    if (strcmp(scene->sensor_name, "tm") == 0)
+    {
+        data->satellite = IS_LANDSAT_5;
+        data->sensor = IS_TM;
+    }
+    else if (strcmp(scene->sensor_name, "etm") == 0)
+    {
+        data->satellite = IS_LANDSAT_7;
+        data->sensor = IS_ETM;
+    }
+    else if (strcmp(scene->sensor_name, "oli") == 0)
+    {
+        data->satellite = IS_LANDSAT_8;
+        data->sensor = scene->use_thermal ? IS_OLITIRS : IS_OLI;
+    }
+    else
+    {
+        RETURN_ERROR("the sensor has to be tm, etm or oli", FUNC_NAME,
+                     FAILURE);
+    }
+
+    if (scene->use_cirrus && data->satellite != IS_LANDSAT_8)
+    {
+        RETURN_ERROR("only the oli scenes have a cirrus band", FUNC_NAME,
+                     FAILURE);
+    }
+
+    if (scene->nrows <= 0 || scene->ncols <= 0 || scene->cloud_count < 0
+        || scene->cloud_fraction < 0.0 || scene->cloud_fraction > 1.0)
+    {
+        RETURN_ERROR("invalid scene size or clouds", FUNC_NAME, FAILURE);
+    }
+
+    meta->day_of_year = BENCH_DAY_OF_YEAR;
+    meta->sun_zen = BENCH_SUN_ZENITH;
+    meta->sun_az = (data->satellite == IS_LANDSAT_8) ? 145.0 : 135.0;
+    meta->fill = FILL_PIXEL;
+    meta->pixel_size[0] = BENCH_PIXEL_SIZE;
+    meta->pixel_size[1] = BENCH_PIXEL_SIZE;
+    meta->therm_scale_fact = BENCH_THERM_SCALE;
+    meta->ul_corner.lat = 40.0;
+    meta->ul_corner.lon = -105.0;
+    meta->lr_corner.lat = 38.0;
+    meta->lr_corner.lon = -103.0;
+
+    /* The calibration of the level 1 bands, only used for the saturation
+       values */
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        meta->satu_value_ref[band_index] = BENCH_SATURATE_VALUE;
+        meta->satu_value_max[band_index] = -9999;
+        if (data->satellite == IS_LANDSAT_8)
+        {
+            meta->gain[band_index] = 0.00002;
+            meta->bias[band_index] = -0.1;
+        }
+        else
+        {
+            meta->gain[band_index] = 0.7658;
+            meta->bias[band_index] = -2.28;
+        }
+    }
+    if (data->satellite == IS_LANDSAT_8)
+    {
+        meta->gain[BI_THERMAL] = 0.0003342;
+        meta->bias[BI_THERMAL] = 0.1;
+        meta->k1 = 774.89;
+        meta->k2 = 1321.08;
+    }
+    else
+    {
+        meta->gain[BI_THERMAL] = 0.055;
+        meta->bias[BI_THERMAL] = 1.18;
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  free_scene
+
+PURPOSE: Release the bands of a generated scene
+*****************************************************************************/
+static void free_scene
+(
+    Bench_data_t *data /* I/O: generated scene */
+)
+{
+    int band_index;
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        free(data->bands[band_index]);
+        data->bands[band_index] = NULL;
+    }
+    free(data->thermal_file);
+    data->thermal_file = NULL;
+}
+
+
+/*****************************************************************************
+MODULE:  generate_scene
+
+PURPOSE: Generate the TOA reflectance and brightness temperature bands of a
+         synthetic scene
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The scene has the skewed footprint of a Landsat scene with fill around
+   it, textured land, a lake and a river, and a snow field.
+2. The clouds are blobs with ragged edges.  A few are large and most are
+   small, their areas add up to the cloud fraction before they overlap.
+   Each cloud has a height, its top is colder than the surface by the lapse
+   rate and its shadow is cast on the surface away from the sun.
+3. Some of the bright cloud pixels of the Landsat 4-7 scenes are saturated.
+4. Every value comes from the seeded generator, so a scene is the same on
+   every run.
+*****************************************************************************/
+static int generate_scene
+(
+    const Bench_scene_t *scene, /* I: scene description */
+    Bench_data_t *data          /* O: generated scene */
+)
+{
+    char *FUNC_NAME = "generate_scene";
+    int nrows = scene->nrows;
+    int ncols = scene->ncols;
+    long pixel_count = (long)nrows * ncols;
+    unsigned long long state;
+    unsigned char *cover = NULL;   /* cloud cover of each pixel, 0 to 255 */
+    unsigned char *height = NULL;  /* cloud height in 50 m steps */
+    unsigned char *shadow = NULL;  /* the pixel is in a cloud shadow */
+    double *weights = NULL;        /* relative area of each cloud */
+    double weight_sum = 0.0;
+    double tan_zenith = tan(BENCH_SUN_ZENITH * RAD);
+    double sun_azimuth;
+    long cloud_pixels = 0;
+    long valid_pixels = 0;
+    int band_index;
+    int cloud_index;
+    int row;
+    int col;
+
+    memset(data->bands, 0, sizeof(data->bands));
+    data->thermal_file = NULL;
+    if (set_scene_metadata(scene, data) != SUCCESS)
+    {
+        RETURN_ERROR("Setting the scene metadata", FUNC_NAME, FAILURE);
+    }
+    sun_azimuth = data->meta.sun_az * RAD;
+
+    state = 88172645463325252ULL ^ (scene->seed * 2654435761ULL);
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (band_index == BI_CIRRUS && data->satellite != IS_LANDSAT_8)
+            continue;
+        if (band_index == BI_THERMAL && data->sensor == IS_OLI)
+            continue;
+        data->bands[band_index] = malloc(pixel_count * sizeof(int16));
+        if (data->bands[band_index] == NULL)
+        {
+            free_scene(data);
+            RETURN_ERROR("Allocating the scene bands", FUNC_NAME, FAILURE);
+        }
+    }
+    if (data->bands[BI_THERMAL] != NULL)
+    {
+        data->thermal_file = malloc(pixel_count * sizeof(int16));
+        if (data->thermal_file == NULL)
+        {
+            free_scene(data);
+            RETURN_ERROR("Allocating the scene bands", FUNC_NAME, FAILURE);
+        }
+    }
+
+    cover = calloc(pixel_count, sizeof(unsigned char));
+    height = calloc(pixel_count, sizeof(unsigned char));
+    shadow = calloc(pixel_count, sizeof(unsigned char));
+    weights = malloc((scene->cloud_count + 1) * sizeof(double));
+    if (cover == NULL || height == NULL || shadow == NULL || weights == NULL)
+    {
+        free(cover);
+        free(height);
+        free(shadow);
+        free(weights);
+        free_scene(data);
+        RETURN_ERROR("Allocating the cloud layers", FUNC_NAME, FAILURE);
+    }
+
+    /* The footprint leans to the right going down the scene, the pixels
+       left of left_col or right of right_col are fill */
+    for (row = 0; row < nrows; row++)
+    {
+        int left_col = (nrows - row) / 6;
+        int right_col = ncols - row / 6;
+
+        if (right_col > ncols - 1)
+            right_col = ncols - 1;
+        if (right_col >= left_col)
+            valid_pixels += right_col - left_col + 1;
+    }
+
+    /* A few large clouds and many small ones */
+    for (cloud_index = 0; cloud_index < scene->cloud_count; cloud_index++)
+    {
+        double draw = bench_random(&state);
+
+        weights[cloud_index] = 0.02 + draw * draw * draw;
+        weight_sum += weights[cloud_index];
+    }
+
+    for (cloud_index = 0; cloud_index < scene->cloud_count; cloud_index++)
+    {
+        double area = scene->cloud_fraction * valid_pixels
+                      * weights[cloud_index] / weight_sum;
+        double radius = sqrt(area / PI);
+        double center_row = bench_random(&state) * nrows;
+        double center_col = bench_random(&state) * ncols;
+        double cloud_height = 1000.0 + bench_random(&state) * 7000.0;
+        double offset = cloud_height * tan_zenith / BENCH_PIXEL_SIZE;
+        int row_offset = (int)round(cos(sun_azimuth) * offset);
+        int col_offset = (int)round(-sin(sun_azimuth) * offset);
+        int first_row = (int)floor(center_row - radius * 1.2);
+        int last_row = (int)ceil(center_row + radius * 1.2);
+        int first_col = (int)floor(center_col - radius * 1.2);
+        int last_col = (int)ceil(center_col + radius * 1.2);
+
+        if (radius < 0.5)
+            continue;
+
+        for (row = first_row; row <= last_row; row++)
+        {
+            if (row < 0 || row >= nrows)
+                continue;
+            for (col = first_col; col <= last_col; col++)
+            {
+                long pixel_index = (long)row * ncols + col;
+                double distance;
+                int value;
+                int shadow_row = row + row_offset;
+                int shadow_col = col + col_offset;
+
+                if (col < 0 || col >= ncols)
+                    continue;
+
+                distance = hypot(row - center_row, col - center_col) / radius
+                           + 0.3 * (bench_random(&state) - 0.5);
+                if (distance >= 1.0)
+                    continue;
+
+                value = (int)((1.0 - distance) * 4.0 * 255.0) + 1;
+                if (value > 255)
+                    value = 255;
+                if (value > cover[pixel_index])
+                {
+                    cover[pixel_index] = value;
+                    height[pixel_index] = (int)(cloud_height / 50.0);
+                }
+
+                if (shadow_row >= 0 && shadow_row < nrows && shadow_col >= 0
+                    && shadow_col < ncols)
+                {
+                    shadow[(long)shadow_row * ncols + shadow_col] = 1;
+                }
+            }
+        }
+    }
+    free(weights);
+
+    for (row = 0; row < nrows; row++)
+    {
+        int left_col = (nrows - row) / 6;
+        int right_col = ncols - row / 6;
+        bool snow_row = row < nrows / 4;
+
+        for (col = 0; col < ncols; col++)
+        {
+            long pixel_index = (long)row * ncols + col;
+            double noise = bench_random(&state);
+            double texture = 300.0 * sin(row * 0.05) + 200.0 * cos(col * 0.07)
+                             + 100.0 * (noise - 0.5);
+            double lake_row = (row - nrows * 0.6) / (nrows * 0.14);
+            double lake_col = (col - ncols * 0.3) / (ncols * 0.14);
+            bool water = lake_row * lake_row + lake_col * lake_col < 1.0
+                         || (col > ncols * 0.75 && col < ncols * 0.78);
+            bool snow = snow_row && col > ncols * 0.6 && col < ncols * 0.7;
+            double refl[NON_THERMAL_BAND_COUNT];
+            double temperature;  /* Celsius */
+            double cloud;
+            double bright;
+            double kelvin;
+
+            if (col < left_col || col > right_col)
+            {
+                for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+                {
+                    if (data->bands[band_index] != NULL)
+                        data->bands[band_index][pixel_index] = FILL_PIXEL;
+                }
+                if (data->thermal_file != NULL)
+                    data->thermal_file[pixel_index] = FILL_PIXEL;
+                continue;
+            }
+
+            if (water)
+            {
+                refl[BI_BLUE] = 900.0;
+                refl[BI_GREEN] = 800.0;
+                refl[BI_RED] = 600.0;
+                refl[BI_NIR] = 300.0 + texture * 0.1;
+                refl[BI_SWIR_1] = 100.0;
+                refl[BI_SWIR_2] = 50.0;
+                temperature = 18.0;
+            }
+            else if (snow)
+            {
+                refl[BI_BLUE] = 8000.0;
+                refl[BI_GREEN] = 7900.0;
+                refl[BI_RED] = 7800.0;
+                refl[BI_NIR] = 7000.0;
+                refl[BI_SWIR_1] = 500.0 + texture;
+                refl[BI_SWIR_2] = 300.0;
+                temperature = -5.0;
+            }
+            else
+            {
+                refl[BI_BLUE] = 800.0 + texture * 0.3;
+                refl[BI_GREEN] = 900.0 + texture * 0.4;
+                refl[BI_RED] = 1000.0 + texture * 0.5;
+                refl[BI_NIR] = 2500.0 + texture;
+                refl[BI_SWIR_1] = 2000.0 + texture * 0.8;
+                refl[BI_SWIR_2] = 1200.0 + texture * 0.6;
+                temperature = 25.0 + texture * 0.005;
+            }
+            refl[BI_CIRRUS] = 10.0 + 5.0 * noise;
+
+            if (shadow[pixel_index] && !water)
+            {
+                refl[BI_BLUE] *= 0.7;
+                refl[BI_GREEN] *= 0.7;
+                refl[BI_RED] *= 0.7;
+                refl[BI_NIR] *= 0.35;
+                refl[BI_SWIR_1] *= 0.35;
+                refl[BI_SWIR_2] *= 0.4;
+                temperature -= 0.3;
+            }
+
+            cloud = cover[pixel_index] / 255.0;
+            if (cloud > 0.0)
+            {
+                double top = temperature - BENCH_LAPSE_RATE
+                             * height[pixel_index] * 50.0 / 1000.0;
+
+                bright = 3500.0 + 3000.0 * cloud;
+                refl[BI_BLUE] = refl[BI_BLUE] * (1.0 - cloud) + bright;
+                refl[BI_GREEN] = refl[BI_GREEN] * (1.0 - cloud) + bright * 0.98;
+                refl[BI_RED] = refl[BI_RED] * (1.0 - cloud) + bright * 0.97;
+                refl[BI_NIR] = refl[BI_NIR] * (1.0 - cloud) + bright * 0.95;
+                refl[BI_SWIR_1] = refl[BI_SWIR_1] * (1.0 - cloud)
+                                  + bright * 0.8;
+                refl[BI_SWIR_2] = refl[BI_SWIR_2] * (1.0 - cloud)
+                                  + bright * 0.6;
+                refl[BI_CIRRUS] += 200.0 * cloud;
+                temperature = temperature * (1.0 - cloud) + top * cloud;
+                cloud_pixels++;
+            }
+
+            for (band_index = 0; band_index < NON_THERMAL_BAND_COUNT;
+                 band_index++)
+            {
+                if (data->bands[band_index] != NULL)
+                {
+                    data->bands[band_index][pixel_index] =
+                        (int16)refl[band_index];
+                }
+            }
+
+            /* The saturated visible bands of the bright clouds */
+            if (data->satellite != IS_LANDSAT_8 && cloud > 0.9 && noise < 0.3)
+            {
+                data->bands[BI_BLUE][pixel_index] = BENCH_SATURATE_VALUE;
+            }
+
+            if (data->thermal_file == NULL)
+                continue;
+
+            /* The brightness temperature file holds Kelvin * 10, the
+               in-memory band is converted from it the way the input lines
+               are, so both give the same Celsius * 100 */
+            kelvin = temperature + 273.15 + (noise - 0.5) * 0.04;
+            data->thermal_file[pixel_index] =
+                (int16)round(kelvin / BENCH_THERM_SCALE);
+            data->bands[BI_THERMAL][pixel_index] =
+                (int)round((data->thermal_file[pixel_index]
+                            * data->meta.therm_scale_fact - 273.15) * 100.0);
+        }
+    }
+
+    free(cover);
+    free(height);
+    free(shadow);
+
+    data->cloud_fraction = (valid_pixels > 0)
+                           ? (float)cloud_pixels / valid_pixels : 0.0;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  set_band_metadata
+
+PURPOSE: Describe one band of a written scene
+*****************************************************************************/
+static void set_band_metadata
+(
+    Espa_band_meta_t *bmeta,  /* O: band metadata */
+    const char *prefix,       /* I: prefix of the scene files */
+    const char *product,      /* I: product of the band */
+    const char *name,         /* I: name of the band */
+    int nrows,                /* I: number of lines */
+    int ncols,                /* I: number of samples */
+    const char *production_date /* I: production date of the band */
+)
+{
+    snprintf(bmeta->product, sizeof(bmeta->product), "%s", product);
+    snprintf(bmeta->name, sizeof(bmeta->name), "%s", name);
+    snprintf(bmeta->short_name, sizeof(bmeta->short_name), "%s", name);
+    snprintf(bmeta->long_name, sizeof(bmeta->long_name), "synthetic %s",
+             name);
+    snprintf(bmeta->file_name, sizeof(bmeta->file_name), "%s_%s.img", prefix,
+             name);
+    snprintf(bmeta->category, sizeof(bmeta->category), "image");
+    snprintf(bmeta->source, sizeof(bmeta->source), "level1");
+    snprintf(bmeta->pixel_units, sizeof(bmeta->pixel_units), "meters");
+    snprintf(bmeta->app_version, sizeof(bmeta->app_version), "%s_%s",
+             BENCH_APP_NAME, CFMASK_VERSION);
+    snprintf(bmeta->production_date, sizeof(bmeta->production_date), "%s",
+             production_date);
+    bmeta->nlines = nrows;
+    bmeta->nsamps = ncols;
+    bmeta->pixel_size[0] = BENCH_PIXEL_SIZE;
+    bmeta->pixel_size[1] = BENCH_PIXEL_SIZE;
+}
+
+
+/*****************************************************************************
+MODULE:  write_scene
+
+PURPOSE: Write a generated scene as an ESPA product, the TOA reflectance and
+         brightness temperature bands with their ENVI headers and the XML
+         metadata, so it can be processed by the cfmask command
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The level 1 bands are only described in the XML file, their files aren't
+   written since cfmask only reads their calibration from the metadata.
+2. The Landsat 8 products also have the coastal aerosol band, toa_band1,
+   which the outputs take their metadata from.  It is a copy of the blue
+   band.
+*****************************************************************************/
+static int write_scene
+(
+    const Bench_scene_t *scene, /* I: scene description */
+    const Bench_data_t *data,   /* I: generated scene */
+    const char *prefix          /* I: prefix of the scene files */
+)
+{
+    char *FUNC_NAME = "write_scene";
+    char errmsg[MAX_STR_LEN];
+    char xml_name[MAX_STR_LEN];
+    char hdr_name[MAX_STR_LEN];
+    char production_date[MAX_DATE_LEN + 1];
+    const char *toa_names[MAX_BAND_COUNT];
+    const char *level1_names[MAX_BAND_COUNT];
+    const int16 *band_data[MAX_BAND_COUNT + 1];
+    Espa_internal_meta_t metadata;
+    Espa_global_meta_t *gmeta = &metadata.global;
+    Espa_band_meta_t *bmeta;
+    Envi_header_t envi_hdr;
+    time_t now;
+    FILE *fp;
+    int band_count = 0;
+    int toa_count = 0;
+    int band_index;
+    int meta_index;
+    int status = SUCCESS;
+
+    if (data->satellite == IS_LANDSAT_8)
+    {
+        const char *oli_toa[MAX_BAND_COUNT] = {"toa_band2", "toa_band3",
+            "toa_band4", "toa_band5", "toa_band6", "toa_band7", "toa_band9",
+            "toa_band10"};
+        const char *oli_level1[MAX_BAND_COUNT] = {"band2", "band3", "band4",
+            "band5", "band6", "band7", "band9", "band10"};
+
+        memcpy(toa_names, oli_toa, sizeof(toa_names));
+        memcpy(level1_names, oli_level1, sizeof(level1_names));
+    }
+    else
+    {
+        const char *tm_toa[MAX_BAND_COUNT] = {"toa_band1", "toa_band2",
+            "toa_band3", "toa_band4", "toa_band5", "toa_band7", NULL,
+            "toa_band6"};
+        const char *tm_level1[MAX_BAND_COUNT] = {"band1", "band2", "band3",
+            "band4", "band5", "band7", NULL, "band6"};
+
+        memcpy(toa_names, tm_toa, sizeof(toa_names));
+        memcpy(level1_names, tm_level1, sizeof(level1_names));
+    }
+
+    /* Each band is described as a TOA band and as a level 1 band */
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (data->bands[band_index] != NULL)
+            band_count += 2;
+    }
+    if (data->satellite == IS_LANDSAT_8)
+        band_count++;
+
+    time(&now);
+    strftime(production_date, sizeof(production_date), "%Y-%m-%dT%H:%M:%SZ",
+             gmtime(&now));
+
+    init_metadata_struct(&metadata);
+    if (allocate_band_metadata(&metadata, band_count) != SUCCESS)
+    {
+        RETURN_ERROR("allocating band metadata", FUNC_NAME, FAILURE);
+    }
+
+    snprintf(gmeta->data_provider, sizeof(gmeta->data_provider),
+             "synthetic");
+    if (data->satellite == IS_LANDSAT_8)
+    {
+        snprintf(gmeta->satellite, sizeof(gmeta->satellite), "LANDSAT_8");
+        snprintf(gmeta->instrument, sizeof(gmeta->instrument), "%s",
+                 (data->sensor == IS_OLI) ? "OLI" : "OLI_TIRS");
+    }
+    else if (data->satellite == IS_LANDSAT_7)
+    {
+        snprintf(gmeta->satellite, sizeof(gmeta->satellite), "LANDSAT_7");
+        snprintf(gmeta->instrument, sizeof(gmeta->instrument), "ETM");
+    }
+    else
+    {
+        snprintf(gmeta->satellite, sizeof(gmeta->satellite), "LANDSAT_5");
+        snprintf(gmeta->instrument, sizeof(gmeta->instrument), "TM");
+    }
+    snprintf(gmeta->acquisition_date, sizeof(gmeta->acquisition_date),
+             BENCH_ACQUISITION_DATE);
+    snprintf(gmeta->scene_center_time, sizeof(gmeta->scene_center_time),
+             "17:21:33.123456Z");
+    snprintf(gmeta->level1_production_date,
+             sizeof(gmeta->level1_production_date), "%s", production_date);
+    gmeta->solar_zenith = data->meta.sun_zen;
+    gmeta->solar_azimuth = data->meta.sun_az;
+    snprintf(gmeta->solar_units, sizeof(gmeta->solar_units), "degrees");
+    gmeta->ul_corner[0] = data->meta.ul_corner.lat;
+    gmeta->ul_corner[1] = data->meta.ul_corner.lon;
+    gmeta->lr_corner[0] = data->meta.lr_corner.lat;
+    gmeta->lr_corner[1] = data->meta.lr_corner.lon;
+    gmeta->proj_info.proj_type = GCTP_UTM_PROJ;
+    gmeta->proj_info.datum_type = ESPA_WGS84;
+    gmeta->proj_info.utm_zone = 13;
+    snprintf(gmeta->proj_info.units, sizeof(gmeta->proj_info.units),
+             "meters");
+    snprintf(gmeta->proj_info.grid_origin,
+             sizeof(gmeta->proj_info.grid_origin), "CENTER");
+    gmeta->proj_info.ul_corner[0] = 500000.0;
+    gmeta->proj_info.ul_corner[1] = 4400000.0;
+    gmeta->proj_info.lr_corner[0] = 500000.0
+                                    + (scene->ncols - 1) * BENCH_PIXEL_SIZE;
+    gmeta->proj_info.lr_corner[1] = 4400000.0
+                                    - (scene->nrows - 1) * BENCH_PIXEL_SIZE;
+
+    /* The TOA bands, then the level 1 bands with the calibration */
+    meta_index = 0;
+    if (data->satellite == IS_LANDSAT_8)
+    {
+        bmeta = &metadata.band[meta_index];
+        set_band_metadata(bmeta, prefix, "toa_refl", "toa_band1",
+                          scene->nrows, scene->ncols, production_date);
+        band_data[meta_index] = data->bands[BI_BLUE];
+        meta_index++;
+    }
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (data->bands[band_index] == NULL)
+            continue;
+
+        bmeta = &metadata.band[meta_index];
+        set_band_metadata(bmeta, prefix,
+                          (band_index == BI_THERMAL) ? "toa_bt" : "toa_refl",
+                          toa_names[band_index], scene->nrows, scene->ncols,
+                          production_date);
+        band_data[meta_index] = (band_index == BI_THERMAL)
+                                ? data->thermal_file : data->bands[band_index];
+        meta_index++;
+    }
+    toa_count = meta_index;
+    for (meta_index = 0; meta_index < toa_count; meta_index++)
+    {
+        bmeta = &metadata.band[meta_index];
+        bmeta->data_type = ESPA_INT16;
+        bmeta->fill_value = FILL_PIXEL;
+        bmeta->saturate_value = BENCH_SATURATE_VALUE;
+        if (strcmp(bmeta->product, "toa_bt") == 0)
+        {
+            bmeta->scale_factor = BENCH_THERM_SCALE;
+            bmeta->valid_range[0] = 1500;
+            bmeta->valid_range[1] = 3500;
+            snprintf(bmeta->data_units, sizeof(bmeta->data_units),
+                     "temperature (kelvin)");
+        }
+        else
+        {
+            bmeta->scale_factor = BENCH_REFL_SCALE;
+            bmeta->valid_range[0] = -2000;
+            bmeta->valid_range[1] = 16000;
+            snprintf(bmeta->data_units, sizeof(bmeta->data_units),
+                     "reflectance");
+        }
+    }
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (data->bands[band_index] == NULL)
+            continue;
+
+        bmeta = &metadata.band[meta_index];
+        set_band_metadata(bmeta, prefix, "L1T", level1_names[band_index],
+                          scene->nrows, scene->ncols, production_date);
+        bmeta->data_type = (data->satellite == IS_LANDSAT_8)
+                           ? ESPA_UINT16 : ESPA_UINT8;
+        bmeta->fill_value = 0;
+        bmeta->saturate_value = (data->satellite == IS_LANDSAT_8)
+                                ? 65535 : 255;
+        bmeta->scale_factor = 1.0;
+        bmeta->valid_range[0] = 1;
+        bmeta->valid_range[1] = bmeta->saturate_value;
+        snprintf(bmeta->data_units, sizeof(bmeta->data_units),
+                 "digital numbers");
+        if (data->satellite == IS_LANDSAT_8 && band_index != BI_THERMAL)
+        {
+            bmeta->refl_gain = data->meta.gain[band_index];
+            bmeta->refl_bias = data->meta.bias[band_index];
+        }
+        else
+        {
+            bmeta->rad_gain = data->meta.gain[band_index];
+            bmeta->rad_bias = data->meta.bias[band_index];
+        }
+        if (data->satellite == IS_LANDSAT_8 && band_index == BI_THERMAL)
+        {
+            bmeta->k1_const = data->meta.k1;
+            bmeta->k2_const = data->meta.k2;
+        }
+        meta_index++;
+    }
+
+    /* Write the bands and their headers */
+    for (meta_index = 0; meta_index < toa_count && status == SUCCESS;
+         meta_index++)
+    {
+        bmeta = &metadata.band[meta_index];
+        fp = open_raw_binary(bmeta->file_name, "w");
+        if (fp == NULL)
+        {
+            snprintf(errmsg, sizeof(errmsg), "Opening %s", bmeta->file_name);
+            ERROR_MESSAGE(errmsg, FUNC_NAME);
+            status = FAILURE;
+            break;
+        }
+        if (write_raw_binary(fp, scene->nrows, scene->ncols, sizeof(int16),
+                             (void *)band_data[meta_index]) != SUCCESS)
+        {
+            snprintf(errmsg, sizeof(errmsg), "Writing %s", bmeta->file_name);
+            ERROR_MESSAGE(errmsg, FUNC_NAME);
+            status = FAILURE;
+        }
+        close_raw_binary(fp);
+
+        snprintf(hdr_name, sizeof(hdr_name), "%s_%s.hdr", prefix,
+                 bmeta->name);
+        if (status == SUCCESS
+            && (create_envi_struct(bmeta, gmeta, &envi_hdr) != SUCCESS
+                || write_envi_hdr(hdr_name, &envi_hdr) != SUCCESS))
+        {
+            snprintf(errmsg, sizeof(errmsg), "Writing %s", hdr_name);
+            ERROR_MESSAGE(errmsg, FUNC_NAME);
+            status = FAILURE;
+        }
+    }
+
+    snprintf(xml_name, sizeof(xml_name), "%s.xml", prefix);
+    if (status == SUCCESS && write_metadata(&metadata, xml_name) != SUCCESS)
+    {
+        snprintf(errmsg, sizeof(errmsg), "Writing %s", xml_name);
+        ERROR_MESSAGE(errmsg, FUNC_NAME);
+        status = FAILURE;
+    }
+
+    free_metadata(&metadata);
+
+    if (status == SUCCESS)
+        printf("Wrote the scene to %s\n", xml_name);
+
+    return status;
+}
+
+
+/*****************************************************************************
+MODULE:  hash_mask
+
+PURPOSE: Hash a mask with 64 bit FNV-1a
+
+RETURN: hash of the mask
+*****************************************************************************/
+static unsigned long long hash_mask
+(
+    const unsigned char *mask, /* I: mask to hash */
+    long pixel_count           /* I: number of pixels of the mask */
+)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    long pixel_index;
+
+    for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+    {
+        hash ^= mask[pixel_index];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/*****************************************************************************
+MODULE:  check_golden
+
+PURPOSE: Compare the hashes of a scene with the golden file, the hashes are
+         added to the file when the scene isn't in it yet and recording is
+         asked for
+
+RETURN: SUCCESS when the hashes match or were recorded
+        FAILURE when they differ or the scene isn't in the golden file
+
+NOTES:
+1. Each line of the golden file is the scene name and the cfmask and
+   confidence hashes in hexadecimal, lines starting with '#' are comments.
+2. The golden hashes should come from masks known to be right, a new scene
+   is recorded from the masks of the unoptimized cfmask, see --write-scene.
+*****************************************************************************/
+static int check_golden
+(
+    const char *golden_name,   /* I: name of the golden file */
+    const char *key,           /* I: name of the scene */
+    unsigned long long mask_hash, /* I: hash of the cfmask band */
+    unsigned long long conf_hash, /* I: hash of the confidence band */
+    bool record                /* I: add the scene when it isn't in the
+                                     golden file */
+)
+{
+    char *FUNC_NAME = "check_golden";
+    char errmsg[MAX_STR_LEN];
+    char line[MAX_STR_LEN];
+    char line_key[MAX_STR_LEN];
+    unsigned long long golden_mask;
+    unsigned long long golden_conf;
+    FILE *fp;
+
+    fp = fopen(golden_name, "r");
+    if (fp != NULL)
+    {
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            if (line[0] == '#')
+                continue;
+            if (sscanf(line, "%509s %llx %llx", line_key, &golden_mask,
+                       &golden_conf) != 3 || strcmp(line_key, key) != 0)
+            {
+                continue;
+            }
+
+            fclose(fp);
+            if (golden_mask != mask_hash || golden_conf != conf_hash)
+            {
+                printf("    golden: MISMATCH (expected %016llx %016llx)\n",
+                       golden_mask, golden_conf);
+                snprintf(errmsg, sizeof(errmsg),
+                         "The masks of %s differ from the golden hashes",
+                         key);
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            printf("    golden: match\n");
+
+            return SUCCESS;
+        }
+        fclose(fp);
+    }
+
+    if (!record)
+    {
+        printf("    golden: MISSING\n");
+        snprintf(errmsg, sizeof(errmsg), "%s isn't in the golden file %s,"
+                 " see --record-golden", key, golden_name);
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
+    /* Record the hashes of a new scene */
+    fp = fopen(golden_name, "a");
+    if (fp == NULL)
+    {
+        snprintf(errmsg, sizeof(errmsg), "Opening the golden file %s",
+                 golden_name);
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+    fprintf(fp, "%s %016llx %016llx\n", key, mask_hash, conf_hash);
+    if (fclose(fp) != 0)
+    {
+        snprintf(errmsg, sizeof(errmsg), "Writing the golden file %s",
+                 golden_name);
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+    printf("    golden: recorded\n");
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  bench_scene
+
+PURPOSE: Generate a scene, mask it in memory with the stages profiled, and
+         report the stage times and the hashes of the masks
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int bench_scene
+(
+    const Bench_scene_t *scene, /* I: scene description */
+    const char *golden_name,    /* I: golden file, NULL for no check */
+    bool record_golden,         /* I: add the scene to the golden file when
+                                      it isn't in it */
+    const char *scene_prefix,   /* I: write the scene files with this prefix
+                                      instead of masking it, NULL to mask */
+    bool verbose                /* I: print the cfmask messages */
+)
+{
+    char *FUNC_NAME = "bench_scene";
+    char key[MAX_STR_LEN];
+    Bench_data_t data;
+    Cfmask_params_t params;
+    Cfmask_context_t context;
+    unsigned char *pixel_mask = NULL;
+    unsigned char *conf_mask = NULL;
+    unsigned long long mask_hash;
+    unsigned long long conf_hash;
+    long pixel_count = (long)scene->nrows * scene->ncols;
+    int total_stage;
+    int status;
+
+    scene_key(scene, key, sizeof(key));
+    printf("Scene %s\n", key);
+
+    reset_profile();
+    total_stage = profile_begin("generate_scene");
+    if (generate_scene(scene, &data) != SUCCESS)
+    {
+        RETURN_ERROR("Generating the scene", FUNC_NAME, FAILURE);
+    }
+    profile_end(total_stage);
+    printf("    generated cloud fraction: %.4f\n", data.cloud_fraction);
+
+    if (scene_prefix != NULL)
+    {
+        status = write_scene(scene, &data, scene_prefix);
+        free_scene(&data);
+        return status;
+    }
+
+    pixel_mask = calloc(pixel_count, sizeof(unsigned char));
+    conf_mask = calloc(pixel_count, sizeof(unsigned char));
+    if (pixel_mask == NULL || conf_mask == NULL)
+    {
+        free(pixel_mask);
+        free(conf_mask);
+        free_scene(&data);
+        RETURN_ERROR("Allocating the masks", FUNC_NAME, FAILURE);
+    }
+
+    cfmask_default_params(&params);
+    params.use_thermal = scene->use_thermal;
+    params.use_cirrus = scene->use_cirrus;
+    params.verbose = verbose;
+
+    total_stage = profile_begin("cfmask_mask_scene");
+    /* C doesn't convert int16 ** to the const bands implicitly */
+    status = cfmask_init_memory_context(data.satellite, data.sensor,
+                                        scene->nrows, scene->ncols,
+                                        &data.meta,
+                                        (const int16 *const *)data.bands,
+                                        &params, &context);
+    if (status == SUCCESS)
+    {
+        status = cfmask_mask_scene(&context, pixel_mask, conf_mask);
+        cfmask_free_context(&context);
+    }
+    profile_end(total_stage);
+    free_scene(&data);
+
+    if (status != SUCCESS)
+    {
+        free(pixel_mask);
+        free(conf_mask);
+        RETURN_ERROR("Masking the scene", FUNC_NAME, FAILURE);
+    }
+
+    mask_hash = hash_mask(pixel_mask, pixel_count);
+    conf_hash = hash_mask(conf_mask, pixel_count);
+    free(pixel_mask);
+    free(conf_mask);
+
+    print_profile(stdout);
+    printf("    cfmask hash: %016llx  confidence hash: %016llx\n",
+           mask_hash, conf_hash);
+
+    if (golden_name != NULL
+        && check_golden(golden_name, key, mask_hash, conf_hash,
+                        record_golden) != SUCCESS)
+    {
+        RETURN_ERROR("Checking the golden hashes", FUNC_NAME, FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  bench_usage
+
+PURPOSE: Print the usage of the benchmark
+*****************************************************************************/
+static void bench_usage()
+{
+    printf("%s generates synthetic scenes, masks them in memory and reports"
+           " the time of each processing stage and the hashes of the output"
+           " masks.\n\n", BENCH_APP_NAME);
+    printf("usage: ./%s [options]\n", BENCH_APP_NAME);
+    printf("       ./%s --suite [--golden=<file> [--record-golden]]\n\n",
+           BENCH_APP_NAME);
+    printf("where the following parameters are optional:\n");
+    printf("    --sensor: tm, etm or oli (default is oli)\n");
+    printf("    --lines: number of lines (default is 2000)\n");
+    printf("    --samples: number of samples (default is 2000)\n");
+    printf("    --cloud-fraction: fraction of the scene covered by the"
+           " clouds, 0 to 1 (default is 0.3)\n");
+    printf("    --clouds: number of cloud objects (default is 50)\n");
+    printf("    --seed: seed of the scene (default is 1)\n");
+    printf("    --without-thermal: don't use the thermal band, the oli"
+           " scenes then have no thermal band (default is to use it)\n");
+    printf("    --with-cirrus: use the cirrus band of the oli scenes"
+           " (default is false)\n");
+    printf("    --suite: run the standard set of scenes instead of the one"
+           " described by the options above\n");
+    printf("    --golden: file of the golden mask hashes to check against,"
+           " a scene not in the file fails (default is no check)\n");
+    printf("    --record-golden: add the hashes of the scenes not in the"
+           " golden file to it instead of failing, only for masks known to"
+           " be right (default is false)\n");
+    printf("    --write-scene: write the scene as an ESPA product, ENVI"
+           " bands and XML file, with this file name prefix instead of"
+           " masking it\n");
+    printf("    --verbose: display the cfmask messages (default is"
+           " false)\n");
+    printf("\nThe ESUN environment variable has to name the static data"
+           " directory for the tm and etm scenes.\n");
+}
+
+
+int main (int argc, char *argv[])
+{
+    char *FUNC_NAME = "main";
+    char errmsg[MAX_STR_LEN];
+    char *golden_name = NULL;
+    char *scene_prefix = NULL;
+    static int use_thermal_flag = 1;
+    static int use_cirrus_flag = 0;
+    static int suite_flag = 0;
+    static int record_golden_flag = 0;
+    static int verbose_flag = 0;
+    static struct option long_options[] = {
+        {"sensor", required_argument, 0, 'e'},
+        {"lines", required_argument, 0, 'l'},
+        {"samples", required_argument, 0, 's'},
+        {"cloud-fraction", required_argument, 0, 'f'},
+        {"clouds", required_argument, 0, 'n'},
+        {"seed", required_argument, 0, 'r'},
+        {"golden", required_argument, 0, 'g'},
+        {"write-scene", required_argument, 0, 'w'},
+        {"without-thermal", no_argument, &use_thermal_flag, 0},
+        {"with-cirrus", no_argument, &use_cirrus_flag, 1},
+        {"suite", no_argument, &suite_flag, 1},
+        {"record-golden", no_argument, &record_golden_flag, 1},
+        {"verbose", no_argument, &verbose_flag, 1},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    Bench_scene_t scene = {"oli", 2000, 2000, 0.3, 50, 1, true, false};
+    int scene_index;
+    int failures = 0;
+    int option_index;
+    int c;
+
+    opterr = 0;
+    while ((c = getopt_long(argc, argv, "", long_options, &option_index))
+           != -1)
+    {
+        switch (c)
+        {
+        case 0:
+            break;
+
+        case 'e':
+            scene.sensor_name = optarg;
+            break;
+
+        case 'l':
+            scene.nrows = atoi(optarg);
+            break;
+
+        case 's':
+            scene.ncols = atoi(optarg);
+            break;
+
+        case 'f':
+            scene.cloud_fraction = atof(optarg);
+            break;
+
+        case 'n':
+            scene.cloud_count = atoi(optarg);
+            break;
+
+        case 'r':
+            scene.seed = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'g':
+            golden_name = optarg;
+            break;
+
+        case 'w':
+            scene_prefix = optarg;
+            break;
+
+        case 'h':
+            bench_usage();
+            exit(SUCCESS);
+            break;
+
+        case '?':
+        default:
+            sprintf(errmsg, "Unknown option %s", argv[optind - 1]);
+            bench_usage();
+            RETURN_ERROR(errmsg, FUNC_NAME, EXIT_FAILURE);
+            break;
+        }
+    }
+    scene.use_thermal = use_thermal_flag;
+    scene.use_cirrus = use_cirrus_flag;
+
+    if (record_golden_flag && golden_name == NULL)
+    {
+        RETURN_ERROR("--record-golden needs a --golden file", FUNC_NAME,
+                     EXIT_FAILURE);
+    }
+
+    if (suite_flag && scene_prefix != NULL)
+    {
+        RETURN_ERROR("--write-scene writes a single scene, not the suite",
+                     FUNC_NAME, EXIT_FAILURE);
+    }
+
+    enable_profile();
+
+    if (suite_flag)
+    {
+        for (scene_index = 0;
+             scene_index < (int)(sizeof(bench_suite) / sizeof(bench_suite[0]));
+             scene_index++)
+        {
+            if (bench_scene(&bench_suite[scene_index], golden_name,
+                            record_golden_flag, NULL, verbose_flag)
+                != SUCCESS)
+            {
+                failures++;
+            }
+        }
+    }
+    else if (bench_scene(&scene, golden_name, record_golden_flag,
+                         scene_prefix, verbose_flag) != SUCCESS)
+    {
+        failures++;
+    }
+
+    if (failures > 0)
+    {
+        sprintf(errmsg, "%d scenes failed", failures);
+        RETURN_ERROR(errmsg, FUNC_NAME, EXIT_FAILURE);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -37,6 +37,11 @@
 #define MAX_DATE_LEN (28)
 
 
+/* Output file formats */
+#define OUTPUT_FORMAT_ENVI 0    /* raw binary with an ENVI header */
+#define OUTPUT_FORMAT_TIFF 1    /* tiled, deflate compressed TIFF */
+
+
 /* Fill pixel value for the input data */
 #define FILL_PIXEL -9999
 
@@ -5,8 +5,12 @@
 */
 
 /* System Includes */
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 /* Local Includes */
@@ -18,87 +22,133 @@
 #define IAS_MAX(A,B)    (((A) > (B)) ? (A) : (B))
 #define IAS_MIN(A,B)    (((A) < (B)) ? (A) : (B))
 
-/* Define the number of pixel elements to allocate in each block */
-#define BUFFER_BLOCK_SIZE 1000000
+/* Define the number of pixel indices in each block of a level queue */
+#define QUEUE_CHUNK_SIZE 1024
+
+/* Define the number of chunks allocated when the queue is created */
+#define INITIAL_CHUNK_COUNT 64
+
+/* Define the minimum number of rows in each strip filled by a thread */
+#define MIN_FILL_STRIP_ROWS 256
 
 /* Support structures and routines for fill_minima. */
-typedef struct queue_element
-{
-    int i;                  /* Row of pixel */
-    int j;                  /* Column of pixel */
-    struct queue_element *next;  /* Pointer to next pixel */
-} QUEUE_ELEMENT;
 
-typedef struct queue_header
+/* FIFO of the pixels at one level.  The pixel indices are stored in a list
+   of chunks, reading from the head chunk and adding to the tail chunk. */
+typedef struct queue_level
 {
-    QUEUE_ELEMENT *first;           /* Pointer in queue - first */
-    QUEUE_ELEMENT *last;            /* Pointer in queue - last */
-} QUEUE_HEADER;
+    int head_chunk;         /* Chunk being read, -1 if the level is empty */
+    int head_pos;           /* Next position to read in the head chunk */
+    int tail_chunk;         /* Chunk being added to */
+    int tail_pos;           /* Next position to add to in the tail chunk */
+} QUEUE_LEVEL;
 
 /* Pixel queue structure.  Instead of allocating each element in the queue
-   separately, a custom allocation scheme is used to allocate a block of
-   elements at a time and assign each of them as needed.  When an additional
-   block is needed, a new one is allocated.  The list of blocks is maintained
-   by using the first element in each block as a pointer to the next block. */
+   separately, the pixel indices of all of the levels are kept in chunks of
+   one arena, which grows when every chunk is in use.  Chunks are linked by
+   their index and returned to a free list once they have been read, so the
+   arena only needs to hold the pixels waiting in the queue. */
 typedef struct pixel_queue
 {
     int h_min;
     int num_levels;
-    QUEUE_HEADER *q;
-    QUEUE_ELEMENT *pix_array;  /* First allocated QUEUE_ELEMENT block */
-    QUEUE_ELEMENT *current_pix_array;/* Current block of QUEUE_ELEMENT being
-                                        used for allocs */
-    int next_new;              /* Next element to alloc in the current block */
-    QUEUE_ELEMENT *free_list;  /* Free list of elements */
+    QUEUE_LEVEL *q;
+    int *chunk_pixels;      /* Pixel indices, QUEUE_CHUNK_SIZE per chunk */
+    int *chunk_next;        /* Next chunk in a level or in the free list */
+    int chunk_count;        /* Number of chunks in the arena */
+    int free_chunk;         /* First chunk of the free list, -1 if empty */
 } PIXEL_QUEUE;
 
 /*----------------------------------------------------------------------------
-NAME: *create_new_pixel
+NAME: grow_chunk_arena
 
-PURPOSE: Allocate a new pixel queue element and initialize it.
+PURPOSE: Double the number of chunks in the arena and put the new chunks on
+         the free list.
 
-RETURNS: Pointer to QUEUE_ELEMENT, NULL if the allocation fails
+RETURNS: SUCCESS/ERROR
 ----------------------------------------------------------------------------*/
-static QUEUE_ELEMENT *create_new_pixel
+static int grow_chunk_arena
 (
-    PIXEL_QUEUE *pixel_q,   /* I: Pixel queue to use for allocations */
-    int i,                  /* I: Row of pixel */
-    int j                   /* I: Column of pixel */
+    PIXEL_QUEUE *pixel_q    /* I: Pixel queue to use for allocations */
 )
 {
-    char *FUNC_NAME = "create_new_pixel";
-    QUEUE_ELEMENT *p;
-    int alloc_index = pixel_q->next_new;
+    char *FUNC_NAME = "grow_chunk_arena";
+    int *chunk_pixels;
+    int *chunk_next;
+    int chunk_count;
+    int i;
 
-    if (alloc_index >= BUFFER_BLOCK_SIZE)
-    {
-        /* Allocate another block of pixel elements */
-        QUEUE_ELEMENT *new_block = malloc(BUFFER_BLOCK_SIZE
-                * sizeof(*new_block));
-        if (!new_block)
-        {
-            RETURN_ERROR("Allocating a new block of queue elements",
-                         FUNC_NAME, NULL);
-        }
-        new_block[0].next = NULL;
+    chunk_count = pixel_q->chunk_count * 2;
+    if (chunk_count < INITIAL_CHUNK_COUNT)
+        chunk_count = INITIAL_CHUNK_COUNT;
 
-        /* The first element in the current array is used as a pointer to the
-           next block */
-        pixel_q->current_pix_array[0].next = new_block;
+    chunk_pixels = realloc(pixel_q->chunk_pixels, (size_t)chunk_count
+                           * QUEUE_CHUNK_SIZE * sizeof(*chunk_pixels));
+    if (!chunk_pixels)
+    {
+        RETURN_ERROR("Allocating a new block of queue elements",
+                     FUNC_NAME, ERROR);
+    }
+    pixel_q->chunk_pixels = chunk_pixels;
 
-        /* Allocating from the next block now */
-        pixel_q->current_pix_array = new_block;
-        pixel_q->next_new = 1;
-        alloc_index = 1;
+    chunk_next = realloc(pixel_q->chunk_next,
+                         chunk_count * sizeof(*chunk_next));
+    if (!chunk_next)
+    {
+        RETURN_ERROR("Allocating a new block of queue elements",
+                     FUNC_NAME, ERROR);
     }
-    pixel_q->next_new++;
+    pixel_q->chunk_next = chunk_next;
+
+    /* Link the new chunks onto the free list */
+    for (i = pixel_q->chunk_count; i < chunk_count - 1; i++)
+        chunk_next[i] = i + 1;
+    chunk_next[chunk_count - 1] = pixel_q->free_chunk;
+    pixel_q->free_chunk = pixel_q->chunk_count;
+    pixel_q->chunk_count = chunk_count;
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME: get_free_chunk
+
+PURPOSE: Take a chunk from the free list, growing the arena if needed.
+
+RETURNS: Index of the chunk, -1 if the allocation fails
+----------------------------------------------------------------------------*/
+static int get_free_chunk
+(
+    PIXEL_QUEUE *pixel_q    /* I: Pixel queue to use for allocations */
+)
+{
+    int chunk;
+
+    if (pixel_q->free_chunk < 0 && grow_chunk_arena(pixel_q) != SUCCESS)
+        return -1;
+
+    chunk = pixel_q->free_chunk;
+    pixel_q->free_chunk = pixel_q->chunk_next[chunk];
+    pixel_q->chunk_next[chunk] = -1;
+
+    return chunk;
+}
 
-    p = &pixel_q->current_pix_array[alloc_index];
-    p->i = i;
-    p->j = j;
-    p->next = NULL;
+/*----------------------------------------------------------------------------
+NAME: release_chunk
+
+PURPOSE: Put a chunk back on the free list.
 
-    return p;
+RETURNS: nothing
+----------------------------------------------------------------------------*/
+static void release_chunk
+(
+    PIXEL_QUEUE *pixel_q,   /* I: Pointer to PIXEL_QUEUE */
+    int chunk               /* I: Chunk to release */
+)
+{
+    pixel_q->chunk_next[chunk] = pixel_q->free_chunk;
+    pixel_q->free_chunk = chunk;
 }
 
 /*----------------------------------------------------------------------------
@@ -129,7 +179,7 @@ static PIXEL_QUEUE *initialize_pixel_queue
     pixel_q->h_min = h_min;
     pixel_q->num_levels = num_levels;
 
-    pixel_q->q = (QUEUE_HEADER *)calloc(num_levels, sizeof(QUEUE_HEADER));
+    pixel_q->q = (QUEUE_LEVEL *)calloc(num_levels, sizeof(QUEUE_LEVEL));
     if (pixel_q->q == NULL)
     {
        free(pixel_q);
@@ -138,25 +188,25 @@ static PIXEL_QUEUE *initialize_pixel_queue
     }
     for (i = 0; i < num_levels; i++)
     {
-        pixel_q->q[i].first = NULL;
-        pixel_q->q[i].last = NULL;
+        pixel_q->q[i].head_chunk = -1;
+        pixel_q->q[i].tail_chunk = -1;
     }
 
-    /* Allocate a starting block of QUEUE_ELEMENT buffers */
-    pixel_q->pix_array = malloc(BUFFER_BLOCK_SIZE * sizeof(QUEUE_ELEMENT));
-    if (!pixel_q->pix_array)
+    /* Allocate a starting block of chunks */
+    pixel_q->chunk_pixels = NULL;
+    pixel_q->chunk_next = NULL;
+    pixel_q->chunk_count = 0;
+    pixel_q->free_chunk = -1;
+    if (grow_chunk_arena(pixel_q) != SUCCESS)
     {
+       free(pixel_q->chunk_pixels);
+       free(pixel_q->chunk_next);
        free(pixel_q->q);
        free(pixel_q);
        RETURN_ERROR("Allocating memory for the queue element array",
                     FUNC_NAME, NULL);
     }
 
-    /* Reserve the first entry for the next block link */
-    pixel_q->next_new = 1;
-    pixel_q->pix_array[0].next = NULL;
-    pixel_q->current_pix_array = pixel_q->pix_array;
-
     return pixel_q;
 }
 
@@ -172,17 +222,10 @@ static void free_pixel_queue
     PIXEL_QUEUE *pixel_q   /* I: Pointer to PIXEL_QUEUE */
 )
 {
-    QUEUE_ELEMENT *p;
-
-    /* Free the blocks of pixel elements.  Note that the free list does not
-       need to be free'd since nothing in that list was directly allocated. */
-    p = pixel_q->pix_array;
-    while (p)
-    {
-        QUEUE_ELEMENT *next = p->next;
-        free(p);
-        p = next;
-    }
+    free(pixel_q->chunk_pixels);
+    pixel_q->chunk_pixels = NULL;
+    free(pixel_q->chunk_next);
+    pixel_q->chunk_next = NULL;
     free(pixel_q->q);
     pixel_q->q = NULL;
 
@@ -195,98 +238,107 @@ NAME: add_pixel
 PURPOSE: Add a pixel at level h
 
 RETURNS: SUCCESS/ERROR
+
+NOTES:
+1. The levels at and above the last level processed by the fill are never
+   read, so pixels added to them are dropped.
 ----------------------------------------------------------------------------*/
 static int add_pixel
 (
     PIXEL_QUEUE *pixel_q,/* I: Pointer to PIXEL_QUEUE */
-    int row,             /* I: Row of pixel */
-    int col,             /* I: Column of pixel */
+    int pixel,           /* I: Index of pixel */
     int h                /* I: Element level in the queue */
 )
 {
     char *FUNC_NAME = "add_pixel";
     int ndx;
-    QUEUE_ELEMENT *current;
-    QUEUE_ELEMENT *new_pixel;
-    QUEUE_HEADER *level_q;
+    int chunk;
+    QUEUE_LEVEL *level_q;
 
     ndx = h - pixel_q->h_min;
-    if (ndx > pixel_q->num_levels)
+    if (ndx < 0)
     {
         RETURN_ERROR("Invalid element level", FUNC_NAME, ERROR);
     }
+    if (ndx >= pixel_q->num_levels - 1)
+        return SUCCESS;
     level_q = &(pixel_q->q[ndx]);
 
-    /* Get a pixel element from the free list, if available */
-    new_pixel = pixel_q->free_list;
-    if (new_pixel)
-    {
-        pixel_q->free_list = new_pixel->next;
-        new_pixel->next = NULL;
-        new_pixel->i = row;
-        new_pixel->j = col;
-    }
-    else
+    /* Start a new chunk when the level is empty or its tail chunk is full */
+    if (level_q->tail_chunk < 0 || level_q->tail_pos == QUEUE_CHUNK_SIZE)
     {
-        /* Take a copy of the pixel structure */
-        new_pixel = create_new_pixel(pixel_q, row, col);
-        if (!new_pixel)
+        chunk = get_free_chunk(pixel_q);
+        if (chunk < 0)
         {
             RETURN_ERROR("Adding element to the pixel queue",
                          FUNC_NAME, ERROR);
         }
-    }
 
-    /* Add to end of queue at this level */
-    current = level_q->last;
-    if (current != NULL)
-    {
-        current->next = new_pixel;
+        if (level_q->tail_chunk < 0)
+        {
+            level_q->head_chunk = chunk;
+            level_q->head_pos = 0;
+        }
+        else
+            pixel_q->chunk_next[level_q->tail_chunk] = chunk;
+        level_q->tail_chunk = chunk;
+        level_q->tail_pos = 0;
     }
-    level_q->last = new_pixel;
 
-    /* If head of queue is NULL, make the new one the head */
-    if (level_q->first == NULL)
-    {
-        level_q->first = new_pixel;
-    }
+    /* Add to end of queue at this level */
+    pixel_q->chunk_pixels[(size_t)level_q->tail_chunk * QUEUE_CHUNK_SIZE
+                          + level_q->tail_pos] = pixel;
+    level_q->tail_pos++;
 
     return SUCCESS;
 }
 
 /*----------------------------------------------------------------------------
-NAME: *get_first_pixel_entry
+NAME: get_first_pixel_entry
 
 PURPOSE: Return the first element in the queue at level h, and remove it
          from the queue
 
-RETURNS: First element in the queue at level h
+RETURNS: true if a pixel was removed, false if the level is empty
 ----------------------------------------------------------------------------*/
-static QUEUE_ELEMENT *get_first_pixel_entry
+static bool get_first_pixel_entry
 (
     PIXEL_QUEUE *pixel_q,/* I: Pointer to PIXEL_QUEUE */
-    int h                /* I: Element level in the queue */
+    int h,               /* I: Element level in the queue */
+    int *pixel           /* O: Index of the pixel removed */
 )
 {
     int ndx;
-    QUEUE_ELEMENT *current;
-    QUEUE_HEADER *level_q;
+    int chunk;
+    QUEUE_LEVEL *level_q;
 
     ndx = h - pixel_q->h_min;
     level_q = &(pixel_q->q[ndx]);
-    current = level_q->first;
+    chunk = level_q->head_chunk;
+    if (chunk < 0)
+        return false;
 
     /* Remove from head of queue */
-    if (current != NULL)
+    *pixel = pixel_q->chunk_pixels[(size_t)chunk * QUEUE_CHUNK_SIZE
+                                   + level_q->head_pos];
+    level_q->head_pos++;
+
+    if (chunk == level_q->tail_chunk && level_q->head_pos == level_q->tail_pos)
     {
-        level_q->first = current->next;
-        if (level_q->first == NULL)
-        {
-            level_q->last = NULL;
-        }
+        /* The level is empty */
+        release_chunk(pixel_q, chunk);
+        level_q->head_chunk = -1;
+        level_q->tail_chunk = -1;
+    }
+    else if (level_q->head_pos == QUEUE_CHUNK_SIZE)
+    {
+        /* Move on to the next chunk of the level */
+        level_q->head_chunk = pixel_q->chunk_next[chunk];
+        level_q->head_pos = 0;
+        release_chunk(pixel_q, chunk);
     }
 
-    return current;
+    return true;
 }
 
 /*----------------------------------------------------------------------------
@@ -337,6 +389,366 @@ static inline bool kernel_has_fill
     return false;
 }
 
+/*----------------------------------------------------------------------------
+NAME:  fill_strip_count
+
+PURPOSE: Determine the number of row strips the fill is split into, one for
+         each thread available.
+
+RETURN: Number of strips, 1 to use the serial fill
+----------------------------------------------------------------------------*/
+static int fill_strip_count
+(
+    int num_rows    /* I: Number of rows in the input image */
+)
+{
+    int num_strips = 1;
+
+#ifdef _OPENMP
+    if (!omp_in_parallel())
+        num_strips = omp_get_max_threads();
+#endif
+
+    if (num_strips > num_rows / MIN_FILL_STRIP_ROWS)
+        num_strips = num_rows / MIN_FILL_STRIP_ROWS;
+    if (num_strips < 1)
+        num_strips = 1;
+
+    return num_strips;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  flood_strip
+
+PURPOSE: Process the queued pixels of a strip, lowering the filled value of
+         their neighbors within the strip, until the queue is empty.
+
+RETURN: SUCCESS/ERROR
+
+NOTES:
+1. A pixel can be queued again when its value is lowered, so an entry is
+   skipped when the pixel no longer has the value of its level.
+----------------------------------------------------------------------------*/
+static int flood_strip
+(
+    const short int *in_img,   /* I: Input image buffer */
+    int num_cols,              /* I: Number of columns in the input image */
+    int strip_start,           /* I: First row of the strip */
+    int strip_end,             /* I: Row after the last row of the strip */
+    int h_start,               /* I: Lowest level with queued pixels */
+    int hmax,                  /* I: Maximum value in the input image */
+    PIXEL_QUEUE *pixel_q,      /* I/O: Queue of the strip */
+    short int *out_img         /* I/O: Output image buffer */
+)
+{
+    char *FUNC_NAME = "flood_strip";
+    int pixel_index;
+    int h_current;
+    int r, c;
+
+    for (h_current = h_start; h_current < hmax; h_current++)
+    {
+        while (get_first_pixel_entry(pixel_q, h_current, &pixel_index))
+        {
+            int p_row = pixel_index / num_cols;
+            int p_col = pixel_index % num_cols;
+            int start_row;
+            int end_row;
+
+            if (out_img[pixel_index] != h_current)
+                continue;
+
+            start_row = IAS_MAX(strip_start, p_row - 1);
+            end_row = IAS_MIN(strip_end, p_row + 2);
+
+            for (r = start_row; r < end_row; r++)
+            {
+                int start_col = IAS_MAX(0, p_col - 1);
+                int end_col = IAS_MIN(num_cols, p_col + 2);
+                const short int *in_row = &in_img[r * num_cols];
+                short int *out_row = &out_img[r * num_cols];
+
+                for (c = start_col; c < end_col; c++)
+                {
+                    short int pixel = in_row[c];
+                    short int value;
+
+                    /* Exclude null area of original image */
+                    if (pixel == FILL_PIXEL)
+                        continue;
+
+                    value = IAS_MAX(h_current, pixel);
+                    if (value < out_row[c])
+                    {
+                        out_row[c] = value;
+                        if (add_pixel(pixel_q, r * num_cols + c, value)
+                            != SUCCESS)
+                        {
+                            RETURN_ERROR("Adding pixel to queue",
+                                         FUNC_NAME, ERROR);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  relax_strip_edge
+
+PURPOSE: Lower the filled values along the edge row of a strip from the
+         filled values of the adjacent row in the neighboring strip, and
+         queue the pixels that changed.
+
+RETURN: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int relax_strip_edge
+(
+    const short int *in_img,   /* I: Input image buffer */
+    int num_cols,              /* I: Number of columns in the input image */
+    int edge_row,              /* I: Edge row of the strip */
+    int adjacent_row,          /* I: Adjacent row in the neighboring strip */
+    const short int *adjacent_out, /* I: Filled values of the adjacent row */
+    int hmax,                  /* I: Maximum value in the input image */
+    PIXEL_QUEUE *pixel_q,      /* I/O: Queue of the strip */
+    int *h_start,              /* I/O: Lowest level with queued pixels */
+    int *changed,              /* I/O: Incremented when a pixel is lowered */
+    short int *out_img         /* I/O: Output image buffer */
+)
+{
+    char *FUNC_NAME = "relax_strip_edge";
+    const short int *in_row = &in_img[edge_row * num_cols];
+    const short int *adjacent_in = &in_img[adjacent_row * num_cols];
+    short int *out_row = &out_img[edge_row * num_cols];
+    int c;
+    int n;
+
+    for (c = 0; c < num_cols; c++)
+    {
+        int start_col = IAS_MAX(0, c - 1);
+        int end_col = IAS_MIN(num_cols, c + 2);
+        short int lowest = hmax;
+        short int value;
+
+        if (in_row[c] == FILL_PIXEL)
+            continue;
+
+        /* Only the neighbors below the maximum have been reached and pass
+           their level on */
+        for (n = start_col; n < end_col; n++)
+        {
+            if (adjacent_in[n] != FILL_PIXEL && adjacent_out[n] < lowest)
+                lowest = adjacent_out[n];
+        }
+        if (lowest == hmax)
+            continue;
+
+        value = IAS_MAX(lowest, in_row[c]);
+        if (value < out_row[c])
+        {
+            out_row[c] = value;
+            if (add_pixel(pixel_q, edge_row * num_cols + c, value) != SUCCESS)
+            {
+                RETURN_ERROR("Adding pixel to queue", FUNC_NAME, ERROR);
+            }
+            if (value < *h_start)
+                *h_start = value;
+            (*changed)++;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_minima_in_strips
+
+PURPOSE: Fill the local minima with the image split into row strips that
+         are filled in parallel.  Each strip is first filled on its own from
+         the boundary pixels it contains.  The filled values along the edges
+         of the strips are then passed to the neighboring strips, and the
+         changes flooded through the strips, until no edge changes.
+
+RETURN: SUCCESS/ERROR
+
+NOTES:
+1. The filled value of a pixel is the lowest level over all of the paths
+   from a boundary pixel of the highest input value along the path, which
+   is what the level ordered queue of the serial fill produces.  The
+   strips only ever lower values to levels reached along real paths, so
+   once the edges are stable the result is identical to the serial fill.
+2. This requires every input value to be at most hmax and the boundary
+   level to be one of the levels processed, which the caller checks.
+----------------------------------------------------------------------------*/
+static int fill_minima_in_strips
+(
+    const short int *in_img,   /* I: Input image buffer */
+    int num_rows,              /* I: Number of rows in the input image */
+    int num_cols,              /* I: Number of columns in the input image */
+    int num_strips,            /* I: Number of strips to fill */
+    int boundary_level,        /* I: Filled value of the boundary pixels */
+    int hmin,                  /* I: Minimum value in the input image */
+    int hmax,                  /* I: Maximum value in the input image */
+    short int *out_img         /* O: Output image buffer */
+)
+{
+    char *FUNC_NAME = "fill_minima_in_strips";
+    PIXEL_QUEUE **strip_q;
+    short int *edge_rows;  /* Copies of the rows adjacent to each strip,
+                              above then below */
+    int failed = 0;
+    int changed;
+    int s;
+
+    strip_q = calloc(num_strips, sizeof(PIXEL_QUEUE *));
+    edge_rows = malloc(2 * (size_t)num_strips * num_cols * sizeof(short int));
+    if (strip_q == NULL || edge_rows == NULL)
+    {
+        free(strip_q);
+        free(edge_rows);
+        RETURN_ERROR("Allocating strip buffers", FUNC_NAME, ERROR);
+    }
+
+    /* Fill each strip on its own */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic,1)
+#endif
+    for (s = 0; s < num_strips; s++)
+    {
+        int strip_start = s * num_rows / num_strips;
+        int strip_end = (s + 1) * num_rows / num_strips;
+        int r, c;
+
+        strip_q[s] = initialize_pixel_queue(hmin, hmax);
+        if (!strip_q[s])
+        {
+            failed = 1;
+            continue;
+        }
+
+        for (r = strip_start; r < strip_end; r++)
+        {
+            const short int *in_line = &in_img[r * num_cols];
+            short int *out_line = &out_img[r * num_cols];
+
+            for (c = 0; c < num_cols; c++)
+            {
+                if (in_line[c] == FILL_PIXEL)
+                    out_line[c] = FILL_PIXEL;
+                else if (kernel_has_fill(in_img, num_rows, num_cols, r, c))
+                {
+                    out_line[c] = boundary_level;
+                    if (add_pixel(strip_q[s], r * num_cols + c,
+                                  boundary_level) != SUCCESS)
+                        failed = 1;
+                }
+                else
+                    out_line[c] = hmax;
+            }
+        }
+
+        if (!failed && flood_strip(in_img, num_cols, strip_start, strip_end,
+                                   boundary_level, hmax, strip_q[s], out_img)
+                       != SUCCESS)
+        {
+            failed = 1;
+        }
+    }
+
+    /* Pass the filled values across the strip edges until they are
+       stable */
+    changed = !failed;
+    while (changed)
+    {
+        changed = 0;
+
+        for (s = 0; s < num_strips; s++)
+        {
+            int strip_start = s * num_rows / num_strips;
+            int strip_end = (s + 1) * num_rows / num_strips;
+            short int *above = &edge_rows[(size_t)2 * s * num_cols];
+            short int *below = above + num_cols;
+
+            if (s > 0)
+            {
+                memcpy(above, &out_img[(strip_start - 1) * num_cols],
+                       num_cols * sizeof(short int));
+            }
+            if (s < num_strips - 1)
+            {
+                memcpy(below, &out_img[strip_end * num_cols],
+                       num_cols * sizeof(short int));
+            }
+        }
+
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic,1) reduction(+:changed)
+#endif
+        for (s = 0; s < num_strips; s++)
+        {
+            int strip_start = s * num_rows / num_strips;
+            int strip_end = (s + 1) * num_rows / num_strips;
+            short int *above = &edge_rows[(size_t)2 * s * num_cols];
+            short int *below = above + num_cols;
+            int h_start = hmax;
+            int strip_changed = 0;
+
+            if (failed)
+                continue;
+
+            if (s > 0 && relax_strip_edge(in_img, num_cols, strip_start,
+                                          strip_start - 1, above, hmax,
+                                          strip_q[s], &h_start,
+                                          &strip_changed, out_img)
+                         != SUCCESS)
+            {
+                failed = 1;
+                continue;
+            }
+            if (s < num_strips - 1
+                && relax_strip_edge(in_img, num_cols, strip_end - 1,
+                                    strip_end, below, hmax, strip_q[s],
+                                    &h_start, &strip_changed, out_img)
+                   != SUCCESS)
+            {
+                failed = 1;
+                continue;
+            }
+
+            if (strip_changed > 0
+                && flood_strip(in_img, num_cols, strip_start, strip_end,
+                               h_start, hmax, strip_q[s], out_img)
+                   != SUCCESS)
+            {
+                failed = 1;
+                continue;
+            }
+            changed += strip_changed;
+        }
+
+        if (failed)
+            changed = 0;
+    }
+
+    for (s = 0; s < num_strips; s++)
+    {
+        if (strip_q[s])
+            free_pixel_queue(strip_q[s]);
+    }
+    free(strip_q);
+    free(edge_rows);
+
+    if (failed)
+    {
+        RETURN_ERROR("Filling the image strips", FUNC_NAME, ERROR);
+    }
+
+    return SUCCESS;
+}
+
 /*----------------------------------------------------------------------------
 NAME:  fill_local_minima_in_image
 
@@ -361,9 +773,11 @@ int fill_local_minima_in_image
     char *FUNC_NAME = "add_pixel";
     int r, c;
     PIXEL_QUEUE *pixel_q;
-    QUEUE_ELEMENT *p;
+    int pixel_index;
     int h_current;
     int hmin, hmax;
+    int first_value = FILL_PIXEL;
+    int num_strips;
     int pixel_count = num_rows * num_cols;
 
     printf("minima filling setup for %s band\n", band_name);
@@ -375,6 +789,8 @@ int fill_local_minima_in_image
     {
          if (in_img[r] == FILL_PIXEL)
              continue;    /* Fill data */
+         if (first_value == FILL_PIXEL)
+             first_value = in_img[r];
          if (in_img[r] < hmin)
              hmin = in_img[r];
          else if (in_img[r] > hmax)
@@ -391,6 +807,26 @@ int fill_local_minima_in_image
     if (boundary_val == 0)
         boundary_val = hmax;
 
+    /* Fill the image in strips when there are threads to share the work.
+       The first value is not compared against the maximum, so it can be
+       above it, and then the serial fill is used to keep its results. */
+    num_strips = fill_strip_count(num_rows);
+    if (num_strips > 1 && first_value <= hmax
+        && (int)boundary_val >= hmin && (int)boundary_val < hmax)
+    {
+        printf("main minima filling started for %s band in %d strips\n",
+               band_name, num_strips);
+        if (fill_minima_in_strips(in_img, num_rows, num_cols, num_strips,
+                                  (int)boundary_val, hmin, hmax, out_img)
+            != SUCCESS)
+        {
+            RETURN_ERROR("Filling the image in strips", FUNC_NAME, ERROR);
+        }
+        printf("main minima filling completed for %s band\n", band_name);
+
+        return SUCCESS;
+    }
+
     /* Fill the out_img with the max value. */
     for (r = 0; r < pixel_count; r++)
         out_img[r] = hmax;
@@ -421,7 +857,8 @@ int fill_local_minima_in_image
             /* If the 3x3 kernel has any fill pixels, it is a boundary pixel */
             if (kernel_has_fill(in_img, num_rows, num_cols, r, c))
             {
-                if (add_pixel(pixel_q, r, c, boundary_val) != SUCCESS)
+                if (add_pixel(pixel_q, r * num_cols + c, boundary_val)
+                    != SUCCESS)
                 {
                     free_pixel_queue(pixel_q);
                     RETURN_ERROR("Adding pixel to queue",
@@ -439,18 +876,20 @@ int fill_local_minima_in_image
     h_current = (int)hmin;
     do
     {
-        while ((p = get_first_pixel_entry(pixel_q, h_current)))
+        while (get_first_pixel_entry(pixel_q, h_current, &pixel_index))
         {
+            int p_row = pixel_index / num_cols;
+            int p_col = pixel_index % num_cols;
             int start_row;
             int end_row;
 
-            start_row = IAS_MAX(0, p->i - 1);
-            end_row = IAS_MIN(num_rows, p->i + 2);
+            start_row = IAS_MAX(0, p_row - 1);
+            end_row = IAS_MIN(num_rows, p_row + 2);
 
             for (r = start_row; r < end_row; r++)
             {
-                int start_col = IAS_MAX(0, p->j - 1);
-                int end_col = IAS_MIN(num_cols, p->j + 2);
+                int start_col = IAS_MAX(0, p_col - 1);
+                int end_col = IAS_MIN(num_cols, p_col + 2);
                 const short int *in_row = &in_img[r * num_cols];
                 short int *out_row = &out_img[r * num_cols];
 
@@ -459,7 +898,7 @@ int fill_local_minima_in_image
                     short int pixel;
 
                     /* Skip the current pixel */
-                    if (r == p->i && c == p->j)
+                    if (r == p_row && c == p_col)
                         continue;
 
                     pixel = in_row[c];
@@ -470,7 +909,8 @@ int fill_local_minima_in_image
                         out_row[c] = IAS_MAX(h_current, pixel);
                         if (pixel < hmax)
                         {
-                            if (add_pixel(pixel_q, r, c, out_row[c]) != SUCCESS)
+                            if (add_pixel(pixel_q, r * num_cols + c,
+                                          out_row[c]) != SUCCESS)
                             {
                                 free_pixel_queue(pixel_q);
                                 RETURN_ERROR("Adding pixel to queue",
@@ -480,10 +920,6 @@ int fill_local_minima_in_image
                     }
                 }
             }
-
-            /* Put the element on the free list */
-            p->next = pixel_q->free_list;
-            pixel_q->free_list = p;
         }
         h_current++;
     } while (h_current < hmax);
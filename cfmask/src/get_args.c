@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+
+
+#include "const.h"
+#include "error.h"
+#include "cfmask.h"
+
+#include "misc.h"
+
+
+/*****************************************************************************
+MODULE:  get_args
+
+PURPOSE:  Gets the command-line arguments and validates that the required
+arguments were specified.
+
+RETURN VALUE:
+Type = int
+Value           Description
+-----           -----------
+FAILURE         Error getting the command-line arguments or a command-line
+                argument and associated value were not specified
+SUCCESS         No errors encountered
+
+NOTES:
+  1. Memory is allocated for the input and output files.  All of these should
+     be character pointers set to NULL on input.  The caller is responsible
+     for freeing the allocated memory upon successful return.
+*****************************************************************************/
+int get_args
+(
+    int argc,          /* I: number of cmd-line args */
+    char *argv[],      /* I: string of cmd-line args */
+    char **xml_infile, /* O: address of input XML filename */
+    char **batch_file, /* O: address of the batch filename, NULL when
+                             processing a single scene */
+    float *cloud_prob, /* O: cloud_probability input */
+    int *cldpix,       /* O: cloud_pixel buffer used for image dilate */
+    int *sdpix,        /* O: shadow_pixel buffer used for image dilate */
+    bool *use_cirrus,  /* O: use Cirrus data */
+    bool *use_thermal, /* O: use Thermal data */
+    bool *cache_bands, /* O: keep the input bands resident in memory */
+    bool *use_mmap,    /* O: memory map the input band files */
+    bool *fast_height_search, /* O: search the cloud heights with a
+                                    subsample of the cloud pixels */
+    int *pyramid_factor, /* O: reduction of the first height search, 1 for
+                               full resolution */
+    bool *huge_pages,  /* O: back the scratch pool with huge pages */
+    int *thread_count, /* O: number of threads, 0 for the OpenMP default */
+    bool *pin_threads, /* O: pin the threads to the CPUs for NUMA */
+    int *estimate_stride, /* O: sample stride of the cloud cover estimate,
+                                0 for the full masking */
+    bool *estimate_preview, /* O: write the preview mask of the estimate */
+    bool *stage_cache, /* O: keep the stage intermediates of each scene */
+    int *memory_cap,   /* O: memory cap in megabytes, 0 for no cap */
+    int *output_format, /* O: OUTPUT_FORMAT_ENVI or OUTPUT_FORMAT_TIFF */
+    char **profile_file, /* O: address of the profile report filename, NULL
+                               when not profiling */
+    bool *verbose      /* O: verbose */
+)
+{
+    char FUNC_NAME[] = "get_args"; /* function name */
+    int c;                         /* current argument index */
+    int option_index;              /* index for the command-line option */
+    static int verbose_flag = 0;   /* verbose flag */
+    static int cldpix_default = 3; /* Default buffer for cloud pixel dilate */
+    static int sdpix_default = 3;  /* Default buffer for shadow pixel dilate */
+    static float cloud_prob_default = 22.5; /* Default cloud probability */
+    static int use_cirrus_flag = 0;  /* Default to not using Cirrus band data */
+    static int use_thermal_flag = 1; /* Default to using Thermal band data */
+    static int cache_bands_flag = 0; /* Default to reading bands line by line */
+    static int use_mmap_flag = 0;    /* Default to reading with stdio */
+    static int fast_height_search_flag = 0; /* Default to the strict search */
+    static int huge_pages_flag = 0;         /* Default to normal pages */
+    static int numa_flag = 0;               /* Default to unpinned threads */
+    static int estimate_flag = 0;           /* Default to the full masking */
+    static int estimate_preview_flag = 0;   /* Default to no preview */
+    static int stage_cache_flag = 0;        /* Default to run every stage */
+    static int estimate_stride_default = 4; /* Default estimate stride */
+    static int memory_cap_default = 0;      /* Default to no memory cap */
+    static int pyramid_factor_default = 1;  /* Default to full resolution */
+    char errmsg[MAX_STR_LEN];               /* error message */
+    static struct option long_options[] = {
+        {"xml", required_argument, 0, 'i'},
+        {"batch", required_argument, 0, 'b'},
+        {"without-thermal", no_argument, &use_thermal_flag, 0},
+        {"with-cirrus", no_argument, &use_cirrus_flag, 1},
+        {"cache-bands", no_argument, &cache_bands_flag, 1},
+        {"mmap-input", no_argument, &use_mmap_flag, 1},
+        {"fast-height-search", no_argument, &fast_height_search_flag, 1},
+        {"pyramid", required_argument, 0, 'y'},
+        {"huge-pages", no_argument, &huge_pages_flag, 1},
+        {"numa", no_argument, &numa_flag, 1},
+        {"threads", required_argument, 0, 't'},
+        {"estimate", no_argument, &estimate_flag, 1},
+        {"estimate-stride", required_argument, 0, 'e'},
+        {"estimate-preview", no_argument, &estimate_preview_flag, 1},
+        {"stage-cache", no_argument, &stage_cache_flag, 1},
+        {"prob", required_argument, 0, 'p'},
+        {"cldpix", required_argument, 0, 'c'},
+        {"sdpix", required_argument, 0, 's'},
+        {"memory-cap", required_argument, 0, 'm'},
+        {"output-format", required_argument, 0, 'o'},
+        {"profile-json", required_argument, 0, 'j'},
+        {"verbose", no_argument, &verbose_flag, 1},
+        {"version", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    /* Assign the default values */
+    *cloud_prob = cloud_prob_default;
+    *cldpix = cldpix_default;
+    *sdpix = sdpix_default;
+    *memory_cap = memory_cap_default;
+    *thread_count = 0;
+    *pyramid_factor = pyramid_factor_default;
+    *estimate_stride = estimate_stride_default;
+    *output_format = OUTPUT_FORMAT_ENVI;
+    *batch_file = NULL;
+    *profile_file = NULL;
+
+    /* Loop through all the cmd-line options */
+    opterr = 0; /* turn off getopt_long error msgs as we'll print our own */
+    while (1)
+    {
+        /* optstring in call to getopt_long is empty since we will only
+           support the long options */
+        c = getopt_long(argc, argv, "", long_options, &option_index);
+        if (c == -1)
+        {
+            /* Out of cmd-line options */
+            break;
+        }
+
+        switch (c)
+        {
+        case 0:
+            /* If this option set a flag, do nothing else now. */
+            if (long_options[option_index].flag != 0)
+                break;
+
+        case 'h':          /* help */
+            usage();
+            exit(SUCCESS);
+            break;
+
+        case 'v':          /* version */
+            version();
+            exit(SUCCESS);
+            break;
+
+        case 'i':          /* xml infile */
+            *xml_infile = strdup(optarg);
+            break;
+
+        case 'b':          /* batch file */
+            free(*batch_file);
+            *batch_file = strdup(optarg);
+            break;
+
+        case 'p':          /* cloud probability value */
+            *cloud_prob = atof(optarg);
+            break;
+
+        case 'c':          /* cloud pixel value for image dilation */
+            *cldpix = atoi(optarg);
+            break;
+
+        case 's':          /* snow pixel value for image dilation */
+            *sdpix = atoi(optarg);
+            break;
+
+        case 'm':          /* memory cap in megabytes */
+            *memory_cap = atoi(optarg);
+            if (*memory_cap < 0)
+            {
+                sprintf(errmsg, "Invalid memory cap %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 't':          /* number of threads */
+            *thread_count = atoi(optarg);
+            if (*thread_count < 1)
+            {
+                sprintf(errmsg, "Invalid number of threads %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'y':          /* pyramid factor of the height search */
+            *pyramid_factor = atoi(optarg);
+            if (*pyramid_factor != 1 && *pyramid_factor != 2
+                && *pyramid_factor != 4)
+            {
+                sprintf(errmsg, "Invalid pyramid factor %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'e':          /* sample stride of the estimate */
+            *estimate_stride = atoi(optarg);
+            if (*estimate_stride < 1)
+            {
+                sprintf(errmsg, "Invalid estimate stride %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'o':          /* output file format */
+            if (strcmp(optarg, "envi") == 0)
+                *output_format = OUTPUT_FORMAT_ENVI;
+            else if (strcmp(optarg, "tiff") == 0)
+                *output_format = OUTPUT_FORMAT_TIFF;
+            else
+            {
+                sprintf(errmsg, "Invalid output format %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'j':          /* profile report file */
+            free(*profile_file);
+            *profile_file = strdup(optarg);
+            break;
+
+        case '?':
+        default:
+            sprintf(errmsg, "Unknown option %s", argv[optind - 1]);
+            usage();
+            RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            break;
+        }
+    }
+
+    /* Make sure the infile or the batch file was specified */
+    if (*xml_infile == NULL && *batch_file == NULL)
+    {
+        sprintf(errmsg, "XML input file is a required argument");
+        usage();
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
+    if (*xml_infile != NULL && *batch_file != NULL)
+    {
+        sprintf(errmsg, "Only one of the XML input file and the batch file"
+                " can be specified");
+        usage();
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
+    /* Check the use cirrus band flag */
+    if (use_cirrus_flag)
+        *use_cirrus = true;
+    else
+        *use_cirrus = false;
+
+    /* Check the use thermal band flag */
+    if (use_thermal_flag)
+        *use_thermal = true;
+    else
+        *use_thermal = false;
+
+    /* Check the cache bands flag */
+    if (cache_bands_flag)
+        *cache_bands = true;
+    else
+        *cache_bands = false;
+
+    /* Check the memory mapped input flag */
+    if (use_mmap_flag)
+        *use_mmap = true;
+    else
+        *use_mmap = false;
+
+    /* Check the fast height search flag */
+    if (fast_height_search_flag)
+        *fast_height_search = true;
+    else
+        *fast_height_search = false;
+
+    /* Check the huge pages flag */
+    if (huge_pages_flag)
+        *huge_pages = true;
+    else
+        *huge_pages = false;
+
+    /* Check the NUMA thread pinning flag */
+    if (numa_flag)
+        *pin_threads = true;
+    else
+        *pin_threads = false;
+
+    /* Check the estimate flags, the stride is only kept for the estimate */
+    if (!estimate_flag)
+        *estimate_stride = 0;
+    if (estimate_flag && estimate_preview_flag)
+        *estimate_preview = true;
+    else
+        *estimate_preview = false;
+
+    /* Check the stage cache flag */
+    if (stage_cache_flag)
+        *stage_cache = true;
+    else
+        *stage_cache = false;
+
+    /* Check the verbose flag */
+    if (verbose_flag)
+        *verbose = true;
+    else
+        *verbose = false;
+
+    if (*verbose)
+    {
+        if (*xml_infile != NULL)
+            printf("XML_input_file = %s\n", *xml_infile);
+        else
+            printf("batch_file = %s\n", *batch_file);
+        printf("cloud_probability = %f\n", *cloud_prob);
+        printf("cloud_pixel_buffer = %d\n", *cldpix);
+        printf("shadow_pixel_buffer = %d\n", *sdpix);
+        if (*use_cirrus)
+            printf("use_cirrus = true\n");
+        else
+            printf("use_cirrus = false\n");
+        if (*use_thermal)
+            printf("use_thermal = true\n");
+        else
+            printf("use_thermal = false\n");
+        if (*cache_bands)
+            printf("cache_bands = true\n");
+        else
+            printf("cache_bands = false\n");
+        if (*use_mmap)
+            printf("use_mmap = true\n");
+        else
+            printf("use_mmap = false\n");
+        printf("pyramid_factor = %d\n", *pyramid_factor);
+        if (*stage_cache)
+            printf("stage_cache = true\n");
+        else
+            printf("stage_cache = false\n");
+        printf("memory_cap = %d\n", *memory_cap);
+        if (*estimate_stride > 0)
+            printf("estimate_stride = %d\n", *estimate_stride);
+        if (*output_format == OUTPUT_FORMAT_TIFF)
+            printf("output_format = tiff\n");
+        else
+            printf("output_format = envi\n");
+    }
+
+    return SUCCESS;
+}
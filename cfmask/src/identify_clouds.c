@@ -7,6 +7,7 @@
 /* System Includes */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Local Includes */
 #include "const.h"
@@ -117,6 +118,38 @@ static int create_cloud_runs
 }
 
 
+/*****************************************************************************
+Name: find_cloud
+
+Purpose: Find the cloud number a cloud has been merged into, compressing the
+    path of merges along the way.
+
+Returns: Cloud number of the merged cloud
+*****************************************************************************/
+static int find_cloud
+(
+    int *merged_into,   /* I/O: Cloud number each cloud was merged into,
+                                itself if it hasn't been merged */
+    int cloud_number    /* I: Cloud number to find */
+)
+{
+    int root = cloud_number;
+
+    while (merged_into[root] != root)
+        root = merged_into[root];
+
+    while (merged_into[cloud_number] != root)
+    {
+        int next = merged_into[cloud_number];
+
+        merged_into[cloud_number] = root;
+        cloud_number = next;
+    }
+
+    return root;
+}
+
+
 /*****************************************************************************
 Name: identify_clouds
 
@@ -125,6 +158,17 @@ Purpose: Given a pixel mask identifying individual pixels as clouds, group
 
 Notes:
     - cloud number zero is reserved for the "no cloud" condition
+    - The runs are grouped with a union-find of the cloud numbers.  While
+      the runs are grouped, a map of three rows holds the index + 1 of the
+      last run covering each pixel of the previous, current and next rows,
+      so the clouds overlapping the previous row are found from the runs
+      without an image sized cloud map.  A run can continue past the end of
+      its row, so it is recorded in the next row of the map, and the check
+      of the previous row can reach into the current row.
+    - A merge keeps the cloud found first and puts the runs of the merged
+      cloud ahead of its runs, and the cloud numbers are condensed in order,
+      which gives the same clouds and runs order as relabeling the cloud map
+      at each merge.
 
 Returns: SUCCESS/ERROR
 *****************************************************************************/
@@ -137,10 +181,8 @@ int identify_clouds
                                        segments */
     int **out_cloud_lookup,      /* O: Array to map clouds to cloud runs */
     int **out_cloud_pixel_count, /* O: Cloud number */
-    int *out_cloud_count,        /* O: Number of clouds in the cloud_lookup
+    int *out_cloud_count         /* O: Number of clouds in the cloud_lookup
                                        and cloud_pixel_count arrays */
-    int *cloud_map               /* I/O: Image containing the cloud number for
-                                         each pixel */
 )
 {
     char *FUNC_NAME = "identify_clouds";
@@ -148,6 +190,12 @@ int identify_clouds
     int run_count;
     int *cloud_lookup = NULL;  /* Array that points to the first RLE for each
                                   cloud number */
+    int *last_run = NULL;      /* Last RLE of each cloud number */
+    int *merged_into = NULL;   /* Cloud number each cloud was merged into */
+    int *run_cloud = NULL;     /* Cloud number assigned to each run */
+    int *run_map = NULL;       /* Run index + 1 covering each pixel of three
+                                  rows, by row modulo 3 */
+    int map_row = -2;          /* Latest row cleared in the run map */
     int *temp_ptr;
     int next_cloud_number = 1;
     int run_index;
@@ -171,11 +219,20 @@ int identify_clouds
     if (run_count == 0)
         return SUCCESS;
 
-    /* Allocate the cloud lookup table sized to assume each run is a separate
+    /* Allocate the cloud tables sized to assume each run is a separate
        cloud */
     cloud_lookup = malloc((1 + run_count) * sizeof(*cloud_lookup));
-    if (!cloud_lookup)
+    last_run = malloc((1 + run_count) * sizeof(*last_run));
+    merged_into = malloc((1 + run_count) * sizeof(*merged_into));
+    run_cloud = malloc(run_count * sizeof(*run_cloud));
+    run_map = calloc(3 * ncols, sizeof(*run_map));
+    if (!cloud_lookup || !last_run || !merged_into || !run_cloud || !run_map)
     {
+        free(cloud_lookup);
+        free(last_run);
+        free(merged_into);
+        free(run_cloud);
+        free(run_map);
         free(runs);
         RETURN_ERROR("Failed allocating cloud lookup table",
                      FUNC_NAME, ERROR);
@@ -188,9 +245,28 @@ int identify_clouds
     for (run_index = 0; run_index < run_count; run_index++)
     {
         RLE_T *run = &runs[run_index];
-        int use_next = 1;
         int assigned_cloud_number = 0;
         int end_col = run->start_col + run->col_count;
+        int fill_col;
+        int clear_row;
+        int *prev_map_row = &run_map[((run->row + 2) % 3) * ncols];
+        int *map_row_cols = &run_map[(run->row % 3) * ncols];
+        int *next_map_row = &run_map[((run->row + 1) % 3) * ncols];
+
+        /* Clear the rows of the map used by this row that haven't been
+           cleared since they held older rows */
+        clear_row = run->row - 1;
+        if (clear_row < map_row + 1)
+            clear_row = map_row + 1;
+        if (clear_row < 0)
+            clear_row = 0;
+        for (; clear_row <= run->row + 1; clear_row++)
+        {
+            memset(&run_map[(clear_row % 3) * ncols], 0,
+                   ncols * sizeof(*run_map));
+        }
+        if (map_row < run->row + 1)
+            map_row = run->row + 1;
 
         /* Check for overlap with clouds from the previous row if not the
            first row.  Note that the overlap includes cloud pixels on the
@@ -198,7 +274,6 @@ int identify_clouds
            on both ends. */
         if (run->row > 0)
         {
-            int *prev_cloud_map_row = &cloud_map[(run->row - 1) * ncols];
             int col;
             int start = run->start_col - 1;
             if (start < 0)
@@ -206,103 +281,48 @@ int identify_clouds
 
             for (col = start; col <= end_col; col++)
             {
-                int cloud_number = prev_cloud_map_row[col];
+                int cloud_number;
+                int map_value;
 
-                /* Check for a cloud in the previous row */
-                if (cloud_number != 0)
-                {
-                    int fill_col;
-                    int *cloud_map_row = &cloud_map[run->row * ncols];
+                if (col < ncols)
+                    map_value = prev_map_row[col];
+                else
+                    map_value = map_row_cols[col - ncols];
+                if (map_value == 0)
+                    continue;
+                cloud_number = find_cloud(merged_into,
+                                          run_cloud[map_value - 1]);
 
+                if (assigned_cloud_number == 0)
+                {
                     /* Found a cloud, so assign this run to that cloud */
                     run->next_index = cloud_lookup[cloud_number];
                     cloud_lookup[cloud_number] = run_index;
-
-                    /* Set this cloud number for the run in the cloud map */
-                    for (fill_col = run->start_col; fill_col < end_col;
-                        fill_col++)
-                    {
-                        cloud_map_row[fill_col] = cloud_number;
-                    }
-
-                    /* Assigned a cloud number, so no need to look */
                     assigned_cloud_number = cloud_number;
-                    use_next = 0;
-                    break;
                 }
-            }
-
-            /* If an overlapping cloud from the previous row was found, look
-               for additional overlapping clouds to merge with, continuing at
-               the next column */
-            for (col = col + 1; col <= end_col; col++)
-            {
-                int cloud_number = prev_cloud_map_row[col];
-
-                /* Check for a cloud in the previous row */
-                if (cloud_number != 0 && cloud_number != assigned_cloud_number)
+                else if (cloud_number != assigned_cloud_number)
                 {
-                    int fill_col;
-                    int last_index;
-                    int *cloud_map_row = &cloud_map[run->row * ncols];
-
-                    /* Found another cloud to merge with, so renumber the
-                       newly found cloud to match this number.  The cloud map
-                       update is "lazy" since it just updates the cloud
-                       numbers in the previous row and pixels to the left in
-                       the current row.  A final pass will update the
-                       cloud_map to make sure it has the correct cloud numbers
-                       for every pixel */
-                    for (fill_col = 0; fill_col < ncols; fill_col++)
-                    {
-                        if (prev_cloud_map_row[fill_col] == cloud_number)
-                        {
-                            prev_cloud_map_row[fill_col]
-                                = assigned_cloud_number;
-                        }
-                    }
-
-                    /* Also fill the pixels on the current row that may belong
-                       to the same cloud */
-                    for (fill_col = 0; fill_col < col; fill_col++)
-                    {
-                        if (cloud_map_row[fill_col] == cloud_number)
-                        {
-                            cloud_map_row[fill_col] = assigned_cloud_number;
-                        }
-                    }
-
-                    /* Find the last node in the cloud being merged */
-                    last_index = cloud_lookup[cloud_number];
-                    while (runs[last_index].next_index != -1)
-                    {
-                        last_index = runs[last_index].next_index;
-                    }
-
-                    /* Merge the newly found cloud list into the current
-                       cloud's list */
-                    runs[last_index].next_index
+                    /* Found another cloud to merge with, so merge the newly
+                       found cloud list into the current cloud's list */
+                    runs[last_run[cloud_number]].next_index
                         = cloud_lookup[assigned_cloud_number];
                     cloud_lookup[assigned_cloud_number]
                         = cloud_lookup[cloud_number];
                     cloud_lookup[cloud_number] = -1;
+                    merged_into[cloud_number] = assigned_cloud_number;
                 }
             }
         }
 
         /* If no cloud number was assigned, use the next one */
-        if (use_next)
+        if (assigned_cloud_number == 0)
         {
-            int fill_col;
-            int *cloud_map_row = &cloud_map[run->row * ncols];
-
-            for (fill_col = run->start_col; fill_col < end_col; fill_col++)
-            {
-                cloud_map_row[fill_col] = next_cloud_number;
-            }
+            assigned_cloud_number = next_cloud_number;
 
             run->next_index = -1;
             cloud_lookup[next_cloud_number] = run_index;
+            last_run[next_cloud_number] = run_index;
+            merged_into[next_cloud_number] = next_cloud_number;
 
             next_cloud_number++;
 
@@ -313,12 +333,31 @@ int identify_clouds
             if (next_cloud_number < 0)
             {
                 free(cloud_lookup);
+                free(last_run);
+                free(merged_into);
+                free(run_cloud);
+                free(run_map);
                 free(runs);
                 RETURN_ERROR("Too many clouds identified", FUNC_NAME, ERROR);
             }
         }
+        run_cloud[run_index] = assigned_cloud_number;
+
+        /* Record this run as the last one covering its pixels */
+        for (fill_col = run->start_col; fill_col < end_col; fill_col++)
+        {
+            if (fill_col < ncols)
+                map_row_cols[fill_col] = run_index + 1;
+            else
+                next_map_row[fill_col - ncols] = run_index + 1;
+        }
     }
 
+    free(run_map);
+    free(last_run);
+    free(merged_into);
+    free(run_cloud);
+
     /* Condense the cloud lookup table */
     cloud_count = next_cloud_number;
     next_cloud_number = 1;
@@ -352,8 +391,7 @@ int identify_clouds
                      "array", FUNC_NAME, ERROR);
     }
 
-    /* Update the cloud map with the latest cloud numbers and to cover any
-       cloud merges that occurred */
+    /* Count the pixels of each cloud */
     for (cloud_index = 1; cloud_index < cloud_count; cloud_index++)
     {
         int run_index = cloud_lookup[cloud_index];
@@ -361,18 +399,9 @@ int identify_clouds
 
         while (run_index != -1)
         {
-            RLE_T *run = &runs[run_index];
-            int fill_col;
-            int *cloud_map_row = &cloud_map[run->row * ncols];
-            int end_col = run->start_col + run->col_count;
-
-            for (fill_col = run->start_col; fill_col < end_col; fill_col++)
-            {
-                cloud_map_row[fill_col] = cloud_index;
-            }
-            pixel_count += run->col_count;
+            pixel_count += runs[run_index].col_count;
 
-            run_index = run->next_index;
+            run_index = runs[run_index].next_index;
         }
 
         cloud_pixel_count[cloud_index] = pixel_count;
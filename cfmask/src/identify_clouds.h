@@ -21,10 +21,8 @@ int identify_clouds
                                        segments */
     int **out_cloud_lookup,      /* O: Array to map clouds to cloud runs */
     int **out_cloud_pixel_count, /* O: Cloud number */
-    int *out_cloud_count,        /* O: Number of clouds in the cloud_lookup
+    int *out_cloud_count         /* O: Number of clouds in the cloud_lookup
                                        and cloud_pixel_count arrays */
-    int *cloud_map               /* I/O: Image containing the cloud number for
-                                         each pixel */
 );
 
 
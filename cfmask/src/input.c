@@ -3,6 +3,8 @@
 *****************************************************************************/
 
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "espa_metadata.h"
 #include "espa_geoloc.h"
@@ -13,6 +15,7 @@
 #include "cfmask.h"
 #include "misc.h"
 #include "input.h"
+#include "profile.h"
 
 
 /*****************************************************************************
@@ -150,6 +153,142 @@ dn_to_toa_saturation
 }
 
 
+/*****************************************************************************
+MODULE:  use_resident_line
+
+PURPOSE: Makes a line of band data which is already resident in memory (in
+         the band cache or in the file mapping) available to the caller.
+         The processing passes replace saturated values in the line data
+         for the non-Landsat 8 satellites, so for those the line is copied to
+         the line buffer to keep the resident data unmodified.  For Landsat 8
+         the resident line is used directly.
+*****************************************************************************/
+static void
+use_resident_line
+(
+    Input_t *input,         /* I: input reflectance band data */
+    const int16 *line_data, /* I: resident data for the line */
+    int16 *line_buf,        /* I/O: line buffer */
+    int16 **line            /* O: the line data to use */
+)
+{
+    if (input->satellite == IS_LANDSAT_8)
+    {
+        /* The passes don't write the Landsat 8 lines, so the resident data
+           stays unmodified */
+        *line = (int16 *)line_data;
+    }
+    else
+    {
+        memcpy(line_buf, line_data, input->size.s * sizeof(int16));
+        *line = line_buf;
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  map_input_band
+
+PURPOSE: Maps the raw binary file of an open band read-only into memory.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+map_input_band
+(
+    Input_t *input, /* I/O: input reflectance band data */
+    int band_index  /* I: the band to map */
+)
+{
+    struct stat file_stat;
+    size_t map_size = (size_t)input->size.l * input->size.s * sizeof(int16);
+    void *map = NULL;
+
+    if (fstat(fileno(input->fp_bin[band_index]), &file_stat) != 0)
+    {
+        RETURN_ERROR("getting the size of the input band file",
+                     "map_input_band", false);
+    }
+    if ((size_t)file_stat.st_size < map_size)
+    {
+        RETURN_ERROR("input band file is smaller than the image size",
+                     "map_input_band", false);
+    }
+
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED,
+               fileno(input->fp_bin[band_index]), 0);
+    if (map == MAP_FAILED)
+    {
+        RETURN_ERROR("mapping the input band file", "map_input_band", false);
+    }
+
+    input->map[band_index] = map;
+    input->map_size = map_size;
+
+    return true;
+}
+
+
+/* Earth/sun distances for each DOY from EarthSunDistance.txt, kept for the
+   next scenes of a batch */
+static float dsun_table[366];
+static bool dsun_table_loaded = false;
+
+
+/*****************************************************************************
+MODULE:  load_dsun_table
+
+PURPOSE: Reads the earth/sun distances from the EarthSunDistance.txt file,
+         unless an earlier scene already read them
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+load_dsun_table
+(
+    const char *esun_path /* I: directory of the EarthSunDistance.txt file */
+)
+{
+    FILE *dsun_fd = NULL; /* EarthSunDistance.txt file pointer */
+    char full_path[PATH_MAX];
+    int esun_index;
+
+    if (dsun_table_loaded)
+        return true;
+
+    snprintf(full_path, sizeof(full_path), "%s/%s",
+             esun_path, "EarthSunDistance.txt");
+    dsun_fd = fopen(full_path, "r");
+    if (dsun_fd == NULL)
+    {
+        RETURN_ERROR("Can't open EarthSunDistance.txt file",
+                     "load_dsun_table", false);
+    }
+
+    for (esun_index = 0; esun_index < 366; esun_index++)
+    {
+        if (fscanf(dsun_fd, "%f", &dsun_table[esun_index]) == EOF)
+        {
+            fclose(dsun_fd);
+            RETURN_ERROR("End of file (EOF) is met before 336 lines",
+                         "load_dsun_table", false);
+        }
+    }
+    fclose(dsun_fd);
+    dsun_table_loaded = true;
+
+    return true;
+}
+
+
 /*****************************************************************************
 MODULE:  OpenInput
 
@@ -163,17 +302,16 @@ Input_t *
 OpenInput
 (
     Espa_internal_meta_t *metadata, /* I: input metadata */
-    bool use_thermal                /* I: value to indicate if thermal data
+    bool use_thermal,               /* I: value to indicate if thermal data
                                           should be used */
+    bool use_mmap                   /* I: value to indicate if the band files
+                                          should be memory mapped */
 )
 {
     Input_t *input = NULL;
     char *error_string = NULL;
     int band_index;
-    int esun_index;
-    FILE *dsun_fd = NULL; /* EarthSunDistance.txt file pointer */
     char *esun_path = NULL;
-    char full_path[PATH_MAX];
 
     /* Check the environment first */
     esun_path = getenv("ESUN");
@@ -198,7 +336,12 @@ OpenInput
         input->open[band_index] = false;
         /* Initialize to NULL, memory is allocated later */
         input->buf[band_index] = NULL;
+        input->line_buf[band_index] = NULL;
+        input->cache[band_index] = NULL;
+        input->map[band_index] = NULL;
     }
+    input->map_size = 0;
+    input->cache_borrowed = false;
 
     /* Initialize and get input from header file */
     if (!GetXMLInput(input, metadata))
@@ -248,43 +391,49 @@ OpenInput
        buffers have multiple bands. */
     for (band_index = 0; band_index < input->num_toa_bands; band_index++)
     {
-        input->buf[band_index] = calloc(input->size.s, sizeof(int16));
-        if (input->buf[band_index] == NULL)
+        input->line_buf[band_index] = calloc(input->size.s, sizeof(int16));
+        if (input->line_buf[band_index] == NULL)
         {
             error_string = "allocating input band buffer";
         }
+        input->buf[band_index] = input->line_buf[band_index];
     }
 
     if (use_thermal)
     {
-        input->buf[BI_THERMAL] = calloc(input->size.s, sizeof(int16));
-        if (input->buf[BI_THERMAL] == NULL)
+        input->line_buf[BI_THERMAL] = calloc(input->size.s, sizeof(int16));
+        if (input->line_buf[BI_THERMAL] == NULL)
         {
             error_string = "allocating input thermal band buffer";
         }
+        input->buf[BI_THERMAL] = input->line_buf[BI_THERMAL];
     }
     else
     {
         input->buf[BI_THERMAL] = NULL;
     }
 
-    snprintf(full_path, sizeof(full_path), "%s/%s",
-             esun_path, "EarthSunDistance.txt");
-    dsun_fd = fopen(full_path, "r");
-    if (dsun_fd == NULL)
+    /* The earth/sun distances are read once for all of the scenes of the
+       process */
+    if (!load_dsun_table(esun_path))
     {
-        error_string = "Can't open EarthSunDistance.txt file";
+        error_string = "Can't read the EarthSunDistance.txt file";
     }
+    memcpy(input->dsun_doy, dsun_table, sizeof(input->dsun_doy));
 
-    for (esun_index = 0; esun_index < 366; esun_index++)
+    /* Map the band files when requested */
+    if (use_mmap && error_string == NULL)
     {
-        if (fscanf(dsun_fd, "%f", &input->dsun_doy[esun_index]) == EOF)
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
         {
-            error_string = "End of file (EOF) is met before 336 lines";
+            if (input->open[band_index]
+                && !map_input_band(input, band_index))
+            {
+                error_string = "memory mapping the input band files";
+                break;
+            }
         }
     }
-    fclose(dsun_fd);
-    dsun_fd = NULL;
 
     if (error_string != NULL)
     {
@@ -310,6 +459,136 @@ OpenInput
 }
 
 
+/*****************************************************************************
+MODULE:  OpenInputMemory
+
+PURPOSE: Sets up the input structure for bands already in memory, in place
+         of opening the band files
+
+RETURN: Type = Input_t *
+    A populated Input_t data structure or NULL when an error occurs
+
+NOTES:
+1. The bands are borrowed as the band caches, so they have to stay valid
+   until the input is freed, and they aren't freed or written.  The lines
+   are served as with CacheInput, so the thermal band has to be in Celsius
+   * 100, the same as the cached thermal band.
+2. The metadata are copied, satu_value_max is calculated from the other
+   values as OpenInput does.  The ESUN environment variable is only needed for
+   the Landsat 4-7 saturation values.
+3. The band files of the input are never opened, so CloseInput only marks
+   the bands as closed.
+*****************************************************************************/
+Input_t *
+OpenInputMemory
+(
+    int satellite,            /* I: satellite, IS_LANDSAT_4 to IS_LANDSAT_8 */
+    int sensor,               /* I: sensor, IS_TM to IS_OLITIRS */
+    int nrows,                /* I: number of lines */
+    int ncols,                /* I: number of samples */
+    const Input_meta_t *meta, /* I: scene metadata */
+    const int16 *const bands[MAX_BAND_COUNT] /* I: TOA reflectance bands and
+                                       the thermal band, NULL for the bands
+                                       not used; only read */
+)
+{
+    Input_t *input = NULL;
+    char *error_string = NULL;
+    char *esun_path = NULL;
+    int band_index;
+
+    /* Create the Input data structure */
+    input = calloc(1, sizeof(Input_t));
+    if (input == NULL)
+    {
+        RETURN_ERROR("allocating Input data structure", "OpenInputMemory",
+                     NULL);
+    }
+
+    input->meta = *meta;
+    input->satellite = satellite;
+    input->sensor = sensor;
+    input->size.l = nrows;
+    input->size.s = ncols;
+    input->cache_borrowed = true;
+    if (sensor == IS_OLI)
+        input->num_toa_bands = OLI_REFL_BAND_COUNT;
+    else if (sensor == IS_OLITIRS)
+        input->num_toa_bands = OLITIRS_REFL_BAND_COUNT;
+    else if (sensor == IS_TM)
+        input->num_toa_bands = TM_REFL_BAND_COUNT;
+    else if (sensor == IS_ETM)
+        input->num_toa_bands = ETM_REFL_BAND_COUNT;
+    else
+        error_string = "invalid sensor";
+
+    if (nrows <= 0 || ncols <= 0)
+        error_string = "invalid scene size";
+
+    /* Use the bands as the band caches, each with a line buffer */
+    for (band_index = 0; band_index < MAX_BAND_COUNT
+         && error_string == NULL; band_index++)
+    {
+        if (bands[band_index] == NULL)
+        {
+            if (band_index < input->num_toa_bands)
+                error_string = "missing input TOA band";
+            continue;
+        }
+        if (band_index >= input->num_toa_bands && band_index != BI_THERMAL)
+            continue;
+
+        input->line_buf[band_index] = calloc(ncols, sizeof(int16));
+        if (input->line_buf[band_index] == NULL)
+        {
+            error_string = "allocating input band buffer";
+            break;
+        }
+        input->buf[band_index] = input->line_buf[band_index];
+        input->cache[band_index] = bands[band_index];
+        input->open[band_index] = true;
+    }
+
+    if (error_string == NULL && satellite != IS_LANDSAT_8)
+    {
+        /* Landsat 8 doesn't have saturation issues */
+        esun_path = getenv("ESUN");
+        if (esun_path == NULL)
+        {
+            error_string = "ESUN environment variable is not set";
+        }
+        else if (!load_dsun_table(esun_path))
+        {
+            error_string = "Can't read the EarthSunDistance.txt file";
+        }
+        else
+        {
+            memcpy(input->dsun_doy, dsun_table, sizeof(input->dsun_doy));
+
+            /* Calculate maximum TOA reflectance values and put them in
+               metadata */
+            dn_to_toa_saturation(input);
+
+            if (input->open[BI_THERMAL])
+            {
+                /* Calculate maximum BT values and put them in metadata */
+                dn_to_bt_saturation(input);
+            }
+        }
+    }
+
+    if (error_string != NULL)
+    {
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+            input->open[band_index] = false;
+        FreeInput(input);
+        RETURN_ERROR(error_string, "OpenInputMemory", NULL);
+    }
+
+    return input;
+}
+
+
 /*****************************************************************************
 MODULE:  CloseInput
 
@@ -339,14 +618,26 @@ CloseInput
             if (input->open[band_index])
             {
                 none_open = false;
-                close_raw_binary(input->fp_bin[band_index]);
+                if (input->fp_bin[band_index] != NULL)
+                    close_raw_binary(input->fp_bin[band_index]);
                 input->open[band_index] = false;
             }
         }
 
+        /* Release the file mappings */
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+        {
+            if (input->map[band_index] != NULL)
+            {
+                munmap(input->map[band_index], input->map_size);
+                input->map[band_index] = NULL;
+            }
+        }
+
         if (input->open[BI_THERMAL])
         {
-            close_raw_binary(input->fp_bin[BI_THERMAL]);
+            if (input->fp_bin[BI_THERMAL] != NULL)
+                close_raw_binary(input->fp_bin[BI_THERMAL]);
             input->open[BI_THERMAL] = false;
         }
 
@@ -390,7 +681,12 @@ FreeInput
             }
             free(input->file_name[band_index]);
             input->file_name[band_index] = NULL;
-            free(input->buf[band_index]);
+            free(input->line_buf[band_index]);
+            input->line_buf[band_index] = NULL;
+            if (!input->cache_borrowed)
+                free((int16 *)input->cache[band_index]);
+            input->cache[band_index] = NULL;
+            input->buf[band_index] = NULL;
         }
 
         free(input);
@@ -402,58 +698,225 @@ FreeInput
 
 
 /*****************************************************************************
-MODULE:  GetInputLine
+MODULE:  read_file_line
 
-PURPOSE: Reads the data for the current band and line
+PURPOSE: Reads a line of a band from the raw binary file.  The files are
+         shared, so only one thread at a time seeks and reads.
 
-RETURN:  Type = Bool,  Updated Input_T data structure.
-    Input_t:  Updated memory buffer for the specified band
+RETURN:  Type = Bool
     Value  Description
     -----  -------------------------------------------------------------------
     true   No Errors
     false  Errors encountered
 *****************************************************************************/
-bool
-GetInputLine
+static bool
+read_file_line
 (
     Input_t *input, /* I: input reflectance band data */
     int band_index, /* I: the band to read */
-    int iline       /* I: the line to read in the band */
+    int iline,      /* I: the line to read in the band */
+    int16 *buf      /* O: buffer for the line */
 )
 {
-    void *buf = NULL;
     long loc; /* pointer location in the raw binary file */
+    char *error_string = NULL;
+
+    loc = (long)iline * input->size.s * sizeof(int16);
+
+#ifdef _OPENMP
+    #pragma omp critical (input_file_read)
+#endif
+    {
+        if (fseek(input->fp_bin[band_index], loc, SEEK_SET))
+        {
+            error_string = "error seeking line (binary)";
+        }
+        else if (read_raw_binary(input->fp_bin[band_index], 1, input->size.s,
+                                 sizeof(int16), buf) != SUCCESS)
+        {
+            error_string = "error reading line (binary)";
+        }
+    }
+
+    if (error_string != NULL)
+    {
+        RETURN_ERROR(error_string, "read_file_line", false);
+    }
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  convert_thermal_line
+
+PURPOSE: Converts a line of thermal data from scaled Kelvin to Celsius * 100
+*****************************************************************************/
+static void
+convert_thermal_line
+(
+    Input_t *input, /* I: input reflectance band data */
+    int16 *buf      /* I/O: thermal data for the line */
+)
+{
+    int i;            /* looping variable */
+    float therm_val;  /* tempoary thermal value for conversion from Kelvin to
+                         Celsius */
 
+    /* Convert from Kelvin back to degrees Celsius since the application is
+       based on the unscaled Celsius values originally produced.  If input is
+       fill or saturated, then leave as fill or saturated. */
+    for (i = 0; i < input->size.s; i++)
+    {
+        if (buf[i] != input->meta.fill &&
+            buf[i] != input->meta.satu_value_ref[BI_THERMAL])
+        {
+            /* unscale and convert to celsius */
+            therm_val = buf[i] * input->meta.therm_scale_fact;
+            therm_val -= 273.15;
+
+            /* apply the old scale factor that the cfmask processing is based
+               upon, to get the original unscaled Celsius values */
+            therm_val *= 100.0;
+            buf[i] = (int)round(therm_val);
+        }
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  ReadInputLine
+
+PURPOSE: Reads the data for a band and line using a caller supplied line
+         buffer.  The line is either read into the buffer or, when the band
+         is resident in memory and the data doesn't have to be modified, the
+         resident line is returned without a copy.  Thermal data is returned
+         in degrees Celsius * 100.  The Input_t structure isn't modified, so
+         several threads can read lines at the same time with their own
+         buffers.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+bool
+ReadInputLine
+(
+    Input_t *input,  /* I: input reflectance band data */
+    int band_index,  /* I: the band to read, a TOA band or BI_THERMAL */
+    int iline,       /* I: the line to read in the band */
+    int16 *line_buf, /* I/O: buffer with room for a line of the band */
+    int16 **line     /* O: the data for the line */
+)
+{
     /* Check the parameters */
     if (input == NULL)
     {
-        RETURN_ERROR("invalid input structure", "GetIntputLine", false);
+        RETURN_ERROR("invalid input structure", "ReadInputLine", false);
     }
-    if (band_index < 0 || band_index >= input->num_toa_bands)
+    if ((band_index < 0 || band_index >= input->num_toa_bands)
+        && band_index != BI_THERMAL)
     {
-        RETURN_ERROR("invalid band number", "GetInputLine", false);
+        RETURN_ERROR("invalid band number", "ReadInputLine", false);
     }
     if (!input->open[band_index])
     {
-        RETURN_ERROR("file not open", "GetInputLine", false);
+        RETURN_ERROR("file not open", "ReadInputLine", false);
     }
     if (iline < 0 || iline >= input->size.l)
     {
-        RETURN_ERROR("invalid line number", "GetInputLine", false);
+        RETURN_ERROR("invalid line number", "ReadInputLine", false);
+    }
+
+    /* Serve the line from the band cache when the band has been cached, the
+       cached thermal values have already been converted to Celsius */
+    if (input->cache[band_index] != NULL)
+    {
+        use_resident_line(input,
+            &input->cache[band_index][(long)iline * input->size.s],
+            line_buf, line);
+        return true;
+    }
+
+    /* The rest of the line sources read the band file */
+    profile_add_bytes_read(input->size.s * sizeof(int16));
+
+    if (band_index == BI_THERMAL)
+    {
+        /* Read the data, the units are converted in the line buffer */
+        if (input->map[BI_THERMAL] != NULL)
+        {
+            memcpy(line_buf,
+                   &input->map[BI_THERMAL][(long)iline * input->size.s],
+                   input->size.s * sizeof(int16));
+        }
+        else if (!read_file_line(input, BI_THERMAL, iline, line_buf))
+        {
+            RETURN_ERROR("reading thermal line", "ReadInputLine", false);
+        }
+
+        convert_thermal_line(input, line_buf);
+        *line = line_buf;
+        return true;
+    }
+
+    /* Point at the line in the file mapping when the band is mapped */
+    if (input->map[band_index] != NULL)
+    {
+        use_resident_line(input,
+            &input->map[band_index][(long)iline * input->size.s],
+            line_buf, line);
+        return true;
     }
 
     /* Read the data */
-    buf = input->buf[band_index];
-    loc = (long)(iline * input->size.s * sizeof(int16));
-    if (fseek(input->fp_bin[band_index], loc, SEEK_SET))
+    if (!read_file_line(input, band_index, iline, line_buf))
+    {
+        RETURN_ERROR("reading line", "ReadInputLine", false);
+    }
+    *line = line_buf;
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  GetInputLine
+
+PURPOSE: Reads the data for the current band and line
+
+RETURN:  Type = Bool,  Updated Input_T data structure.
+    Input_t:  Updated memory buffer for the specified band
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+bool
+GetInputLine
+(
+    Input_t *input, /* I: input reflectance band data */
+    int band_index, /* I: the band to read */
+    int iline       /* I: the line to read in the band */
+)
+{
+    /* Check the parameters */
+    if (input == NULL)
     {
-        RETURN_ERROR("error seeking line (binary)", "GetInputLine", false);
+        RETURN_ERROR("invalid input structure", "GetIntputLine", false);
+    }
+    if (band_index < 0 || band_index >= input->num_toa_bands)
+    {
+        RETURN_ERROR("invalid band number", "GetInputLine", false);
     }
 
-    if (read_raw_binary(input->fp_bin[band_index], 1, input->size.s,
-                        sizeof(int16), buf) != SUCCESS)
+    /* Read the data */
+    if (!ReadInputLine(input, band_index, iline, input->line_buf[band_index],
+                       &input->buf[band_index]))
     {
-        RETURN_ERROR("error reading line (binary)", "GetInputLine", false);
+        RETURN_ERROR("error reading line", "GetInputLine", false);
     }
 
     return true;
@@ -478,59 +941,98 @@ GetInputThermLine
     int iline       /* I: the line to read in the band */
 )
 {
-    void *buf = NULL;
-    int i;            /* looping variable */
-    long loc;         /* pointer location in the raw binary file */
-    float therm_val;  /* tempoary thermal value for conversion from Kelvin to
-                         Celsius */
-
     /* Check the parameters */
     if (input == NULL)
     {
         RETURN_ERROR("invalid input structure", "GetIntputThermLine", false);
     }
-    if (!input->open[BI_THERMAL])
-    {
-        RETURN_ERROR("file not open", "GetInputThermLine", false);
-    }
-    if (iline < 0 || iline >= input->size.l)
-    {
-        RETURN_ERROR("invalid line number", "GetInputThermLine", false);
-    }
 
     /* Read the data */
-    buf = input->buf[BI_THERMAL];
-    loc = (long) (iline * input->size.s * sizeof(int16));
-    if (fseek(input->fp_bin[BI_THERMAL], loc, SEEK_SET))
+    if (!ReadInputLine(input, BI_THERMAL, iline, input->line_buf[BI_THERMAL],
+                       &input->buf[BI_THERMAL]))
     {
-        RETURN_ERROR("error seeking thermal line (binary)",
-                     "GetInputThermLine", false);
+        RETURN_ERROR("error reading thermal line", "GetInputThermLine",
+                     false);
     }
 
-    if (read_raw_binary(input->fp_bin[BI_THERMAL], 1, input->size.s,
-                        sizeof (int16), buf) != SUCCESS)
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  CacheInput
+
+PURPOSE: Reads each open band once into a scene-resident cache, so the
+         processing passes over the image do not re-read the input files.
+         The thermal band is cached already converted to Celsius.  After
+         this call GetInputLine and GetInputThermLine serve the lines from
+         the cache, and the cached thermal band can be used directly as an
+         image.
+
+NOTES: Requires (number of bands * lines * samples * sizeof(int16)) bytes.
+
+RETURN:  Type = Bool,  Updated Input_T data structure.
+    Input_t:  The cache field is populated for each open band
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+bool
+CacheInput
+(
+    Input_t *input /* I/O: input reflectance band data */
+)
+{
+    int band_index;
+    int line;
+    int16 *cache = NULL;
+    long pixel_count;
+
+    if (input == NULL)
     {
-        RETURN_ERROR("error reading thermal line (binary)",
-                     "GetInputThermLine", false);
+        RETURN_ERROR("invalid input structure", "CacheInput", false);
     }
 
-    /* Convert from Kelvin back to degrees Celsius since the application is
-       based on the unscaled Celsius values originally produced.  If input is
-       fill or saturated, then leave as fill or saturated. */
-    for (i = 0; i < input->size.s; i++)
+    pixel_count = (long)input->size.l * input->size.s;
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
     {
-        if (input->buf[BI_THERMAL][i] != input->meta.fill &&
-            input->buf[BI_THERMAL][i] != input->meta.satu_value_ref[BI_THERMAL])
+        if (!input->open[band_index] || input->cache[band_index] != NULL)
+            continue;
+
+        cache = malloc(pixel_count * sizeof(int16));
+        if (cache == NULL)
         {
-            /* unscale and convert to celsius */
-            therm_val = input->buf[BI_THERMAL][i] * input->meta.therm_scale_fact;
-            therm_val -= 273.15;
+            RETURN_ERROR("allocating input band cache", "CacheInput", false);
+        }
 
-            /* apply the old scale factor that the cfmask processing is based
-               upon, to get the original unscaled Celsius values */
-            therm_val *= 100.0;
-            input->buf[BI_THERMAL][i] = (int)round(therm_val);
+        for (line = 0; line < input->size.l; line++)
+        {
+            if (band_index == BI_THERMAL)
+            {
+                if (!GetInputThermLine(input, line))
+                {
+                    free(cache);
+                    RETURN_ERROR("reading input thermal data for a line",
+                                 "CacheInput", false);
+                }
+            }
+            else
+            {
+                if (!GetInputLine(input, band_index, line))
+                {
+                    free(cache);
+                    RETURN_ERROR("reading input TOA data for a line",
+                                 "CacheInput", false);
+                }
+            }
+
+            memcpy(&cache[(long)line * input->size.s], input->buf[band_index],
+                   input->size.s * sizeof(int16));
         }
+
+        input->cache[band_index] = cache;
     }
 
     return true;
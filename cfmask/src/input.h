@@ -39,7 +39,19 @@ typedef struct
     bool open[MAX_BAND_COUNT];  /* Indicates whether the specific input
                                    TOA reflectance file is open for access;
                                    'true' = open, 'false' = not open */
-    int16 *buf[MAX_BAND_COUNT]; /* Input data buffer (one line of data) */
+    int16 *buf[MAX_BAND_COUNT]; /* Input data buffer (one line of data);
+                                   points into line_buf or the band cache */
+    int16 *line_buf[MAX_BAND_COUNT]; /* Allocated line buffers used when the
+                                        band is read from the file */
+    const int16 *cache[MAX_BAND_COUNT]; /* Scene-resident band data, the
+                                     thermal band already converted to
+                                     Celsius, only read; NULL if the band is
+                                     not cached */
+    bool cache_borrowed;          /* the band caches belong to the caller of
+                                     OpenInputMemory and aren't freed */
+    int16 *map[MAX_BAND_COUNT];   /* Read-only memory mapping of the band
+                                     file; NULL if the band is not mapped */
+    size_t map_size;              /* Size in bytes of each band mapping */
     float dsun_doy[366];        /* Array of earth/sun distances for each DOY;
                                    read from the EarthSunDistance.txt file */
 } Input_t;
@@ -47,7 +59,16 @@ typedef struct
 
 /* Prototypes */
 Input_t *
-OpenInput(Espa_internal_meta_t *metadata, bool use_thermal);
+OpenInput(Espa_internal_meta_t *metadata, bool use_thermal, bool use_mmap);
+
+Input_t *
+OpenInputMemory(int satellite, int sensor, int nrows, int ncols,
+                const Input_meta_t *meta,
+                const int16 *const bands[MAX_BAND_COUNT]);
+
+bool
+ReadInputLine(Input_t *input, int band_index, int iline, int16 *line_buf,
+              int16 **line);
 
 bool
 GetInputLine(Input_t *input, int iband, int iline);
@@ -55,6 +76,9 @@ GetInputLine(Input_t *input, int iband, int iline);
 bool
 GetInputThermLine(Input_t *input, int iline);
 
+bool
+CacheInput(Input_t *input);
+
 bool
 CloseInput(Input_t *input);
 
@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+
+#include "espa_geoloc.h"
+
+
+#include "const.h"
+#include "error.h"
+#include "input.h"
+#include "scratch_pool.h"
+#include "stage_cache.h"
+#include "potential_cloud_shadow_snow_mask.h"
+#include "object_cloud_shadow_match.h"
+#include "convert_and_generate_statistics.h"
+#include "profile.h"
+#include "threads.h"
+#include "libcfmask.h"
+
+
+/* Normal quantile of the 95% sampling bounds of the estimates */
+#define ESTIMATE_BOUND_Z 1.96
+
+
+/*****************************************************************************
+MODULE:  cfmask_default_params
+
+PURPOSE: Set the processing parameters to the cfmask defaults
+*****************************************************************************/
+void cfmask_default_params
+(
+    Cfmask_params_t *params /* O: default processing parameters */
+)
+{
+    params->cloud_prob = 22.5;
+    params->cldpix = 3;
+    params->sdpix = 3;
+    params->use_cirrus = false;
+    params->use_thermal = true;
+    params->fast_height_search = false;
+    params->pyramid_factor = 1;
+    params->huge_pages = false;
+    params->verbose = false;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_init_context
+
+PURPOSE: Set up the masking context of an opened input
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The input is borrowed, the caller closes and frees it after the context
+   is released.
+*****************************************************************************/
+int cfmask_init_context
+(
+    Input_t *input,                 /* I: opened input, borrowed */
+    const Cfmask_params_t *params,  /* I: processing parameters */
+    Cfmask_context_t *context       /* O: context of the scene */
+)
+{
+    char *FUNC_NAME = "cfmask_init_context";
+
+    if (input == NULL || params == NULL || context == NULL)
+    {
+        RETURN_ERROR("invalid context arguments", FUNC_NAME, FAILURE);
+    }
+
+    context->input = input;
+    context->own_input = false;
+    context->params = *params;
+    context->pool = NULL;
+    init_scratch_pool(&context->own_pool, params->huge_pages);
+    context->stage_cache = NULL;
+    context->clear_ptm = 0.0;
+    context->t_templ = 0.0;
+    context->t_temph = 0.0;
+    context->data_count = 0;
+    context->clear_percent = 0.0;
+    context->cloud_percent = 0.0;
+    context->cloud_shadow_percent = 0.0;
+    context->water_percent = 0.0;
+    context->snow_percent = 0.0;
+
+    /* The thermal band can only be used if it was provided */
+    if (context->params.use_thermal && !input->open[BI_THERMAL])
+    {
+        RETURN_ERROR("the thermal band isn't available", FUNC_NAME, FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_init_memory_context
+
+PURPOSE: Set up the masking context of a scene whose bands are already in
+         memory, so the bands don't have to be written to files and read
+         back
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The bands are borrowed, not copied, and have to stay valid until the
+   context is released.  They are only read.
+2. See OpenInputMemory for the units of the bands and the metadata used.
+*****************************************************************************/
+int cfmask_init_memory_context
+(
+    int satellite,            /* I: satellite, IS_LANDSAT_4 to IS_LANDSAT_8 */
+    int sensor,               /* I: sensor, IS_TM to IS_OLITIRS */
+    int nrows,                /* I: number of lines */
+    int ncols,                /* I: number of samples */
+    const Input_meta_t *meta, /* I: scene metadata */
+    const int16 *const bands[MAX_BAND_COUNT], /* I: TOA reflectance bands
+                                        and the thermal band in Celsius * 100,
+                                        borrowed and only read; NULL for the
+                                        bands not used */
+    const Cfmask_params_t *params, /* I: processing parameters */
+    Cfmask_context_t *context /* O: context of the scene */
+)
+{
+    char *FUNC_NAME = "cfmask_init_memory_context";
+    Input_t *input;
+
+    input = OpenInputMemory(satellite, sensor, nrows, ncols, meta, bands);
+    if (input == NULL)
+    {
+        RETURN_ERROR("setting up the input bands", FUNC_NAME, FAILURE);
+    }
+
+    if (cfmask_init_context(input, params, context) != SUCCESS)
+    {
+        CloseInput(input);
+        FreeInput(input);
+        RETURN_ERROR("setting up the context", FUNC_NAME, FAILURE);
+    }
+    context->own_input = true;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  context_pool
+
+PURPOSE: Find the scratch pool used by a context
+
+RETURN: the scratch pool
+*****************************************************************************/
+static Scratch_pool_t *context_pool
+(
+    Cfmask_context_t *context   /* I: context of the scene */
+)
+{
+    if (context->pool != NULL)
+        return context->pool;
+
+    return &context->own_pool;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_use_scratch_pool
+
+PURPOSE: Use a scratch pool of the caller for the stages of the context in
+         place of its own, so the pool can be kept for the next scene
+
+NOTES:
+1. The pool is borrowed and has to stay valid until the context is
+   released.
+*****************************************************************************/
+void cfmask_use_scratch_pool
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    Scratch_pool_t *pool        /* I: scratch pool to use, borrowed */
+)
+{
+    free_scratch_pool(&context->own_pool);
+    context->pool = pool;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_use_stage_cache
+
+PURPOSE: Use the stages kept for the scene by an earlier run, and keep the
+         stages run by this one, so only the stages whose inputs changed are
+         run
+
+NOTES:
+1. The cache is borrowed and has to stay valid until the context is
+   released.  The caller writes it after the masking.
+*****************************************************************************/
+void cfmask_use_stage_cache
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    Stage_cache_t *cache        /* I: stages of the scene, borrowed */
+)
+{
+    context->stage_cache = cache;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_potential_mask
+
+PURPOSE: Build the potential cloud, shadow, snow and water masks and the
+         cloud confidence of the scene
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int cfmask_potential_mask
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    unsigned char *pixel_mask,  /* O: potential cloud, shadow, snow and water
+                                      bits */
+    unsigned char *conf_mask    /* O: cloud confidence */
+)
+{
+    char *FUNC_NAME = "cfmask_potential_mask";
+    Input_t *input = context->input;
+    Stage_cache_t *cache = context->stage_cache;
+    int pixel_count = input->size.l * input->size.s;
+    int stage;
+    int status;
+
+    /* The scratch buffers of all of the stages are sized once for the
+       scene */
+    if (reserve_scratch_pool(context_pool(context), input->size.l,
+                             input->size.s) != SUCCESS)
+    {
+        RETURN_ERROR("Allocating the scratch buffers", FUNC_NAME, FAILURE);
+    }
+
+    /* Initialize the mask to clear data, by the threads which process the
+       pixels */
+    first_touch(pixel_mask, pixel_count, CF_NO_BITS);
+    first_touch(conf_mask, pixel_count, CLOUD_CONFIDENCE_NONE);
+
+    /* The kept intermediates only need the cloud probability threshold
+       applied again */
+    if (cache != NULL && cache->have_potential)
+    {
+        stage = profile_begin("restore_potential_mask");
+        restore_potential_mask(&cache->potential, context->params.cloud_prob,
+                               pixel_count, &context->clear_ptm,
+                               &context->t_templ, &context->t_temph,
+                               pixel_mask, conf_mask,
+                               context->params.verbose);
+        profile_end(stage);
+        printf("Potential Cloud Shadow: Restored from the stage cache\n");
+
+        return SUCCESS;
+    }
+
+    /* Build the potential cloud, shadow, snow, water mask */
+    stage = profile_begin("potential_cloud_shadow_snow_mask");
+    status = potential_cloud_shadow_snow_mask(input,
+                                              context->params.cloud_prob,
+                                              &context->clear_ptm,
+                                              &context->t_templ,
+                                              &context->t_temph,
+                                              pixel_mask, conf_mask,
+                                              context_pool(context),
+                                              cache != NULL
+                                              ? &cache->potential : NULL,
+                                              context->params.use_cirrus,
+                                              context->params.use_thermal,
+                                              context->params.verbose);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("processing potential_cloud_shadow_snow_mask",
+                     FUNC_NAME, FAILURE);
+    }
+    profile_end(stage);
+    if (cache != NULL)
+        keep_potential_stage(cache);
+    printf("Potential Cloud Shadow: Done\n");
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_shadow_match
+
+PURPOSE: Match the cloud shadows to the clouds, combine the final masks into
+         the cfmask values and calculate the statistics of the scene
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. cfmask_potential_mask has to be called first with the same pixel mask.
+   With a stage cache a shadow match kept for the same potential mask and
+   height search is used, so only the dilate is run again.
+2. If the scene is an ascending polar scene (flipped upside down), then
+   the solar azimuth needs to be adjusted by 180 degrees.  The scene in
+   this case would be north down and the solar azimuth is based on north
+   being up clock-wise direction. Flip the south to be up will not change
+   the actual sun location, with the below relations, the solar azimuth
+   angle will need add in 180.0 for correct sun location.  The original
+   azimuth is restored for the output metadata.
+*****************************************************************************/
+int cfmask_shadow_match
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    unsigned char *pixel_mask   /* I/O: potential bits as input, final cfmask
+                                        values as output */
+)
+{
+    char *FUNC_NAME = "cfmask_shadow_match";
+    Input_t *input = context->input;
+    Stage_cache_t *cache = context->stage_cache;
+    bool restore_match = false; /* use the kept shadow match */
+    float sun_azi_temp = input->meta.sun_az; /* original sun azimuth */
+    bool polar_scene = input->meta.ul_corner.lat < input->meta.lr_corner.lat;
+    int stage;
+    int status;
+
+    if (polar_scene)
+    {
+        input->meta.sun_az += 180.0;
+        if (input->meta.sun_az > 360.0)
+        {
+            input->meta.sun_az -= 360.0;
+        }
+        if (context->params.verbose)
+        {
+            printf("Polar or ascending scene."
+                    "  Readjusting solar azimuth by 180 degrees.\n"
+                    "  New value: %f degrees\n", input->meta.sun_az);
+        }
+    }
+
+    if (cache != NULL)
+    {
+        restore_match = find_match_stage(cache, context->params.cloud_prob,
+                                         context->params.fast_height_search,
+                                         context->params.pyramid_factor);
+    }
+
+    /* Build the final cloud shadow based on geometry matching and
+       combine the final cloud, shadow, snow, water masks into fmask
+       the pixel_mask is a bit mask as input and a value mask as output */
+    stage = profile_begin("object_cloud_shadow_match");
+    status = object_cloud_shadow_match(input, context->clear_ptm,
+                                       context->t_templ, context->t_temph,
+                                       context->params.cldpix,
+                                       context->params.sdpix, pixel_mask,
+                                       context_pool(context),
+                                       &context->data_count,
+                                       context->params.use_thermal,
+                                       context->params.fast_height_search,
+                                       context->params.pyramid_factor,
+                                       cache != NULL ? &cache->match : NULL,
+                                       restore_match,
+                                       context->params.verbose);
+
+    /* Reassign solar azimuth angle for output purpose if south up north
+       down scene is involved */
+    input->meta.sun_az = sun_azi_temp;
+
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("processing object_cloud_and_shadow_match",
+                     FUNC_NAME, FAILURE);
+    }
+    profile_end(stage);
+    printf("Object Cloud Shadow Matching: Done\n");
+
+    /* Convert the pixel_mask to a value mask
+       Also retrieve and report statistics */
+    stage = profile_begin("convert_and_generate_statistics");
+    convert_and_generate_statistics(context->params.verbose, pixel_mask,
+                                    input->size.l * input->size.s,
+                                    context->data_count,
+                                    &context->clear_percent,
+                                    &context->cloud_percent,
+                                    &context->cloud_shadow_percent,
+                                    &context->water_percent,
+                                    &context->snow_percent);
+    profile_end(stage);
+    printf("Statistics Generation: Done\n");
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_mask_scene
+
+PURPOSE: Build the cfmask values and the cloud confidence of the scene
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int cfmask_mask_scene
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    unsigned char *pixel_mask,  /* O: cfmask values */
+    unsigned char *conf_mask    /* O: cloud confidence */
+)
+{
+    char *FUNC_NAME = "cfmask_mask_scene";
+
+    if (cfmask_potential_mask(context, pixel_mask, conf_mask) != SUCCESS)
+    {
+        RETURN_ERROR("Building the potential masks", FUNC_NAME, FAILURE);
+    }
+
+    if (cfmask_shadow_match(context, pixel_mask) != SUCCESS)
+    {
+        RETURN_ERROR("Matching the cloud shadows", FUNC_NAME, FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  percent_bounds
+
+PURPOSE: Calculate the Wilson score bounds of a percentage of the samples
+
+NOTES:
+1. The bounds only cover the error of sampling the grid, not the difference
+   between the sampled mask and the full masking.
+2. The bounds are those of independent samples.  The pixels of a cloud are
+   spatially correlated, so on a scene with a few large clouds the actual
+   error of a sparse grid can be larger.
+*****************************************************************************/
+static void percent_bounds
+(
+    float percent,    /* I: percentage of the samples */
+    int sample_count, /* I: number of samples */
+    float *low,       /* O: lower bound of the percentage */
+    float *high       /* O: upper bound of the percentage */
+)
+{
+    double z2 = ESTIMATE_BOUND_Z * ESTIMATE_BOUND_Z;
+    double fraction = percent / 100.0;
+    double n = sample_count;
+    double center;
+    double half_width;
+
+    if (sample_count <= 0)
+    {
+        *low = 0.0;
+        *high = 100.0;
+        return;
+    }
+
+    center = (fraction + z2 / (2.0 * n)) / (1.0 + z2 / n);
+    half_width = ESTIMATE_BOUND_Z
+                 * sqrt(fraction * (1.0 - fraction) / n + z2 / (4.0 * n * n))
+                 / (1.0 + z2 / n);
+
+    *low = 100.0 * (center - half_width);
+    *high = 100.0 * (center + half_width);
+    if (*low < 0.0)
+        *low = 0.0;
+    if (*high > 100.0)
+        *high = 100.0;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_estimate_cover
+
+PURPOSE: Estimate the potential cloud cover statistics of the scene from a
+         grid of samples, every stride line and sample, with the spectral
+         tests and the cloud probability thresholds of the potential mask
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The minima fill and the shadow matching are skipped, so the clouds are
+   the potential clouds of the samples: they aren't dilated, the small
+   clouds aren't removed and the shadows aren't matched.  The potential
+   clear percent includes the pixels the full masking marks as shadow or
+   as the dilated cloud buffer, so it can be far above the clear percent of
+   the full masking and the potential cloud percent below its cloud
+   percent.  The bounds are only those of the sampling, they don't cover
+   this difference.
+2. The preview mask has the cfmask values of the samples, grid_rows by
+   grid_cols, and is released with cfmask_free_estimate.
+*****************************************************************************/
+int cfmask_estimate_cover
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    int stride,                 /* I: lines and samples between the samples */
+    Cloud_estimate_t *estimate  /* O: estimated cloud cover */
+)
+{
+    char *FUNC_NAME = "cfmask_estimate_cover";
+    Input_t *input = context->input;
+    int sample_count;
+    int stage;
+    int status;
+
+    estimate->stride = stride;
+    estimate->grid_rows = SAMPLE_GRID_SIZE(input->size.l, stride);
+    estimate->grid_cols = SAMPLE_GRID_SIZE(input->size.s, stride);
+    sample_count = estimate->grid_rows * estimate->grid_cols;
+
+    estimate->preview_mask = calloc(sample_count, sizeof(unsigned char));
+    if (estimate->preview_mask == NULL)
+    {
+        RETURN_ERROR("Allocating the preview mask", FUNC_NAME, FAILURE);
+    }
+
+    stage = profile_begin("estimate_potential_cloud_mask");
+    status = estimate_potential_cloud_mask(input, context->params.cloud_prob,
+                                           stride, estimate->preview_mask,
+                                           &estimate->data_count,
+                                           &estimate->clear_ptm,
+                                           context->params.use_cirrus,
+                                           context->params.use_thermal,
+                                           context->params.verbose);
+    if (status != SUCCESS)
+    {
+        cfmask_free_estimate(estimate);
+        RETURN_ERROR("Estimating the potential cloud mask", FUNC_NAME,
+                     FAILURE);
+    }
+    profile_end(stage);
+
+    /* The samples are converted to cfmask values for the preview */
+    convert_and_generate_statistics(context->params.verbose,
+                                    estimate->preview_mask, sample_count,
+                                    estimate->data_count,
+                                    &estimate->potential_clear_percent,
+                                    &estimate->potential_cloud_percent,
+                                    &estimate->potential_shadow_percent,
+                                    &estimate->water_percent,
+                                    &estimate->snow_percent);
+
+    /* The bounds are only those of sampling the potential mask */
+    percent_bounds(estimate->potential_clear_percent, estimate->data_count,
+                   &estimate->clear_sampling_low,
+                   &estimate->clear_sampling_high);
+    percent_bounds(estimate->potential_cloud_percent, estimate->data_count,
+                   &estimate->cloud_sampling_low,
+                   &estimate->cloud_sampling_high);
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_free_estimate
+
+PURPOSE: Release the preview mask of a cloud cover estimate
+*****************************************************************************/
+void cfmask_free_estimate
+(
+    Cloud_estimate_t *estimate  /* I/O: estimate to release */
+)
+{
+    free(estimate->preview_mask);
+    estimate->preview_mask = NULL;
+}
+
+
+/*****************************************************************************
+MODULE:  cfmask_free_context
+
+PURPOSE: Release the context of a scene, and its input if the context set it
+         up
+*****************************************************************************/
+void cfmask_free_context
+(
+    Cfmask_context_t *context   /* I/O: context to release */
+)
+{
+    if (context->own_input && context->input != NULL)
+    {
+        CloseInput(context->input);
+        FreeInput(context->input);
+    }
+    context->input = NULL;
+    context->own_input = false;
+
+    free_scratch_pool(&context->own_pool);
+    context->pool = NULL;
+    context->stage_cache = NULL;
+}
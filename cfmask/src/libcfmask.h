@@ -0,0 +1,172 @@
+#ifndef LIBCFMASK_H
+#define LIBCFMASK_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "espa_geoloc.h"
+
+#include "cfmask.h"
+#include "input.h"
+#include "scratch_pool.h"
+#include "stage_cache.h"
+
+
+/* Processing parameters of the masking */
+typedef struct
+{
+    float cloud_prob;        /* cloud probability threshold */
+    int cldpix;              /* cloud buffer size for the dilate */
+    int sdpix;               /* shadow buffer size for the dilate */
+    bool use_cirrus;         /* use the Cirrus band in the cloud tests */
+    bool use_thermal;        /* use the thermal band */
+    bool fast_height_search; /* search the cloud heights with a subsample of
+                                the cloud pixels */
+    int pyramid_factor;      /* reduction of the first height search, 1 for
+                                full resolution */
+    bool huge_pages;         /* back the scratch pool with huge pages */
+    bool verbose;            /* print intermediate messages */
+} Cfmask_params_t;
+
+/* Masking of one scene, from the input bands to the statistics of the
+   final mask */
+typedef struct
+{
+    Input_t *input;          /* bands and metadata of the scene */
+    bool own_input;          /* the input is closed and freed with the
+                                context */
+    Cfmask_params_t params;  /* processing parameters */
+    Scratch_pool_t *pool;    /* scratch pool lent by the caller, NULL to use
+                                own_pool */
+    Scratch_pool_t own_pool; /* scratch pool of the context */
+    Stage_cache_t *stage_cache; /* stages kept between runs, lent by the
+                                   caller, NULL to run all of the stages */
+    float clear_ptm;         /* percent of clear-sky pixels */
+    float t_templ;           /* percentile of low background temperature */
+    float t_temph;           /* percentile of high background temperature */
+    int data_count;          /* count of valid image pixels */
+    float clear_percent;     /* percent of clear pixels in the image data */
+    float cloud_percent;     /* percent of cloud pixels */
+    float cloud_shadow_percent; /* percent of cloud shadow pixels */
+    float water_percent;     /* percent of water pixels */
+    float snow_percent;      /* percent of snow pixels */
+} Cfmask_context_t;
+
+/* Potential cloud cover of a scene estimated from a grid of samples, for
+   triage without the full masking.  The percents are those of the potential
+   mask, before the dilate and the shadow matching, so they aren't estimates
+   of the percents of the full masking, see cfmask_estimate_cover. */
+typedef struct
+{
+    int stride;              /* lines and samples between the samples */
+    int grid_rows;           /* number of sampled lines */
+    int grid_cols;           /* number of samples of each line */
+    unsigned char *preview_mask; /* cfmask values of the samples */
+    int data_count;          /* count of non-fill samples */
+    float clear_ptm;         /* percent of clear-sky samples */
+    float potential_clear_percent; /* percent of the samples that aren't
+                                      potential cloud, water or snow, which
+                                      includes the shadows */
+    float potential_cloud_percent; /* percent of potential cloud samples */
+    float potential_shadow_percent; /* percent of shadow samples, only for a
+                                       scene without clear samples */
+    float water_percent;     /* percent of water samples */
+    float snow_percent;      /* percent of snow samples */
+    float clear_sampling_low;  /* 95% bounds of the sampling error of the */
+    float clear_sampling_high; /* potential clear percent */
+    float cloud_sampling_low;  /* 95% bounds of the sampling error of the */
+    float cloud_sampling_high; /* potential cloud percent */
+} Cloud_estimate_t;
+
+
+
+void cfmask_default_params
+(
+    Cfmask_params_t *params /* O: default processing parameters */
+);
+
+
+int cfmask_init_context
+(
+    Input_t *input,                 /* I: opened input, borrowed */
+    const Cfmask_params_t *params,  /* I: processing parameters */
+    Cfmask_context_t *context       /* O: context of the scene */
+);
+
+
+int cfmask_init_memory_context
+(
+    int satellite,            /* I: satellite, IS_LANDSAT_4 to IS_LANDSAT_8 */
+    int sensor,               /* I: sensor, IS_TM to IS_OLITIRS */
+    int nrows,                /* I: number of lines */
+    int ncols,                /* I: number of samples */
+    const Input_meta_t *meta, /* I: scene metadata */
+    const int16 *const bands[MAX_BAND_COUNT], /* I: TOA reflectance bands
+                                        and the thermal band in Celsius * 100,
+                                        borrowed and only read; NULL for the
+                                        bands not used */
+    const Cfmask_params_t *params, /* I: processing parameters */
+    Cfmask_context_t *context /* O: context of the scene */
+);
+
+
+void cfmask_use_scratch_pool
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    Scratch_pool_t *pool        /* I: scratch pool to use, borrowed */
+);
+
+
+void cfmask_use_stage_cache
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    Stage_cache_t *cache        /* I: stages of the scene, borrowed */
+);
+
+
+int cfmask_potential_mask
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    unsigned char *pixel_mask,  /* O: potential cloud, shadow, snow and water
+                                      bits */
+    unsigned char *conf_mask    /* O: cloud confidence */
+);
+
+
+int cfmask_shadow_match
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    unsigned char *pixel_mask   /* I/O: potential bits as input, final cfmask
+                                        values as output */
+);
+
+
+int cfmask_mask_scene
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    unsigned char *pixel_mask,  /* O: cfmask values */
+    unsigned char *conf_mask    /* O: cloud confidence */
+);
+
+
+int cfmask_estimate_cover
+(
+    Cfmask_context_t *context,  /* I/O: context of the scene */
+    int stride,                 /* I: lines and samples between the samples */
+    Cloud_estimate_t *estimate  /* O: estimated cloud cover */
+);
+
+
+void cfmask_free_estimate
+(
+    Cloud_estimate_t *estimate  /* I/O: estimate to release */
+);
+
+void cfmask_free_context
+(
+    Cfmask_context_t *context   /* I/O: context to release */
+);
+
+
+#endif
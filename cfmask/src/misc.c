@@ -2,7 +2,6 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <getopt.h>
 #include <string.h>
 #include <math.h>
 
@@ -15,305 +14,327 @@
 
 
 /*****************************************************************************
-MODULE:  prctile
+MODULE:  grow_histogram
 
-PURPOSE: Calculate Percentile of an integer array
+PURPOSE: Extends the range of a histogram so it contains the specified value
 
 RETURN: SUCCESS
         FAILURE
 *****************************************************************************/
-int prctile
+static int grow_histogram
 (
-    int16 *array, /* I: input data pointer */
-    int nums,     /* I: number of input data array */
-    int16 min,    /* I: minimum value in the input data array */
-    int16 max,    /* I: maximum value in the input data array  */
-    float prct,   /* I: percentage threshold */
-    float *result /* O: percentile calculated */
+    Histogram_t *hist, /* I/O: histogram to extend */
+    int value          /* I: value the histogram needs a bin for */
 )
 {
-    int *interval = NULL; /* array to store data in an interval */
-    int i, j;           /* loop variables */
-    int loops;          /* data range for input data */
-    float inv_nums_100; /* inverse of the nums value * 100 */
-    int sum;
+    long first;        /* value of the new first bin */
+    long last;         /* value of the new last bin */
+    long grow;         /* minimum number of bins to extend by */
+    int *bins = NULL;  /* new bin counts */
 
-    /* Just return 0 if no input value */
-    if (nums == 0)
+    if (hist->bin_count > 0 && value >= hist->first
+        && value - hist->first < hist->bin_count)
     {
-        *result = 0.0;
         return SUCCESS;
     }
-    else
-    {
-        *result = max;
-    }
 
-    loops = max - min + 1;
+    first = hist->first;
+    last = (long)hist->first + hist->bin_count - 1;
+    grow = (hist->bin_count > 64) ? hist->bin_count : 64;
 
-    interval = calloc(loops, sizeof(int));
-    if (interval == NULL)
+    if (hist->bin_count == 0)
+    {
+        first = value;
+        last = value + grow - 1;
+    }
+    if (value < first)
+    {
+        first = (value < first - grow) ? value : first - grow;
+    }
+    if (value > last)
     {
-        RETURN_ERROR("Invalid memory allocation", "prctile", FAILURE);
+        last = (value > last + grow) ? value : last + grow;
     }
 
-    for (i = 0; i < nums; i++)
+    bins = calloc(last - first + 1, sizeof(int));
+    if (bins == NULL)
     {
-        interval[array[i] - min]++;
+        RETURN_ERROR("Invalid memory allocation", "grow_histogram", FAILURE);
+    }
+    if (hist->bin_count > 0)
+    {
+        memcpy(&bins[hist->first - first], hist->bins,
+               hist->bin_count * sizeof(int));
     }
 
-    inv_nums_100 = (1.0 / nums) * 100.0;
-    sum = 0;
-    for (j = 0; j < loops; j++)
+    free(hist->bins);
+    hist->bins = bins;
+    hist->first = (int)first;
+    hist->bin_count = (int)(last - first + 1);
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  init_histogram
+
+PURPOSE: Initialize an empty histogram with one bin for each integer value
+         in the expected range of the samples.  The range is extended as
+         samples outside of it are added.
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int init_histogram
+(
+    Histogram_t *hist, /* O: histogram to initialize */
+    int min,           /* I: smallest expected sample value */
+    int max            /* I: largest expected sample value */
+)
+{
+    hist->bins = NULL;
+    hist->first = 0;
+    hist->bin_count = 0;
+    hist->count = 0;
+    hist->min = 0;
+    hist->max = 0;
+
+    if (max >= min)
     {
-        sum += interval[j];
-        if ((sum * inv_nums_100) >= prct)
+        hist->bins = calloc((long)max - min + 1, sizeof(int));
+        if (hist->bins == NULL)
         {
-            *result = min + j;
-            break;
+            RETURN_ERROR("Invalid memory allocation", "init_histogram",
+                         FAILURE);
         }
-        else
+        hist->first = min;
+        hist->bin_count = max - min + 1;
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  add_to_histogram
+
+PURPOSE: Add an integer sample to a histogram
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int add_to_histogram
+(
+    Histogram_t *hist, /* I/O: histogram to update */
+    int value          /* I: sample value */
+)
+{
+    if (value < hist->first || value - hist->first >= hist->bin_count)
+    {
+        if (grow_histogram(hist, value) != SUCCESS)
         {
-            continue;
+            RETURN_ERROR("Extending the histogram", "add_to_histogram",
+                         FAILURE);
         }
     }
-    free(interval);
+
+    hist->bins[value - hist->first]++;
+
+    if (hist->count == 0 || value < hist->min)
+        hist->min = value;
+    if (hist->count == 0 || value > hist->max)
+        hist->max = value;
+    hist->count++;
 
     return SUCCESS;
 }
 
 
 /*****************************************************************************
-MODULE:  prctile2
+MODULE:  add_float_to_histogram
 
-PURPOSE:  Calculate Percentile of a floating point array
+PURPOSE: Add a floating point sample to a histogram, the sample is counted
+         in the bin of the nearest integer value
 
 RETURN: SUCCESS
         FAILURE
 *****************************************************************************/
-int prctile2
+int add_float_to_histogram
 (
-    float *array, /* I: input data pointer */
-    int nums,     /* I: number of input data array */
-    float min,    /* I: minimum value in the input data array */
-    float max,    /* I: maximum value in the input data array  */
-    float prct,   /* I: percentage threshold */
-    float *result /* O: percentile calculated */
+    Histogram_t *hist, /* I/O: histogram to update */
+    float value        /* I: sample value */
 )
 {
-    int *interval;      /* array to store data in an interval */
-    int i, j;           /* loop variables */
-    int start, end;     /* start/end variables */
-    int loops;          /* data range of input data */
-    float inv_nums_100; /* inverse of the nums value * 100 */
-    int sum;
+    return add_to_histogram(hist, (int)rint(value));
+}
 
-    /* Just return 0 if no input value */
-    if (nums == 0)
-    {
-        *result = 0.0;
+
+/*****************************************************************************
+MODULE:  merge_histogram
+
+PURPOSE: Add the samples of one histogram to another histogram
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int merge_histogram
+(
+    Histogram_t *hist,            /* I/O: histogram to update */
+    const Histogram_t *other_hist /* I: histogram with the samples to add */
+)
+{
+    int i;
+
+    if (other_hist->count == 0)
         return SUCCESS;
+
+    /* Make sure both ends of the other histogram's samples have bins */
+    if ((other_hist->min < hist->first
+         || other_hist->max - hist->first >= hist->bin_count)
+        && (grow_histogram(hist, other_hist->min) != SUCCESS
+            || grow_histogram(hist, other_hist->max) != SUCCESS))
+    {
+        RETURN_ERROR("Extending the histogram", "merge_histogram", FAILURE);
     }
-    else
+
+    if (hist->count == 0 || other_hist->min < hist->min)
+        hist->min = other_hist->min;
+    if (hist->count == 0 || other_hist->max > hist->max)
+        hist->max = other_hist->max;
+
+    for (i = other_hist->min; i <= other_hist->max; i++)
     {
-        *result = max;
+        hist->bins[i - hist->first] +=
+            other_hist->bins[i - other_hist->first];
     }
+    hist->count += other_hist->count;
 
-    start = (int)rint(min);
-    end = (int)rint(max);
+    return SUCCESS;
+}
 
-    loops = end - start + 2;
 
-    interval = calloc(loops, sizeof(int));
-    if (interval == NULL)
+/*****************************************************************************
+MODULE:  histogram_percentiles
+
+PURPOSE: Calculate several percentiles of the samples in a histogram with a
+         single scan of the bins.  The result for each percentage is the
+         smallest bin value with at least that percentage of the samples at
+         or below it.
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int histogram_percentiles
+(
+    const Histogram_t *hist, /* I: histogram of the samples */
+    int prct_count,          /* I: number of percentiles to calculate */
+    const float *prct,       /* I: percentage thresholds */
+    float *result            /* O: percentiles calculated */
+)
+{
+    int i, k;           /* loop variables */
+    int remaining;      /* number of percentiles still to be found */
+    float inv_nums_100; /* inverse of the number of samples * 100 */
+    int sum;
+    bool found[MAX_PERCENTILE_COUNT]; /* percentile has been found */
+
+    if (prct_count < 1 || prct_count > MAX_PERCENTILE_COUNT)
     {
-        RETURN_ERROR("Invalid memory allocation", "prctile2", FAILURE);
+        RETURN_ERROR("Invalid number of percentiles",
+                     "histogram_percentiles", FAILURE);
     }
 
-    for (i = 0; i < nums; i++)
+    for (k = 0; k < prct_count; k++)
     {
-        interval[(int)rint(array[i]) - start]++;
+        /* Just return 0 if no input value */
+        if (hist->count == 0)
+            result[k] = 0.0;
+        else
+            result[k] = hist->max;
+        found[k] = false;
     }
 
-    inv_nums_100 = (1.0 / nums) * 100.0;
+    if (hist->count == 0)
+        return SUCCESS;
+
+    inv_nums_100 = (1.0 / hist->count) * 100.0;
     sum = 0;
-    for (j = 0; j < loops; j++)
+    remaining = prct_count;
+    for (i = hist->min; i <= hist->max && remaining > 0; i++)
     {
-        sum += interval[j];
-        if ((sum * inv_nums_100) >= prct)
+        sum += hist->bins[i - hist->first];
+        for (k = 0; k < prct_count; k++)
         {
-            *result = start + j;
-            break;
-        }
-        else
-        {
-            continue;
+            if (!found[k] && (sum * inv_nums_100) >= prct[k])
+            {
+                result[k] = i;
+                found[k] = true;
+                remaining--;
+            }
         }
     }
-    free(interval);
 
     return SUCCESS;
 }
 
 
 /*****************************************************************************
-MODULE:  get_args
-
-PURPOSE:  Gets the command-line arguments and validates that the required
-arguments were specified.
-
-RETURN VALUE:
-Type = int
-Value           Description
------           -----------
-FAILURE         Error getting the command-line arguments or a command-line
-                argument and associated value were not specified
-SUCCESS         No errors encountered
-
-NOTES:
-  1. Memory is allocated for the input and output files.  All of these should
-     be character pointers set to NULL on input.  The caller is responsible
-     for freeing the allocated memory upon successful return.
+MODULE:  histogram_percentile
+
+PURPOSE: Calculate a percentile of the samples in a histogram
+
+RETURN: SUCCESS
+        FAILURE
 *****************************************************************************/
-int get_args
+int histogram_percentile
 (
-    int argc,          /* I: number of cmd-line args */
-    char *argv[],      /* I: string of cmd-line args */
-    char **xml_infile, /* O: address of input XML filename */
-    float *cloud_prob, /* O: cloud_probability input */
-    int *cldpix,       /* O: cloud_pixel buffer used for image dilate */
-    int *sdpix,        /* O: shadow_pixel buffer used for image dilate */
-    bool *use_cirrus,  /* O: use Cirrus data */
-    bool *use_thermal, /* O: use Thermal data */
-    bool *verbose      /* O: verbose */
+    const Histogram_t *hist, /* I: histogram of the samples */
+    float prct,              /* I: percentage threshold */
+    float *result            /* O: percentile calculated */
 )
 {
-    char FUNC_NAME[] = "get_args"; /* function name */
-    int c;                         /* current argument index */
-    int option_index;              /* index for the command-line option */
-    static int verbose_flag = 0;   /* verbose flag */
-    static int cldpix_default = 3; /* Default buffer for cloud pixel dilate */
-    static int sdpix_default = 3;  /* Default buffer for shadow pixel dilate */
-    static float cloud_prob_default = 22.5; /* Default cloud probability */
-    static int use_cirrus_flag = 0;  /* Default to not using Cirrus band data */
-    static int use_thermal_flag = 1; /* Default to using Thermal band data */
-    char errmsg[MAX_STR_LEN];               /* error message */
-    static struct option long_options[] = {
-        {"xml", required_argument, 0, 'i'},
-        {"without-thermal", no_argument, &use_thermal_flag, 0},
-        {"with-cirrus", no_argument, &use_cirrus_flag, 1},
-        {"prob", required_argument, 0, 'p'},
-        {"cldpix", required_argument, 0, 'c'},
-        {"sdpix", required_argument, 0, 's'},
-        {"verbose", no_argument, &verbose_flag, 1},
-        {"version", no_argument, 0, 'v'},
-        {"help", no_argument, 0, 'h'},
-        {0, 0, 0, 0}
-    };
-
-    /* Assign the default values */
-    *cloud_prob = cloud_prob_default;
-    *cldpix = cldpix_default;
-    *sdpix = sdpix_default;
-
-    /* Loop through all the cmd-line options */
-    opterr = 0; /* turn off getopt_long error msgs as we'll print our own */
-    while (1)
-    {
-        /* optstring in call to getopt_long is empty since we will only
-           support the long options */
-        c = getopt_long(argc, argv, "", long_options, &option_index);
-        if (c == -1)
-        {
-            /* Out of cmd-line options */
-            break;
-        }
+    return histogram_percentiles(hist, 1, &prct, result);
+}
 
-        switch (c)
-        {
-        case 0:
-            /* If this option set a flag, do nothing else now. */
-            if (long_options[option_index].flag != 0)
-                break;
-
-        case 'h':          /* help */
-            usage();
-            exit(SUCCESS);
-            break;
-
-        case 'v':          /* version */
-            version();
-            exit(SUCCESS);
-            break;
-
-        case 'i':          /* xml infile */
-            *xml_infile = strdup(optarg);
-            break;
-
-        case 'p':          /* cloud probability value */
-            *cloud_prob = atof(optarg);
-            break;
-
-        case 'c':          /* cloud pixel value for image dilation */
-            *cldpix = atoi(optarg);
-            break;
-
-        case 's':          /* snow pixel value for image dilation */
-            *sdpix = atoi(optarg);
-            break;
-
-        case '?':
-        default:
-            sprintf(errmsg, "Unknown option %s", argv[optind - 1]);
-            usage();
-            RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
-            break;
-        }
-    }
 
-    /* Make sure the infile was specified */
-    if (*xml_infile == NULL)
+/*****************************************************************************
+MODULE:  clear_histogram
+
+PURPOSE: Remove all of the samples from a histogram, keeping the bins for
+         reuse
+*****************************************************************************/
+void clear_histogram
+(
+    Histogram_t *hist /* I/O: histogram to clear */
+)
+{
+    if (hist->count > 0)
     {
-        sprintf(errmsg, "XML input file is a required argument");
-        usage();
-        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+        memset(&hist->bins[hist->min - hist->first], 0,
+               ((long)hist->max - hist->min + 1) * sizeof(int));
     }
+    hist->count = 0;
+    hist->min = 0;
+    hist->max = 0;
+}
 
-    /* Check the use cirrus band flag */
-    if (use_cirrus_flag)
-        *use_cirrus = true;
-    else
-        *use_cirrus = false;
-
-    /* Check the use thermal band flag */
-    if (use_thermal_flag)
-        *use_thermal = true;
-    else
-        *use_thermal = false;
-
-    /* Check the verbose flag */
-    if (verbose_flag)
-        *verbose = true;
-    else
-        *verbose = false;
 
-    if (*verbose)
-    {
-        printf("XML_input_file = %s\n", *xml_infile);
-        printf("cloud_probability = %f\n", *cloud_prob);
-        printf("cloud_pixel_buffer = %d\n", *cldpix);
-        printf("shadow_pixel_buffer = %d\n", *sdpix);
-        if (*use_cirrus)
-            printf("use_cirrus = true\n");
-        else
-            printf("use_cirrus = false\n");
-        if (*use_thermal)
-            printf("use_thermal = true\n");
-        else
-            printf("use_thermal = false\n");
-    }
+/*****************************************************************************
+MODULE:  free_histogram
 
-    return SUCCESS;
+PURPOSE: Release the memory of a histogram
+*****************************************************************************/
+void free_histogram
+(
+    Histogram_t *hist /* I/O: histogram to release */
+)
+{
+    free(hist->bins);
+    hist->bins = NULL;
+    hist->first = 0;
+    hist->bin_count = 0;
+    hist->count = 0;
 }
 
 
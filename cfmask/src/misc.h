@@ -4,25 +4,78 @@
 #include <stdbool.h>
 
 
-int prctile
+/* Histogram with one bin for each integer value, used to calculate
+   percentiles without keeping the samples */
+typedef struct
+{
+    int *bins;      /* number of samples in each bin */
+    int first;      /* value of the first bin */
+    int bin_count;  /* number of bins */
+    int count;      /* number of samples */
+    int min;        /* smallest sample value */
+    int max;        /* largest sample value */
+} Histogram_t;
+
+/* Maximum number of percentiles calculated by one histogram_percentiles
+   call */
+#define MAX_PERCENTILE_COUNT 8
+
+
+int init_histogram
+(
+    Histogram_t *hist, /* O: histogram to initialize */
+    int min,           /* I: smallest expected sample value */
+    int max            /* I: largest expected sample value */
+);
+
+
+int add_to_histogram
+(
+    Histogram_t *hist, /* I/O: histogram to update */
+    int value          /* I: sample value */
+);
+
+
+int add_float_to_histogram
+(
+    Histogram_t *hist, /* I/O: histogram to update */
+    float value        /* I: sample value */
+);
+
+
+int merge_histogram
+(
+    Histogram_t *hist,            /* I/O: histogram to update */
+    const Histogram_t *other_hist /* I: histogram with the samples to add */
+);
+
+
+int histogram_percentiles
+(
+    const Histogram_t *hist, /* I: histogram of the samples */
+    int prct_count,          /* I: number of percentiles to calculate */
+    const float *prct,       /* I: percentage thresholds */
+    float *result            /* O: percentiles calculated */
+);
+
+
+int histogram_percentile
+(
+    const Histogram_t *hist, /* I: histogram of the samples */
+    float prct,              /* I: percentage threshold */
+    float *result            /* O: percentile calculated */
+);
+
+
+void clear_histogram
 (
-    int16 *array, /* I: input data pointer */
-    int nums,     /* I: number of input data array */
-    int16 min,    /* I: minimum value in the input data array */
-    int16 max,    /* I: maximum value in the input data array  */
-    float prct,   /* I: percentage threshold */
-    float *result /* O: percentile calculated */
+    Histogram_t *hist /* I/O: histogram to clear */
 );
 
 
-int prctile2
+void free_histogram
 (
-    float *array, /* I: input data pointer */
-    int nums,     /* I: number of input data array */
-    float min,    /* I: minimum value in the input data array */
-    float max,    /* I: maximum value in the input data array  */
-    float prct,   /* I: percentage threshold */
-    float *result /* O: percentile calculated */
+    Histogram_t *hist /* I/O: histogram to release */
 );
 
 
@@ -31,11 +84,30 @@ int get_args
     int argc,          /* I: number of cmd-line args */
     char *argv[],      /* I: string of cmd-line args */
     char **xml_infile, /* O: address of input XML filename */
+    char **batch_file, /* O: address of the batch filename, NULL when
+                             processing a single scene */
     float *cloud_prob, /* O: cloud_probability input */
     int *cldpix,       /* O: cloud_pixel buffer used for image dilate */
     int *sdpix,        /* O: shadow_pixel buffer used for image dilate  */
     bool *use_cirrus,  /* O: use Cirrus data */
     bool *use_thermal, /* O: use Thermal data */
+    bool *cache_bands, /* O: keep the input bands resident in memory */
+    bool *use_mmap,    /* O: memory map the input band files */
+    bool *fast_height_search, /* O: search the cloud heights with a
+                                    subsample of the cloud pixels */
+    int *pyramid_factor, /* O: reduction of the first height search, 1 for
+                               full resolution */
+    bool *huge_pages,  /* O: back the scratch pool with huge pages */
+    int *thread_count, /* O: number of threads, 0 for the OpenMP default */
+    bool *pin_threads, /* O: pin the threads to the CPUs for NUMA */
+    int *estimate_stride, /* O: sample stride of the cloud cover estimate,
+                                0 for the full masking */
+    bool *estimate_preview, /* O: write the preview mask of the estimate */
+    bool *stage_cache, /* O: keep the stage intermediates of each scene */
+    int *memory_cap,   /* O: memory cap in megabytes, 0 for no cap */
+    int *output_format, /* O: OUTPUT_FORMAT_ENVI or OUTPUT_FORMAT_TIFF */
+    char **profile_file, /* O: address of the profile report filename, NULL
+                               when not profiling */
     bool *verbose      /* O: verbose */
 );
 
@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <math.h>
 
@@ -18,7 +19,11 @@
 #include "input.h"
 #include "misc.h"
 #include "identify_clouds.h"
+#include "bit_mask.h"
+#include "scratch_pool.h"
+#include "stage_cache.h"
 #include "object_cloud_shadow_match.h"
+#include "profile.h"
 
 
 #define MAX_CLOUD_TYPE 3000000
@@ -83,152 +88,1926 @@ void viewgeo
 }
 
 
+/* Clouds with at least this many pixels are matched one at a time with the
+   threads splitting the pixels, the smaller clouds are spread across the
+   threads */
+#define LARGE_CLOUD_OBJ 250000
+
+/* Number of pixels of a cloud used by the fast height search */
+#define FAST_SEARCH_SAMPLES 4096
+
+/* Fewest pixels of a cloud used by the reduced height search of the
+   pyramid, smaller clouds are searched at full resolution */
+#define PYRAMID_SEARCH_SAMPLES 64
+
+/* Clouds with at most this many pixels are matched with a serial kernel
+   without the window and the pixel loop setup, and are handed to the
+   threads in batches */
+#define TINY_CLOUD_OBJ 64
+#define TINY_CLOUD_BATCH 64
+
+/* Largest shadow window of a cloud, larger clouds look up the masks of the
+   scene directly */
+#define MAX_WINDOW_PIXELS (16 * 1024 * 1024)
+
+/* Bits of the shadow window pixels */
+#define WINDOW_MATCH 0x01 /* fill, shadow or another cloud */
+#define WINDOW_OWN   0x02 /* part of the cloud being matched */
+
+
+/* Values shared by the shadow matching of all of the clouds */
+typedef struct
+{
+    const unsigned char *pixel_mask; /* pixel mask */
+    const int *cloud_lookup; /* first run for each cloud */
+    const RLE_T *cloud_runs; /* cloud run-length encoded segments */
+    const int *row_runs;     /* first run of each row, nrows + 1 entries */
+    const int *run_cloud;    /* cloud number of each run */
+    const int *run_temp_start; /* first cloud_temp entry of each run */
+    const int16 *cloud_temp; /* brightness temperature of the run pixels */
+    const int16 *therm_band; /* scene-resident thermal band, used in place
+                                of cloud_temp when it isn't NULL */
+    int nrows;               /* number of rows */
+    int ncols;               /* number of columns */
+    int data_counter;        /* count of imagery pixels */
+    bool use_thermal;        /* use the thermal data or not */
+    bool fast_height_search; /* search the heights with a subsample */
+    int pyramid_factor;      /* reduction of the first height search */
+    float t_templ;           /* percentile of low background temp */
+    float t_temph;           /* percentile of high background temp */
+    int i_step;              /* height iteration step */
+    float inv_shadow_step;
+    float shadow_dir_x;      /* unit vector from the cloud to its shadow, the
+                                solar azimuth side is folded in */
+    float shadow_dir_y;
+    float a, b, c;           /* view geometry, see viewgeo */
+    float inv_a_b_distance;
+    float inv_cos_omiga_per_minus_par;
+    float cos_omiga_par;
+    float sin_omiga_par;
+} Shadow_match_t;
+
+
+/* Buffers for the shadow matching of one cloud, each thread has its own */
+typedef struct
+{
+    int size;              /* number of pixels allocated */
+    int *orig_row;         /* original cloud locations */
+    int *orig_col;
+    float *dist_par;       /* height independent part of the cloud move,
+                              see prepare_cloud_projection */
+    double *height_offset; /* cloud pixel height above the base height */
+    int *shadow_row;       /* shadow locations for the current height */
+    int *shadow_col;
+    int16 *temp_obj;       /* temperature for each cloud pixel */
+    float *cloud_height;   /* cloud height */
+    float *matched_height; /* best match height values */
+    unsigned char *window; /* WINDOW_* bits around the shadows of the cloud */
+    int window_size;       /* number of window pixels allocated */
+    int window_row;        /* first row and column of the window */
+    int window_col;
+    int window_nrows;      /* size of the window, 0 when not used */
+    int window_ncols;
+    Histogram_t temp_hist; /* temperatures of the cloud */
+} Cloud_scratch_t;
+
+
+/* Cloud number and size, used to order the clouds for matching */
+typedef struct
+{
+    int cloud_type; /* cloud number */
+    int pixels;     /* number of pixels in the cloud */
+} Cloud_order_t;
+
+
 /*****************************************************************************
-MODULE:  mat_truecloud
+MODULE:  compare_cloud_order
 
-PURPOSE:  Calculate shadow pixel locations of a true cloud segment
+PURPOSE: qsort comparison to order the clouds largest first
 
-RETURN: None
+RETURN: less than, equal to or greater than zero
+*****************************************************************************/
+static int compare_cloud_order
+(
+    const void *p1, /* I: first cloud */
+    const void *p2  /* I: second cloud */
+)
+{
+    const Cloud_order_t *cloud1 = p1;
+    const Cloud_order_t *cloud2 = p2;
+
+    if (cloud1->pixels != cloud2->pixels)
+        return (cloud1->pixels > cloud2->pixels) ? -1 : 1;
+
+    return cloud1->cloud_type - cloud2->cloud_type;
+}
+
+
+/*****************************************************************************
+MODULE:  init_cloud_scratch
+
+PURPOSE: Initialize empty cloud scratch buffers
+*****************************************************************************/
+static void init_cloud_scratch
+(
+    Cloud_scratch_t *scratch /* O: scratch buffers */
+)
+{
+    scratch->size = 0;
+    scratch->orig_row = NULL;
+    scratch->orig_col = NULL;
+    scratch->dist_par = NULL;
+    scratch->height_offset = NULL;
+    scratch->shadow_row = NULL;
+    scratch->shadow_col = NULL;
+    scratch->temp_obj = NULL;
+    scratch->cloud_height = NULL;
+    scratch->matched_height = NULL;
+    scratch->window = NULL;
+    scratch->window_size = 0;
+    scratch->window_nrows = 0;
+    scratch->window_ncols = 0;
+    init_histogram(&scratch->temp_hist, 0, -1);
+}
+
+
+/*****************************************************************************
+MODULE:  free_cloud_buffers
+
+PURPOSE: Release the pixel buffers of the cloud scratch buffers
+*****************************************************************************/
+static void free_cloud_buffers
+(
+    Cloud_scratch_t *scratch /* I/O: scratch buffers */
+)
+{
+    free(scratch->orig_row);
+    scratch->orig_row = NULL;
+    free(scratch->orig_col);
+    scratch->orig_col = NULL;
+    free(scratch->dist_par);
+    scratch->dist_par = NULL;
+    free(scratch->height_offset);
+    scratch->height_offset = NULL;
+    free(scratch->shadow_row);
+    scratch->shadow_row = NULL;
+    free(scratch->shadow_col);
+    scratch->shadow_col = NULL;
+    free(scratch->temp_obj);
+    scratch->temp_obj = NULL;
+    free(scratch->cloud_height);
+    scratch->cloud_height = NULL;
+    free(scratch->matched_height);
+    scratch->matched_height = NULL;
+    scratch->size = 0;
+}
+
+
+/*****************************************************************************
+MODULE:  free_cloud_scratch
+
+PURPOSE: Release the cloud scratch buffers
+*****************************************************************************/
+static void free_cloud_scratch
+(
+    Cloud_scratch_t *scratch /* I/O: scratch buffers */
+)
+{
+    free_cloud_buffers(scratch);
+    free(scratch->window);
+    scratch->window = NULL;
+    scratch->window_size = 0;
+    free_histogram(&scratch->temp_hist);
+}
+
+
+/*****************************************************************************
+MODULE:  reserve_cloud_scratch
+
+PURPOSE: Make sure the cloud scratch buffers hold a cloud of the size given
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int reserve_cloud_scratch
+(
+    Cloud_scratch_t *scratch, /* I/O: scratch buffers */
+    int pixels                /* I: number of pixels in the cloud */
+)
+{
+    if (pixels <= scratch->size)
+        return SUCCESS;
+
+    /* The histogram bins are kept, they don't depend on the cloud size */
+    free_cloud_buffers(scratch);
+
+    scratch->orig_row = malloc(pixels * sizeof(int));
+    scratch->orig_col = malloc(pixels * sizeof(int));
+    scratch->dist_par = malloc(pixels * sizeof(float));
+    scratch->height_offset = malloc(pixels * sizeof(double));
+    scratch->shadow_row = malloc(pixels * sizeof(int));
+    scratch->shadow_col = malloc(pixels * sizeof(int));
+    scratch->temp_obj = malloc(pixels * sizeof(int16));
+    scratch->cloud_height = malloc(pixels * sizeof(float));
+    scratch->matched_height = malloc(pixels * sizeof(float));
+    if (scratch->orig_row == NULL || scratch->orig_col == NULL
+        || scratch->dist_par == NULL || scratch->height_offset == NULL
+        || scratch->shadow_row == NULL || scratch->shadow_col == NULL
+        || scratch->temp_obj == NULL || scratch->cloud_height == NULL
+        || scratch->matched_height == NULL)
+    {
+        free_cloud_buffers(scratch);
+        RETURN_ERROR("Allocating cloud memory", "reserve_cloud_scratch",
+                     FAILURE);
+    }
+    scratch->size = pixels;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  build_cloud_run_index
+
+PURPOSE: Build the lookup of the cloud number of the pixels from the cloud
+         runs, in place of an image sized cloud map
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. identify_clouds creates the runs in image order, so the runs of a row are
+   contiguous and sorted by column.  The index keeps the first run of each
+   row and the cloud number of each run.
+2. This has to be called before the small clouds are removed from the
+   cloud lookup, so every run is found from its cloud.
+*****************************************************************************/
+static int build_cloud_run_index
+(
+    const RLE_T *cloud_runs,  /* I: cloud run-length encoded segments */
+    const int *cloud_lookup,  /* I: first run for each cloud */
+    int num_clouds,           /* I: number of entries in cloud_lookup */
+    int nrows,                /* I: number of rows */
+    int **row_runs,           /* O: first run of each row, nrows + 1 */
+    int **run_cloud           /* O: cloud number of each run */
+)
+{
+    char *FUNC_NAME = "build_cloud_run_index";
+    int run_count = 0;
+    int cloud_index;
+    int run_index;
+    int row;
+
+    for (cloud_index = 1; cloud_index < num_clouds; cloud_index++)
+    {
+        for (run_index = cloud_lookup[cloud_index]; run_index != -1;
+             run_index = cloud_runs[run_index].next_index)
+        {
+            run_count++;
+        }
+    }
+
+    *row_runs = malloc((nrows + 1) * sizeof(int));
+    *run_cloud = malloc((run_count + 1) * sizeof(int));
+    if (*row_runs == NULL || *run_cloud == NULL)
+    {
+        free(*row_runs);
+        free(*run_cloud);
+        *row_runs = NULL;
+        *run_cloud = NULL;
+        RETURN_ERROR("Allocating cloud run index memory", FUNC_NAME,
+                     FAILURE);
+    }
+
+    for (cloud_index = 1; cloud_index < num_clouds; cloud_index++)
+    {
+        for (run_index = cloud_lookup[cloud_index]; run_index != -1;
+             run_index = cloud_runs[run_index].next_index)
+        {
+            (*run_cloud)[run_index] = cloud_index;
+        }
+    }
+
+    run_index = 0;
+    for (row = 0; row <= nrows; row++)
+    {
+        while (run_index < run_count && cloud_runs[run_index].row < row)
+            run_index++;
+        (*row_runs)[row] = run_index;
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  cloud_number_at
+
+PURPOSE: Find the cloud number of a pixel from the cloud runs of its row
+
+RETURN: cloud number, 0 if the pixel isn't in a cloud
+*****************************************************************************/
+static int cloud_number_at
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int row,                     /* I: row of the pixel */
+    int col                      /* I: column of the pixel */
+)
+{
+    int low = match->row_runs[row];
+    int high = match->row_runs[row + 1] - 1;
+
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        const RLE_T *run = &match->cloud_runs[middle];
+
+        if (col < run->start_col)
+            high = middle - 1;
+        else if (col >= run->start_col + run->col_count)
+            low = middle + 1;
+        else
+            return match->run_cloud[middle];
+    }
+
+    return 0;
+}
+
+
+/*****************************************************************************
+MODULE:  shadow_pixel_bits
+
+PURPOSE: Find how a shadow pixel compares with the masks for the cloud being
+         matched
+
+RETURN: WINDOW_* bits of the pixel
+*****************************************************************************/
+static unsigned char shadow_pixel_bits
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_type,              /* I: cloud number */
+    int row,                     /* I: row of the pixel */
+    int col                      /* I: column of the pixel */
+)
+{
+    unsigned char mask = match->pixel_mask[row * match->ncols + col];
+    int c_value = 0;
+
+    /* Only the cloud pixels are in a cloud run */
+    if (mask & CF_CLOUD_BIT)
+        c_value = cloud_number_at(match, row, col);
+
+    if (c_value == cloud_type)
+        return (mask & CF_FILL_BIT) ? (WINDOW_OWN | WINDOW_MATCH) : WINDOW_OWN;
+
+    if (mask & (CF_FILL_BIT | CF_CLOUD_BIT | CF_SHADOW_BIT))
+        return WINDOW_MATCH;
+
+    return 0;
+}
+
+
+/*****************************************************************************
+MODULE:  load_cloud_temperatures
+
+PURPOSE: Read the brightness temperature of the pixels of the cloud runs into
+         a list that follows the order of the runs, in place of an image
+         sized thermal band
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The thermal band is read one line at a time, so only the cloud pixels are
+   kept in memory.
+2. A run can continue past the end of its row, those pixels are read from the
+   next row the same as the image order would.  Pixels past the last row are
+   left as zero.
+3. This isn't needed when the thermal band is cached, the clouds read their
+   pixels from the cache.
 *****************************************************************************/
-void mat_truecloud
+static int load_cloud_temperatures
 (
-    int *x,              /* I: input pixel cloumn */
-    int *y,              /* I: input pixel row */
-    int array_length,    /* I: number of input array */
-    float *h,            /* I: cloud pixel height */
-    float a,             /* I: coefficient */
-    float b,             /* I: coefficient */
-    float c,             /* I: coefficient */
-    float inv_a_b_distance, /* I: precalculated */
-    float inv_cos_omiga_per_minus_par, /* I: precalculated */
-    float cos_omiga_par, /* I: precalculated */
-    float sin_omiga_par, /* I: precalculated */
-    float *x_new,        /* O: output pixel cloumn */
-    float *y_new         /* O: output pixel row */
+    Input_t *input,           /* I: input structure */
+    const RLE_T *cloud_runs,  /* I: cloud run-length encoded segments */
+    const int *row_runs,      /* I: first run of each row, nrows + 1 */
+    int nrows,                /* I: number of rows */
+    int ncols,                /* I: number of columns */
+    int **run_temp_start,     /* O: first cloud_temp entry of each run,
+                                    run count + 1 entries */
+    int16 **cloud_temp        /* O: temperature of each run pixel */
 )
 {
-    float dist;      /* distance */
-    float dist_par;  /* distance in parallel direction */
-    float dist_move; /* distance moved */
-    float delt_x;    /* change in column */
-    float delt_y;    /* change in row */
+    char *FUNC_NAME = "load_cloud_temperatures";
+    char errstr[MAX_STR_LEN];  /* error string */
+    int run_count = row_runs[nrows];
+    int run_index;
+    int row;
+    int col;
+
+    *run_temp_start = malloc((run_count + 1) * sizeof(int));
+    if (*run_temp_start == NULL)
+    {
+        RETURN_ERROR("Allocating cloud temperature index memory", FUNC_NAME,
+                     FAILURE);
+    }
+
+    (*run_temp_start)[0] = 0;
+    for (run_index = 0; run_index < run_count; run_index++)
+    {
+        (*run_temp_start)[run_index + 1] = (*run_temp_start)[run_index]
+            + cloud_runs[run_index].col_count;
+    }
+
+    *cloud_temp = calloc((*run_temp_start)[run_count] + 1, sizeof(int16));
+    if (*cloud_temp == NULL)
+    {
+        free(*run_temp_start);
+        *run_temp_start = NULL;
+        RETURN_ERROR("Allocating cloud temperature memory", FUNC_NAME,
+                     FAILURE);
+    }
+
+    for (row = 0; row < nrows; row++)
+    {
+        const int16 *therm_line;
+
+        /* Skip the rows without cloud pixels */
+        if (row_runs[row] == row_runs[row + 1]
+            && (row == 0 || row_runs[row - 1] == row_runs[row]))
+        {
+            continue;
+        }
+
+        if (!GetInputThermLine(input, row))
+        {
+            free(*run_temp_start);
+            free(*cloud_temp);
+            *run_temp_start = NULL;
+            *cloud_temp = NULL;
+            snprintf(errstr, sizeof(errstr),
+                     "Reading input thermal data for line %d", row);
+            RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+        }
+        therm_line = input->buf[BI_THERMAL];
+
+        /* The pixels of the runs of the previous row past its end */
+        if (row > 0)
+        {
+            for (run_index = row_runs[row - 1]; run_index < row_runs[row];
+                 run_index++)
+            {
+                const RLE_T *run = &cloud_runs[run_index];
+                int16 *run_temp = &(*cloud_temp)[(*run_temp_start)[run_index]
+                                                 - run->start_col];
+
+                for (col = ncols; col < run->start_col + run->col_count;
+                     col++)
+                {
+                    run_temp[col] = therm_line[col - ncols];
+                }
+            }
+        }
+
+        for (run_index = row_runs[row]; run_index < row_runs[row + 1];
+             run_index++)
+        {
+            const RLE_T *run = &cloud_runs[run_index];
+            int16 *run_temp = &(*cloud_temp)[(*run_temp_start)[run_index]
+                                             - run->start_col];
+            int end_col = run->start_col + run->col_count;
+
+            if (end_col > ncols)
+                end_col = ncols;
+            for (col = run->start_col; col < end_col; col++)
+                run_temp[col] = therm_line[col];
+        }
+    }
+
+    return SUCCESS;
+}
+
 
-    float height = 705000.0; /* average Landsat 4,5,&7 height (m) */
-    int i;
+/*****************************************************************************
+MODULE:  prepare_cloud_projection
+
+PURPOSE: Calculate the parts of the shadow projection of the cloud pixels
+         which don't depend on the cloud base height
+
+NOTES:
+1. The cloud pixels are moved to their true position, away from the
+   central perpendicular of the satellite track, by a distance proportional
+   to their height.  The distance from the perpendicular (unit: pixel) is
+   the same for every height, so it is kept for each pixel.
+2. With the thermal band the height of a pixel is the base height plus an
+   offset from the difference of its temperature with the cloud base
+   temperature, the offset is kept for each pixel as well.
+3. temp_obj has to hold the temperatures already limited to the cloud base
+   temperature.
+*****************************************************************************/
+static void prepare_cloud_projection
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    float t_obj,                 /* I: cloud base temperature */
+    bool parallel_pixels,        /* I: use threads for the pixel loops */
+    Cloud_scratch_t *scratch     /* I/O: scratch buffers for the cloud */
+)
+{
+    const int *cloud_orig_row = scratch->orig_row;
+    const int *cloud_orig_col = scratch->orig_col;
+    const int16 *temp_obj = scratch->temp_obj;
+    float *dist_par = scratch->dist_par;
+    double *height_offset = scratch->height_offset;
+    float inv_rate_elapse = 1.0/6.5; /* inverse wet air lapse rate */
+    float dist;                /* distance from the trace line */
+    int index;                 /* loop index */
 
-    for (i = 0; i < array_length; i++)
+#ifdef _OPENMP
+    #pragma omp parallel for if (parallel_pixels) private(dist)
+#endif
+    for (index = 0; index < cloud_pixels; index++)
     {
-        dist = (a * (float)x[i] + b * (float)y[i] + c) * inv_a_b_distance;
+        dist = (match->a * (float)cloud_orig_col[index]
+                + match->b * (float)cloud_orig_row[index] + match->c)
+               * match->inv_a_b_distance;
 
         /* from the cetral perpendicular (unit: pixel) */
-        dist_par = dist * inv_cos_omiga_per_minus_par;
+        dist_par[index] = dist * match->inv_cos_omiga_per_minus_par;
+    }
+
+    if (match->use_thermal)
+    {
+#ifdef _OPENMP
+        #pragma omp parallel for if (parallel_pixels)
+#endif
+        for (index = 0; index < cloud_pixels; index++)
+        {
+            height_offset[index] =
+                (10.0 * (t_obj - (float)temp_obj[index])) * inv_rate_elapse;
+        }
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  project_shadow_pixel
+
+PURPOSE: Calculate the location of the shadow of a cloud pixel at a height
+
+NOTES:
+1. The pixel is moved to its true position by the height times the
+   distance kept by prepare_cloud_projection, and then along the shadow
+   direction by the height.  The order of the operations is kept from the
+   original per pixel calculation, so the locations are the same.
+*****************************************************************************/
+static inline void project_shadow_pixel
+(
+    const Shadow_match_t *match,    /* I: values shared by all of the
+                                          clouds */
+    const Cloud_scratch_t *scratch, /* I: scratch buffers for the cloud */
+    int index,                      /* I: cloud pixel */
+    float pixel_height,             /* I: height of the cloud pixel */
+    int *shadow_row,                /* O: shadow location */
+    int *shadow_col
+)
+{
+    float height = 705000.0;   /* average Landsat 4,5,&7 height (m) */
+    float dist_move;           /* cloud move distance (m) */
+    float pos_row;             /* true location of the cloud pixel */
+    float pos_col;
+    float i_xy;                /* shadow distance in steps */
+
+    dist_move = (scratch->dist_par[index] * pixel_height) / height;
+    pos_col = scratch->orig_col[index] + dist_move * match->cos_omiga_par;
+    pos_row = scratch->orig_row[index] + dist_move * match->sin_omiga_par;
+
+    i_xy = pixel_height * match->inv_shadow_step;
+    *shadow_col = rint(pos_col + i_xy * match->shadow_dir_x);
+    *shadow_row = rint(pos_row + i_xy * match->shadow_dir_y);
+}
 
-        /* cloud move distance (m) */
-        dist_move = (dist_par * h[i]) / height;
 
-        delt_x = dist_move * cos_omiga_par;
-        delt_y = dist_move * sin_omiga_par;
+/*****************************************************************************
+MODULE:  cloud_pixel_height
+
+PURPOSE: Calculate the height of a cloud pixel for a cloud base height
+
+RETURN: height of the pixel (m)
+*****************************************************************************/
+static inline float cloud_pixel_height
+(
+    const Shadow_match_t *match,    /* I: values shared by all of the
+                                          clouds */
+    const Cloud_scratch_t *scratch, /* I: scratch buffers for the cloud */
+    int index,                      /* I: cloud pixel */
+    int base_h                      /* I: cloud base height */
+)
+{
+    if (match->use_thermal)
+        return scratch->height_offset[index] + (float)base_h;
+
+    return base_h;
+}
+
+
+/*****************************************************************************
+MODULE:  project_shadow_pixels
+
+PURPOSE: Calculate the cloud pixel heights for a cloud base height and the
+         locations of the shadows of the pixels
+
+NOTES:
+1. Only every stride pixels of the cloud are projected, a stride of one
+   projects all of them.
+2. The loop only does arithmetic on the pixel arrays, so the compiler can
+   vectorize it.
+*****************************************************************************/
+static void project_shadow_pixels
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    int stride,                  /* I: step between the pixels projected */
+    int base_h,                  /* I: cloud base height, -1 to use the
+                                       heights in cloud_height */
+    bool parallel_pixels,        /* I: use threads for the pixel loops */
+    Cloud_scratch_t *scratch,    /* I/O: scratch buffers for the cloud */
+    float *cloud_height          /* I/O: cloud pixel heights */
+)
+{
+    int *shadow_row = scratch->shadow_row;
+    int *shadow_col = scratch->shadow_col;
+    int index;                 /* loop index */
+
+#ifdef _OPENMP
+    #pragma omp parallel for if (parallel_pixels)
+#endif
+    for (index = 0; index < cloud_pixels; index += stride)
+    {
+        if (base_h >= 0)
+        {
+            cloud_height[index] = cloud_pixel_height(match, scratch, index,
+                                                     base_h);
+        }
+
+        project_shadow_pixel(match, scratch, index, cloud_height[index],
+                             &shadow_row[index], &shadow_col[index]);
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  shadow_similarity
+
+PURPOSE: Project the cloud pixels to their shadow locations for a cloud base
+         height and calculate how much of the shadow matches the potential
+         shadow, cloud, fill or outside of the image
+
+RETURN: the similarity of the shadow
 
-        x_new[i] = x[i] + delt_x; /* new x, j */
-        y_new[i] = y[i] + delt_y; /* new y, i */
+NOTES:
+1. Only every stride pixels of the cloud are used, a stride of one uses all
+   of them.  The heights and the shadow locations are left in the scratch
+   buffers for the pixels used.
+2. The shadow pixels are looked up in the window of the cloud made by
+   build_shadow_window, the pixels outside it use the masks of the scene.
+*****************************************************************************/
+static float shadow_similarity
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_type,              /* I: cloud number */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    int stride,                  /* I: step between the pixels used */
+    int base_h,                  /* I: cloud base height */
+    bool parallel_pixels,        /* I: use threads for the pixel loops */
+    Cloud_scratch_t *scratch     /* I/O: scratch buffers for the cloud */
+)
+{
+    int nrows = match->nrows;  /* number of rows */
+    int ncols = match->ncols;  /* number of columns */
+    const int *shadow_row = scratch->shadow_row;
+    const int *shadow_col = scratch->shadow_col;
+    int out_all;               /* total number of pixels outdside boundary */
+    int match_all;             /* total number of matched pixels */
+    int total_all;             /* total number of pixels */
+    int index;                 /* loop index */
+    int row;                   /* row index */
+    int col;                   /* column index */
+
+    /* Get the true postion of the cloud and its shadow with the base
+       height */
+    project_shadow_pixels(match, cloud_pixels, stride, base_h,
+                          parallel_pixels, scratch, scratch->cloud_height);
+
+    out_all = 0;
+    match_all = 0;
+    total_all = 0;
+#ifdef _OPENMP
+    #pragma omp parallel for if (parallel_pixels) private(col, row) reduction(+:out_all, match_all, total_all)
+#endif
+    for (index = 0; index < cloud_pixels; index += stride)
+    {
+        col = shadow_col[index];
+        row = shadow_row[index];
+
+        /* the id that is out of the image */
+        if (row < 0 || row >= nrows || col < 0 || col >= ncols)
+        {
+            out_all++;
+        }
+        else
+        {
+            unsigned char bits;
+            int window_row = row - scratch->window_row;
+            int window_col = col - scratch->window_col;
+
+            if (window_row >= 0 && window_row < scratch->window_nrows
+                && window_col >= 0 && window_col < scratch->window_ncols)
+            {
+                bits = scratch->window[window_row * scratch->window_ncols
+                                       + window_col];
+            }
+            else
+            {
+                bits = shadow_pixel_bits(match, cloud_type, row, col);
+            }
+
+            if (bits & WINDOW_MATCH)
+                match_all++;
+            if (!(bits & WINDOW_OWN))
+                total_all++;
+        }
     }
+    match_all += out_all;
+    total_all += out_all;
+
+    return (float)match_all / (float)total_all;
 }
 
 
 /*****************************************************************************
-MODULE:  image_dilate
+MODULE:  tiny_shadow_similarity
+
+PURPOSE: Calculate the similarity of the shadow of a tiny cloud for a cloud
+         base height, the same as shadow_similarity with all of the pixels
+
+RETURN: the similarity of the shadow
+
+NOTES:
+1. The projection and the lookup are done in one serial loop, which is
+   cheaper than setting up the pixel loops for a few pixels.
+*****************************************************************************/
+static float tiny_shadow_similarity
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_type,              /* I: cloud number */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    int base_h,                  /* I: cloud base height */
+    Cloud_scratch_t *scratch     /* I/O: scratch buffers for the cloud */
+)
+{
+    float *cloud_height = scratch->cloud_height;
+    int out_all = 0;           /* total number of pixels outdside boundary */
+    int match_all = 0;         /* total number of matched pixels */
+    int total_all = 0;         /* total number of pixels */
+    int index;                 /* loop index */
+    int row;                   /* row index */
+    int col;                   /* column index */
+
+    for (index = 0; index < cloud_pixels; index++)
+    {
+        cloud_height[index] = cloud_pixel_height(match, scratch, index,
+                                                 base_h);
+        project_shadow_pixel(match, scratch, index, cloud_height[index],
+                             &row, &col);
+
+        /* the id that is out of the image */
+        if (row < 0 || row >= match->nrows || col < 0 || col >= match->ncols)
+        {
+            out_all++;
+        }
+        else
+        {
+            unsigned char bits = shadow_pixel_bits(match, cloud_type, row,
+                                                   col);
 
-PURPOSE: Dilate the image with a n x n rectangular buffer
+            if (bits & WINDOW_MATCH)
+                match_all++;
+            if (!(bits & WINDOW_OWN))
+                total_all++;
+        }
+    }
+    match_all += out_all;
+    total_all += out_all;
+
+    return (float)match_all / (float)total_all;
+}
+
+
+/*****************************************************************************
+MODULE:  mark_cloud_shadow
+
+PURPOSE: Add the shadow of a cloud at the matched heights to the calibration
+         shadow mask
+*****************************************************************************/
+static void mark_cloud_shadow
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    bool parallel_pixels,        /* I: use threads for the pixel loops */
+    Cloud_scratch_t *scratch,    /* I/O: scratch buffers for the cloud */
+    Bit_mask_t *shadow_mask      /* I/O: calibration shadow mask */
+)
+{
+    int nrows = match->nrows;  /* number of rows */
+    int ncols = match->ncols;  /* number of columns */
+    const int *shadow_row = scratch->shadow_row;
+    const int *shadow_col = scratch->shadow_col;
+    int index;                 /* loop index */
+    int row;                   /* row index */
+    int col;                   /* column index */
+
+    /* Re-calculate the shadow position using the height with the best
+       match */
+    project_shadow_pixels(match, cloud_pixels, 1, -1, parallel_pixels,
+                          scratch, scratch->matched_height);
+
+#ifdef _OPENMP
+    #pragma omp parallel for if (parallel_pixels) private(col, row)
+#endif
+    for (index = 0; index < cloud_pixels; index++)
+    {
+        col = shadow_col[index];
+        row = shadow_row[index];
+
+        /* put data within range */
+        if (row < 0)
+            row = 0;
+        else if (row >= nrows)
+            row = nrows - 1;
+        if (col < 0)
+            col = 0;
+        else if (col >= ncols)
+            col = ncols - 1;
+
+        /* Other threads may be adding shadow from other clouds, which the
+           bit mask handles */
+        set_bit_mask_pixel(shadow_mask, row, col);
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  build_shadow_window
+
+PURPOSE: Copy the part of the masks the shadow of a cloud can fall on into a
+         small window, so the similarity of each height looks up nearby
+         memory instead of pixels spread across the scene
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The shadow of each cloud pixel moves along a line as the height changes,
+   so the window is the box around the shadows at the lowest and the highest
+   heights, with a pixel added on each side for the rounding.  Any shadow
+   pixel still outside the window is looked up in the scene masks, so the
+   similarity doesn't depend on the window.
+2. The window isn't used when it would take more work to fill than the
+   lookups it replaces, or when it is larger than MAX_WINDOW_PIXELS.
+3. The cloud pixel heights and shadow locations in the scratch buffers are
+   overwritten.
+*****************************************************************************/
+static int build_shadow_window
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_type,              /* I: cloud number */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    int min_height,              /* I: lowest cloud base height */
+    int max_height,              /* I: highest cloud base height */
+    bool parallel_pixels,        /* I: use threads for the pixel loops */
+    Cloud_scratch_t *scratch     /* I/O: scratch buffers for the cloud */
+)
+{
+    int nrows = match->nrows;  /* number of rows */
+    int ncols = match->ncols;  /* number of columns */
+    const int *shadow_row = scratch->shadow_row;
+    const int *shadow_col = scratch->shadow_col;
+    int first_row = nrows;     /* bounds of the shadows */
+    int last_row = -1;
+    int first_col = ncols;
+    int last_col = -1;
+    int window_nrows;
+    int window_ncols;
+    long window_pixels;
+    long lookups;              /* shadow pixels looked up for the heights */
+    int base_h;                /* cloud base height */
+    int index;                 /* loop index */
+    int row;                   /* row index */
+
+    scratch->window_nrows = 0;
+    scratch->window_ncols = 0;
+    if (min_height > max_height)
+        return SUCCESS;
+
+    for (base_h = min_height; ; base_h = max_height)
+    {
+        project_shadow_pixels(match, cloud_pixels, 1, base_h,
+                              parallel_pixels, scratch,
+                              scratch->cloud_height);
+        for (index = 0; index < cloud_pixels; index++)
+        {
+            if (shadow_row[index] < first_row)
+                first_row = shadow_row[index];
+            if (shadow_row[index] > last_row)
+                last_row = shadow_row[index];
+            if (shadow_col[index] < first_col)
+                first_col = shadow_col[index];
+            if (shadow_col[index] > last_col)
+                last_col = shadow_col[index];
+        }
+
+        if (base_h == max_height)
+            break;
+    }
+
+    /* Only the pixels within the image are looked up */
+    first_row = (first_row - 1 < 0) ? 0 : first_row - 1;
+    first_col = (first_col - 1 < 0) ? 0 : first_col - 1;
+    last_row = (last_row + 1 >= nrows) ? nrows - 1 : last_row + 1;
+    last_col = (last_col + 1 >= ncols) ? ncols - 1 : last_col + 1;
+    if (first_row > last_row || first_col > last_col)
+        return SUCCESS;
+
+    window_nrows = last_row - first_row + 1;
+    window_ncols = last_col - first_col + 1;
+    window_pixels = (long)window_nrows * window_ncols;
+    lookups = (long)cloud_pixels
+              * ((max_height - min_height) / match->i_step + 1);
+    if (window_pixels > MAX_WINDOW_PIXELS || window_pixels > lookups)
+        return SUCCESS;
+
+    if (window_pixels > scratch->window_size)
+    {
+        free(scratch->window);
+        scratch->window_size = 0;
+        scratch->window = malloc(window_pixels);
+        if (scratch->window == NULL)
+        {
+            RETURN_ERROR("Allocating shadow window memory",
+                         "build_shadow_window", FAILURE);
+        }
+        scratch->window_size = window_pixels;
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for if (parallel_pixels)
+#endif
+    for (row = first_row; row <= last_row; row++)
+    {
+        const unsigned char *mask_line = &match->pixel_mask[row * ncols];
+        unsigned char *window_line = &scratch->window[(row - first_row)
+                                                      * window_ncols
+                                                      - first_col];
+        int run_index;
+        int col;
+
+        for (col = first_col; col <= last_col; col++)
+        {
+            window_line[col] = (mask_line[col]
+                                & (CF_FILL_BIT | CF_CLOUD_BIT
+                                   | CF_SHADOW_BIT)) ? WINDOW_MATCH : 0;
+        }
+
+        /* The pixels of the cloud found the same way as cloud_number_at */
+        for (run_index = match->row_runs[row];
+             run_index < match->row_runs[row + 1]; run_index++)
+        {
+            const RLE_T *run = &match->cloud_runs[run_index];
+            int start_col = run->start_col;
+            int end_col = run->start_col + run->col_count - 1;
+
+            if (match->run_cloud[run_index] != cloud_type)
+                continue;
+
+            if (start_col < first_col)
+                start_col = first_col;
+            if (end_col > last_col)
+                end_col = last_col;
+            for (col = start_col; col <= end_col; col++)
+            {
+                if (!(mask_line[col] & CF_CLOUD_BIT))
+                    continue;
+
+                window_line[col] = (mask_line[col] & CF_FILL_BIT)
+                                   ? (WINDOW_OWN | WINDOW_MATCH)
+                                   : WINDOW_OWN;
+            }
+        }
+    }
+
+    scratch->window_row = first_row;
+    scratch->window_col = first_col;
+    scratch->window_nrows = window_nrows;
+    scratch->window_ncols = window_ncols;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  match_cloud_shadow
+
+PURPOSE: Find the height with the best similarity for the shadow of a cloud
+         and mark the shadow in the calibration shadow mask
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The pixel loops use threads when parallel_pixels is set, which is used
+   for the large clouds.  The smaller clouds are matched concurrently, so
+   the shadow bits are added to the calibration mask atomically.
+2. With the fast height search, clouds larger than FAST_SEARCH_SAMPLES walk
+   the heights with a subsample of their pixels, using the same acceptance
+   tests.  The best height and the heights on each side of it are then
+   compared with all of the pixels.  The result can differ from the strict
+   search, which matches every height with all of the pixels.
+3. With a pyramid factor the clouds with at least PYRAMID_SEARCH_SAMPLES
+   pixels at the reduced resolution walk every factor height with one of
+   each factor * factor pixels, then the heights between the neighbors of
+   the best one are refined with all of the pixels as above.
+*****************************************************************************/
+static int match_cloud_shadow
+(
+    const Shadow_match_t *match, /* I: values shared by all of the clouds */
+    int cloud_type,              /* I: cloud number */
+    int cloud_pixels,            /* I: number of pixels in the cloud */
+    bool parallel_pixels,        /* I: use threads for the pixel loops */
+    Cloud_scratch_t *scratch,    /* I/O: scratch buffers for the cloud */
+    Bit_mask_t *shadow_mask      /* I/O: calibration shadow mask */
+)
+{
+    char *FUNC_NAME = "match_cloud_shadow";
+    char errstr[MAX_STR_LEN];  /* error string */
+    int *cloud_orig_row;       /* original cloud locations */
+    int *cloud_orig_col;
+    int16 *temp_obj;           /* temperature for each cloud pixel */
+    float *cloud_height;       /* Cloud height */
+    float *matched_height;     /* Best match height values */
+    float cloud_radius;        /* Cloud radius */
+    short int t_obj_int = 0;   /* Integer object temperature */
+    float t_obj = 0.0;         /* cloud percentile value */
+    float pct_obj;             /* percent of edge pixels */
+    int16 temp_obj_max;        /* maximum temperature for each cloud */
+    int16 temp_obj_min;        /* minimum temperature for each cloud */
+    float t_similar;           /* similarity threshold */
+    float t_buffer;            /* threshold for matching buffering */
+    float max_similar = 0.95;  /* max similarity threshold */
+    float num_pix = 3.0;       /* number of inward pixes (240m) for cloud base
+                                  temperature */
+    float inv_rate_dlapse = 1.0/9.8; /* inverse dry air lapse rate */
+    float thresh_match;        /* thresh match value */
+    float record_thresh;       /* record thresh value */
+    int base_h;                /* cloud base height */
+    int record_h;              /* cloud base height of the record match */
+    int refine_h;              /* cloud base height being refined */
+    int stride;                /* step between the cloud pixels matched */
+    int height_step;           /* step between the heights searched (m) */
+    int max_cl_height;         /* Max cloud base height (m) */
+    int min_cl_height;         /* Min cloud base height (m) */
+    int max_height;            /* refined maximum height (m) */
+    int min_height;            /* refined minimum height (m) */
+    int run_index;             /* Index into the cloud_runs */
+    int index;                 /* loop index */
+    int col;                   /* column index */
+
+    if (reserve_cloud_scratch(scratch, cloud_pixels) != SUCCESS)
+    {
+        RETURN_ERROR("Allocating cloud height memory", FUNC_NAME, FAILURE);
+    }
+    cloud_orig_row = scratch->orig_row;
+    cloud_orig_col = scratch->orig_col;
+    temp_obj = scratch->temp_obj;
+    cloud_height = scratch->cloud_height;
+    matched_height = scratch->matched_height;
+
+    /* Update in Fmask v3.3, for larger (> 10% scene area), use
+       another set of t_similar and t_buffer to address some
+       missing cloud shadow at edge area */
+    if (cloud_pixels <= (int)(0.1 * match->data_counter))
+    {
+        t_similar = 0.3;
+        t_buffer = 0.95;
+    }
+    else
+    {
+        t_similar = 0.1;
+        t_buffer = 0.98;
+    }
+
+    /* Build the set of pixels for the current cloud and find the
+       min/max temperatures present in the cloud */
+    temp_obj_max = SHRT_MIN;
+    temp_obj_min = SHRT_MAX;
+    index = 0;
+    run_index = match->cloud_lookup[cloud_type];
+    while (run_index != -1)
+    {
+        const RLE_T *run = &match->cloud_runs[run_index];
+        int end_col = run->start_col + run->col_count;
+
+        for (col = run->start_col; col < end_col; col++)
+        {
+            if (match->use_thermal)
+            {
+                if (match->therm_band != NULL)
+                {
+                    /* The same pixels load_cloud_temperatures keeps */
+                    long pixel = (long)run->row * match->ncols + col;
+
+                    if (pixel < (long)match->nrows * match->ncols)
+                        temp_obj[index] = match->therm_band[pixel];
+                    else
+                        temp_obj[index] = 0;
+                }
+                else
+                {
+                    temp_obj[index] = match->cloud_temp[
+                        match->run_temp_start[run_index] + col
+                        - run->start_col];
+                }
+
+                if (temp_obj[index] > temp_obj_max)
+                    temp_obj_max = temp_obj[index];
+
+                if (temp_obj[index] < temp_obj_min)
+                    temp_obj_min = temp_obj[index];
+            }
+
+            cloud_orig_col[index] = col;
+            cloud_orig_row[index] = run->row;
+            index++;
+        }
+        run_index = run->next_index;
+    }
+
+    /* Make sure the number of pixels counted is the same as the
+       number expected */
+    if (index != cloud_pixels)
+    {
+        snprintf(errstr, sizeof(errstr),
+                 "Inconsistent number of pixels found in a"
+                 " cloud %d/%d - this is a bug", index, cloud_pixels);
+        RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+    }
+
+    if (match->use_thermal)
+    {
+        /* The base temperature for cloud.  Assumes object is round
+           with cloud_radius being the radius of cloud */
+        cloud_radius = sqrt(cloud_pixels / (2.0 * PI));
+
+        /* number of inward pixels for correct temperature */
+        if (cloud_radius > num_pix)
+        {
+            pct_obj = ((cloud_radius - num_pix) * (cloud_radius - num_pix))
+                      / (cloud_radius * cloud_radius);
+
+            /* The histogram bins are reused for every cloud */
+            clear_histogram(&scratch->temp_hist);
+            for (index = 0; index < cloud_pixels; index++)
+            {
+                if (add_to_histogram(&scratch->temp_hist, temp_obj[index])
+                    != SUCCESS)
+                {
+                    break;
+                }
+            }
+
+            if (index < cloud_pixels
+                || histogram_percentile(&scratch->temp_hist,
+                                        100.0 * pct_obj, &t_obj)
+                   != SUCCESS)
+            {
+                RETURN_ERROR("Error calculating the cloud base"
+                             " temperature", FUNC_NAME, FAILURE);
+            }
+        }
+        else
+        {
+            /* Use the minimum temperature instead */
+            t_obj = temp_obj_min;
+        }
+
+        t_obj_int = rint(t_obj);
+    }
+
+    /* refine cloud height range (m) */
+    min_cl_height = 200;
+    max_cl_height = 12000;
+
+    if (match->use_thermal)
+    {
+        min_height =
+            (int)rint(10.0 * (match->t_templ - t_obj) * inv_rate_dlapse);
+        max_height = (int)rint(10.0 * (match->t_temph - t_obj));
+
+        /* Pick the smallest height range based */
+        if (min_cl_height < min_height)
+            min_cl_height = min_height;
+        if (max_cl_height > max_height)
+            max_cl_height = max_height;
+
+        /* put the edge of the cloud the same value as t_obj */
+#ifdef _OPENMP
+        #pragma omp parallel for if (parallel_pixels)
+#endif
+        for (index = 0; index < cloud_pixels; index++)
+        {
+            if (temp_obj[index] > t_obj_int)
+                temp_obj[index] = t_obj_int;
+        }
+    }
+
+    /* The heights only change the parts of the projection which are
+       calculated for every height */
+    prepare_cloud_projection(match, cloud_pixels, t_obj, parallel_pixels,
+                             scratch);
+
+    /* The masks around the shadows of all of the heights, the tiny clouds
+       look up the few shadow pixels in the scene masks */
+    scratch->window_nrows = 0;
+    scratch->window_ncols = 0;
+    if (cloud_pixels > TINY_CLOUD_OBJ
+        && build_shadow_window(match, cloud_type, cloud_pixels,
+                               min_cl_height, max_cl_height,
+                               parallel_pixels, scratch) != SUCCESS)
+    {
+        RETURN_ERROR("Building the cloud shadow window", FUNC_NAME, FAILURE);
+    }
+
+    memset(matched_height, 0, cloud_pixels * sizeof(float));
+
+    /* The fast search walks the heights with a subsample of the cloud */
+    stride = 1;
+    height_step = match->i_step;
+    if (match->fast_height_search && cloud_pixels > FAST_SEARCH_SAMPLES)
+    {
+        stride = (cloud_pixels + FAST_SEARCH_SAMPLES - 1)
+                 / FAST_SEARCH_SAMPLES;
+    }
+
+    /* The pyramid search walks the heights a factor apart with the cloud
+       reduced by the factor in both directions, as the shadow moves a
+       factor more pixels for each height */
+    if (match->pyramid_factor > 1
+        && cloud_pixels >= PYRAMID_SEARCH_SAMPLES * match->pyramid_factor
+                           * match->pyramid_factor)
+    {
+        if (stride < match->pyramid_factor * match->pyramid_factor)
+            stride = match->pyramid_factor * match->pyramid_factor;
+        height_step = match->pyramid_factor * match->i_step;
+    }
+
+    /* Initialize height and similarity info */
+    record_thresh = 0.0;
+    record_h = min_cl_height;
+    for (base_h = min_cl_height; base_h <= max_cl_height;
+         base_h += height_step)
+    {
+        if (cloud_pixels <= TINY_CLOUD_OBJ)
+        {
+            thresh_match = tiny_shadow_similarity(match, cloud_type,
+                                                  cloud_pixels, base_h,
+                                                  scratch);
+        }
+        else
+        {
+            thresh_match = shadow_similarity(match, cloud_type, cloud_pixels,
+                                             stride, base_h, parallel_pixels,
+                                             scratch);
+        }
+        if (((thresh_match - t_buffer * record_thresh) >= MINSIGMA)
+            && (base_h < max_cl_height - height_step)
+            && ((record_thresh - max_similar) < MINSIGMA))
+        {
+            if (thresh_match > record_thresh)
+            {
+                record_thresh = thresh_match;
+                record_h = base_h;
+
+                /* Save the new heights */
+                if (stride == 1)
+                {
+                    memcpy(matched_height, cloud_height,
+                           sizeof(*matched_height) * cloud_pixels);
+                }
+            }
+        }
+        else if (record_thresh > t_similar)
+        {
+            if (stride > 1)
+            {
+                /* Refine the subsample's best height and the heights up
+                   to the next ones searched with all of the cloud pixels */
+                record_thresh = 0.0;
+                for (refine_h = record_h - height_step;
+                     refine_h <= record_h + height_step;
+                     refine_h += match->i_step)
+                {
+                    if (refine_h < min_cl_height || refine_h > max_cl_height)
+                        continue;
+
+                    thresh_match = shadow_similarity(match, cloud_type,
+                                                     cloud_pixels, 1,
+                                                     refine_h,
+                                                     parallel_pixels,
+                                                     scratch);
+                    if (thresh_match > record_thresh)
+                    {
+                        record_thresh = thresh_match;
+                        memcpy(matched_height, cloud_height,
+                               sizeof(*matched_height) * cloud_pixels);
+                    }
+                }
+
+                /* The full cloud doesn't match well enough */
+                if (record_thresh <= t_similar)
+                    break;
+            }
+
+            mark_cloud_shadow(match, cloud_pixels, parallel_pixels, scratch,
+                              shadow_mask);
+
+            /* Done with this cloud */
+            break;
+        }
+        else
+        {
+            record_thresh = 0.0;
+        }
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  scratch_bit_mask
+
+PURPOSE: Set up a cleared bit mask in a slot of the scratch pool
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int scratch_bit_mask
+(
+    Scratch_pool_t *pool, /* I/O: scene sized scratch buffers */
+    int slot,             /* I: SCRATCH_* slot of the mask */
+    int nrows,            /* I: number of rows */
+    int ncols,            /* I: number of columns */
+    Bit_mask_t *mask      /* O: cleared bit mask */
+)
+{
+    uint64_t *words;
+
+    words = get_scratch_buffer(pool, slot, bit_mask_bytes(nrows, ncols),
+                               false);
+    if (words == NULL)
+    {
+        RETURN_ERROR("Allocating bit mask memory", "scratch_bit_mask",
+                     FAILURE);
+    }
+    attach_bit_mask(nrows, ncols, words, mask);
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  match_scene_shadows
+
+PURPOSE: Label the clouds of the potential mask and match the shadow of each
+         cloud, which sets the calibration cloud and shadow masks the final
+         masks are dilated from
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The calibration masks are in the SCRATCH_CLEAR and SCRATCH_BAND slots of
+   the scratch pool.  They are only set up when the match succeeds.
+*****************************************************************************/
+static int match_scene_shadows
+(
+    Input_t *input,   /* I: input structure */
+    float t_templ,    /* I: percentile of low background temp */
+    float t_temph,    /* I: percentile of high background temp */
+    unsigned char *pixel_mask, /* I: pixel mask */
+    int data_counter, /* I: count of imagery pixels */
+    Scratch_pool_t *pool, /* I/O: scene sized scratch buffers */
+    bool use_thermal, /* I: value to indicate if thermal data should be used */
+    bool fast_height_search, /* I: search the cloud heights with a
+                                   subsample of the cloud pixels */
+    int pyramid_factor, /* I: reduction of the first height search, 1 to
+                              search at full resolution */
+    bool verbose,     /* I: value to indicate if intermediate messages
+                            be printed */
+    Bit_mask_t *cal_cloud,  /* O: calibration cloud mask */
+    Bit_mask_t *cal_shadow  /* O: calibration shadow mask */
+)
+{
+    char *FUNC_NAME = "match_scene_shadows";
+    int nrows = input->size.l; /* number of rows */
+    int ncols = input->size.s; /* number of columns */
+    int pixel_index;
+    int *row_runs = NULL;       /* first cloud run of each row */
+    int *run_cloud = NULL;      /* cloud number of each cloud run */
+    int *run_temp_start = NULL; /* first cloud_temp entry of each run */
+    int16 *cloud_temp = NULL;   /* brightness temperature of the cloud
+                                   run pixels */
+    Cloud_order_t *cloud_order = NULL; /* clouds ordered largest first */
+    Shadow_match_t match;       /* values shared by the cloud matches */
+    Cloud_scratch_t scratch;    /* buffers for matching the large clouds */
+    bool failed = false;        /* a cloud match failed */
+    int stage;                  /* profile stage */
+
+    int index;             /* loop index */
+    int row = 0;           /* row index */
+    int col = 0;           /* column index */
+
+    int num_clouds;
+    int i_step;            /* iteration step */
+    int x_ul = 0;          /* upper left column */
+    int y_ul = 0;          /* upper left row */
+    int x_lr = 0;          /* lower right column */
+    int y_lr = 0;          /* lower right row */
+    int x_ll = 0;          /* lower left column */
+    int y_ll = 0;          /* lower left row */
+    int x_ur = 0;          /* upper right column */
+    int y_ur = 0;          /* upper right row */
+    int num_of_real_clouds; /* counter */
+    int order_index;        /* index into the cloud order */
+    int tiny_index;         /* first tiny cloud in the cloud order */
+
+    float inv_a_b_distance;            /* Inverse of... */
+    float inv_cos_omiga_per_minus_par; /* Inverse of... */
+    float cos_omiga_par;
+    float sin_omiga_par;
+    float a, b, c, omiga_par, omiga_per; /* variables used for viewgeo
+                                            routine, see it for detail */
+
+    float pixel_size = 30.0; /* pixel size */
+    float sun_ele;           /* sun elevation angle */
+    float tan_sun_elevation; /* tangent of sun elevation angle */
+    float inv_shadow_step;
+    float sun_tazi;          /* sun azimuth angle */
+    float sun_tazi_rad;      /* sun azimuth angle in radiance */
+    float shadow_unit_vec_x;
+    float shadow_unit_vec_y;
+
+    /* Tangent of sun elevation angle */
+    sun_ele = 90.0 - input->meta.sun_zen;
+    tan_sun_elevation = tan (sun_ele * RAD);
+
+    /* Solar azimuth angle in radians */
+    sun_tazi = input->meta.sun_az - 90.0;
+    sun_tazi_rad = sun_tazi * RAD;
+
+    if (verbose)
+    {
+        printf("Shadow Match processing\n");
+        printf("Shadow match for cloud object >= %d pixels\n",
+               MIN_CLOUD_OBJ);
+    }
+
+    i_step = rint (2.0 * pixel_size * tan_sun_elevation);
+    /* move 2 pixel at a time */
+    if (i_step < (2 * pixel_size))
+    {
+        /* Make 2 * pixel_size for polar large solar zenith angle case */
+        i_step = 2 * pixel_size;
+    }
+
+    inv_shadow_step = 1.0 / (pixel_size * tan_sun_elevation);
+    shadow_unit_vec_x = cos(sun_tazi_rad);
+    shadow_unit_vec_y = sin(sun_tazi_rad);
+
+    /* Get moving direction, the idea is to get the corner rows/cols */
+    bool not_found = true;
+    for (row = 0; row < nrows && not_found; row++)
+    {
+        for (col = 0; col < ncols; col++)
+        {
+            pixel_index = row * ncols + col;
+
+            if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
+            {
+                y_ul = row;
+                x_ul = col;
+                not_found = false;
+                break;
+            }
+        }
+    }
+
+    not_found = true;
+    for (col = ncols - 1; col >= 0 && not_found; col--)
+    {
+        for (row = 0; row < nrows; row++)
+        {
+            pixel_index = row * ncols + col;
+
+            if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
+            {
+                y_ur = row;
+                x_ur = col;
+                not_found = false;
+                break;
+            }
+        }
+    }
+
+    not_found = true;
+    for (col = 0; col < ncols && not_found; col++)
+    {
+        for (row = nrows - 1; row >= 0; row--)
+        {
+            pixel_index = row * ncols + col;
+
+            if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
+            {
+                y_ll = row;
+                x_ll = col;
+                not_found = false;
+                break;
+            }
+        }
+    }
+
+    not_found = true;
+    for (row = nrows - 1; row >= 0 && not_found; row--)
+    {
+        for (col = ncols - 1; col >= 0; col--)
+        {
+            pixel_index = row * ncols + col;
+
+            if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
+            {
+                y_lr = row;
+                x_lr = col;
+                not_found = false;
+                break;
+            }
+        }
+    }
+
+    /* get view angle geometry */
+    viewgeo(x_ul, y_ul, x_ur, y_ur, x_ll, y_ll, x_lr, y_lr, &a, &b, &c,
+            &omiga_par, &omiga_per);
+
+    /* These don't change so calculate them here */
+    inv_a_b_distance = 1 / sqrt(a * a + b * b);
+    inv_cos_omiga_per_minus_par = 1 / cos(omiga_per - omiga_par);
+    cos_omiga_par = cos(omiga_par);
+    sin_omiga_par = sin(omiga_par);
+
+    /* Labeling the cloud pixels */
+    printf("Labeling Clouds\n");
+    int *cloud_pixel_count = NULL; /* Array for the count of pixels
+                                      in each of the identified clouds */
+    int *cloud_lookup = NULL; /* Array to point to the first run for each
+                                 cloud */
+    RLE_T *cloud_runs = NULL; /* Array of cloud run-length encoded
+                                 segments */
+
+    stage = profile_begin("identify_clouds");
+    if (identify_clouds(pixel_mask, nrows, ncols, &cloud_runs,
+                        &cloud_lookup, &cloud_pixel_count, &num_clouds)
+        != SUCCESS)
+    {
+        RETURN_ERROR("Failed labeling clouds", FUNC_NAME, FAILURE);
+    }
+    profile_end(stage);
+
+    /* The cloud numbers are looked up from the cloud runs from here on */
+    if (build_cloud_run_index(cloud_runs, cloud_lookup, num_clouds, nrows,
+                              &row_runs, &run_cloud) != SUCCESS)
+    {
+        free(cloud_pixel_count);
+        free(cloud_lookup);
+        free(cloud_runs);
+        RETURN_ERROR("Indexing the cloud runs", FUNC_NAME, FAILURE);
+    }
+
+    printf("Filtering Clouds\n");
+    num_of_real_clouds = 0;
+    for (index = 1; index < num_clouds; index++)
+    {
+        if (cloud_pixel_count[index] <= MIN_CLOUD_OBJ)
+        {
+            cloud_pixel_count[index] = 0;
+            cloud_lookup[index] = -1;
+            continue;
+        }
+
+        num_of_real_clouds++;
+    }
+
+    if (verbose)
+    {
+        printf("Num of clouds = %d\n", num_clouds);
+        printf("Num of real clouds = %d\n", num_of_real_clouds);
+    }
+
+    printf("Finding Shadows\n");
+    /* A cached thermal band is read in place by each cloud, otherwise
+       the brightness temperature of the cloud pixels only is kept */
+    if (use_thermal && input->cache[BI_THERMAL] == NULL)
+    {
+        if (load_cloud_temperatures(input, cloud_runs, row_runs, nrows,
+                                    ncols, &run_temp_start, &cloud_temp)
+            != SUCCESS)
+        {
+            free(cloud_pixel_count);
+            free(cloud_lookup);
+            free(cloud_runs);
+            free(row_runs);
+            free(run_cloud);
+            RETURN_ERROR("Loading the cloud temperatures", FUNC_NAME,
+                         FAILURE);
+        }
+    }
+
+    /* Cloud cal mask */
+    if (scratch_bit_mask(pool, SCRATCH_CLEAR, nrows, ncols, cal_cloud)
+        != SUCCESS)
+    {
+        free(cloud_pixel_count);
+        free(cloud_lookup);
+        free(cloud_runs);
+        free(row_runs);
+        free(run_cloud);
+        free(run_temp_start);
+        free(cloud_temp);
+        RETURN_ERROR("Allocating cal_mask memory", FUNC_NAME, FAILURE);
+    }
+    if (scratch_bit_mask(pool, SCRATCH_BAND, nrows, ncols, cal_shadow)
+        != SUCCESS)
+    {
+        free_bit_mask(cal_cloud);
+        free(cloud_pixel_count);
+        free(cloud_lookup);
+        free(cloud_runs);
+        free(row_runs);
+        free(run_cloud);
+        free(run_temp_start);
+        free(cloud_temp);
+        RETURN_ERROR("Allocating cal_mask memory", FUNC_NAME, FAILURE);
+    }
+
+    /* Cloud_cal pixels are cloud_mask pixels with < 9 pixels removed,
+       which are the runs of the remaining clouds.  The cloud pixels are
+       never fill. */
+    for (index = 1; index < num_clouds; index++)
+    {
+        int run_index;
+
+        if (cloud_pixel_count[index] == 0)
+            continue;
+
+        for (run_index = cloud_lookup[index]; run_index != -1;
+             run_index = cloud_runs[run_index].next_index)
+        {
+            set_bit_mask_run(cal_cloud, cloud_runs[run_index].row,
+                             cloud_runs[run_index].start_col,
+                             cloud_runs[run_index].col_count);
+        }
+    }
+
+    /* Order the clouds largest first, so the threads finish together */
+    cloud_order = malloc((num_of_real_clouds + 1) * sizeof(*cloud_order));
+    if (cloud_order == NULL)
+    {
+        free(cloud_pixel_count);
+        free_bit_mask(cal_cloud);
+        free_bit_mask(cal_shadow);
+        free(cloud_lookup);
+        free(cloud_runs);
+        free(row_runs);
+        free(run_cloud);
+        free(run_temp_start);
+        free(cloud_temp);
+        RETURN_ERROR("Allocating cloud order memory", FUNC_NAME,
+                     FAILURE);
+    }
+
+    order_index = 0;
+    for (index = 1; index < num_clouds; index++)
+    {
+        if (cloud_pixel_count[index] == 0)
+            continue;
+
+        cloud_order[order_index].cloud_type = index;
+        cloud_order[order_index].pixels = cloud_pixel_count[index];
+        order_index++;
+    }
+    qsort(cloud_order, num_of_real_clouds, sizeof(*cloud_order),
+          compare_cloud_order);
+
+    match.pixel_mask = pixel_mask;
+    match.cloud_lookup = cloud_lookup;
+    match.cloud_runs = cloud_runs;
+    match.row_runs = row_runs;
+    match.run_cloud = run_cloud;
+    match.run_temp_start = run_temp_start;
+    match.cloud_temp = cloud_temp;
+    match.therm_band = use_thermal ? input->cache[BI_THERMAL] : NULL;
+    match.nrows = nrows;
+    match.ncols = ncols;
+    match.data_counter = data_counter;
+    match.use_thermal = use_thermal;
+    match.fast_height_search = fast_height_search;
+    match.pyramid_factor = pyramid_factor;
+    match.t_templ = t_templ;
+    match.t_temph = t_temph;
+    match.i_step = i_step;
+    match.inv_shadow_step = inv_shadow_step;
+
+    /* The shadow is cast against the unit vector when the sun is in
+       the east.  The check here can assume to handle the south up north
+       down scene case correctly as azimuth angle needs to be added by
+       180.0 degree */
+    if (input->meta.sun_az < 180.0)
+    {
+        match.shadow_dir_x = -shadow_unit_vec_x;
+        match.shadow_dir_y = -shadow_unit_vec_y;
+    }
+    else
+    {
+        match.shadow_dir_x = shadow_unit_vec_x;
+        match.shadow_dir_y = shadow_unit_vec_y;
+    }
+    match.a = a;
+    match.b = b;
+    match.c = c;
+    match.inv_a_b_distance = inv_a_b_distance;
+    match.inv_cos_omiga_per_minus_par = inv_cos_omiga_per_minus_par;
+    match.cos_omiga_par = cos_omiga_par;
+    match.sin_omiga_par = sin_omiga_par;
+
+    /* Use iteration to get the optimal move distance, Calulate the
+       moving cloud shadow.  The large clouds are matched one at a time
+       with the threads splitting the cloud pixels. */
+    stage = profile_begin("cloud shadow matching");
+    init_cloud_scratch(&scratch);
+    for (order_index = 0; order_index < num_of_real_clouds
+         && cloud_order[order_index].pixels >= LARGE_CLOUD_OBJ;
+         order_index++)
+    {
+        if (match_cloud_shadow(&match, cloud_order[order_index].cloud_type,
+                               cloud_order[order_index].pixels, true,
+                               &scratch, cal_shadow) != SUCCESS)
+        {
+            failed = true;
+            break;
+        }
+    }
+    free_cloud_scratch(&scratch);
 
-RETURN: None
-*****************************************************************************/
-void image_dilate
-(
-    unsigned char *in_mask,    /* I: Mask to be dilated */
-    int nrows,                 /* I: Number of rows in the mask */
-    int ncols,                 /* I: Number of columns in the mask */
-    int idx,                   /* I: Pixel buffer 2 * idx + 1 */
-    unsigned char search_type, /* I: Type of data to dilate */
-    unsigned char *out_mask    /* O: Mask after dilate */
-)
-{
-    bool found;       /* flag to add the bit to the output mask */
-    /* loop indices */
-    int row, col;
-    int w_row, w_col; /* window */
-    int s_row;        /* start */
-    int s_col;        /* start */
-    int e_row;        /* end */
-    int e_col;        /* end */
-    /* locations */
-    int row_index;
-    int w_row_index;  /* window */
-    int out_index;
-    int in_index;
+    /* The clouds are ordered largest first, so the tiny clouds are the
+       end of the order */
+    tiny_index = order_index;
+    while (tiny_index < num_of_real_clouds
+           && cloud_order[tiny_index].pixels > TINY_CLOUD_OBJ)
+    {
+        tiny_index++;
+    }
+    if (verbose)
+    {
+        printf("Num of large clouds = %d\n", order_index);
+        printf("Num of tiny clouds = %d\n",
+               num_of_real_clouds - tiny_index);
+    }
 
+    /* The remaining clouds are spread across the threads, each thread
+       taking the next largest cloud when it finishes one */
 #ifdef _OPENMP
-    #pragma omp parallel for private(s_row, e_row, row_index, col, out_index, s_col, e_col, found, w_row, w_row_index, w_col, in_index)
+    #pragma omp parallel firstprivate(order_index)
 #endif
-    for (row = 0; row < nrows; row++)
     {
-        s_row = row - idx;
-        e_row = row + idx;
+        Cloud_scratch_t thread_scratch; /* buffers for this thread */
+        int cloud_index;
 
-        row_index = row * ncols;
+        init_cloud_scratch(&thread_scratch);
 
-        for (col = 0; col < ncols; col++)
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1) nowait
+#endif
+        for (cloud_index = order_index; cloud_index < tiny_index;
+             cloud_index++)
         {
-            out_index = row_index + col;
+            if (failed)
+                continue;
 
-            /* Skip processing output that is a fill pixel */
-            if (out_mask[out_index] & CF_FILL_BIT)
+            if (match_cloud_shadow(&match,
+                                   cloud_order[cloud_index].cloud_type,
+                                   cloud_order[cloud_index].pixels, false,
+                                   &thread_scratch, cal_shadow)
+                != SUCCESS)
             {
-                continue;
+                failed = true;
             }
+        }
 
-            /* Quick check the current pixel */
-            if (in_mask[out_index] & search_type)
-            {
-                out_mask[out_index] |= search_type;
+        /* The tiny clouds are handed out in batches */
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, TINY_CLOUD_BATCH)
+#endif
+        for (cloud_index = tiny_index; cloud_index < num_of_real_clouds;
+             cloud_index++)
+        {
+            if (failed)
                 continue;
+
+            if (match_cloud_shadow(&match,
+                                   cloud_order[cloud_index].cloud_type,
+                                   cloud_order[cloud_index].pixels, false,
+                                   &thread_scratch, cal_shadow)
+                != SUCCESS)
+            {
+                failed = true;
             }
+        }
 
-            s_col = col - idx;
-            e_col = col + idx;
+        free_cloud_scratch(&thread_scratch);
+    }
+    profile_end(stage);
+
+    /* Release memory */
+    free(cloud_pixel_count);
+    cloud_pixel_count = NULL;
+    free(cloud_lookup);
+    cloud_lookup = NULL;
+    free(cloud_runs);
+    cloud_runs = NULL;
+    free(row_runs);
+    row_runs = NULL;
+    free(run_cloud);
+    run_cloud = NULL;
+    free(cloud_order);
+    cloud_order = NULL;
+    free(run_temp_start);
+    run_temp_start = NULL;
+    free(cloud_temp);
+    cloud_temp = NULL;
+
+    if (failed)
+    {
+        free_bit_mask(cal_cloud);
+        free_bit_mask(cal_shadow);
+        RETURN_ERROR("Matching the cloud shadows", FUNC_NAME, FAILURE);
+    }
 
-            found = false;
-            /* For each row in the window */
-            for (w_row = s_row; w_row < e_row + 1 && !found; w_row++)
-            {
-                /* Skip out of bounds locations */
-                if (w_row < 0 || w_row > (nrows - 1))
-                    continue;
+    return SUCCESS;
+}
 
-                w_row_index = w_row * ncols;
 
-                /* For each column in the window */
-                for (w_col = s_col; w_col < e_col + 1; w_col++)
-                {
-                    /* Skip out of bounds locations */
-                    if (w_col < 0 || w_col > (ncols - 1))
-                        continue;
+/*****************************************************************************
+MODULE:  restore_calibration_masks
 
-                    in_index = w_row_index + w_col;
+PURPOSE: Set up the calibration cloud and shadow masks of a shadow match
+         kept by the stage cache, in the scratch slots match_scene_shadows
+         uses for them
 
-                    if (in_mask[in_index] & search_type)
-                    {
-                        found = true;
-                        break;
-                    }
-                }
-            }
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int restore_calibration_masks
+(
+    const Match_stage_t *match_stage, /* I: kept calibration masks */
+    Scratch_pool_t *pool,   /* I/O: scene sized scratch buffers */
+    int nrows,              /* I: number of rows */
+    int ncols,              /* I: number of columns */
+    Bit_mask_t *cal_cloud,  /* O: calibration cloud mask */
+    Bit_mask_t *cal_shadow  /* O: calibration shadow mask */
+)
+{
+    size_t mask_bytes = bit_mask_bytes(nrows, ncols);
 
-            if (found)
-                out_mask[out_index] |= search_type;
-            else
-                out_mask[out_index] &= ~search_type;
-        }
+    if (scratch_bit_mask(pool, SCRATCH_CLEAR, nrows, ncols, cal_cloud)
+        != SUCCESS
+        || scratch_bit_mask(pool, SCRATCH_BAND, nrows, ncols, cal_shadow)
+           != SUCCESS)
+    {
+        RETURN_ERROR("Allocating cal_mask memory",
+                     "restore_calibration_masks", FAILURE);
     }
+    memcpy(cal_cloud->words, match_stage->cloud_words, mask_bytes);
+    memcpy(cal_shadow->words, match_stage->shadow_words, mask_bytes);
+
+    return SUCCESS;
 }
 
 
@@ -241,6 +2020,12 @@ PURPOSE: Identify the final shadow pixels by doing a geometric cloud and
 
 RETURN: SUCCESS
         FAILURE
+
+NOTES:
+1. The calibration masks only depend on the potential mask and the height
+   search, not on the buffers of the dilate.  With a match stage they are
+   kept there, or restored from it, so the shadows aren't matched again
+   when only cldpix or sdpix change.
 *****************************************************************************/
 int object_cloud_shadow_match
 (
@@ -251,14 +2036,22 @@ int object_cloud_shadow_match
     int cldpix,       /* I: cloud buffer size */
     int sdpix,        /* I: shadow buffer size */
     unsigned char *pixel_mask, /* I/O: pixel mask */
+    Scratch_pool_t *pool, /* I/O: scene sized scratch buffers */
     int *image_data_count,  /* O: count of valid image pixels */
     bool use_thermal, /* I: value to indicate if thermal data should be used */
+    bool fast_height_search, /* I: search the cloud heights with a
+                                   subsample of the cloud pixels */
+    int pyramid_factor, /* I: reduction of the first height search, 1 to
+                              search at full resolution */
+    Match_stage_t *match_stage, /* I/O: calibration masks kept by the stage
+                                        cache, NULL to keep none */
+    bool restore_match, /* I: use the calibration masks of match_stage in
+                              place of matching the shadows */
     bool verbose      /* I: value to indicate if intermediate messages
                             be printed */
 )
 {
     char *FUNC_NAME = "object_cloud_shadow_match";
-    char errstr[MAX_STR_LEN];  /* error string */
     int nrows = input->size.l; /* number of rows */
     int ncols = input->size.s; /* number of columns */
 
@@ -306,6 +2099,9 @@ int object_cloud_shadow_match
        => no match => rest are definite shadows */
     if (clear_ptm <= 0.1 || revised_ptm >= 0.90)
     {
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
         for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
         {
             /* Skip fill pixels */
@@ -322,706 +2118,87 @@ int object_cloud_shadow_match
     }
     else
     {
-        unsigned char *cal_mask = NULL; /* calibration pixel mask */
-        int *cloud_map = NULL;      /* Image sized array with cloud numbers */
-        int16 *temp_data = NULL;    /* brightness temperature */
-        int16 *temp_obj = NULL;     /* temperature for each cloud */
-
-        int index;             /* loop index */
-        int row = 0;           /* row index */
-        int col = 0;           /* column index */
-
-        int base_h;            /* cloud base height */
-        int out_all;           /* total number of pixels outdside boundary */
-        int match_all;         /* total number of matched pixels */
-        int total_all;         /* total number of pixels */
-        int num_clouds;
-        int max_cl_height;     /* Max cloud base height (m) */
-        int min_cl_height;     /* Min cloud base height (m) */
-        int max_height;        /* refined maximum height (m) */
-        int min_height;        /* refined minimum height (m) */
-        int i_step;            /* iteration step */
-        int max_cloud_pixels = 1;
-        int x_ul = 0;          /* upper left column */
-        int y_ul = 0;          /* upper left row */
-        int x_lr = 0;          /* lower right column */
-        int y_lr = 0;          /* lower right row */
-        int x_ll = 0;          /* lower left column */
-        int y_ll = 0;          /* lower left row */
-        int x_ur = 0;          /* upper right column */
-        int y_ur = 0;          /* upper right row */
-        int16 temp_obj_max = 0; /* maximum temperature for each cloud */
-        int16 temp_obj_min = 0; /* minimum temperature for each cloud */
-        int num_of_real_clouds; /* counter */
-        int run_index;          /* Index into the cloud_runs */
-
-        float t_similar;       /* similarity threshold */
-        float t_buffer;        /* threshold for matching buffering */
-        float max_similar = 0.95; /* max similarity threshold */
-        float num_pix = 3.0;   /* number of inward pixes (240m) for cloud base
-                                  temperature */
-        float inv_rate_elapse = 1.0/6.5; /* inverse wet air lapse rate */
-        float inv_rate_dlapse = 1.0/9.8; /* inverse dry air lapse rate */
-        float thresh_match;    /* thresh match value */
-        float record_thresh;   /* record thresh value */
-        float inv_a_b_distance;            /* Inverse of... */
-        float inv_cos_omiga_per_minus_par; /* Inverse of... */
-        float cos_omiga_par;
-        float sin_omiga_par;
-        float a, b, c, omiga_par, omiga_per; /* variables used for viewgeo
-                                                routine, see it for detail */
-
-        int cloud_type;          /* cloud type iterator */
-        int *cloud_orig_row_col; /* Array for original cloud locations */
-        int *cloud_orig_row;
-        int *cloud_orig_col;
-        float *cloud_pos_row_col;
-        float *cloud_pos_row;
-        float *cloud_pos_col;
-
-        float pixel_size = 30.0; /* pixel size */
-        float sun_ele;           /* sun elevation angle */
-        float tan_sun_elevation; /* tangent of sun elevation angle */
-        float inv_shadow_step;
-        float sun_tazi;          /* sun azimuth angle */
-        float sun_tazi_rad;      /* sun azimuth angle in radiance */
-        float shadow_unit_vec_x;
-        float shadow_unit_vec_y;
-
-        float pct_obj;           /* percent of edge pixels */
-        float t_obj;             /* cloud percentile value */
-
-        /* Tangent of sun elevation angle */
-        sun_ele = 90.0 - input->meta.sun_zen;
-        tan_sun_elevation = tan (sun_ele * RAD);
-
-        /* Solar azimuth angle in radians */
-        sun_tazi = input->meta.sun_az - 90.0;
-        sun_tazi_rad = sun_tazi * RAD;
-
-        if (verbose)
-        {
-            printf("Shadow Match processing\n");
-            printf("Shadow match for cloud object >= %d pixels\n",
-                   MIN_CLOUD_OBJ);
-        }
-
-        i_step = rint (2.0 * pixel_size * tan_sun_elevation);
-        /* move 2 pixel at a time */
-        if (i_step < (2 * pixel_size))
-        {
-            /* Make 2 * pixel_size for polar large solar zenith angle case */
-            i_step = 2 * pixel_size;
-        }
+        Bit_mask_t cal_cloud;       /* calibration cloud mask */
+        Bit_mask_t cal_shadow;      /* calibration shadow mask */
+        Bit_mask_t dilated;         /* dilated calibration mask */
+        int stage;                  /* profile stage */
 
-        inv_shadow_step = 1.0 / (pixel_size * tan_sun_elevation);
-        shadow_unit_vec_x = cos(sun_tazi_rad);
-        shadow_unit_vec_y = sin(sun_tazi_rad);
-
-        /* Get moving direction, the idea is to get the corner rows/cols */
-        bool not_found = true;
-        for (row = 0; row < nrows && not_found; row++)
-        {
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
-                {
-                    y_ul = row;
-                    x_ul = col;
-                    not_found = false;
-                    break;
-                }
-            }
-        }
-
-        not_found = true;
-        for (col = ncols - 1; col >= 0 && not_found; col--)
-        {
-            for (row = 0; row < nrows; row++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
-                {
-                    y_ur = row;
-                    x_ur = col;
-                    not_found = false;
-                    break;
-                }
-            }
-        }
-
-        not_found = true;
-        for (col = 0; col < ncols && not_found; col++)
-        {
-            for (row = nrows - 1; row >= 0; row--)
-            {
-                pixel_index = row * ncols + col;
-
-                if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
-                {
-                    y_ll = row;
-                    x_ll = col;
-                    not_found = false;
-                    break;
-                }
-            }
-        }
-
-        not_found = true;
-        for (row = nrows - 1; row >= 0 && not_found; row--)
-        {
-            for (col = ncols - 1; col >= 0; col--)
-            {
-                pixel_index = row * ncols + col;
-
-                if (!(pixel_mask[pixel_index] & CF_FILL_BIT))
-                {
-                    y_lr = row;
-                    x_lr = col;
-                    not_found = false;
-                    break;
-                }
-            }
-        }
-
-        /* get view angle geometry */
-        viewgeo(x_ul, y_ul, x_ur, y_ur, x_ll, y_ll, x_lr, y_lr, &a, &b, &c,
-                &omiga_par, &omiga_per);
-
-        /* These don't change so calculate them here */
-        inv_a_b_distance = 1 / sqrt(a * a + b * b);
-        inv_cos_omiga_per_minus_par = 1 / cos(omiga_per - omiga_par);
-        cos_omiga_par = cos(omiga_par);
-        sin_omiga_par = sin(omiga_par);
-
-        /* Labeling the cloud pixels */
-        printf("Labeling Clouds\n");
-        int *cloud_pixel_count = NULL; /* Array for the count of pixels
-                                          in each of the identified clouds */
-        int *cloud_lookup = NULL; /* Array to point to the first run for each
-                                     cloud */
-        RLE_T *cloud_runs = NULL; /* Array of cloud run-length encoded
-                                     segments */
-
-        /* Allocate memory for array to map image pixels to cloud numbers */
-        cloud_map = calloc(pixel_count, sizeof(*cloud_map));
-        if (cloud_map == NULL)
-        {
-            RETURN_ERROR("Allocating memory for cloud map",
-                         FUNC_NAME, FAILURE);
-        }
-
-        if (identify_clouds(pixel_mask, nrows, ncols, &cloud_runs,
-                            &cloud_lookup, &cloud_pixel_count, &num_clouds,
-                            cloud_map) != SUCCESS)
+        if (restore_match)
         {
-            free(cloud_map);
-            RETURN_ERROR("Failed labeling clouds", FUNC_NAME, FAILURE);
-        }
-
-        /* If there are no clouds, set the maximum cloud pixels to 1 since
-           leaving it at zero would cause problems later */
-        if (num_clouds == 0)
-            max_cloud_pixels = 1;
-
-        printf("Filtering Clouds\n");
-        num_of_real_clouds = 0;
-        for (index = 1; index < num_clouds; index++)
-        {
-            if (cloud_pixel_count[index] <= MIN_CLOUD_OBJ)
+            if (restore_calibration_masks(match_stage, pool, nrows, ncols,
+                                          &cal_cloud, &cal_shadow)
+                != SUCCESS)
             {
-                cloud_pixel_count[index] = 0;
-                cloud_lookup[index] = -1;
-                continue;
+                RETURN_ERROR("Restoring the cloud shadow match", FUNC_NAME,
+                             FAILURE);
             }
-
-            num_of_real_clouds++;
-
-            if (max_cloud_pixels < cloud_pixel_count[index])
-                max_cloud_pixels = cloud_pixel_count[index];
-        }
-
-        if (verbose)
-        {
-            printf("Num of clouds = %d\n", num_clouds);
-            printf("Num of real clouds = %d\n", num_of_real_clouds);
-        }
-
-        printf("Finding Shadows\n");
-        /* Allocate space for the row/col locations of the height adjusted
-           cloud */
-        cloud_pos_row_col = malloc(2 * max_cloud_pixels
-                                   * sizeof(*cloud_pos_row_col));
-
-        /* Allocate space for the row/col locations of the original cloud */
-        cloud_orig_row_col = malloc(2 * max_cloud_pixels
-                                    * sizeof(*cloud_orig_row_col));
-
-        if (cloud_pos_row_col == NULL || cloud_orig_row_col == NULL)
-        {
-            free(cloud_pixel_count);
-            free(cloud_lookup);
-            free(cloud_runs);
-            free(cloud_map);
-            free(cloud_pos_row_col);
-            free(cloud_orig_row_col);
-            RETURN_ERROR("Allocating cloud memory", FUNC_NAME, FAILURE);
+            if (verbose)
+                printf("Cloud shadow match restored from the stage cache\n");
         }
-
-        /* Set up pointers to the row/column info for the cloud row/col info */
-        cloud_pos_row = cloud_pos_row_col;
-        cloud_pos_col = &cloud_pos_row_col[max_cloud_pixels];
-        cloud_orig_row = cloud_orig_row_col;
-        cloud_orig_col = &cloud_orig_row_col[max_cloud_pixels];
-
-        if (use_thermal)
+        else
         {
-            /* Thermal band data allocation */
-            temp_data = calloc(pixel_count, sizeof (int16));
-            if (temp_data == NULL)
-            {
-                free(cloud_pixel_count);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                RETURN_ERROR("Allocating temp memory", FUNC_NAME, FAILURE);
-            }
-
-            /* Load the thermal band */
-            for (row = 0; row < nrows; row++)
+            if (match_scene_shadows(input, t_templ, t_temph, pixel_mask,
+                                    data_counter, pool, use_thermal,
+                                    fast_height_search, pyramid_factor,
+                                    verbose, &cal_cloud, &cal_shadow)
+                != SUCCESS)
             {
-                if (!GetInputThermLine(input, row))
-                {
-                    free(cloud_pixel_count);
-                    free(cloud_lookup);
-                    free(cloud_runs);
-                    free(cloud_map);
-                    free(cloud_pos_row_col);
-                    free(cloud_orig_row_col);
-                    free(temp_data);
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-                memcpy(&temp_data[row * ncols], &input->buf[BI_THERMAL][0],
-                       ncols * sizeof(int16));
+                RETURN_ERROR("Matching the cloud shadows", FUNC_NAME,
+                             FAILURE);
             }
 
-            /* Temperature of the cloud object */
-            temp_obj = calloc(max_cloud_pixels, sizeof(int16));
-            if (temp_obj == NULL)
+            /* Keep the calibration masks for a later run which only changes
+               the buffers of the dilate */
+            if (match_stage != NULL)
             {
-                free(cloud_pixel_count);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                free(temp_data);
-                RETURN_ERROR("Allocating temp_obj memory", FUNC_NAME, FAILURE);
-            }
-        }
-
-        /* Cloud cal mask */
-        cal_mask = calloc(pixel_count, sizeof(unsigned char));
-        if (cal_mask == NULL)
-        {
-            free(cloud_pixel_count);
-            free(cloud_lookup);
-            free(cloud_runs);
-            free(cloud_map);
-            free(cloud_pos_row_col);
-            free(cloud_orig_row_col);
-            free(temp_data);
-            free(temp_obj);
-            RETURN_ERROR("Allocating cal_mask memory", FUNC_NAME, FAILURE);
-        }
-
-        /* Cloud_cal pixels are cloud_mask pixels with < 9 pixels removed */
-        unsigned char pixel_mask_value;
-#ifdef _OPENMP
-        #pragma omp parallel for private(pixel_mask_value)
-#endif
-        for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
-        {
-            pixel_mask_value = pixel_mask[pixel_index];
-
-            /* Has not been used yet, so initialize it first */
-            cal_mask[pixel_index] = CF_CLEAR_PIXEL;
+                size_t mask_bytes = bit_mask_bytes(nrows, ncols);
 
-            if ((pixel_mask_value & CF_CLOUD_BIT)
-                && (!(pixel_mask_value & CF_FILL_BIT))
-                && (cloud_pixel_count[cloud_map[pixel_index]] != 0))
-            {
-                cal_mask[pixel_index] |= CF_CLOUD_BIT;
+                memcpy(match_stage->cloud_words, cal_cloud.words,
+                       mask_bytes);
+                memcpy(match_stage->shadow_words, cal_shadow.words,
+                       mask_bytes);
             }
         }
 
-        /* Use iteration to get the optimal move distance, Calulate the
-           moving cloud shadow */
-        for (cloud_type = 1; cloud_type < num_clouds; cloud_type++)
+        if (scratch_bit_mask(pool, SCRATCH_FILLED, nrows, ncols, &dilated)
+            != SUCCESS)
         {
-            float *cloud_height;              /* Cloud height */
-            float *matched_height;            /* Best match height values */
-            float cloud_radius;               /* Cloud radius */
-            short int t_obj_int;              /* Integer object temperature */
-            int cloud_pixels = cloud_pixel_count[cloud_type];
-
-            if (cloud_pixels == 0)
-                continue;
-
-            /* Update in Fmask v3.3, for larger (> 10% scene area), use
-               another set of t_similar and t_buffer to address some
-               missing cloud shadow at edge area */
-            if (cloud_pixels <= (int)(0.1 * data_counter))
-            {
-                t_similar = 0.3;
-                t_buffer = 0.95;
-            }
-            else
-            {
-                t_similar = 0.1;
-                t_buffer = 0.98;
-            }
-
-            /* Build the set of pixels for the current cloud and find the
-               min/max temperatures present in the cloud */
-            temp_obj_max = SHRT_MIN;
-            temp_obj_min = SHRT_MAX;
-            index = 0;
-            run_index = cloud_lookup[cloud_type];
-            while (run_index != -1)
-            {
-                RLE_T *run = &cloud_runs[run_index];
-                int end_col = run->start_col + run->col_count;
-
-                for (col = run->start_col; col < end_col; col++)
-                {
-                    if (use_thermal)
-                    {
-                        temp_obj[index] = temp_data[run->row * ncols + col];
-
-                        if (temp_obj[index] > temp_obj_max)
-                            temp_obj_max = temp_obj[index];
-
-                        if (temp_obj[index] < temp_obj_min)
-                            temp_obj_min = temp_obj[index];
-                    }
-
-                    cloud_orig_col[index] = col;
-                    cloud_orig_row[index] = run->row;
-                    index++;
-                }
-                run_index = run->next_index;
-            }
-
-            /* Make sure the number of pixels counted is the same as the
-               number expected */
-            if (index != cloud_pixels)
-            {
-                free(cloud_pixel_count);
-                free(cal_mask);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                free(temp_data);
-                free(temp_obj);
-                snprintf(errstr, sizeof(errstr),
-                         "Inconsistent number of pixels found in a"
-                         " cloud %d/%d - this is a bug", index, cloud_pixels);
-                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-            }
-
-            if (use_thermal)
-            {
-                /* The base temperature for cloud.  Assumes object is round
-                   with cloud_radius being the radius of cloud */
-                cloud_radius = sqrt(cloud_pixels / (2.0 * PI));
-
-                /* number of inward pixels for correct temperature */
-                if (cloud_radius > num_pix)
-                {
-                    pct_obj = ((cloud_radius - num_pix)
-                               * (cloud_radius - num_pix))
-                              / (cloud_radius * cloud_radius);
-
-                    if (prctile(temp_obj, cloud_pixels, temp_obj_min,
-                                temp_obj_max, 100.0 * pct_obj, &t_obj)
-                        != SUCCESS)
-                    {
-                        free(cloud_pixel_count);
-                        free(cal_mask);
-                        free(cloud_lookup);
-                        free(cloud_runs);
-                        free(cloud_map);
-                        free(cloud_pos_row_col);
-                        free(cloud_orig_row_col);
-                        free(temp_data);
-                        free(temp_obj);
-                        RETURN_ERROR("Error calling prctile",
-                                     FUNC_NAME, FAILURE);
-                    }
-                }
-                else
-                {
-                    /* Use the minimum temperature instead */
-                    t_obj = temp_obj_min;
-                }
-
-                t_obj_int = rint(t_obj);
-            }
-
-            /* refine cloud height range (m) */
-            min_cl_height = 200;
-            max_cl_height = 12000;
-
-            if (use_thermal)
-            {
-                min_height =
-                    (int)rint(10.0 * (t_templ - t_obj) * inv_rate_dlapse);
-                max_height = (int)rint(10.0 * (t_temph - t_obj));
-
-                /* Pick the smallest height range based */
-                if (min_cl_height < min_height)
-                    min_cl_height = min_height;
-                if (max_cl_height > max_height)
-                    max_cl_height = max_height;
-
-                /* put the edge of the cloud the same value as t_obj */
-#ifdef _OPENMP
-                #pragma omp parallel for
-#endif
-                for (index = 0; index < cloud_pixels; index++)
-                {
-                    if (temp_obj[index] > t_obj_int)
-                        temp_obj[index] = t_obj_int;
-                }
-            }
-
-            /* Allocate memory for cloud height and matched height */
-            cloud_height = malloc(cloud_pixels * sizeof(float));
-            matched_height = calloc(cloud_pixels, sizeof(float));
-            if (cloud_height == NULL || matched_height == NULL)
-            {
-                free(cloud_pixel_count);
-                free(cal_mask);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                free(temp_data);
-                free(temp_obj);
-                RETURN_ERROR("Allocating cloud height memory",
-                             FUNC_NAME, FAILURE);
-            }
-
-            /* Initialize height and similarity info */
-            record_thresh = 0.0;
-            for (base_h = min_cl_height; base_h <= max_cl_height;
-                 base_h += i_step)
-            {
-                if (use_thermal)
-                {
-#ifdef _OPENMP
-                    #pragma omp parallel for
-#endif
-                    for (index = 0; index < cloud_pixels; index++)
-                    {
-                        cloud_height[index] =
-                            (10.0 * (t_obj - (float)temp_obj[index]))
-                            * inv_rate_elapse + (float)base_h;
-                    }
-                }
-                else
-                {
-                    for (index = 0; index < cloud_pixels; index++)
-                    {
-                        cloud_height[index] = base_h;
-                    }
-                }
-
-                /* Get the true postion of the cloud
-                   calculate cloud DEM with initial base height */
-                mat_truecloud(cloud_orig_col, cloud_orig_row,
-                              cloud_pixels, cloud_height, a, b, c,
-                              inv_a_b_distance,
-                              inv_cos_omiga_per_minus_par,
-                              cos_omiga_par, sin_omiga_par,
-                              cloud_pos_col, cloud_pos_row);
-
-                float i_xy;
-                out_all = 0;
-                match_all = 0;
-                total_all = 0;
-#ifdef _OPENMP
-                #pragma omp parallel for private(i_xy, col, row) reduction(+:out_all, match_all, total_all)
-#endif
-                for (index = 0; index < cloud_pixels; index++)
-                {
-                    i_xy = cloud_height[index] * inv_shadow_step;
-
-                    /* The check here can assume to handle the south up
-                       north down scene case correctly as azimuth angle
-                       needs to be added by 180.0 degree */
-                    if (input->meta.sun_az < 180.0)
-                    {
-                        col = rint(cloud_pos_col[index]
-                                   - i_xy * shadow_unit_vec_x);
-                        row = rint(cloud_pos_row[index]
-                                   - i_xy * shadow_unit_vec_y);
-                    }
-                    else
-                    {
-                        col = rint(cloud_pos_col[index]
-                                   + i_xy * shadow_unit_vec_x);
-                        row = rint(cloud_pos_row[index]
-                                   + i_xy * shadow_unit_vec_y);
-                    }
-
-                    /* the id that is out of the image */
-                    if (row < 0 || row >= nrows || col < 0 || col >= ncols)
-                    {
-                        out_all++;
-                    }
-                    else
-                    {
-                        int c_value = cloud_map[row * ncols + col];
-                        unsigned char mask = pixel_mask[row * ncols + col];
-
-                        if ((mask & CF_FILL_BIT)
-                            || ((c_value != cloud_type)
-                                && (mask & (CF_CLOUD_BIT | CF_SHADOW_BIT))))
-                        {
-                            match_all++;
-                        }
-                        if (c_value != cloud_type)
-                        {
-                            total_all++;
-                        }
-                    }
-                }
-                match_all += out_all;
-                total_all += out_all;
-
-                thresh_match = (float)match_all / (float)total_all;
-                if (((thresh_match - t_buffer * record_thresh) >= MINSIGMA)
-                    && (base_h < max_cl_height - i_step)
-                    && ((record_thresh - max_similar) < MINSIGMA))
-                {
-                    if (thresh_match > record_thresh)
-                    {
-                        record_thresh = thresh_match;
-
-                        /* Save the new heights */
-                        memcpy(matched_height, cloud_height,
-                               sizeof(*matched_height) * cloud_pixels);
-                    }
-                }
-                else if (record_thresh > t_similar)
-                {
-                    /* Re-calculate the cloud position using the height
-                       with the best match */
-                    mat_truecloud(cloud_orig_col, cloud_orig_row,
-                                  cloud_pixels, matched_height, a, b, c,
-                                  inv_a_b_distance,
-                                  inv_cos_omiga_per_minus_par,
-                                  cos_omiga_par, sin_omiga_par,
-                                  cloud_pos_col, cloud_pos_row);
-
-                    float i_vir;
-#ifdef _OPENMP
-                    #pragma omp parallel for private(i_vir, col, row)
-#endif
-                    for (index = 0; index < cloud_pixels; index++)
-                    {
-                        i_vir = matched_height[index] * inv_shadow_step;
-
-                        /* The check here can assume to handle the south
-                           up north down scene case correctly as azimuth
-                           angle needs to be added by 180.0 degree */
-                        if (input->meta.sun_az < 180.0)
-                        {
-                            col = rint(cloud_pos_col[index]
-                                       - i_vir * shadow_unit_vec_x);
-                            row = rint(cloud_pos_row[index]
-                                       - i_vir * shadow_unit_vec_y);
-                        }
-                        else
-                        {
-                            col = rint(cloud_pos_col[index]
-                                       + i_vir * shadow_unit_vec_x);
-                            row = rint(cloud_pos_row[index]
-                                       + i_vir * shadow_unit_vec_y);
-                        }
-
-                        /* put data within range */
-                        if (row < 0)
-                            row = 0;
-                        else if (row >= nrows)
-                            row = nrows - 1;
-                        if (col < 0)
-                            col = 0;
-                        else if (col >= ncols)
-                            col = ncols - 1;
-
-                        cal_mask[row * ncols + col] |= CF_SHADOW_BIT;
-                    }
-
-                    /* Done with this cloud */
-                    break;
-                }
-                else
-                {
-                    record_thresh = 0.0;
-                }
-            }
-
-            free(cloud_height);
-            cloud_height = NULL;
-            free(matched_height);
-            matched_height = NULL;
+            free_bit_mask(&cal_cloud);
+            free_bit_mask(&cal_shadow);
+            RETURN_ERROR("Allocating dilate memory", FUNC_NAME, FAILURE);
         }
 
-        /* Release memory */
-        free(cloud_pixel_count);
-        cloud_pixel_count = NULL;
-        free(cloud_lookup);
-        cloud_lookup = NULL;
-        free(cloud_runs);
-        cloud_runs = NULL;
-        free(cloud_map);
-        cloud_map = NULL;
-        free(cloud_pos_row_col);
-        cloud_pos_row_col = NULL;
-        free(cloud_orig_row_col);
-        cloud_orig_row_col = NULL;
-        free(temp_data);
-        temp_data = NULL;
-        free(temp_obj);
-        temp_obj = NULL;
-
         /* Do image dilate for cloud, shadow, snow */
         if (verbose)
            printf("Performing cloud dilate\n");
-        image_dilate(cal_mask, nrows, ncols, cldpix, CF_CLOUD_BIT,
-                     pixel_mask);
+        stage = profile_begin("cloud dilate");
+        if (dilate_bit_mask(&cal_cloud, cldpix, &dilated) != SUCCESS)
+        {
+            free_bit_mask(&cal_cloud);
+            free_bit_mask(&cal_shadow);
+            free_bit_mask(&dilated);
+            RETURN_ERROR("Dilating the cloud mask", FUNC_NAME, FAILURE);
+        }
+        apply_bit_mask(&dilated, CF_CLOUD_BIT, pixel_mask);
+        free_bit_mask(&cal_cloud);
+        profile_end(stage);
 
         if (verbose)
            printf("Performing cloud shadow dilate\n");
-        image_dilate(cal_mask, nrows, ncols, sdpix, CF_SHADOW_BIT,
-                     pixel_mask);
+        stage = profile_begin("cloud shadow dilate");
+        if (dilate_bit_mask(&cal_shadow, sdpix, &dilated) != SUCCESS)
+        {
+            free_bit_mask(&cal_shadow);
+            free_bit_mask(&dilated);
+            RETURN_ERROR("Dilating the cloud shadow mask", FUNC_NAME,
+                         FAILURE);
+        }
+        apply_bit_mask(&dilated, CF_SHADOW_BIT, pixel_mask);
+        profile_end(stage);
 
         /* Release memory */
-        free(cal_mask);
-        cal_mask = NULL;
+        free_bit_mask(&cal_shadow);
+        free_bit_mask(&dilated);
     }
 
     /* Return the amount of data that was image data */
@@ -11,8 +11,17 @@ int object_cloud_shadow_match
     int cldpix,       /* I: cloud buffer size */
     int sdpix,        /* I: shadow buffer size */
     unsigned char *pixel_mask, /* I/O: pixel mask */
+    Scratch_pool_t *pool, /* I/O: scene sized scratch buffers */
     int *data_count,  /* O: count of valid image pixels */
     bool use_thermal, /* I: value to indicate if thermal data should be used */
+    bool fast_height_search, /* I: search the cloud heights with a
+                                   subsample of the cloud pixels */
+    int pyramid_factor, /* I: reduction of the first height search, 1 to
+                              search at full resolution */
+    Match_stage_t *match_stage, /* I/O: calibration masks kept by the stage
+                                        cache, NULL to keep none */
+    bool restore_match, /* I: use the calibration masks of match_stage in
+                              place of matching the shadows */
     bool verbose      /* I: value to indicate if intermediate messages be
                             printed */
 );
@@ -13,6 +13,8 @@
 #include "error.h"
 #include "input.h"
 #include "output.h"
+#include "profile.h"
+#include "tiff_output.h"
 
 
 #define FMASK_PRODUCT "cfmask"
@@ -22,6 +24,7 @@
 #define FMASK_CONFIDENCE_SHORTNAME "CFMASK_CONF"
 #define FMASK_CONFIDENCE_NAME "cfmask_conf"
 #define FMASK_CONFIDENCE_LONG_NAME "cfmask_conf_band"
+#define FMASK_PREVIEW_NAME "cfmask_preview"
 
 
 /*****************************************************************************
@@ -44,7 +47,9 @@ Output_t *OpenOutputCFmask
     float cloud_percent,           /* I: */
     float cloud_shadow_percent,    /* I: */
     float water_percent,           /* I: */
-    float snow_percent             /* I: */
+    float snow_percent,            /* I: */
+    int format                     /* I: OUTPUT_FORMAT_ENVI or
+                                         OUTPUT_FORMAT_TIFF */
 )
 {
     Output_t *output = NULL;
@@ -124,6 +129,7 @@ Output_t *OpenOutputCFmask
     /* Populate the data structure */
     output->open = false;
     output->fp_bin = NULL;
+    output->format = format;
     output->nband = 1;
     output->size.l = input->size.l;
     output->size.s = input->size.s;
@@ -198,8 +204,9 @@ Output_t *OpenOutputCFmask
 
     /* Set up the filename with the scene name and band name and open the
        file for write access */
-    snprintf(file_name, sizeof(file_name), "%s_%s.img",
-             scene_name, bmeta[0].name);
+    snprintf(file_name, sizeof(file_name), "%s_%s.%s",
+             scene_name, bmeta[0].name,
+             (format == OUTPUT_FORMAT_TIFF) ? "tif" : "img");
     snprintf(bmeta[0].file_name, sizeof(bmeta[0].file_name), "%s", file_name);
     output->fp_bin = open_raw_binary(file_name, "w");
     if (output->fp_bin == NULL)
@@ -224,7 +231,9 @@ RETURN: Type = Output_t *
 Output_t *OpenOutputConfidence
 (
     Espa_internal_meta_t *in_meta, /* I: input metadata structure */
-    Input_t *input                 /* I: input reflectance band data */
+    Input_t *input,                /* I: input reflectance band data */
+    int format                     /* I: OUTPUT_FORMAT_ENVI or
+                                         OUTPUT_FORMAT_TIFF */
 )
 {
     Output_t *output = NULL;
@@ -302,6 +311,7 @@ Output_t *OpenOutputConfidence
     /* Populate the data structure */
     output->open = false;
     output->fp_bin = NULL;
+    output->format = format;
     output->nband = 1;
     output->size.l = input->size.l;
     output->size.s = input->size.s;
@@ -361,8 +371,9 @@ Output_t *OpenOutputConfidence
 
     /* Set up the filename with the scene name and band name and open the
        file for write access */
-    snprintf(file_name, sizeof(file_name), "%s_%s.img",
-             scene_name, bmeta[0].name);
+    snprintf(file_name, sizeof(file_name), "%s_%s.%s",
+             scene_name, bmeta[0].name,
+             (format == OUTPUT_FORMAT_TIFF) ? "tif" : "img");
     snprintf(bmeta[0].file_name, sizeof(bmeta[0].file_name), "%s", file_name);
     output->fp_bin = open_raw_binary(file_name, "w");
     if (output->fp_bin == NULL)
@@ -447,11 +458,104 @@ PutOutput(Output_t *output, unsigned char *final_mask)
     if (!output->open)
         RETURN_ERROR("file not open", "PutOutputLine", false);
 
+    if (output->format == OUTPUT_FORMAT_TIFF)
+    {
+        if (!write_tiled_tiff(output->fp_bin, final_mask, output->size.l,
+                              output->size.s, CF_FILL_PIXEL))
+        {
+            RETURN_ERROR("writing the TIFF output", "PutOutput", false);
+        }
+        return true;
+    }
+
     if (write_raw_binary(output->fp_bin, output->size.l, output->size.s,
                          sizeof(unsigned char), final_mask) != SUCCESS)
     {
         RETURN_ERROR("writing output line", "PutOutput", false);
     }
+    profile_add_bytes_written((size_t)output->size.l * output->size.s
+                              * sizeof(unsigned char));
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  WritePreviewCFmask
+
+PURPOSE: Write the low resolution preview mask of a cloud cover estimate as
+         a TIFF file next to the scene bands
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+
+NOTES:
+1. The file is named after the scene like the cfmask band, with the
+   cfmask_preview name.  It has the cfmask values of the samples and isn't
+   added to the XML file, since it doesn't have the size of the scene.
+*****************************************************************************/
+bool
+WritePreviewCFmask
+(
+    Espa_internal_meta_t *in_meta, /* I: input metadata structure */
+    const unsigned char *preview,  /* I: cfmask values of the samples */
+    int nrows,                     /* I: number of sample lines */
+    int ncols                      /* I: number of samples of each line */
+)
+{
+    char *mychar = NULL;        /* pointer to '_' */
+    char scene_name[STR_SIZE];  /* scene name for the current scene */
+    char file_name[STR_SIZE];   /* output filename */
+    int band_index;             /* looping variable for bands */
+    int ref_index = -1;         /* band index in XML file for the reflectance
+                                   band */
+    FILE *fp = NULL;            /* preview file */
+    bool written;
+
+    /* Find the representative band for the scene name */
+    for (band_index = 0; band_index < in_meta->nbands; band_index++)
+    {
+        if (!strcmp(in_meta->band[band_index].name, "toa_band1") &&
+            !strcmp(in_meta->band[band_index].product, "toa_refl"))
+        {
+            ref_index = band_index;
+            break;
+        }
+    }
+    if (ref_index == -1)
+    {
+        RETURN_ERROR("Unable to find the TOA reflectance bands in the XML file"
+                     " for naming the preview.", "WritePreviewCFmask", false);
+    }
+
+    /* Determine the scene name */
+    snprintf(scene_name, sizeof(scene_name), "%s",
+             in_meta->band[ref_index].file_name);
+    mychar = strstr(scene_name, "_toa_band");
+    if (mychar != NULL)
+        *mychar = '\0';
+
+    snprintf(file_name, sizeof(file_name), "%s_%s.tif", scene_name,
+             FMASK_PREVIEW_NAME);
+    fp = fopen(file_name, "wb");
+    if (fp == NULL)
+    {
+        RETURN_ERROR("unable to open the preview file", "WritePreviewCFmask",
+                     false);
+    }
+
+    written = write_tiled_tiff(fp, preview, nrows, ncols, CF_FILL_PIXEL);
+    if (fclose(fp) != 0)
+        written = false;
+    if (!written)
+    {
+        RETURN_ERROR("writing the preview file", "WritePreviewCFmask", false);
+    }
+
+    printf("Preview mask written to %s\n", file_name);
 
     return true;
 }
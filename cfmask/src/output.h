@@ -16,6 +16,7 @@ typedef struct
                                       metadata for the output band; global
                                       metadata won't be valid */
     FILE *fp_bin;         /* File pointer for binary output file */
+    int format;           /* OUTPUT_FORMAT_ENVI or OUTPUT_FORMAT_TIFF */
 } Output_t;
 
 
@@ -28,10 +29,12 @@ Output_t *OpenOutputCFmask
     float cloud_percent,
     float cloud_shadow_percent,
     float water_percent,
-    float snow_percent
+    float snow_percent,
+    int format
 );
 
-Output_t *OpenOutputConfidence(Espa_internal_meta_t *in_meta, Input_t *input);
+Output_t *OpenOutputConfidence(Espa_internal_meta_t *in_meta, Input_t *input,
+                               int format);
 
 bool PutOutput(Output_t *output, unsigned char *final_mask);
 
@@ -39,5 +42,8 @@ bool CloseOutput(Output_t *output);
 
 bool FreeOutput(Output_t *output);
 
+bool WritePreviewCFmask(Espa_internal_meta_t *in_meta,
+                        const unsigned char *preview, int nrows, int ncols);
+
 
 #endif
@@ -5,7 +5,9 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
+#include <math.h>
 
 
 #include "espa_geoloc.h"
@@ -17,126 +19,630 @@
 #include "input.h"
 #include "misc.h"
 #include "fill_local_minima_in_image.h"
+#include "spectral_tests.h"
+#include "profile.h"
+#include "scratch_pool.h"
+#include "stage_cache.h"
 #include "potential_cloud_shadow_snow_mask.h"
 
 
-bool is_fill_data
+/*****************************************************************************
+MODULE:  allocate_line_buffers
+
+PURPOSE: Allocate a line buffer for each band, used by a thread to read the
+         input lines it processes
+
+RETURN: true when the buffers were allocated
+*****************************************************************************/
+static bool allocate_line_buffers
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    bool use_cirrus, /* I: use the cirrus data or not */
-    bool use_thermal /* I: use the thermal data or not */
+    int ncols,       /* I: number of columns */
+    int16 **line_buf /* O: line buffers, indexed by band */
 )
 {
-    if (input->buf[BI_BLUE][column] == FILL_PIXEL
-        || input->buf[BI_GREEN][column] == FILL_PIXEL
-        || input->buf[BI_RED][column] == FILL_PIXEL
-        || input->buf[BI_NIR][column] == FILL_PIXEL
-        || input->buf[BI_SWIR_1][column] == FILL_PIXEL
-        || input->buf[BI_SWIR_2][column] == FILL_PIXEL)
+    int band_index;
+    bool allocated = true;
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
     {
-        return true;
+        line_buf[band_index] = malloc(ncols * sizeof(int16));
+        if (line_buf[band_index] == NULL)
+            allocated = false;
     }
 
-    if (use_cirrus)
+    return allocated;
+}
+
+
+/*****************************************************************************
+MODULE:  free_line_buffers
+
+PURPOSE: Release the line buffers of a thread
+*****************************************************************************/
+static void free_line_buffers
+(
+    int16 **line_buf /* I/O: line buffers, indexed by band */
+)
+{
+    int band_index;
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
     {
-        if (input->buf[BI_CIRRUS][column] == FILL_PIXEL)
-            return true;
+        free(line_buf[band_index]);
+        line_buf[band_index] = NULL;
     }
+}
 
-    if (use_thermal)
+
+/*****************************************************************************
+MODULE:  read_input_lines
+
+PURPOSE: Read the TOA bands, and the thermal band when it is used, for a line
+         using the caller's line buffers
+
+RETURN: true when all of the bands were read
+*****************************************************************************/
+static bool read_input_lines
+(
+    Input_t * input,  /* I: input structure */
+    int row,          /* I: line to read */
+    bool use_thermal, /* I: value to indicate if Thermal data should be
+                            used */
+    int16 **line_buf, /* I/O: line buffers, indexed by band */
+    int16 **line      /* O: band data for the line, indexed by band */
+)
+{
+    char errstr[MAX_STR_LEN];
+    int band_index;
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
     {
-        if (input->buf[BI_THERMAL][column] <= FILL_PIXEL)
-            return true;
+        if (band_index >= input->num_toa_bands
+            && (band_index != BI_THERMAL || !use_thermal))
+        {
+            continue;
+        }
+
+        if (!ReadInputLine(input, band_index, row, line_buf[band_index],
+                           &line[band_index]))
+        {
+            snprintf(errstr, sizeof(errstr),
+                     "Reading input data for line %d, band %d",
+                     row, band_index);
+            ERROR_MESSAGE(errstr, "read_input_lines");
+            return false;
+        }
     }
 
-    return false;
+    return true;
 }
 
 
-bool basic_cloud_test
+/*****************************************************************************
+MODULE:  fix_saturated_line_values
+
+PURPOSE: Replace the saturated values of a pixel in the non-cirrus band
+         lines and the thermal band line with the maximum values
+*****************************************************************************/
+static void fix_saturated_line_values
 (
     Input_t * input, /* I: input structure */
+    int16 **line,    /* I/O: band data for the line, indexed by band */
     int column,      /* I: column in the input data array */
-    float ndvi,      /* I: NDVI value */
-    float ndsi,      /* I: NDSI value */
-    bool use_thermal /* I: use the thermal data or not */
+    bool use_thermal /* I: value to indicate if Thermal data should be used */
 )
 {
-    bool result = false;
+    int band_index;
+
+    /* Landsat 8 doesn't have saturation issues */
+    if (input->satellite == IS_LANDSAT_8)
+        return;
+
+    for (band_index = 0; band_index < NON_CIRRUS_BAND_COUNT; band_index++)
+    {
+        if (line[band_index][column] ==
+            input->meta.satu_value_ref[band_index])
+        {
+            line[band_index][column] =
+                input->meta.satu_value_max[band_index];
+        }
+    }
 
-    if (ndsi < 0.8 && ndvi < 0.8 && (input->buf[BI_SWIR_2][column] > 300))
+    if (use_thermal)
     {
-        result = true;
+        if (line[BI_THERMAL][column] ==
+            input->meta.satu_value_ref[BI_THERMAL])
+        {
+            line[BI_THERMAL][column] =
+                input->meta.satu_value_max[BI_THERMAL];
+        }
     }
+}
+
 
-    /* If we are using thermal, then the original test was and'ing the thermal
-       test */
-    if (result && use_thermal)
+/*****************************************************************************
+MODULE:  cloud_probability
+
+PURPOSE: Calculate the cloud probability of a pixel, the cloud over water
+         probability for water pixels and the cloud over land probability
+         otherwise
+
+RETURN: The cloud probability
+*****************************************************************************/
+static float cloud_probability
+(
+    Input_t * input,  /* I: input structure */
+    int16 **line,     /* I: band data for the line, indexed by band */
+    int column,       /* I: column in the input data array */
+    bool is_water,    /* I: value to indicate if the pixel is water */
+    float t_temph,    /* I: percentile of high background temp */
+    float temp_diff,  /* I: difference of low/high temperature percentiles */
+    float t_wtemp,    /* I: high percentile water temperature */
+    bool use_cirrus,  /* I: value to inidicate if Cirrus data should be used */
+    bool use_thermal  /* I: value to indicate if Thermal data should be used */
+)
+{
+    float ndvi, ndsi;      /* NDVI and NDSI values */
+    float visi_mean;       /* mean of visible bands */
+    float whiteness;       /* whiteness value */
+    int t_bright;          /* brightness test value for water */
+    float brightness_prob; /* brightness probability value */
+    float vari_prob;       /* probability from NDVI, NDSI, and whiteness */
+    float max_value;       /* maximum value */
+    float probability;     /* final probability value */
+
+    if (is_water)
     {
-        if (input->buf[BI_THERMAL][column] < 2700)
+        /* Brightness test (over water) */
+        t_bright = 1100;
+        brightness_prob = (float)line[BI_SWIR_1][column] /
+            (float)t_bright;
+        if (brightness_prob > 1.0)
+            brightness_prob = 1.0;
+        if (brightness_prob < 0.0)
+            brightness_prob = 0.0;
+
+        if (use_thermal)
+        {
+            /* water temperature probability value */
+            float wtemp_prob;
+
+            /* Get cloud prob over water */
+            /* Temperature test over water */
+            wtemp_prob = (t_wtemp - (float)line[BI_THERMAL][column])
+                         / 400.0;
+
+            if (wtemp_prob < 0.0)
+                wtemp_prob = 0.0;
+
+            brightness_prob *= wtemp_prob;
+        }
+
+        /*Final prob mask (water), cloud over water probability */
+        if (use_cirrus)
         {
-            result = true;
+            probability = 100.0
+                * (brightness_prob
+                   + (float)line[BI_CIRRUS][column] / 400.0);
         }
         else
         {
-            result = false;
+            probability = 100.0 * brightness_prob;
+        }
+
+        return probability;
+    }
+
+    if ((line[BI_RED][column] + line[BI_NIR][column]) != 0)
+    {
+        ndvi = (float)(line[BI_NIR][column]
+                       - line[BI_RED][column])
+               / (float)(line[BI_NIR][column]
+                         + line[BI_RED][column]);
+    }
+    else
+        ndvi = 0.01;
+
+    if ((line[BI_GREEN][column] + line[BI_SWIR_1][column]) != 0)
+    {
+        ndsi = (float)(line[BI_GREEN][column]
+                       - line[BI_SWIR_1][column])
+               / (float)(line[BI_GREEN][column]
+                         + line[BI_SWIR_1][column]);
+    }
+    else
+        ndsi = 0.01;
+
+    /* NDVI and NDSI should not be negative */
+    if (ndsi < 0.0)
+        ndsi = 0.0;
+    if (ndvi < 0.0)
+        ndvi = 0.0;
+
+    visi_mean = (line[BI_BLUE][column]
+                 + line[BI_GREEN][column]
+                 + line[BI_RED][column]) / 3.0;
+    if (visi_mean != 0)
+    {
+        whiteness = ((fabs((float)line[BI_BLUE][column] - visi_mean)
+                      + fabs((float)line[BI_GREEN][column] - visi_mean)
+                      + fabs((float)line[BI_RED][column] - visi_mean)))
+                    / visi_mean;
+    }
+    else
+        whiteness = 0.0;
+
+    if (input->satellite != IS_LANDSAT_8)
+    {
+        /* Landsat 8 doesn't have saturation issues */
+        /* If one visible band is saturated, whiteness = 0 */
+        if ((line[BI_BLUE][column]
+             >= (input->meta.satu_value_max[BI_BLUE] - 1))
+            ||
+            (line[BI_GREEN][column]
+             >= (input->meta.satu_value_max[BI_GREEN] - 1))
+            ||
+            (line[BI_RED][column]
+             >= (input->meta.satu_value_max[BI_RED] - 1)))
+        {
+            whiteness = 0.0;
         }
     }
 
-    return result;
+    /* Vari_prob=1-max(max(abs(NDSI),abs(NDVI)),whiteness); */
+    if (ndsi > ndvi)
+        max_value = ndsi;
+    else
+        max_value = ndvi;
+    if (whiteness > max_value)
+        max_value = whiteness;
+    vari_prob = 1.0 - max_value;
+
+    if (use_thermal)
+    {
+        /* temperature probability */
+        float temp_prob;
+
+        temp_prob = (t_temph - (float)line[BI_THERMAL][column])
+                    / temp_diff;
+
+        /* Temperature can have prob > 1 */
+        if (temp_prob < 0.0)
+            temp_prob = 0.0;
+
+        vari_prob *= temp_prob;
+    }
+
+    /*Final prob mask (land) */
+    if (use_cirrus)
+    {
+        probability = 100.0 *
+            (vari_prob + ((float)line[BI_CIRRUS][column] / 400.0));
+    }
+    else
+    {
+        probability = 100.0 * vari_prob;
+    }
+
+    return probability;
 }
 
 
-bool basic_snow_test
+/* Thresholds of the cloud confidence test of a pixel */
+typedef struct
+{
+    float cold_temp;  /* temperature below which a pixel is a cloud */
+    float t_temph;    /* percentile of high background temp */
+    float temp_diff;  /* difference of low/high temperature percentiles */
+    float t_wtemp;    /* high percentile water temperature */
+    float clr_mask;   /* clear sky (land) probability threshold */
+    float wclr_mask;  /* water probability threshold */
+    bool use_cirrus;  /* use the Cirrus data */
+    bool use_thermal; /* use the Thermal data */
+} Cloud_thresholds_t;
+
+
+/*****************************************************************************
+MODULE:  select_clear_bits
+
+PURPOSE: Select the clear bits of the pixels used for the land and the water
+         background, all of the clear pixels when there is too little clear
+         land or clear water
+*****************************************************************************/
+static void select_clear_bits
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    float ndsi,      /* I: NDSI value */
-    bool use_thermal /* I: use the thermal data or not */
+    float land_ptm,           /* I: clear land pixel percentage */
+    float water_ptm,          /* I: clear water pixel percentage */
+    unsigned char *land_bit,  /* O: clear bit to test for land */
+    unsigned char *water_bit  /* O: clear bit to test for water */
 )
 {
-    bool result = false;
+    if (land_ptm >= 0.1)
+    {
+        /* use clear land only */
+        *land_bit = CF_CLEAR_LAND_BIT;
+    }
+    else
+    {
+        /* not enough clear land so use all clear pixels */
+        *land_bit = CF_CLEAR_BIT;
+    }
 
-    if (ndsi > 0.15
-        && input->buf[BI_NIR][column] > 1100
-        && input->buf[BI_GREEN][column] > 1000)
+    if (water_ptm >= 0.1)
+    {
+        /* use clear water only */
+        *water_bit = CF_CLEAR_WATER_BIT;
+    }
+    else
     {
-        result = true;
+        /* not enough clear water so use all clear pixels */
+        *water_bit = CF_CLEAR_BIT;
     }
+}
+
+
+/*****************************************************************************
+MODULE:  background_temperatures
 
-    /* If we are using thermal, then the original test was and'ing the thermal
-       test */
-    if (result && use_thermal)
+PURPOSE: Calculate the low and high percentiles of the clear land
+         temperatures and the high percentile of the clear water
+         temperatures
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int background_temperatures
+(
+    Histogram_t *land_temp_hist,  /* I: clear land temperatures */
+    Histogram_t *water_temp_hist, /* I: clear water temperatures */
+    unsigned char land_bit,       /* I: clear bit tested for land */
+    unsigned char water_bit,      /* I: clear bit tested for water */
+    float l_pt,                   /* I: low percentile threshold */
+    float h_pt,                   /* I: high percentile threshold */
+    float *t_templ,               /* O: percentile of low background temp */
+    float *t_temph,               /* O: percentile of high background temp */
+    float *t_wtemp                /* O: high percentile water temperature */
+)
+{
+    char *FUNC_NAME = "background_temperatures";
+    Histogram_t clear_temp_hist; /* clear land and water temperatures */
+    Histogram_t *land_temp = land_temp_hist;
+    Histogram_t *water_temp = water_temp_hist;
+    float prct[2];               /* percentages for the percentiles */
+    float prct_value[2];         /* percentiles calculated */
+    int status;
+
+    /* The clear pixel temperatures are the clear land and clear water
+       temperatures together */
+    init_histogram(&clear_temp_hist, 0, -1);
+    if (land_bit == CF_CLEAR_BIT || water_bit == CF_CLEAR_BIT)
     {
-        if (input->buf[BI_THERMAL][column] < 1000)
+        if (merge_histogram(&clear_temp_hist, land_temp_hist) != SUCCESS
+            || merge_histogram(&clear_temp_hist, water_temp_hist)
+               != SUCCESS)
         {
-            result = true;
+            RETURN_ERROR("Merging the temperature histograms",
+                         FUNC_NAME, FAILURE);
         }
-        else
+
+        if (land_bit == CF_CLEAR_BIT)
+            land_temp = &clear_temp_hist;
+        if (water_bit == CF_CLEAR_BIT)
+            water_temp = &clear_temp_hist;
+    }
+
+    /* 0.175 percentile background temperature (low) and 0.825
+       percentile background temperature (high) */
+    prct[0] = 100.0 * l_pt;
+    prct[1] = 100.0 * h_pt;
+    status = histogram_percentiles(land_temp, 2, prct, prct_value);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Error calling histogram_percentiles routine",
+                     FUNC_NAME, FAILURE);
+    }
+    *t_templ = prct_value[0];
+    *t_temph = prct_value[1];
+
+    status = histogram_percentile(water_temp, 100.0 * h_pt, t_wtemp);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Error calling histogram_percentile routine",
+                     FUNC_NAME, FAILURE);
+    }
+
+    /* Release the temperature histogram */
+    free_histogram(&clear_temp_hist);
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  set_cloud_confidence
+
+PURPOSE: Set the cloud confidence of a non-fill pixel from its cloud score,
+         and keep the cloud bit only for the high confidence
+*****************************************************************************/
+static void set_cloud_confidence
+(
+    float score,      /* I: cloud score of the pixel, see cloud_score */
+    float clr_mask,   /* I: clear sky (land) probability threshold */
+    float wclr_mask,  /* I: water probability threshold */
+    unsigned char *pixel_bits,  /* I/O: pixel mask bits of the pixel */
+    unsigned char *confidence   /* O: cloud confidence of the pixel */
+)
+{
+    float threshold;
+
+    if (*pixel_bits & CF_WATER_BIT)
+        threshold = wclr_mask;
+    else
+        threshold = clr_mask;
+
+    if (score > threshold)
+    {
+        /* This test indicates a high confidence */
+        *confidence = CLOUD_CONFIDENCE_HIGH;
+
+        /* Original code was only this if test and setting the cloud bit or
+           not */
+        *pixel_bits |= CF_CLOUD_BIT;
+    }
+    else if (score > threshold - 10.0)
+    {
+        /* This test indicates a medium confidence */
+        *confidence = CLOUD_CONFIDENCE_MED;
+
+        /* Don't set the cloud bit per the original code */
+        *pixel_bits &= ~CF_CLOUD_BIT;
+    }
+    else
+    {
+        /* All remaining are a low confidence */
+        *confidence = CLOUD_CONFIDENCE_LOW;
+
+        /* Don't set the cloud bit per the original code */
+        *pixel_bits &= ~CF_CLOUD_BIT;
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  cloud_score
+
+PURPOSE: Find the cloud score of a non-fill pixel, which is compared to the
+         probability thresholds for its cloud confidence
+
+RETURN: the cloud probability of a potential cloud pixel, INFINITY for a
+        pixel colder than the clouds, so it is always a high confidence,
+        and -INFINITY for the other pixels, so they are always a low
+        confidence
+
+NOTES:
+1. The score doesn't depend on the cloud probability threshold, so it can
+   be kept to assign the confidence again for another threshold.
+*****************************************************************************/
+static float cloud_score
+(
+    Input_t * input,  /* I: input structure */
+    int16 **line,     /* I: band data for the line, indexed by band */
+    int column,       /* I: column in the input data array */
+    const Cloud_thresholds_t *thresholds, /* I: confidence thresholds */
+    unsigned char pixel_bits    /* I: potential mask bits of the pixel */
+)
+{
+    if (thresholds->use_thermal
+        && line[BI_THERMAL][column] < thresholds->cold_temp)
+    {
+        return INFINITY;
+    }
+
+    /* The probability is only needed for the cloud pixels */
+    if (!(pixel_bits & CF_CLOUD_BIT))
+        return -INFINITY;
+
+    return cloud_probability(input, line, column,
+                             (pixel_bits & CF_WATER_BIT) != 0,
+                             thresholds->t_temph, thresholds->temp_diff,
+                             thresholds->t_wtemp, thresholds->use_cirrus,
+                             thresholds->use_thermal);
+}
+
+
+/*****************************************************************************
+MODULE:  read_fill_band
+
+PURPOSE: Read the NIR or SWIR1 band for the whole image into the buffer that
+         is filled by fill_local_minima_in_image, replacing the saturated
+         values of the image pixels with the maximum value
+
+RETURN: true when all of the lines were read
+*****************************************************************************/
+static bool read_fill_band
+(
+    Input_t * input,                 /* I: input structure */
+    int band_index,                  /* I: band to read */
+    const unsigned char *clear_mask, /* I: clear mask, marks the fill */
+    int16 *band_data                 /* O: band data for the whole image */
+)
+{
+    char errstr[MAX_STR_LEN];
+    int nrows = input->size.l;
+    int ncols = input->size.s;
+    int row;
+    int col;
+
+    for (row = 0; row < nrows; row++)
+    {
+        int16 *data_line = &band_data[row * ncols];
+
+        if (!GetInputLine(input, band_index, row))
+        {
+            snprintf(errstr, sizeof(errstr),
+                     "Reading input image data for line %d, band %d",
+                     row, band_index);
+            ERROR_MESSAGE(errstr, "read_fill_band");
+            return false;
+        }
+
+        memcpy(data_line, input->buf[band_index], ncols * sizeof(int16));
+
+        /* Landsat 8 doesn't have saturation issues */
+        if (input->satellite == IS_LANDSAT_8)
+            continue;
+
+        for (col = 0; col < ncols; col++)
         {
-            result = false;
+            if (clear_mask[row * ncols + col] & CF_CLEAR_FILL_BIT)
+                continue;
+
+            if (data_line[col] == input->meta.satu_value_ref[band_index])
+                data_line[col] = input->meta.satu_value_max[band_index];
         }
     }
 
-    return result;
+    return true;
 }
 
 
-bool zhe_water_test
+/*****************************************************************************
+MODULE:  apply_filled_shadow_test
+
+PURPOSE: Apply the shadow test of one filled band, where the filled value
+         must be more than 200 above the band value in both the NIR and the
+         SWIR1 bands.  The result is kept in the shadow bit, so the second
+         band only clears the bits set by the first.
+*****************************************************************************/
+static void apply_filled_shadow_test
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    float ndvi       /* I: NDVI value */
+    const int16 *band_data,   /* I: band data for the whole image */
+    const int16 *filled_data, /* I: filled band data for the whole image */
+    int pixel_count,          /* I: number of pixels in the image */
+    bool first_band,          /* I: set the bits for the first band, only
+                                    clear them for the second */
+    unsigned char *pixel_mask /* I/O: pixel mask */
 )
 {
-    if ((ndvi < 0.01 && input->buf[BI_NIR][column] < 1100)
-        || (ndvi < 0.1 && ndvi > 0.0 && input->buf[BI_NIR][column] < 500))
+    int pixel_index;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
     {
-        return true;
-    }
+        int16 shadow_prob;
+
+        if (pixel_mask[pixel_index] & CF_FILL_BIT)
+            continue;
+
+        shadow_prob = filled_data[pixel_index] - band_data[pixel_index];
 
-    return false;
+        if (shadow_prob <= 200)
+            pixel_mask[pixel_index] &= ~CF_SHADOW_BIT;
+        else if (first_band)
+            pixel_mask[pixel_index] |= CF_SHADOW_BIT;
+    }
 }
 
 
@@ -158,6 +664,10 @@ NOTES:
 1. Thermal buffer is expected to be in degrees Celsius with a factor applied
    of 100.  Many values which compare to the thermal buffer in this code are
    hardcoded and assume degrees celsius * 100.
+2. With a potential stage the pixel mask before the cloud confidence, the
+   cloud scores and the thresholds without the cloud probability threshold
+   are kept, see restore_potential_mask.  The buffers of the stage are
+   allocated by the caller.
 *****************************************************************************/
 int potential_cloud_shadow_snow_mask
 (
@@ -168,6 +678,9 @@ int potential_cloud_shadow_snow_mask
     float *t_temph,             /*O: percentile of high background temp */
     unsigned char *pixel_mask,  /*I/O: pixel mask */
     unsigned char *conf_mask,   /*I/O: confidence mask */
+    Scratch_pool_t *pool,       /*I/O: scene sized scratch buffers */
+    Potential_stage_t *potential, /*O: intermediates kept by the stage cache,
+                                     NULL to keep none */
     bool use_cirrus,            /*I: value to inidicate if Cirrus data should
                                      be used */
     bool use_thermal,           /*I: value to indicate if Thermal data should
@@ -180,19 +693,18 @@ int potential_cloud_shadow_snow_mask
     char errstr[MAX_STR_LEN];   /* error string */
     int nrows = input->size.l;  /* number of rows */
     int ncols = input->size.s;  /* number of columns */
-    int band_index = 0;         /* band index */
     int row = 0;                /* row index */
     int col = 0;                /* column index */
     int image_data_counter = 0;        /* mask counter */
     int clear_pixel_counter = 0;       /* clear sky pixel counter */
     int clear_land_pixel_counter = 0;  /* clear land pixel counter */
     int clear_water_pixel_counter = 0; /* clear water pixel counter */
-    float ndvi, ndsi;           /* NDVI and NDSI values */
-    int16 *f_temp = NULL;       /* clear land temperature */
-    int16 *f_wtemp = NULL;      /* clear water temperature */
-    float visi_mean;            /* mean of visible bands */
-    float whiteness = 0.0;      /* whiteness value */
-    float hot;                  /* hot value for hot test */
+    bool failed;                /* an error occurred in a parallel section */
+    int stage;                  /* profile stage */
+    Histogram_t land_temp_hist;  /* clear land temperatures */
+    Histogram_t water_temp_hist; /* clear water temperatures */
+    Histogram_t land_prob_hist;  /* clear land cloud probabilities */
+    Histogram_t water_prob_hist; /* clear water cloud probabilities */
     float land_ptm;             /* clear land pixel percentage */
     float water_ptm;            /* clear water pixel percentage */
     unsigned char land_bit;     /* Which clear bit to test all or just land */
@@ -200,292 +712,211 @@ int potential_cloud_shadow_snow_mask
     float l_pt;                 /* low percentile threshold */
     float h_pt;                 /* high percentile threshold */
     float t_wtemp;              /* high percentile water temperature */
-    float *wfinal_prob = NULL;  /* final water pixel probabilty value */
-    float *final_prob = NULL;   /* final land pixel probability value */
-    int t_bright;               /* brightness test value for water */
-    float brightness_prob;      /* brightness probability value */
     int t_buffer;               /* temperature test buffer */
     float temp_diff = 0.0;      /* difference of low/high temperature
                                    percentiles */
-    float vari_prob;            /* probability from NDVI, NDSI, and whiteness */
-    float max_value;            /* maximum value */
-    float *prob = NULL;         /* probability value */
-    float *wprob = NULL;        /* probability value */
     float clr_mask = 0.0;       /* clear sky pixel threshold */
     float wclr_mask = 0.0;      /* water pixel threshold */
+    Cloud_thresholds_t thresholds; /* cloud confidence thresholds */
     int data_size;              /* Data size for memory allocation */
-    int16 *nir = NULL;          /* near infrared band data */
-    int16 *swir1 = NULL;        /* short wavelength infrared band data */
-    int16 *nir_data = NULL;          /* Data to be filled */
-    int16 *swir1_data = NULL;        /* Data to be filled */
-    int16 *filled_nir_data = NULL;   /* Filled result */
-    int16 *filled_swir1_data = NULL; /* Filled result */
+    Histogram_t nir_hist;       /* clear land near infrared band data */
+    Histogram_t swir1_hist;     /* clear land short wavelength infrared band
+                                   data */
+    int16 *band_data = NULL;     /* NIR or SWIR1 data to be filled */
+    int16 *filled_data = NULL;   /* Filled result */
     float nir_boundary;         /* NIR boundary value / background value */
     float swir1_boundary;       /* SWIR1 boundary value / background value */
-    int16 shadow_prob;          /* shadow probability */
     int status;                 /* return value */
-    int satu_bv;                /* sum of saturated bands 1, 2, 3 value */
 
     int pixel_index;
     int pixel_count;
 
     pixel_count = nrows * ncols;
 
-    /* Dynamic memory allocation */
+    /* The clear mask is written for every pixel by the first pass */
     unsigned char *clear_mask = NULL;
 
-    clear_mask = calloc(pixel_count, sizeof(unsigned char));
+    clear_mask = get_scratch_buffer(pool, SCRATCH_CLEAR,
+                                    pixel_count * sizeof(unsigned char),
+                                    false);
     if (clear_mask == NULL)
     {
         RETURN_ERROR("Allocating mask memory", FUNC_NAME, FAILURE);
     }
 
+    /* Temperatures are degrees Celsius * 100 */
+    if (init_histogram(&land_temp_hist, -10000, 10000) != SUCCESS
+        || init_histogram(&water_temp_hist, -10000, 10000) != SUCCESS)
+    {
+        RETURN_ERROR("Allocating temp histogram memory", FUNC_NAME, FAILURE);
+    }
+
     if (verbose)
     {
         printf("The first pass\n");
     }
+    stage = profile_begin("first pass");
 
-    /* Loop through each line in the image */
-    for (row = 0; row < nrows; row++)
+    /* The rows are independent, so they are processed in parallel with
+       thread private line buffers, counters and temperature histograms */
+    failed = false;
+#ifdef _OPENMP
+    #pragma omp parallel reduction(+:image_data_counter, clear_pixel_counter, \
+                                     clear_land_pixel_counter, \
+                                     clear_water_pixel_counter)
+#endif
     {
-        if (verbose)
-        {
-            /* Print status on every 1000 lines */
-            if (!(row % 1000))
-            {
-                printf("Processing line %d\r", row);
-                fflush(stdout);
-            }
-        }
+        int16 *line[MAX_BAND_COUNT];     /* band data for the line */
+        int16 *line_buf[MAX_BAND_COUNT]; /* thread private line buffers */
+        Histogram_t thread_land_temp;    /* clear land temperatures */
+        Histogram_t thread_water_temp;   /* clear water temperatures */
+        Histogram_t *clear_temp;         /* histogram for a clear pixel */
+        unsigned char *test_bits;        /* spectral test bits of the line */
+        int band_index;
+        int row;
+        int col;
+
+        test_bits = malloc(ncols * sizeof(unsigned char));
+        if (!allocate_line_buffers(ncols, line_buf) || test_bits == NULL)
+            failed = true;
+        init_histogram(&thread_land_temp, 0, -1);
+        init_histogram(&thread_water_temp, 0, -1);
 
-        /* For each of the image bands */
-        for (band_index = 0; band_index < input->num_toa_bands; band_index++)
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 16)
+#endif
+        for (row = 0; row < nrows; row++)
         {
-            /* Read each input reflective band -- data is read into
-               input->buf[band_index] */
-            if (!GetInputLine(input, band_index, row))
+            if (failed)
+                continue;
+
+            if (verbose)
             {
-                snprintf(errstr, sizeof(errstr),
-                         "Reading input image data for line %d, band %d",
-                         row, band_index);
-                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                /* Print status on every 1000 lines */
+                if (!(row % 1000))
+                {
+                    printf("Processing line %d\r", row);
+                    fflush(stdout);
+                }
             }
-        }
 
-        if (use_thermal)
-        {
-            /* For the thermal band */
-            /* Read the input thermal band --
-               data is read into input->therm_buf */
-            if (!GetInputThermLine(input, row))
+            /* Read each of the image bands and the thermal band */
+            if (!read_input_lines(input, row, use_thermal, line_buf, line))
             {
-                snprintf(errstr, sizeof(errstr),
-                         "Reading input thermal data for line %d", row);
-                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                failed = true;
+                continue;
             }
-        }
-
-        for (col = 0; col < ncols; col++)
-        {
-            pixel_index = row * ncols + col;
 
             if (input->satellite != IS_LANDSAT_8)
             {
                 /* Landsat 8 doesn't have saturation issues */
-                int band_index;
-                for (band_index = 0;
-                     band_index < input->num_toa_bands;
+                for (band_index = 0; band_index < MAX_BAND_COUNT;
                      band_index++)
                 {
-                    if (input->buf[band_index][col] ==
-                        input->meta.satu_value_ref[band_index])
+                    int satu_value_ref;
+                    int satu_value_max;
+
+                    if (band_index >= input->num_toa_bands
+                        && (band_index != BI_THERMAL || !use_thermal))
                     {
-                        input->buf[band_index][col] =
-                            input->meta.satu_value_max[band_index];
+                        continue;
                     }
-                }
 
-                if (use_thermal)
-                {
-                    if (input->buf[BI_THERMAL][col] ==
-                        input->meta.satu_value_ref[BI_THERMAL])
+                    satu_value_ref = input->meta.satu_value_ref[band_index];
+                    satu_value_max = input->meta.satu_value_max[band_index];
+                    for (col = 0; col < ncols; col++)
                     {
-                        input->buf[BI_THERMAL][col] =
-                            input->meta.satu_value_max[BI_THERMAL];
+                        if (line[band_index][col] == satu_value_ref)
+                            line[band_index][col] = satu_value_max;
                     }
                 }
             }
 
-            /* process non-fill pixels only */
-            if (is_fill_data(input, col, use_cirrus, use_thermal))
-            {
-                pixel_mask[pixel_index] = CF_FILL_BIT;
-                clear_mask[pixel_index] = CF_CLEAR_FILL_BIT;
-                continue;
-            }
-            image_data_counter++;
+            /* Fill, cloud, snow and water tests for the whole line */
+            spectral_test_row(input, line, ncols, use_cirrus, use_thermal,
+                              test_bits);
 
-            if ((input->buf[BI_RED][col] + input->buf[BI_NIR][col]) != 0)
+            for (col = 0; col < ncols; col++)
             {
-                ndvi = (float)(input->buf[BI_NIR][col]
-                               - input->buf[BI_RED][col])
-                       / (float)(input->buf[BI_NIR][col]
-                                 + input->buf[BI_RED][col]);
-            }
-            else
-                ndvi = 0.01;
+                int pixel_index = row * ncols + col;
 
-            if ((input->buf[BI_GREEN][col] + input->buf[BI_SWIR_1][col]) != 0)
-            {
-                ndsi = (float)(input->buf[BI_GREEN][col]
-                               - input->buf[BI_SWIR_1][col])
-                       / (float)(input->buf[BI_GREEN][col]
-                                 + input->buf[BI_SWIR_1][col]);
-            }
-            else
-                ndsi = 0.01;
-
-            /* Basic cloud test, equation 1 */
-            if (basic_cloud_test(input, col, ndvi, ndsi, use_thermal))
-            {
-                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-
-            /* It takes every snow pixel including snow pixels under thin
-               or icy clouds, equation 20 */
-            if (basic_snow_test(input, col, ndsi, use_thermal))
-            {
-                pixel_mask[pixel_index] |= CF_SNOW_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_SNOW_BIT;
+                /* process non-fill pixels only */
+                if (test_bits[col] & CF_FILL_BIT)
+                {
+                    pixel_mask[pixel_index] = CF_FILL_BIT;
+                    clear_mask[pixel_index] = CF_CLEAR_FILL_BIT;
+                    continue;
+                }
+                image_data_counter++;
 
-            /* Zhe's water test (works over thin cloud), equation 5 */
-            if (zhe_water_test(input, col, ndvi))
-            {
-                pixel_mask[pixel_index] |= CF_WATER_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_WATER_BIT;
+                pixel_mask[pixel_index] &=
+                    ~(CF_CLOUD_BIT | CF_SNOW_BIT | CF_WATER_BIT);
+                pixel_mask[pixel_index] |= test_bits[col];
 
-            /* visible bands flatness (sum(abs)/mean < 0.6 => bright and dark
-               cloud), equation 2 */
-            if (pixel_mask[pixel_index] & CF_CLOUD_BIT)
-            {
-                visi_mean = (float)(input->buf[BI_BLUE][col]
-                                    + input->buf[BI_GREEN][col]
-                                    + input->buf[BI_RED][col]) / 3.0;
-                if (visi_mean != 0)
+                /* Build counters for clear, clear land, and clear water */
+                if (pixel_mask[pixel_index] & CF_CLOUD_BIT)
                 {
-                    whiteness =
-                        ((fabs ((float)input->buf[BI_BLUE][col] - visi_mean)
-                          + fabs ((float)input->buf[BI_GREEN][col] - visi_mean)
-                          + fabs ((float)input->buf[BI_RED][col]
-                                  - visi_mean))) / visi_mean;
+                    /* It is cloud so make sure none of the bits are set */
+                    clear_mask[pixel_index] = CF_CLEAR_NONE;
                 }
                 else
                 {
-                    /* Just put a large value to remove them from cloud pixel
-                       identification */
-                    whiteness = 100.0;
-                }
-            }
-
-            satu_bv = 0;
-            if (input->satellite != IS_LANDSAT_8)
-            {
-                /* Landsat 8 doesn't have saturation issues */
-                /* Update cloud_mask,  if one visible band is saturated,
-                   whiteness = 0, due to data type conversion, pixel value
-                   difference of 1 is possible */
-                if ((input->buf[BI_BLUE][col]
-                     >= (input->meta.satu_value_max[BI_BLUE] - 1))
-                    ||
-                    (input->buf[BI_GREEN][col]
-                     >= (input->meta.satu_value_max[BI_GREEN] - 1))
-                    ||
-                    (input->buf[BI_RED][col]
-                     >= (input->meta.satu_value_max[BI_RED] - 1)))
-                {
-                    whiteness = 0.0;
-                    satu_bv = 1;
-                }
-            }
-
-            if ((pixel_mask[pixel_index] & CF_CLOUD_BIT) &&
-                whiteness < 0.7)
-            {
-                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-
-            /* Haze test, equation 3 */
-            hot = (float)input->buf[BI_BLUE][col]
-                  - 0.5 * (float)input->buf[BI_RED][col]
-                  - 800.0;
-            if ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                && (hot > 0.0 || satu_bv == 1))
-                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
+                    clear_mask[pixel_index] = CF_CLEAR_BIT;
+                    clear_pixel_counter++;
 
-            /* Ratio 4/5 > 0.75 test, equation 4 */
-            if ((pixel_mask[pixel_index] & CF_CLOUD_BIT) &&
-                input->buf[BI_SWIR_1][col] != 0)
-            {
-                if ((float)input->buf[BI_NIR][col] /
-                    (float)input->buf[BI_SWIR_1][col] > 0.75)
-                    pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-                else
-                    pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
+                    if (pixel_mask[pixel_index] & CF_WATER_BIT)
+                    {
+                        /* Add the clear water bit */
+                        clear_mask[pixel_index] |= CF_CLEAR_WATER_BIT;
+                        clear_water_pixel_counter++;
+                        clear_temp = &thread_water_temp;
+                    }
+                    else
+                    {
+                        /* Add the clear land bit */
+                        clear_mask[pixel_index] |= CF_CLEAR_LAND_BIT;
+                        clear_land_pixel_counter++;
+                        clear_temp = &thread_land_temp;
+                    }
 
-            /* Cirrus cloud test */
-            if (use_cirrus)
-            {
-                if ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                    ||
-                    (float)(input->buf[BI_CIRRUS][col] / 400.0 - 0.25)
-                    > 0.0)
-                {
-                    pixel_mask[pixel_index] |= CF_CLOUD_BIT;
+                    /* Gather the clear land and water temperatures for the
+                       background temperature percentiles */
+                    if (use_thermal
+                        && add_to_histogram(clear_temp,
+                                            line[BI_THERMAL][col])
+                           != SUCCESS)
+                    {
+                        failed = true;
+                    }
                 }
-                else
-                    pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
             }
+        }
 
-            /* Build counters for clear, clear land, and clear water */
-            if (pixel_mask[pixel_index] & CF_CLOUD_BIT)
-            {
-                /* It is cloud so make sure none of the bits are set */
-                clear_mask[pixel_index] = CF_CLEAR_NONE;
-            }
-            else
+        /* Combine the thread's clear temperatures */
+#ifdef _OPENMP
+        #pragma omp critical (first_pass_merge)
+#endif
+        {
+            if (merge_histogram(&land_temp_hist, &thread_land_temp) != SUCCESS
+                || merge_histogram(&water_temp_hist, &thread_water_temp)
+                   != SUCCESS)
             {
-                clear_mask[pixel_index] = CF_CLEAR_BIT;
-                clear_pixel_counter++;
-
-                if (pixel_mask[pixel_index] & CF_WATER_BIT)
-                {
-                    /* Add the clear water bit */
-                    clear_mask[pixel_index] |= CF_CLEAR_WATER_BIT;
-                    clear_water_pixel_counter++;
-                }
-                else
-                {
-                    /* Add the clear land bit */
-                    clear_mask[pixel_index] |= CF_CLEAR_LAND_BIT;
-                    clear_land_pixel_counter++;
-                }
+                failed = true;
             }
         }
+
+        free_histogram(&thread_land_temp);
+        free_histogram(&thread_water_temp);
+        free_line_buffers(line_buf);
+        free(test_bits);
     }
     printf("\n");
+    profile_end(stage);
+
+    if (failed)
+    {
+        RETURN_ERROR("Processing the first pass", FUNC_NAME, FAILURE);
+    }
 
     *clear_ptm = 100.0 * ((float)clear_pixel_counter
                           / (float)image_data_counter);
@@ -506,6 +937,10 @@ int potential_cloud_shadow_snow_mask
 
     if (*clear_ptm <= 0.1)
     {
+        /* Release the temperature histograms, they aren't needed */
+        free_histogram(&land_temp_hist);
+        free_histogram(&water_temp_hist);
+
         if (use_thermal)
         {
             /* No thermal test is needed, all clouds */
@@ -528,197 +963,305 @@ int potential_cloud_shadow_snow_mask
                 pixel_mask[pixel_index] |= CF_SHADOW_BIT;
             }
         }
+
+        if (potential != NULL)
+        {
+            memcpy(potential->pixel_mask, pixel_mask,
+                   pixel_count * sizeof(unsigned char));
+            potential->all_cloud = true;
+        }
     }
     else
     {
+        /* Determine which bits to test for land and water */
+        select_clear_bits(land_ptm, water_ptm, &land_bit, &water_bit);
+
+        /* Tempearture for snow test */
+        l_pt = 0.175;
+        h_pt = 1.0 - l_pt;
+
         if (use_thermal)
         {
-            f_temp = calloc(pixel_count, sizeof(int16));
-            f_wtemp = calloc(pixel_count, sizeof(int16));
-            if (f_temp == NULL || f_wtemp == NULL)
+            if (background_temperatures(&land_temp_hist, &water_temp_hist,
+                                        land_bit, water_bit, l_pt, h_pt,
+                                        t_templ, t_temph, &t_wtemp)
+                != SUCCESS)
             {
-                RETURN_ERROR("Allocating temp memory", FUNC_NAME, FAILURE);
+                RETURN_ERROR("Calculating the background temperatures",
+                             FUNC_NAME, FAILURE);
             }
-        }
 
-        if (verbose)
-        {
-            printf("The second pass\n");
+            /* Temperature test */
+            t_buffer = 4 * 100;
+            *t_templ -= (float)t_buffer;
+            *t_temph += (float)t_buffer;
+            temp_diff = *t_temph - *t_templ;
         }
+        free_histogram(&land_temp_hist);
+        free_histogram(&water_temp_hist);
 
-        /* Determine which bit to test for land */
-        if (land_ptm >= 0.1)
-        {
-            /* use clear land only */
-            land_bit = CF_CLEAR_LAND_BIT;
-        }
-        else
+        /* Probabilities are mostly in the 0 to 100 range but are extended
+           as needed */
+        if (init_histogram(&land_prob_hist, 0, 255) != SUCCESS
+            || init_histogram(&water_prob_hist, 0, 255) != SUCCESS)
         {
-            /* not enough clear land so use all clear pixels */
-            land_bit = CF_CLEAR_BIT;
+            RETURN_ERROR("Allocating prob histogram memory",
+                         FUNC_NAME, FAILURE);
         }
 
-        /* Determine which bit to test for water */
-        if (water_ptm >= 0.1)
-        {
-            /* use clear water only */
-            water_bit = CF_CLEAR_WATER_BIT;
-        }
-        else
+        if (verbose)
         {
-            /* not enough clear water so use all clear pixels */
-            water_bit = CF_CLEAR_BIT;
+            printf("The second pass\n");
         }
+        stage = profile_begin("second pass");
 
-        int16 f_temp_max = SHRT_MIN;
-        int16 f_temp_min = SHRT_MAX;
-        int16 f_wtemp_max = SHRT_MIN;
-        int16 f_wtemp_min = SHRT_MAX;
-        int land_count = 0;
-        int water_count = 0;
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
+        /* Gather the cloud probabilities of the clear pixels, which
+           determine the dynamic thresholds */
+        failed = false;
+#ifdef _OPENMP
+        #pragma omp parallel
+#endif
         {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
+            int16 *line[MAX_BAND_COUNT];     /* band data for the line */
+            int16 *line_buf[MAX_BAND_COUNT]; /* thread private line buffers */
+            Histogram_t thread_land_prob;    /* clear land probabilities */
+            Histogram_t thread_water_prob;   /* clear water probabilities */
+            int row;
+            int col;
+
+            if (!allocate_line_buffers(ncols, line_buf))
+                failed = true;
+            init_histogram(&thread_land_prob, 0, -1);
+            init_histogram(&thread_water_prob, 0, -1);
 
-            if (use_thermal)
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 16)
+#endif
+            for (row = 0; row < nrows; row++)
             {
-                /* For the thermal band, read the input thermal band  */
-                if (!GetInputThermLine(input, row))
+                if (failed)
+                    continue;
+
+                if (verbose)
                 {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                    /* Print status on every 1000 lines */
+                    if (!(row % 1000))
+                    {
+                        printf("Processing line %d\r", row);
+                        fflush(stdout);
+                    }
                 }
-            }
 
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
+                if (!read_input_lines(input, row, use_thermal, line_buf,
+                                      line))
+                {
+                    failed = true;
                     continue;
+                }
 
-                if (use_thermal && input->satellite != IS_LANDSAT_8)
+                /* Loop through each sample in the image */
+                for (col = 0; col < ncols; col++)
                 {
-                    /* Landsat 8 doesn't have saturation issues */
-                    if (input->buf[BI_THERMAL][col] ==
-                        input->meta.satu_value_ref[BI_THERMAL])
+                    int pixel_index = row * ncols + col;
+                    bool is_water;
+                    float probability;
+
+                    /* Only the clear pixels contribute to the thresholds */
+                    if (!(clear_mask[pixel_index] & CF_CLEAR_BIT))
+                        continue;
+
+                    fix_saturated_line_values(input, line, col, use_thermal);
+
+                    is_water = (pixel_mask[pixel_index] & CF_WATER_BIT) != 0;
+                    probability = cloud_probability(input, line, col,
+                                                    is_water, *t_temph,
+                                                    temp_diff, t_wtemp,
+                                                    use_cirrus, use_thermal);
+
+                    /* Clear pixels of the other type have a probability of
+                       zero */
+                    if ((clear_mask[pixel_index] & land_bit)
+                        && add_float_to_histogram(&thread_land_prob,
+                                                  is_water ? 0.0
+                                                           : probability)
+                           != SUCCESS)
                     {
-                        input->buf[BI_THERMAL][col] =
-                            input->meta.satu_value_max[BI_THERMAL];
+                        failed = true;
                     }
-                }
 
-                /* get clear land temperature */
-                if (clear_mask[pixel_index] & land_bit)
-                {
-                    if (use_thermal)
+                    if ((clear_mask[pixel_index] & water_bit)
+                        && add_float_to_histogram(&thread_water_prob,
+                                                  is_water ? probability
+                                                           : 0.0)
+                           != SUCCESS)
                     {
-                        f_temp[land_count] = input->buf[BI_THERMAL][col];
-                        if (f_temp_max < f_temp[land_count])
-                            f_temp_max = f_temp[land_count];
-                        if (f_temp_min > f_temp[land_count])
-                            f_temp_min = f_temp[land_count];
+                        failed = true;
                     }
-                    land_count++;
                 }
+            }
 
-                /* get clear water temperature */
-                if (clear_mask[pixel_index] & water_bit)
+            /* Combine the thread's clear probabilities */
+#ifdef _OPENMP
+            #pragma omp critical (second_pass_merge)
+#endif
+            {
+                if (merge_histogram(&land_prob_hist, &thread_land_prob)
+                    != SUCCESS
+                    || merge_histogram(&water_prob_hist, &thread_water_prob)
+                       != SUCCESS)
                 {
-                    if (use_thermal)
-                    {
-                        f_wtemp[water_count] = input->buf[BI_THERMAL][col];
-                        if (f_wtemp_max < f_wtemp[water_count])
-                            f_wtemp_max = f_wtemp[water_count];
-                        if (f_wtemp_min > f_wtemp[water_count])
-                            f_wtemp_min = f_wtemp[water_count];
-                    }
-                    water_count++;
+                    failed = true;
                 }
             }
+
+            free_histogram(&thread_land_prob);
+            free_histogram(&thread_water_prob);
+            free_line_buffers(line_buf);
         }
         printf("\n");
+        profile_end(stage);
 
-        if (use_thermal)
+        if (failed)
         {
-            /* Set maximum and minimum values to zero if no clear land/water
-               pixels */
-            if (f_temp_min == SHRT_MAX)
-                f_temp_min = 0;
-            if (f_temp_max == SHRT_MIN)
-                f_temp_max = 0;
-            if (f_wtemp_min == SHRT_MAX)
-                f_wtemp_min = 0;
-            if (f_wtemp_max == SHRT_MIN)
-                f_wtemp_max = 0;
+            RETURN_ERROR("Gathering the cloud probabilities", FUNC_NAME,
+                         FAILURE);
         }
 
-        /* Tempearture for snow test */
-        l_pt = 0.175;
-        h_pt = 1.0 - l_pt;
+        /* Dynamic threshold for land */
+        status = histogram_percentile(&land_prob_hist, 100.0 * h_pt,
+                                      &clr_mask);
+        if (status != SUCCESS)
+        {
+            RETURN_ERROR("Error calling histogram_percentile routine",
+                         FUNC_NAME, FAILURE);
+        }
+
+        /* Dynamic threshold for water */
+        status = histogram_percentile(&water_prob_hist, 100.0 * h_pt,
+                                      &wclr_mask);
+        if (status != SUCCESS)
+        {
+            RETURN_ERROR("Error calling histogram_percentile routine",
+                         FUNC_NAME, FAILURE);
+        }
+
+        if (potential != NULL)
+        {
+            potential->land_threshold = clr_mask;
+            potential->water_threshold = wclr_mask;
+        }
+        clr_mask += cloud_prob_threshold;
+        wclr_mask += cloud_prob_threshold;
+
+        /* Release the probability histograms */
+        free_histogram(&land_prob_hist);
+        free_histogram(&water_prob_hist);
+
+        if (verbose)
+        {
+            printf("probability threshold (land) = %.2f\n", clr_mask);
+            printf("probability threshold (water) = %.2f\n", wclr_mask);
+
+            printf("The third pass\n");
+        }
+        stage = profile_begin("third pass");
 
         if (use_thermal)
+            thresholds.cold_temp = *t_templ + t_buffer - 3500;
+        else
+            thresholds.cold_temp = 0.0;
+        thresholds.t_temph = *t_temph;
+        thresholds.temp_diff = temp_diff;
+        thresholds.t_wtemp = t_wtemp;
+        thresholds.clr_mask = clr_mask;
+        thresholds.wclr_mask = wclr_mask;
+        thresholds.use_cirrus = use_cirrus;
+        thresholds.use_thermal = use_thermal;
+
+        /* Assign the confidence of each pixel */
+        failed = false;
+#ifdef _OPENMP
+        #pragma omp parallel
+#endif
         {
-            /* 0.175 percentile background temperature (low) */
-            status = prctile(f_temp, land_count, f_temp_min, f_temp_max,
-                             100.0 * l_pt, t_templ);
-            if (status != SUCCESS)
-            {
-                RETURN_ERROR("Error calling prctile routine",
-                             FUNC_NAME, FAILURE);
-            }
+            int16 *line[MAX_BAND_COUNT];     /* band data for the line */
+            int16 *line_buf[MAX_BAND_COUNT]; /* thread private line buffers */
+            int row;
+            int col;
 
-            /* 0.825 percentile background temperature (high) */
-            status = prctile(f_temp, land_count, f_temp_min, f_temp_max,
-                             100.0 * h_pt, t_temph);
-            if (status != SUCCESS)
-            {
-                RETURN_ERROR("Error calling prctile routine",
-                             FUNC_NAME, FAILURE);
-            }
+            if (!allocate_line_buffers(ncols, line_buf))
+                failed = true;
 
-            status = prctile(f_wtemp, water_count, f_wtemp_min, f_wtemp_max,
-                             100.0 * h_pt, &t_wtemp);
-            if (status != SUCCESS)
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 16)
+#endif
+            for (row = 0; row < nrows; row++)
             {
-                RETURN_ERROR("Error calling prctile routine",
-                             FUNC_NAME, FAILURE);
+                if (failed)
+                    continue;
+
+                if (verbose)
+                {
+                    /* Print status on every 1000 lines */
+                    if (!(row % 1000))
+                    {
+                        printf("Processing line %d\r", row);
+                        fflush(stdout);
+                    }
+                }
+
+                if (!read_input_lines(input, row, use_thermal, line_buf,
+                                      line))
+                {
+                    failed = true;
+                    continue;
+                }
+
+                for (col = 0; col < ncols; col++)
+                {
+                    int pixel_index = row * ncols + col;
+                    float score;
+
+                    if (pixel_mask[pixel_index] & CF_FILL_BIT)
+                        continue;
+
+                    fix_saturated_line_values(input, line, col, use_thermal);
+
+                    score = cloud_score(input, line, col, &thresholds,
+                                        pixel_mask[pixel_index]);
+                    set_cloud_confidence(score, thresholds.clr_mask,
+                                         thresholds.wclr_mask,
+                                         &pixel_mask[pixel_index],
+                                         &conf_mask[pixel_index]);
+                    if (potential != NULL)
+                        potential->cloud_score[pixel_index] = score;
+                }
             }
 
-            /* Temperature test */
-            t_buffer = 4 * 100;
-            *t_templ -= (float)t_buffer;
-            *t_temph += (float)t_buffer;
-            temp_diff = *t_temph - *t_templ;
+            free_line_buffers(line_buf);
+        }
+        printf("\n");
+        profile_end(stage);
 
-            /* Release f_temp memory */
-            free(f_wtemp);
-            f_wtemp = NULL;
-            free(f_temp);
-            f_temp = NULL;
+        if (failed)
+        {
+            RETURN_ERROR("Assigning the cloud confidence", FUNC_NAME,
+                         FAILURE);
         }
 
-        wfinal_prob = calloc(pixel_count, sizeof(float));
-        final_prob = calloc(pixel_count, sizeof(float));
-        if (wfinal_prob == NULL || final_prob == NULL)
+        /* Band NIR & SWIR1 flood fill section */
+        if (init_histogram(&nir_hist, 0, 10000) != SUCCESS
+            || init_histogram(&swir1_hist, 0, 10000) != SUCCESS)
         {
-            RETURN_ERROR("Allocating prob memory", FUNC_NAME, FAILURE);
+            RETURN_ERROR("Allocating nir and swir1 histogram memory",
+                         FUNC_NAME, FAILURE);
         }
 
         if (verbose)
         {
-            printf("The third pass\n");
+            printf("The fourth pass\n");
         }
+        stage = profile_begin("fourth pass");
 
         /* Loop through each line in the image */
         for (row = 0; row < nrows; row++)
@@ -733,695 +1276,713 @@ int potential_cloud_shadow_snow_mask
                 }
             }
 
-            /* For each of the image bands */
-            for (band_index = 0;
-                 band_index < input->num_toa_bands;
-                 band_index++)
-            {
-                /* Read each input reflective band -- data is read into
-                   input->buf[band_index] */
-                if (!GetInputLine(input, band_index, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input image data for line %d, band %d",
-                             row, band_index);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-            }
-
-            if (use_thermal)
+            /* Read the NIR and SWIR1 bands -- data is read into
+               input->buf[band_index] */
+            if (!GetInputLine(input, BI_NIR, row)
+                || !GetInputLine(input, BI_SWIR_1, row))
             {
-                /* For the thermal band, data is read into input->therm_buf */
-                if (!GetInputThermLine(input, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
+                snprintf(errstr, sizeof(errstr),
+                         "Reading input image data for line %d", row);
+                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
             }
 
-            /* Loop through each sample in the image */
             for (col = 0; col < ncols; col++)
             {
                 pixel_index = row * ncols + col;
 
-                if (pixel_mask[pixel_index] & CF_FILL_BIT)
+                if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
                     continue;
 
                 if (input->satellite != IS_LANDSAT_8)
                 {
                     /* Landsat 8 doesn't have saturation issues */
-                    for (band_index = 0;
-                         band_index < NON_CIRRUS_BAND_COUNT;
-                         band_index++)
+                    if (input->buf[BI_NIR][col]
+                        == input->meta.satu_value_ref[BI_NIR])
                     {
-                        if (input->buf[band_index][col] ==
-                            input->meta.satu_value_ref[band_index])
-                        {
-                            input->buf[band_index][col] =
-                                input->meta.satu_value_max[band_index];
-                        }
+                        input->buf[BI_NIR][col] =
+                            input->meta.satu_value_max[BI_NIR];
                     }
-
-                    if (use_thermal)
+                    if (input->buf[BI_SWIR_1][col]
+                        == input->meta.satu_value_ref[BI_SWIR_1])
                     {
-                        if (input->buf[BI_THERMAL][col] ==
-                            input->meta.satu_value_ref[BI_THERMAL])
-                        {
-                            input->buf[BI_THERMAL][col] =
-                                input->meta.satu_value_max[BI_THERMAL];
-                        }
+                        input->buf[BI_SWIR_1][col] =
+                            input->meta.satu_value_max[BI_SWIR_1];
                     }
                 }
 
-                if (pixel_mask[pixel_index] & CF_WATER_BIT)
+                if (clear_mask[pixel_index] & land_bit)
                 {
-                    /* Brightness test (over water) */
-                    t_bright = 1100;
-                    brightness_prob = (float)input->buf[BI_SWIR_1][col] /
-                        (float)t_bright;
-                    if (brightness_prob > 1.0)
-                        brightness_prob = 1.0;
-                    if (brightness_prob < 0.0)
-                        brightness_prob = 0.0;
-
-                    if (use_thermal)
+                    if (add_to_histogram(&nir_hist, input->buf[BI_NIR][col])
+                        != SUCCESS
+                        || add_to_histogram(&swir1_hist,
+                                            input->buf[BI_SWIR_1][col])
+                           != SUCCESS)
                     {
-                        /* water temperature probability value */
-                        float wtemp_prob;
+                        RETURN_ERROR("Adding to the nir and swir1"
+                                     " histograms", FUNC_NAME, FAILURE);
+                    }
+                }
+            }
+        }
+        printf("\n");
+        profile_end(stage);
 
-                        /* Get cloud prob over water */
-                        /* Temperature test over water */
-                        wtemp_prob =
-                            (t_wtemp - (float)input->buf[BI_THERMAL][col])
-                            / 400.0;
+        /* Estimating background (land) Band NIR Ref */
+        status = histogram_percentile(&nir_hist, 100.0 * l_pt,
+                                      &nir_boundary);
+        if (status != SUCCESS)
+        {
+            RETURN_ERROR("Calling histogram_percentile function",
+                         FUNC_NAME, FAILURE);
+        }
+        status = histogram_percentile(&swir1_hist, 100.0 * l_pt,
+                                      &swir1_boundary);
+        if (status != SUCCESS)
+        {
+            RETURN_ERROR("Calling histogram_percentile function",
+                         FUNC_NAME, FAILURE);
+        }
 
-                        if (wtemp_prob < 0.0)
-                            wtemp_prob = 0.0;
+        /* Release the memory */
+        free_histogram(&nir_hist);
+        free_histogram(&swir1_hist);
 
-                        brightness_prob *= wtemp_prob;
-                    }
+        /* Fill the NIR band and then the SWIR1 band through the same pair
+           of buffers.  Only the result of the shadow test is kept between
+           them, in the shadow bit.  Both are written for every pixel before
+           they are read. */
+        data_size = input->size.l * input->size.s;
+        band_data = get_scratch_buffer(pool, SCRATCH_BAND,
+                                       data_size * sizeof(int16), false);
+        filled_data = get_scratch_buffer(pool, SCRATCH_FILLED,
+                                         data_size * sizeof(int16), false);
+        if (band_data == NULL || filled_data == NULL)
+        {
+            RETURN_ERROR("Allocating nir and swir1 memory",
+                         FUNC_NAME, FAILURE);
+        }
 
-                    /*Final prob mask (water), cloud over water probability */
-                    if (use_cirrus)
-                    {
-                        wfinal_prob[pixel_index] = 100.0
-                            * (brightness_prob
-                               + (float)input->buf[BI_CIRRUS][col] / 400.0);
-                    }
-                    else
-                    {
-                        wfinal_prob[pixel_index] = 100.0 * brightness_prob;
-                    }
+        /* Call the fill minima routine to do image fill.  Each call splits
+           the image into strips shared by the threads. */
+        {
+            int fill_stage = profile_begin("fill_local_minima_in_image NIR");
 
-                    final_prob[pixel_index] = 0.0;
-                }
-                else
-                {
-                    if ((input->buf[BI_RED][col]
-                         + input->buf[BI_NIR][col]) != 0)
-                    {
-                        ndvi = (float)(input->buf[BI_NIR][col]
-                                       - input->buf[BI_RED][col])
-                               / (float)(input->buf[BI_NIR][col]
-                                         + input->buf[BI_RED][col]);
-                    }
-                    else
-                        ndvi = 0.01;
+            if (!read_fill_band(input, BI_NIR, clear_mask, band_data))
+            {
+                RETURN_ERROR("Reading the NIR band", FUNC_NAME, FAILURE);
+            }
 
-                    if ((input->buf[BI_GREEN][col]
-                         + input->buf[BI_SWIR_1][col]) != 0)
-                    {
-                        ndsi = (float)(input->buf[BI_GREEN][col]
-                                       - input->buf[BI_SWIR_1][col])
-                               / (float)(input->buf[BI_GREEN][col]
-                                         + input->buf[BI_SWIR_1][col]);
-                    }
-                    else
-                        ndsi = 0.01;
-
-                    /* NDVI and NDSI should not be negative */
-                    if (ndsi < 0.0)
-                        ndsi = 0.0;
-                    if (ndvi < 0.0)
-                        ndvi = 0.0;
-
-                    visi_mean = (input->buf[BI_BLUE][col]
-                                 + input->buf[BI_GREEN][col]
-                                 + input->buf[BI_RED][col]) / 3.0;
-                    if (visi_mean != 0)
-                    {
-                        whiteness =
-                            ((fabs((float)input->buf[BI_BLUE][col]
-                                   - visi_mean)
-                              + fabs((float)input->buf[BI_GREEN][col]
-                                     - visi_mean)
-                              + fabs((float)input->buf[BI_RED][col]
-                                     - visi_mean))) / visi_mean;
-                    }
-                    else
-                        whiteness = 0.0;
-
-                    if (input->satellite != IS_LANDSAT_8)
-                    {
-                        /* Landsat 8 doesn't have saturation issues */
-                        /* If one visible band is saturated, whiteness = 0 */
-                        if ((input->buf[BI_BLUE][col]
-                             >= (input->meta.satu_value_max[BI_BLUE] - 1))
-                            ||
-                            (input->buf[BI_GREEN][col]
-                             >= (input->meta.satu_value_max[BI_GREEN] - 1))
-                            ||
-                            (input->buf[BI_RED][col]
-                             >= (input->meta.satu_value_max[BI_RED] - 1)))
-                        {
-                            whiteness = 0.0;
-                        }
-                    }
+            if (fill_local_minima_in_image("NIR Band", band_data,
+                                           input->size.l, input->size.s,
+                                           nir_boundary, filled_data)
+                != SUCCESS)
+            {
+                RETURN_ERROR("Running fill_local_minima_in_image on NIR band",
+                             FUNC_NAME, FAILURE);
+            }
 
-                    /* Vari_prob=1-max(max(abs(NDSI),abs(NDVI)),whiteness); */
-                    if (ndsi > ndvi)
-                        max_value = ndsi;
-                    else
-                        max_value = ndvi;
-                    if (whiteness > max_value)
-                        max_value = whiteness;
-                    vari_prob = 1.0 - max_value;
+            apply_filled_shadow_test(band_data, filled_data, pixel_count,
+                                     true, pixel_mask);
+            profile_end(fill_stage);
+        }
 
-                    if (use_thermal)
-                    {
-                        /* temperature probability */
-                        float temp_prob;
+        {
+            int fill_stage = profile_begin("fill_local_minima_in_image SWIR1");
 
-                        temp_prob =
-                            (*t_temph - (float)input->buf[BI_THERMAL][col])
-                            / temp_diff;
+            if (!read_fill_band(input, BI_SWIR_1, clear_mask, band_data))
+            {
+                RETURN_ERROR("Reading the SWIR1 band", FUNC_NAME, FAILURE);
+            }
 
-                        /* Temperature can have prob > 1 */
-                        if (temp_prob < 0.0)
-                            temp_prob = 0.0;
+            if (fill_local_minima_in_image("SWIR1 Band", band_data,
+                                           input->size.l, input->size.s,
+                                           swir1_boundary, filled_data)
+                != SUCCESS)
+            {
+                RETURN_ERROR("Running fill_local_minima_in_image on SWIR1"
+                             " band", FUNC_NAME, FAILURE);
+            }
 
-                        vari_prob *= temp_prob;
-                    }
+            apply_filled_shadow_test(band_data, filled_data, pixel_count,
+                                     false, pixel_mask);
+            profile_end(fill_stage);
+        }
 
-                    /*Final prob mask (land) */
-                    if (use_cirrus)
-                    {
-                        final_prob[pixel_index] = 100.0 *
-                            (vari_prob + ((float)input->buf[BI_CIRRUS][col]
-                                          / 400.0));
-                    }
-                    else
-                    {
-                        final_prob[pixel_index] = 100.0 * vari_prob;
-                    }
+        /* The buffers stay in the scratch pool for the later stages */
+        band_data = NULL;
+        filled_data = NULL;
 
-                    wfinal_prob[pixel_index] = 0.0;
-                }
-            }
+        /* The pixel mask is kept before the water is refined, the cloud
+           bits are assigned again from the cloud scores */
+        if (potential != NULL)
+        {
+            memcpy(potential->pixel_mask, pixel_mask,
+                   pixel_count * sizeof(unsigned char));
+            potential->all_cloud = false;
         }
-        printf("\n");
 
-        /* Allocate memory for prob */
-        prob = malloc(pixel_count * sizeof(float));
-        if (prob == NULL)
+        if (verbose)
         {
-            RETURN_ERROR("Allocating prob memory", FUNC_NAME, FAILURE);
+            printf("The fifth pass\n");
         }
+        stage = profile_begin("fifth pass");
 
-        float prob_max = 0.0;
-        float prob_min = 0.0;
-        land_count = 0;
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
         for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
         {
-            if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
+            if (pixel_mask[pixel_index] & CF_FILL_BIT)
+            {
+                conf_mask[pixel_index] = CF_FILL_PIXEL;
                 continue;
+            }
 
-            if (clear_mask[pixel_index] & land_bit)
+            /* refine Water mask (no confusion water/cloud) */
+            if ((pixel_mask[pixel_index] & CF_WATER_BIT) &&
+                (pixel_mask[pixel_index] & CF_CLOUD_BIT))
             {
-                prob[land_count] = final_prob[pixel_index];
+                pixel_mask[pixel_index] &= ~CF_WATER_BIT;
+            }
+        }
+        profile_end(stage);
+    }
 
-                if (prob[land_count] > prob_max)
-                    prob_max = prob[land_count];
+    clear_mask = NULL;
 
-                if (prob_min > prob[land_count])
-                    prob_min = prob[land_count];
+    if (potential != NULL)
+    {
+        potential->clear_ptm = *clear_ptm;
+        potential->t_templ = *t_templ;
+        potential->t_temph = *t_temph;
+    }
 
-                land_count++;
-            }
-        }
+    return SUCCESS;
+}
 
-        /* Dynamic threshold for land */
-        status = prctile2(prob, land_count, prob_min, prob_max,
-                          100.0 * h_pt, &clr_mask);
-        if (status != SUCCESS)
-        {
-            RETURN_ERROR("Error calling prctile2 routine", FUNC_NAME, FAILURE);
-        }
-        clr_mask += cloud_prob_threshold;
 
-        /* Release memory for prob */
-        free(prob);
-        prob = NULL;
+/*****************************************************************************
+MODULE:  restore_potential_mask
 
-        /* Allocate memory for wprob */
-        wprob = malloc(pixel_count * sizeof(float));
-        if (wprob == NULL)
-        {
-            RETURN_ERROR("Allocating wprob memory", FUNC_NAME, FAILURE);
-        }
+PURPOSE: Build the potential mask and the cloud confidence again from the
+         intermediates kept by the stage cache, for a cloud probability
+         threshold which may differ from the one they were kept with
 
-        float wprob_max = 0.0;
-        float wprob_min = 0.0;
-        water_count = 0;
-        for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
-        {
-            if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
-                continue;
+NOTES:
+1. This gives the same masks potential_cloud_shadow_snow_mask does for the
+   threshold, without reading the bands.  Only the cloud confidence and the
+   cloud bits it keeps depend on the threshold, and the cloud scores they
+   are assigned from don't.
+*****************************************************************************/
+void restore_potential_mask
+(
+    const Potential_stage_t *potential, /* I: kept intermediates */
+    float cloud_prob_threshold, /* I: cloud probability threshold */
+    int pixel_count,            /* I: number of pixels in the image */
+    float *clear_ptm,           /* O: percent of clear-sky pixels */
+    float *t_templ,             /* O: percentile of low background temp */
+    float *t_temph,             /* O: percentile of high background temp */
+    unsigned char *pixel_mask,  /* O: pixel mask */
+    unsigned char *conf_mask,   /* O: confidence mask */
+    bool verbose                /* I: value to indicate if intermediate
+                                      messages should be printed */
+)
+{
+    float clr_mask = potential->land_threshold + cloud_prob_threshold;
+    float wclr_mask = potential->water_threshold + cloud_prob_threshold;
+    int pixel_index;
 
-            if (clear_mask[pixel_index] & water_bit)
-            {
-                wprob[water_count] = wfinal_prob[pixel_index];
+    *clear_ptm = potential->clear_ptm;
+    *t_templ = potential->t_templ;
+    *t_temph = potential->t_temph;
 
-                if (wprob[water_count] > wprob_max)
-                    wprob_max = wprob[water_count];
+    if (verbose && !potential->all_cloud)
+    {
+        printf("probability threshold (land) = %.2f\n", clr_mask);
+        printf("probability threshold (water) = %.2f\n", wclr_mask);
+    }
 
-                if (wprob_min > wprob[water_count])
-                    wprob_min = wprob[water_count];
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+    {
+        unsigned char pixel_bits = potential->pixel_mask[pixel_index];
 
-                water_count++;
-            }
+        if (potential->all_cloud)
+        {
+            /* The mask is final, the clouds are a high confidence */
+            if (pixel_bits & CF_CLOUD_BIT)
+                conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
+            else
+                conf_mask[pixel_index] = CLOUD_CONFIDENCE_LOW;
         }
-
-        /* Dynamic threshold for water */
-        status = prctile2(wprob, water_count, wprob_min, wprob_max,
-                          100.0 * h_pt, &wclr_mask);
-        if (status != SUCCESS)
+        else if (pixel_bits & CF_FILL_BIT)
         {
-            RETURN_ERROR("Error calling prctile2 routine", FUNC_NAME, FAILURE);
+            conf_mask[pixel_index] = CF_FILL_PIXEL;
         }
-        wclr_mask += cloud_prob_threshold;
-
-        /* Release memory for wprob */
-        free(wprob);
-        wprob = NULL;
-
-        if (verbose)
+        else
         {
-            printf("probability threshold (land) = %.2f\n", clr_mask);
-            printf("probability threshold (water) = %.2f\n", wclr_mask);
+            set_cloud_confidence(potential->cloud_score[pixel_index],
+                                 clr_mask, wclr_mask, &pixel_bits,
+                                 &conf_mask[pixel_index]);
 
-            printf("The fourth pass\n");
+            /* refine Water mask (no confusion water/cloud) */
+            if ((pixel_bits & CF_WATER_BIT) && (pixel_bits & CF_CLOUD_BIT))
+                pixel_bits &= ~CF_WATER_BIT;
         }
 
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
+        pixel_mask[pixel_index] = pixel_bits;
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  gather_samples
+
+PURPOSE: Read the sampled lines and keep the band values of every stride
+         sample, then run the spectral tests on the samples of each line
+
+RETURN: true when all of the sampled lines were read
+*****************************************************************************/
+static bool gather_samples
+(
+    Input_t * input,            /* I: input structure */
+    int stride,                 /* I: lines and samples between the samples */
+    int grid_rows,              /* I: number of sampled lines */
+    int grid_cols,              /* I: number of samples of each line */
+    bool use_cirrus,            /* I: use the Cirrus data */
+    bool use_thermal,           /* I: use the Thermal data */
+    int16 **samples,            /* O: band values of the samples, indexed by
+                                      band, NULL for the bands not read */
+    unsigned char *sample_mask  /* O: spectral test bits of the samples */
+)
+{
+    int ncols = input->size.s;  /* number of columns */
+    bool failed = false;        /* an error occurred in a parallel section */
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        int16 *line[MAX_BAND_COUNT];        /* band data for the line */
+        int16 *line_buf[MAX_BAND_COUNT];    /* thread private line buffers */
+        int16 *sample_line[MAX_BAND_COUNT]; /* samples of the line */
+        int grid_row;
+        int grid_col;
+        int band_index;
+
+        if (!allocate_line_buffers(ncols, line_buf))
+            failed = true;
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 4)
+#endif
+        for (grid_row = 0; grid_row < grid_rows; grid_row++)
         {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
+            if (failed)
+                continue;
 
-            if (use_thermal)
+            if (!read_input_lines(input, grid_row * stride, use_thermal,
+                                  line_buf, line))
             {
-                /* For the thermal band, data is read into input->therm_buf */
-                if (!GetInputThermLine(input, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
+                failed = true;
+                continue;
             }
 
-            for (col = 0; col < ncols; col++)
+            for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
             {
-                pixel_index = row * ncols + col;
+                int16 satu_value_ref = input->meta.satu_value_ref[band_index];
+                int16 satu_value_max = input->meta.satu_value_max[band_index];
 
-                if (pixel_mask[pixel_index] & CF_FILL_BIT)
+                sample_line[band_index] = NULL;
+                if (samples[band_index] == NULL)
                     continue;
 
-                if (use_thermal)
+                sample_line[band_index] =
+                    &samples[band_index][grid_row * grid_cols];
+                for (grid_col = 0; grid_col < grid_cols; grid_col++)
                 {
-                    if (input->satellite != IS_LANDSAT_8)
-                    {
-                        /* Landsat 8 doesn't have saturation issues */
-                        if (input->buf[BI_THERMAL][col] ==
-                            input->meta.satu_value_ref[BI_THERMAL])
-                        {
-                            input->buf[BI_THERMAL][col] =
-                                input->meta.satu_value_max[BI_THERMAL];
-                        }
-                    }
+                    int16 value = line[band_index][grid_col * stride];
 
-                    if (input->buf[BI_THERMAL][col]
-                        < *t_templ + t_buffer - 3500)
+                    /* Landsat 8 doesn't have saturation issues */
+                    if (input->satellite != IS_LANDSAT_8
+                        && value == satu_value_ref)
                     {
-                        /* This test indicates a high confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
-
-                        /* Original code was only this if test and setting the
-                           cloud bit or not */
-                        pixel_mask[pixel_index] |= CF_CLOUD_BIT;
+                        value = satu_value_max;
                     }
+                    sample_line[band_index][grid_col] = value;
                 }
+            }
 
-                if (conf_mask[pixel_index] == CLOUD_CONFIDENCE_NONE)
-                {
-                    if (((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                         &&
-                         (final_prob[pixel_index] > clr_mask)
-                         &&
-                         (!(pixel_mask[pixel_index] & CF_WATER_BIT)))
-                        ||
-                        ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                         &&
-                         (wfinal_prob[pixel_index] > wclr_mask)
-                         &&
-                         (pixel_mask[pixel_index] & CF_WATER_BIT)))
-                    {
-                        /* This test indicates a high confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
+            /* Fill, cloud, snow and water tests for the samples */
+            spectral_test_row(input, sample_line, grid_cols, use_cirrus,
+                              use_thermal,
+                              &sample_mask[grid_row * grid_cols]);
+        }
 
-                        /* Original code was only this if test and setting the
-                           cloud bit or not */
-                        pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-                    }
-                    else if (((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                              &&
-                              (final_prob[pixel_index] > clr_mask-10.0)
-                              &&
-                              (!(pixel_mask[pixel_index] & CF_WATER_BIT)))
-                             ||
-                             ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                              &&
-                              (wfinal_prob[pixel_index] > wclr_mask-10.0)
-                              &&
-                              (pixel_mask[pixel_index] & CF_WATER_BIT)))
-                    {
-                        /* This test indicates a medium confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_MED;
+        free_line_buffers(line_buf);
+    }
 
-                        /* Don't set the cloud bit per the original code */
-                        pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-                    }
-                    else
-                    {
-                        /* All remaining are a low confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_LOW;
+    return !failed;
+}
 
-                        /* Don't set the cloud bit per the original code */
-                        pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-                    }
-                }
-            }
-        }
-        printf("\n");
 
-        /* Free the memory */
-        free(wfinal_prob);
-        wfinal_prob = NULL;
-        free(final_prob);
-        final_prob = NULL;
+/*****************************************************************************
+MODULE:  classify_samples
 
-        /* Band NIR & SWIR1 flood fill section */
-        data_size = input->size.l * input->size.s;
-        nir = calloc(data_size, sizeof(int16));
-        swir1 = calloc(data_size, sizeof(int16));
-        if (nir == NULL || swir1 == NULL)
-        {
-            RETURN_ERROR("Allocating nir and swir1 memory",
-                         FUNC_NAME, FAILURE);
-        }
+PURPOSE: Apply the clear sky statistics and the dynamic cloud probability
+         thresholds of the clear samples to the spectral test bits of the
+         samples
 
-        if (verbose)
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int classify_samples
+(
+    Input_t * input,            /* I: input structure */
+    float cloud_prob_threshold, /* I: cloud probability threshold */
+    int16 **samples,            /* I: band values of the samples, indexed by
+                                      band */
+    int sample_count,           /* I: number of samples */
+    unsigned char *clear_mask,  /* O: clear bits of the samples */
+    unsigned char *conf_mask,   /* I/O: cloud confidence of the samples, no
+                                        confidence as input */
+    unsigned char *sample_mask, /* I/O: spectral test bits as input, cloud,
+                                        shadow, snow and water bits as
+                                        output */
+    int *data_count,            /* O: number of non-fill samples */
+    float *clear_ptm,           /* O: percent of clear-sky samples */
+    bool use_cirrus,            /* I: use the Cirrus data */
+    bool use_thermal,           /* I: use the Thermal data */
+    bool verbose                /* I: print intermediate messages */
+)
+{
+    char *FUNC_NAME = "classify_samples";
+    int clear_pixel_counter = 0;       /* clear sky sample counter */
+    int clear_land_pixel_counter = 0;  /* clear land sample counter */
+    int clear_water_pixel_counter = 0; /* clear water sample counter */
+    Histogram_t land_temp_hist;  /* clear land temperatures */
+    Histogram_t water_temp_hist; /* clear water temperatures */
+    Histogram_t land_prob_hist;  /* clear land cloud probabilities */
+    Histogram_t water_prob_hist; /* clear water cloud probabilities */
+    Cloud_thresholds_t thresholds; /* cloud confidence thresholds */
+    float land_ptm = 0.0;       /* clear land sample percentage */
+    float water_ptm = 0.0;      /* clear water sample percentage */
+    unsigned char land_bit;     /* Which clear bit to test all or just land */
+    unsigned char water_bit;    /* Which clear bit to test all or just water */
+    float l_pt = 0.175;         /* low percentile threshold */
+    float h_pt = 1.0 - l_pt;    /* high percentile threshold */
+    float t_templ = 0.0;        /* percentile of low background temp */
+    float t_temph = 0.0;        /* percentile of high background temp */
+    float t_wtemp = 0.0;        /* high percentile water temperature */
+    int t_buffer = 4 * 100;     /* temperature test buffer */
+    int sample_index;
+
+    /* Temperatures are degrees Celsius * 100 */
+    if (init_histogram(&land_temp_hist, -10000, 10000) != SUCCESS
+        || init_histogram(&water_temp_hist, -10000, 10000) != SUCCESS)
+    {
+        RETURN_ERROR("Allocating temp histogram memory", FUNC_NAME, FAILURE);
+    }
+
+    /* Build counters for clear, clear land, and clear water */
+    *data_count = 0;
+    for (sample_index = 0; sample_index < sample_count; sample_index++)
+    {
+        Histogram_t *clear_temp; /* histogram for a clear sample */
+
+        if (sample_mask[sample_index] & CF_FILL_BIT)
         {
-            printf("The fifth pass\n");
+            sample_mask[sample_index] = CF_FILL_BIT;
+            clear_mask[sample_index] = CF_CLEAR_FILL_BIT;
+            continue;
         }
+        (*data_count)++;
 
-        nir_data = calloc(data_size, sizeof(int16));
-        swir1_data = calloc(data_size, sizeof(int16));
-        filled_nir_data = calloc(data_size, sizeof(int16));
-        filled_swir1_data = calloc(data_size, sizeof(int16));
-        if (nir_data == NULL || swir1_data == NULL ||
-            filled_nir_data == NULL || filled_swir1_data == NULL)
+        if (sample_mask[sample_index] & CF_CLOUD_BIT)
         {
-            RETURN_ERROR("Allocating nir and swir1 memory",
-                         FUNC_NAME, FAILURE);
+            clear_mask[sample_index] = CF_CLEAR_NONE;
+            continue;
         }
 
-        int16 nir_max = 0;
-        int16 nir_min = 0;
-        int16 swir1_max = 0;
-        int16 swir1_min = 0;
-        int nir_count = 0;
-        int swir1_count = 0;
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
+        clear_mask[sample_index] = CF_CLEAR_BIT;
+        clear_pixel_counter++;
+        if (sample_mask[sample_index] & CF_WATER_BIT)
         {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
-
-            /* For each of the image bands */
-            for (band_index = 0;
-                 band_index < input->num_toa_bands;
-                 band_index++)
-            {
-                /* Read each input reflective band -- data is read into
-                   input->buf[band_index] */
-                if (!GetInputLine(input, band_index, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input image data for line %d, band %d",
-                             row, band_index);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-            }
-
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
-                    continue;
-
-                if (input->satellite != IS_LANDSAT_8)
-                {
-                    /* Landsat 8 doesn't have saturation issues */
-                    if (input->buf[BI_NIR][col]
-                        == input->meta.satu_value_ref[BI_NIR])
-                    {
-                        input->buf[BI_NIR][col] =
-                            input->meta.satu_value_max[BI_NIR];
-                    }
-                    if (input->buf[BI_SWIR_1][col]
-                        == input->meta.satu_value_ref[BI_SWIR_1])
-                    {
-                        input->buf[BI_SWIR_1][col] =
-                            input->meta.satu_value_max[BI_SWIR_1];
-                    }
-                }
-
-                if (clear_mask[pixel_index] & land_bit)
-                {
-                    nir[nir_count] = input->buf[BI_NIR][col];
-                    if (nir[nir_count] > nir_max)
-                        nir_max = nir[nir_count];
-                    if (nir[nir_count] < nir_min)
-                        nir_min = nir[nir_count];
-                    nir_count++;
-
-                    swir1[swir1_count] = input->buf[BI_SWIR_1][col];
-                    if (swir1[swir1_count] > swir1_max)
-                        swir1_max = swir1[swir1_count];
-                    if (swir1[swir1_count] < swir1_min)
-                        swir1_min = swir1[swir1_count];
-                    swir1_count++;
-                }
-            }
-
-            /* NIR */
-            memcpy(&nir_data[row * input->size.s], &input->buf[BI_NIR][0],
-                   input->size.s * sizeof(int16));
-            /* SWIR1 */
-            memcpy(&swir1_data[row * input->size.s],
-                   &input->buf[BI_SWIR_1][0], input->size.s * sizeof(int16));
+            clear_mask[sample_index] |= CF_CLEAR_WATER_BIT;
+            clear_water_pixel_counter++;
+            clear_temp = &water_temp_hist;
         }
-        printf("\n");
-
-        /* Estimating background (land) Band NIR Ref */
-        status = prctile(nir, nir_count, nir_min, nir_max,
-                         100.0 * l_pt, &nir_boundary);
-        if (status != SUCCESS)
+        else
         {
-            RETURN_ERROR("Calling prctile function", FUNC_NAME, FAILURE);
+            clear_mask[sample_index] |= CF_CLEAR_LAND_BIT;
+            clear_land_pixel_counter++;
+            clear_temp = &land_temp_hist;
         }
-        status = prctile(swir1, swir1_count, swir1_min, swir1_max,
-                         100.0 * l_pt, &swir1_boundary);
-        if (status != SUCCESS)
+
+        if (use_thermal
+            && add_to_histogram(clear_temp,
+                                samples[BI_THERMAL][sample_index])
+               != SUCCESS)
         {
-            RETURN_ERROR("Calling prctile function", FUNC_NAME, FAILURE);
+            RETURN_ERROR("Adding to the temperature histograms", FUNC_NAME,
+                         FAILURE);
         }
+    }
 
-        /* Release the memory */
-        free(nir);
-        free(swir1);
-        nir = NULL;
-        swir1 = NULL;
+    *clear_ptm = 0.0;
+    if (*data_count > 0)
+    {
+        *clear_ptm = 100.0 * ((float)clear_pixel_counter
+                              / (float)*data_count);
+        land_ptm = 100.0 * ((float)clear_land_pixel_counter
+                            / (float)*data_count);
+        water_ptm = 100.0 * ((float)clear_water_pixel_counter
+                             / (float)*data_count);
+    }
 
-        /* Call the fill minima routine to do image fill */
-/* Perform them in parallel if threading is enabled */
-#ifdef _OPENMP
-#pragma omp parallel sections
-#endif
-{
+    if (verbose)
     {
-        if (fill_local_minima_in_image("NIR Band", nir_data,
-                                       input->size.l, input->size.s,
-                                       nir_boundary, filled_nir_data)
-            != SUCCESS)
+        printf("(clear_samples, data_samples) = (%d, %d)\n",
+               clear_pixel_counter, *data_count);
+        printf("(clear_ptm, land_ptm, water_ptm) = (%f, %f, %f)\n",
+               *clear_ptm, land_ptm, water_ptm);
+    }
+
+    if (*clear_ptm <= 0.1)
+    {
+        free_histogram(&land_temp_hist);
+        free_histogram(&water_temp_hist);
+
+        /* All cloud and cloud shadow */
+        for (sample_index = 0; sample_index < sample_count; sample_index++)
         {
-            printf("Error Running fill_local_minima_in_image on NIR band");
-            status = ERROR;
+            if (!(sample_mask[sample_index] & (CF_FILL_BIT | CF_CLOUD_BIT)))
+                sample_mask[sample_index] |= CF_SHADOW_BIT;
         }
+
+        return SUCCESS;
     }
 
-#ifdef _OPENMP
-    #pragma omp section
-#endif
+    select_clear_bits(land_ptm, water_ptm, &land_bit, &water_bit);
+
+    if (use_thermal)
     {
-        if (fill_local_minima_in_image("SWIR1 Band", swir1_data,
-                                       input->size.l, input->size.s,
-                                       swir1_boundary, filled_swir1_data)
+        if (background_temperatures(&land_temp_hist, &water_temp_hist,
+                                    land_bit, water_bit, l_pt, h_pt,
+                                    &t_templ, &t_temph, &t_wtemp)
             != SUCCESS)
         {
-            printf("Error Running fill_local_minima_in_image on SWIR1 band");
-            status = ERROR;
+            RETURN_ERROR("Calculating the background temperatures",
+                         FUNC_NAME, FAILURE);
         }
-    }
-}
 
-        /* Release the memory */
-        free(nir_data);
-        free(swir1_data);
-        nir_data = NULL;
-        swir1_data = NULL;
+        /* Temperature test */
+        t_templ -= (float)t_buffer;
+        t_temph += (float)t_buffer;
+        thresholds.cold_temp = t_templ + t_buffer - 3500;
+    }
+    else
+        thresholds.cold_temp = 0.0;
+    free_histogram(&land_temp_hist);
+    free_histogram(&water_temp_hist);
+
+    thresholds.t_temph = t_temph;
+    thresholds.temp_diff = t_temph - t_templ;
+    thresholds.t_wtemp = t_wtemp;
+    thresholds.use_cirrus = use_cirrus;
+    thresholds.use_thermal = use_thermal;
+
+    /* Gather the cloud probabilities of the clear samples, which determine
+       the dynamic thresholds */
+    if (init_histogram(&land_prob_hist, 0, 255) != SUCCESS
+        || init_histogram(&water_prob_hist, 0, 255) != SUCCESS)
+    {
+        RETURN_ERROR("Allocating prob histogram memory", FUNC_NAME, FAILURE);
+    }
 
-        if (status == ERROR)
+    for (sample_index = 0; sample_index < sample_count; sample_index++)
+    {
+        bool is_water;
+        float probability;
+
+        if (!(clear_mask[sample_index] & CF_CLEAR_BIT))
+            continue;
+
+        /* The samples of each band are used as one line */
+        is_water = (sample_mask[sample_index] & CF_WATER_BIT) != 0;
+        probability = cloud_probability(input, samples, sample_index,
+                                        is_water, thresholds.t_temph,
+                                        thresholds.temp_diff, t_wtemp,
+                                        use_cirrus, use_thermal);
+
+        /* Clear samples of the other type have a probability of zero */
+        if ((clear_mask[sample_index] & land_bit)
+            && add_float_to_histogram(&land_prob_hist,
+                                      is_water ? 0.0 : probability)
+               != SUCCESS)
         {
-            free(filled_nir_data);
-            free(filled_swir1_data);
-            RETURN_ERROR("Running fill_local_minima_in_image",
+            RETURN_ERROR("Adding to the probability histograms",
                          FUNC_NAME, FAILURE);
         }
 
-        if (verbose)
+        if ((clear_mask[sample_index] & water_bit)
+            && add_float_to_histogram(&water_prob_hist,
+                                      is_water ? probability : 0.0)
+               != SUCCESS)
         {
-            printf("The sixth pass\n");
+            RETURN_ERROR("Adding to the probability histograms",
+                         FUNC_NAME, FAILURE);
         }
+    }
 
-        int16 new_nir;
-        int16 new_swir1;
-        for (row = 0; row < nrows; row++)
-        {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
+    /* Dynamic thresholds for land and water */
+    if (histogram_percentile(&land_prob_hist, 100.0 * h_pt,
+                             &thresholds.clr_mask) != SUCCESS
+        || histogram_percentile(&water_prob_hist, 100.0 * h_pt,
+                                &thresholds.wclr_mask) != SUCCESS)
+    {
+        RETURN_ERROR("Error calling histogram_percentile routine",
+                     FUNC_NAME, FAILURE);
+    }
+    thresholds.clr_mask += cloud_prob_threshold;
+    thresholds.wclr_mask += cloud_prob_threshold;
 
-            /* For each of the image bands */
-            for (band_index = 0;
-                 band_index < input->num_toa_bands;
-                 band_index++)
-            {
-                /* Read each input reflective band -- data is read into
-                   input->buf[band_index] */
-                if (!GetInputLine(input, band_index, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input image data for line %d, band %d",
-                             row, band_index);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-            }
+    /* Release the probability histograms */
+    free_histogram(&land_prob_hist);
+    free_histogram(&water_prob_hist);
 
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
+    if (verbose)
+    {
+        printf("probability threshold (land) = %.2f\n", thresholds.clr_mask);
+        printf("probability threshold (water) = %.2f\n",
+               thresholds.wclr_mask);
+    }
 
-                if (input->satellite != IS_LANDSAT_8)
-                {
-                    /* Landsat 8 doesn't have saturation issues */
-                    if (input->buf[BI_NIR][col]
-                        == input->meta.satu_value_ref[BI_NIR])
-                    {
-                        input->buf[BI_NIR][col] =
-                            input->meta.satu_value_max[BI_NIR];
-                    }
-                    if (input->buf[BI_SWIR_1][col]
-                        == input->meta.satu_value_ref[BI_SWIR_1])
-                    {
-                        input->buf[BI_SWIR_1][col] =
-                            input->meta.satu_value_max[BI_SWIR_1];
-                    }
-                }
+    /* Assign the confidence of each sample, only the high confidence
+       clouds keep the cloud bit */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (sample_index = 0; sample_index < sample_count; sample_index++)
+    {
+        if (sample_mask[sample_index] & CF_FILL_BIT)
+            continue;
+
+        set_cloud_confidence(cloud_score(input, samples, sample_index,
+                                         &thresholds,
+                                         sample_mask[sample_index]),
+                             thresholds.clr_mask, thresholds.wclr_mask,
+                             &sample_mask[sample_index],
+                             &conf_mask[sample_index]);
+    }
 
-                if (pixel_mask[pixel_index] & CF_FILL_BIT)
-                {
-                    conf_mask[pixel_index] = CF_FILL_PIXEL;
-                    continue;
-                }
+    return SUCCESS;
+}
 
-                new_nir = filled_nir_data[pixel_index] -
-                          input->buf[BI_NIR][col];
-                new_swir1 = filled_swir1_data[pixel_index] -
-                            input->buf[BI_SWIR_1][col];
 
-                if (new_nir < new_swir1)
-                    shadow_prob = new_nir;
-                else
-                    shadow_prob = new_swir1;
+/*****************************************************************************
+MODULE:  estimate_potential_cloud_mask
 
-                if (shadow_prob > 200)
-                    pixel_mask[pixel_index] |= CF_SHADOW_BIT;
-                else
-                    pixel_mask[pixel_index] &= ~CF_SHADOW_BIT;
+PURPOSE: Identify the cloud, snow and water pixels of a grid of samples of
+         the image, every stride line and sample, for a fast estimate of the
+         cloud cover
 
-                /* refine Water mask (no confusion water/cloud) */
-                if ((pixel_mask[pixel_index] & CF_WATER_BIT) &&
-                    (pixel_mask[pixel_index] & CF_CLOUD_BIT))
-                {
-                    pixel_mask[pixel_index] &= ~CF_WATER_BIT;
-                }
-            }
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The samples go through the spectral tests of the first pass and the
+   dynamic cloud probability thresholds of the second and third passes,
+   with the thresholds taken from the clear samples only.  The shadows need
+   the minima fill of the whole image, so the potential shadows aren't
+   identified, except for a scene without clear pixels where every pixel
+   is cloud or shadow as in potential_cloud_shadow_snow_mask.
+2. The sample mask has SAMPLE_GRID_SIZE(lines, stride) rows of
+   SAMPLE_GRID_SIZE(samples, stride) samples.  The band values of the
+   samples are kept in memory, so only the sampled lines are read and they
+   are read once.
+*****************************************************************************/
+int estimate_potential_cloud_mask
+(
+    Input_t * input,            /* I: input structure */
+    float cloud_prob_threshold, /* I: cloud probability threshold */
+    int stride,                 /* I: lines and samples between the samples
+                                      of the grid */
+    unsigned char *sample_mask, /* O: cloud, shadow, snow and water bits of
+                                      the samples */
+    int *data_count,            /* O: number of non-fill samples */
+    float *clear_ptm,           /* O: percent of clear-sky samples */
+    bool use_cirrus,            /* I: value to inidicate if Cirrus data should
+                                      be used */
+    bool use_thermal,           /* I: value to indicate if Thermal data should
+                                      be used */
+    bool verbose                /* I: value to indicate if intermediate
+                                      messages should be printed */
+)
+{
+    char *FUNC_NAME = "estimate_potential_cloud_mask";
+    int grid_rows = SAMPLE_GRID_SIZE(input->size.l, stride);
+    int grid_cols = SAMPLE_GRID_SIZE(input->size.s, stride);
+    int sample_count = grid_rows * grid_cols;
+    int16 *samples[MAX_BAND_COUNT];  /* band values of the samples */
+    unsigned char *clear_mask = NULL; /* clear bits of the samples */
+    unsigned char *conf_mask = NULL;  /* cloud confidence of the samples */
+    bool allocated = true;
+    int band_index;
+    int status = FAILURE;
+
+    /* Only the bands which are read are kept */
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        samples[band_index] = NULL;
+        if (band_index >= input->num_toa_bands
+            && (band_index != BI_THERMAL || !use_thermal))
+        {
+            continue;
         }
-        printf("\n");
 
-        /* Release the memory */
-        free(filled_nir_data);
-        filled_nir_data = NULL;
-        free(filled_swir1_data);
-        filled_swir1_data = NULL;
+        samples[band_index] = malloc(sample_count * sizeof(int16));
+        if (samples[band_index] == NULL)
+            allocated = false;
+    }
+    clear_mask = malloc(sample_count * sizeof(unsigned char));
+    conf_mask = calloc(sample_count, sizeof(unsigned char));
+
+    if (verbose)
+    {
+        printf("Sampling %d x %d of %d x %d pixels\n", grid_rows, grid_cols,
+               input->size.l, input->size.s);
+    }
+
+    if (!allocated || clear_mask == NULL || conf_mask == NULL)
+    {
+        ERROR_MESSAGE("Allocating the sample memory", FUNC_NAME);
+    }
+    else if (!gather_samples(input, stride, grid_rows, grid_cols,
+                             use_cirrus, use_thermal, samples, sample_mask))
+    {
+        ERROR_MESSAGE("Reading the sampled lines", FUNC_NAME);
+    }
+    else
+    {
+        status = classify_samples(input, cloud_prob_threshold, samples,
+                                  sample_count, clear_mask, conf_mask,
+                                  sample_mask, data_count, clear_ptm,
+                                  use_cirrus, use_thermal, verbose);
     }
 
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+        free(samples[band_index]);
     free(clear_mask);
-    clear_mask = NULL;
+    free(conf_mask);
+
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Estimating the potential cloud mask", FUNC_NAME,
+                     FAILURE);
+    }
 
     return SUCCESS;
 }
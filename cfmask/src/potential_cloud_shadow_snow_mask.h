@@ -2,6 +2,11 @@
 #define POTENTIAL_CLOUD_SHADOW_SNOW_MASK_H
 
 
+/* Number of samples along a side of the image of the given size, when
+   every stride pixel is sampled */
+#define SAMPLE_GRID_SIZE(size, stride) (((size) + (stride) - 1) / (stride))
+
+
 int potential_cloud_shadow_snow_mask
 (
     Input_t *input,             /* I: input structure */
@@ -11,6 +16,43 @@ int potential_cloud_shadow_snow_mask
     float *t_temph,             /* O: percentile of high background temp */
     unsigned char *pixel_mask,  /* I/O: pixel mask */
     unsigned char *conf_mask,   /* I/O: confidence mask */
+    Scratch_pool_t *pool,       /* I/O: scene sized scratch buffers */
+    Potential_stage_t *potential, /* O: intermediates kept by the stage
+                                       cache, NULL to keep none */
+    bool use_cirrus,            /* I: value to inidicate if Cirrus data should
+                                      be used */
+    bool use_thermal,           /* I: value to indicate if Thermal data should
+                                      be used */
+    bool verbose                /* I: value to indicate if intermediate
+                                      messages should be printed */
+);
+
+
+void restore_potential_mask
+(
+    const Potential_stage_t *potential, /* I: kept intermediates */
+    float cloud_prob_threshold, /* I: cloud probability threshold */
+    int pixel_count,            /* I: number of pixels in the image */
+    float *clear_ptm,           /* O: percent of clear-sky pixels */
+    float *t_templ,             /* O: percentile of low background temp */
+    float *t_temph,             /* O: percentile of high background temp */
+    unsigned char *pixel_mask,  /* O: pixel mask */
+    unsigned char *conf_mask,   /* O: confidence mask */
+    bool verbose                /* I: value to indicate if intermediate
+                                      messages should be printed */
+);
+
+
+int estimate_potential_cloud_mask
+(
+    Input_t *input,             /* I: input structure */
+    float cloud_prob_threshold, /* I: cloud probability threshold */
+    int stride,                 /* I: lines and samples between the samples
+                                      of the grid */
+    unsigned char *sample_mask, /* O: cloud, shadow, snow and water bits of
+                                      the samples */
+    int *data_count,            /* O: number of non-fill samples */
+    float *clear_ptm,           /* O: percent of clear-sky samples */
     bool use_cirrus,            /* I: value to inidicate if Cirrus data should
                                       be used */
     bool use_thermal,           /* I: value to indicate if Thermal data should
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+
+#include "const.h"
+#include "error.h"
+#include "profile.h"
+
+
+/* Measurements of one stage */
+typedef struct
+{
+    const char *name;            /* name of the stage */
+    double start_wall;           /* wall clock seconds at the start */
+    double wall_seconds;         /* elapsed wall clock seconds */
+    double start_cpu;            /* process CPU seconds at the start */
+    double cpu_seconds;          /* CPU seconds used by all of the threads */
+    unsigned long long start_read;    /* bytes read at the start */
+    unsigned long long bytes_read;    /* bytes read during the stage */
+    unsigned long long start_written; /* bytes written at the start */
+    unsigned long long bytes_written; /* bytes written during the stage */
+    long peak_rss_kb;            /* peak resident set size at the end */
+    bool done;                   /* the stage has ended */
+} Profile_stage_t;
+
+
+static bool profile_enabled = false;
+static double profile_start_wall;  /* wall clock seconds when enabled */
+static Profile_stage_t profile_stages[MAX_PROFILE_STAGES];
+static int profile_stage_count = 0;
+static int profile_dropped_count = 0; /* stages past the full table */
+static unsigned long long profile_bytes_read = 0;
+static unsigned long long profile_bytes_written = 0;
+static unsigned long long profile_scratch_bytes = 0; /* scratch pool peak */
+
+/* Guards the stages and the byte counts, which the OpenMP threads and the
+   band writer thread update; a mutex instead of an OpenMP critical so the
+   guard is also compiled without OpenMP */
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*****************************************************************************
+MODULE:  wall_seconds
+
+PURPOSE: Read the monotonic wall clock
+
+RETURN: seconds
+*****************************************************************************/
+static double wall_seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+/*****************************************************************************
+MODULE:  read_usage
+
+PURPOSE: Read the CPU time of the process, which includes all of its threads,
+         and its peak resident set size
+*****************************************************************************/
+static void read_usage
+(
+    double *cpu_seconds, /* O: user and system CPU seconds */
+    long *peak_rss_kb    /* O: peak resident set size in kilobytes */
+)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    *cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6
+                   + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    *peak_rss_kb = usage.ru_maxrss;
+}
+
+
+/*****************************************************************************
+MODULE:  enable_profile
+
+PURPOSE: Start recording the stages, the other profile routines do nothing
+         until this is called
+*****************************************************************************/
+void enable_profile()
+{
+    profile_enabled = true;
+    profile_start_wall = wall_seconds();
+}
+
+
+/*****************************************************************************
+MODULE:  reset_profile
+
+PURPOSE: Forget the recorded stages and the byte counts, so the stages of
+         another run can be recorded from the start
+*****************************************************************************/
+void reset_profile()
+{
+    pthread_mutex_lock(&profile_mutex);
+    profile_stage_count = 0;
+    profile_dropped_count = 0;
+    profile_bytes_read = 0;
+    profile_bytes_written = 0;
+    profile_scratch_bytes = 0;
+    profile_start_wall = wall_seconds();
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+
+/*****************************************************************************
+MODULE:  profile_begin
+
+PURPOSE: Start measuring a stage
+
+RETURN: the stage to pass to profile_end, -1 when not profiling or when the
+        table of stages is full
+
+NOTES:
+1. Stages may nest and may run concurrently, the CPU time and the bytes of a
+   stage include everything the process did while it ran.
+2. The stages past MAX_PROFILE_STAGES are counted and reported as dropped by
+   write_profile_json, reset_profile empties the table.
+*****************************************************************************/
+int profile_begin
+(
+    const char *stage_name /* I: name of the stage, kept by reference */
+)
+{
+    Profile_stage_t *stage;
+    long peak_rss_kb;
+    int stage_index = -1;
+
+    if (!profile_enabled)
+        return -1;
+
+    pthread_mutex_lock(&profile_mutex);
+    if (profile_stage_count < MAX_PROFILE_STAGES)
+    {
+        stage_index = profile_stage_count;
+        profile_stage_count++;
+
+        stage = &profile_stages[stage_index];
+        stage->name = stage_name;
+        stage->start_wall = wall_seconds();
+        read_usage(&stage->start_cpu, &peak_rss_kb);
+        stage->start_read = profile_bytes_read;
+        stage->start_written = profile_bytes_written;
+        stage->done = false;
+    }
+    else
+        profile_dropped_count++;
+    pthread_mutex_unlock(&profile_mutex);
+
+    return stage_index;
+}
+
+
+/*****************************************************************************
+MODULE:  profile_end
+
+PURPOSE: Finish measuring a stage
+*****************************************************************************/
+void profile_end
+(
+    int stage_index /* I: stage returned by profile_begin */
+)
+{
+    Profile_stage_t *stage;
+    double cpu_seconds;
+
+    if (!profile_enabled || stage_index < 0)
+        return;
+
+    pthread_mutex_lock(&profile_mutex);
+    stage = &profile_stages[stage_index];
+    stage->wall_seconds = wall_seconds() - stage->start_wall;
+    read_usage(&cpu_seconds, &stage->peak_rss_kb);
+    stage->cpu_seconds = cpu_seconds - stage->start_cpu;
+    stage->bytes_read = profile_bytes_read - stage->start_read;
+    stage->bytes_written = profile_bytes_written - stage->start_written;
+    stage->done = true;
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+
+/*****************************************************************************
+MODULE:  profile_add_bytes_read
+
+PURPOSE: Count bytes read from the input files, may be called by any thread
+*****************************************************************************/
+void profile_add_bytes_read
+(
+    size_t bytes /* I: number of bytes read from the input files */
+)
+{
+    if (!profile_enabled)
+        return;
+
+    pthread_mutex_lock(&profile_mutex);
+    profile_bytes_read += bytes;
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+
+/*****************************************************************************
+MODULE:  profile_add_bytes_written
+
+PURPOSE: Count bytes written to the output files, may be called by any
+         thread
+*****************************************************************************/
+void profile_add_bytes_written
+(
+    size_t bytes /* I: number of bytes written to the output files */
+)
+{
+    if (!profile_enabled)
+        return;
+
+    pthread_mutex_lock(&profile_mutex);
+    profile_bytes_written += bytes;
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+
+/*****************************************************************************
+MODULE:  profile_scratch_peak
+
+PURPOSE: Record the peak size of the scratch pool, the largest value given
+         is reported
+*****************************************************************************/
+void profile_scratch_peak
+(
+    size_t bytes /* I: bytes held by the scratch pool */
+)
+{
+    if (!profile_enabled)
+        return;
+
+    pthread_mutex_lock(&profile_mutex);
+    if (bytes > profile_scratch_bytes)
+        profile_scratch_bytes = bytes;
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+
+/*****************************************************************************
+MODULE:  write_profile_json
+
+PURPOSE: Write the measurements of the stages which have ended to a JSON
+         report, in the order the stages started
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The report has the number of stages dropped because the table was full,
+   a warning is written when there are any.
+*****************************************************************************/
+int write_profile_json
+(
+    const char *filename /* I: name of the JSON report file */
+)
+{
+    char *FUNC_NAME = "write_profile_json";
+    char errmsg[MAX_STR_LEN];  /* error message */
+    FILE *fd;
+    Profile_stage_t *stage;
+    int stage_index;
+    bool first = true;
+
+    fd = fopen(filename, "w");
+    if (fd == NULL)
+    {
+        snprintf(errmsg, sizeof(errmsg), "Opening the profile report %s",
+                 filename);
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
+    fprintf(fd, "{\n  \"stages\": [");
+    for (stage_index = 0; stage_index < profile_stage_count; stage_index++)
+    {
+        stage = &profile_stages[stage_index];
+        if (!stage->done)
+            continue;
+
+        /* The stage names are literals without characters to escape */
+        fprintf(fd, "%s\n    {\"name\": \"%s\", \"start_seconds\": %.6f,"
+                " \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f,"
+                " \"bytes_read\": %llu, \"bytes_written\": %llu,"
+                " \"peak_rss_kb\": %ld}",
+                first ? "" : ",", stage->name,
+                stage->start_wall - profile_start_wall, stage->wall_seconds,
+                stage->cpu_seconds, stage->bytes_read, stage->bytes_written,
+                stage->peak_rss_kb);
+        first = false;
+    }
+    fprintf(fd, "\n  ],\n  \"dropped_stages\": %d,"
+            "\n  \"scratch_peak_bytes\": %llu\n}\n",
+            profile_dropped_count, profile_scratch_bytes);
+
+    if (fclose(fd) != 0)
+    {
+        snprintf(errmsg, sizeof(errmsg), "Writing the profile report %s",
+                 filename);
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
+    if (profile_dropped_count > 0)
+    {
+        snprintf(errmsg, sizeof(errmsg), "%d stages past the %d of the"
+                 " profile table are missing from %s", profile_dropped_count,
+                 MAX_PROFILE_STAGES, filename);
+        WARNING_MESSAGE(errmsg, FUNC_NAME);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  print_profile
+
+PURPOSE: Print the wall and CPU seconds of the stages which have ended, in
+         the order the stages started
+*****************************************************************************/
+void print_profile
+(
+    FILE *fd /* I: stream to print to */
+)
+{
+    Profile_stage_t *stage;
+    int stage_index;
+
+    fprintf(fd, "    %-40s %12s %12s\n", "stage", "wall_seconds",
+            "cpu_seconds");
+    for (stage_index = 0; stage_index < profile_stage_count; stage_index++)
+    {
+        stage = &profile_stages[stage_index];
+        if (!stage->done)
+            continue;
+
+        fprintf(fd, "    %-40s %12.4f %12.4f\n", stage->name,
+                stage->wall_seconds, stage->cpu_seconds);
+    }
+    fprintf(fd, "    scratch pool peak: %.1f MB\n",
+            profile_scratch_bytes / (1024.0 * 1024.0));
+}
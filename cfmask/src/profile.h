@@ -0,0 +1,61 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+/* Maximum number of stages recorded in a profile */
+#define MAX_PROFILE_STAGES 64
+
+
+void enable_profile();
+
+
+void reset_profile();
+
+
+int profile_begin
+(
+    const char *stage_name /* I: name of the stage, kept by reference */
+);
+
+
+void profile_end
+(
+    int stage /* I: stage returned by profile_begin */
+);
+
+
+void profile_add_bytes_read
+(
+    size_t bytes /* I: number of bytes read from the input files */
+);
+
+
+void profile_add_bytes_written
+(
+    size_t bytes /* I: number of bytes written to the output files */
+);
+
+
+void profile_scratch_peak
+(
+    size_t bytes /* I: bytes held by the scratch pool */
+);
+
+
+int write_profile_json
+(
+    const char *filename /* I: name of the JSON report file */
+);
+
+
+void print_profile
+(
+    FILE *fd /* I: stream to print to */
+);
+
+
+#endif
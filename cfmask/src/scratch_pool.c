@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+
+#include "const.h"
+#include "error.h"
+#include "profile.h"
+#include "threads.h"
+#include "scratch_pool.h"
+
+
+/* Alignment of the slots backed by huge pages */
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+
+/*****************************************************************************
+MODULE:  allocate_slot
+
+PURPOSE: Allocate the memory of a scratch slot
+
+RETURN: the memory, NULL if it can't be allocated
+
+NOTES:
+1. With huge pages the memory is aligned to the huge page size and the
+   kernel is asked to back it with transparent huge pages.  The advice is
+   only a hint, the memory is used the same when it isn't followed.
+*****************************************************************************/
+static void *allocate_slot
+(
+    size_t bytes,    /* I: bytes to allocate */
+    bool huge_pages  /* I: back the memory with huge pages */
+)
+{
+    void *memory = NULL;
+
+    if (!huge_pages)
+        return malloc(bytes);
+
+    bytes = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    if (posix_memalign(&memory, HUGE_PAGE_BYTES, bytes) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+
+    return memory;
+}
+
+
+/*****************************************************************************
+MODULE:  update_peak
+
+PURPOSE: Add up the bytes allocated for the slots of a scratch pool and keep
+         the peak, which is also reported to the profile
+*****************************************************************************/
+static void update_peak
+(
+    Scratch_pool_t *pool /* I/O: scratch pool */
+)
+{
+    size_t total = 0;
+    int slot;
+
+    for (slot = 0; slot < SCRATCH_SLOT_COUNT; slot++)
+        total += pool->size[slot];
+
+    if (total > pool->peak_bytes)
+        pool->peak_bytes = total;
+    profile_scratch_peak(pool->peak_bytes);
+}
+
+
+/*****************************************************************************
+MODULE:  init_scratch_pool
+
+PURPOSE: Initialize a scratch pool without any memory
+*****************************************************************************/
+void init_scratch_pool
+(
+    Scratch_pool_t *pool, /* O: empty scratch pool */
+    bool huge_pages       /* I: back the slots with huge pages */
+)
+{
+    int slot;
+
+    for (slot = 0; slot < SCRATCH_SLOT_COUNT; slot++)
+    {
+        pool->buffer[slot] = NULL;
+        pool->size[slot] = 0;
+    }
+    pool->peak_bytes = 0;
+    pool->huge_pages = huge_pages;
+}
+
+
+/*****************************************************************************
+MODULE:  reserve_scratch_pool
+
+PURPOSE: Size the slots of a scratch pool for a scene, so the stages find
+         their buffers already allocated
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The slots only grow, so a pool kept for the scenes of a batch allocates
+   again only for a larger scene.
+*****************************************************************************/
+int reserve_scratch_pool
+(
+    Scratch_pool_t *pool, /* I/O: scratch pool */
+    int nrows,            /* I: number of lines of the scene */
+    int ncols             /* I: number of samples of the scene */
+)
+{
+    size_t pixel_count = (size_t)nrows * ncols;
+
+    if (get_scratch_buffer(pool, SCRATCH_CLEAR, pixel_count, false) == NULL
+        || get_scratch_buffer(pool, SCRATCH_BAND, 2 * pixel_count, false)
+           == NULL
+        || get_scratch_buffer(pool, SCRATCH_FILLED, 2 * pixel_count, false)
+           == NULL)
+    {
+        RETURN_ERROR("Allocating the scratch pool", "reserve_scratch_pool",
+                     FAILURE);
+    }
+
+    /* Reported again for the profile of each scene */
+    update_peak(pool);
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  get_scratch_buffer
+
+PURPOSE: Get the memory of a slot of the scratch pool for a stage
+
+RETURN: the memory of the slot, NULL if it can't be allocated
+
+NOTES:
+1. The memory stays valid until the slot is asked for more bytes or the
+   pool is released.  Its contents are whatever the previous user of the
+   slot left, unless it is cleared.  New memory is always cleared.
+*****************************************************************************/
+void *get_scratch_buffer
+(
+    Scratch_pool_t *pool, /* I/O: scratch pool */
+    int slot,             /* I: SCRATCH_* slot */
+    size_t bytes,         /* I: bytes needed */
+    bool clear            /* I: zero the bytes */
+)
+{
+    if (bytes > pool->size[slot])
+    {
+        free(pool->buffer[slot]);
+        pool->size[slot] = 0;
+        pool->buffer[slot] = allocate_slot(bytes, pool->huge_pages);
+        if (pool->buffer[slot] == NULL)
+        {
+            ERROR_MESSAGE("Allocating scratch memory", "get_scratch_buffer");
+            return NULL;
+        }
+        pool->size[slot] = bytes;
+        update_peak(pool);
+
+        /* Place the new pages with the threads which use them */
+        first_touch(pool->buffer[slot], bytes, 0);
+    }
+    else if (clear)
+    {
+        first_touch(pool->buffer[slot], bytes, 0);
+    }
+
+    return pool->buffer[slot];
+}
+
+
+/*****************************************************************************
+MODULE:  free_scratch_pool
+
+PURPOSE: Release the memory of a scratch pool
+*****************************************************************************/
+void free_scratch_pool
+(
+    Scratch_pool_t *pool  /* I/O: scratch pool to release */
+)
+{
+    int slot;
+
+    for (slot = 0; slot < SCRATCH_SLOT_COUNT; slot++)
+    {
+        free(pool->buffer[slot]);
+        pool->buffer[slot] = NULL;
+        pool->size[slot] = 0;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef SCRATCH_POOL_H
+#define SCRATCH_POOL_H
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+/* Slots of the scratch pool.  The buffers of a slot belong to stages that
+   are never running at the same time, so they share the same memory:
+       SCRATCH_CLEAR  - potential mask clear bits, then the calibration cloud
+                        bit mask of the shadow match
+       SCRATCH_BAND   - band to be filled, then the calibration shadow bit
+                        mask
+       SCRATCH_FILLED - filled band, then the dilated bit mask */
+#define SCRATCH_CLEAR 0
+#define SCRATCH_BAND 1
+#define SCRATCH_FILLED 2
+#define SCRATCH_SLOT_COUNT 3
+
+/* Bytes of the scratch pool for each pixel of the scene */
+#define SCRATCH_BYTES_PER_PIXEL 5
+
+
+/* Scene sized scratch buffers shared by the processing stages */
+typedef struct
+{
+    void *buffer[SCRATCH_SLOT_COUNT]; /* memory of each slot */
+    size_t size[SCRATCH_SLOT_COUNT];  /* bytes allocated for each slot */
+    size_t peak_bytes;   /* largest total of the slots */
+    bool huge_pages;     /* ask for transparent huge pages */
+} Scratch_pool_t;
+
+
+void init_scratch_pool
+(
+    Scratch_pool_t *pool, /* O: empty scratch pool */
+    bool huge_pages       /* I: back the slots with huge pages */
+);
+
+
+int reserve_scratch_pool
+(
+    Scratch_pool_t *pool, /* I/O: scratch pool */
+    int nrows,            /* I: number of lines of the scene */
+    int ncols             /* I: number of samples of the scene */
+);
+
+
+void *get_scratch_buffer
+(
+    Scratch_pool_t *pool, /* I/O: scratch pool */
+    int slot,             /* I: SCRATCH_* slot */
+    size_t bytes,         /* I: bytes needed */
+    bool clear            /* I: zero the bytes */
+);
+
+
+void free_scratch_pool
+(
+    Scratch_pool_t *pool  /* I/O: scratch pool to release */
+);
+
+
+#endif
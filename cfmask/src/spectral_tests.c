@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+
+#include "espa_geoloc.h"
+
+
+#include "const.h"
+#include "cfmask.h"
+#include "input.h"
+#include "spectral_tests.h"
+
+
+/* Number of columns tested at a time by the vector kernel */
+#define KERNEL_WIDTH 8
+
+/* Vector types for the kernel, the compiler maps these onto the SSE, AVX2
+   or NEON registers of the target */
+typedef int16 v8hi __attribute__ ((vector_size (KERNEL_WIDTH * 2)));
+typedef int v8si __attribute__ ((vector_size (KERNEL_WIDTH * 4)));
+typedef float v8sf __attribute__ ((vector_size (KERNEL_WIDTH * 4)));
+typedef double v8df __attribute__ ((vector_size (KERNEL_WIDTH * 8)));
+
+/* Values used by the vector kernel for one line */
+typedef struct
+{
+    bool use_cirrus;       /* use the cirrus data or not */
+    bool use_thermal;      /* use the thermal data or not */
+    bool test_saturation;  /* test the visible bands for saturation */
+    int satu_blue;         /* saturation limits of the visible bands */
+    int satu_green;
+    int satu_red;
+    float ndvi_lt_0_8;     /* float thresholds matching the comparisons of */
+    float ndsi_lt_0_8;     /* the scalar code against double constants */
+    float ndsi_gt_0_15;
+    float ndvi_lt_0_01;
+    float ndvi_lt_0_1;
+    float whiteness_lt_0_7;
+} Kernel_params_t;
+
+
+bool is_fill_data
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    bool use_cirrus, /* I: use the cirrus data or not */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    if (line[BI_BLUE][column] == FILL_PIXEL
+        || line[BI_GREEN][column] == FILL_PIXEL
+        || line[BI_RED][column] == FILL_PIXEL
+        || line[BI_NIR][column] == FILL_PIXEL
+        || line[BI_SWIR_1][column] == FILL_PIXEL
+        || line[BI_SWIR_2][column] == FILL_PIXEL)
+    {
+        return true;
+    }
+
+    if (use_cirrus)
+    {
+        if (line[BI_CIRRUS][column] == FILL_PIXEL)
+            return true;
+    }
+
+    if (use_thermal)
+    {
+        if (line[BI_THERMAL][column] <= FILL_PIXEL)
+            return true;
+    }
+
+    return false;
+}
+
+
+bool basic_cloud_test
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    float ndvi,      /* I: NDVI value */
+    float ndsi,      /* I: NDSI value */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    bool result = false;
+
+    if (ndsi < 0.8 && ndvi < 0.8 && (line[BI_SWIR_2][column] > 300))
+    {
+        result = true;
+    }
+
+    /* If we are using thermal, then the original test was and'ing the thermal
+       test */
+    if (result && use_thermal)
+    {
+        if (line[BI_THERMAL][column] < 2700)
+        {
+            result = true;
+        }
+        else
+        {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+
+bool basic_snow_test
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    float ndsi,      /* I: NDSI value */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    bool result = false;
+
+    if (ndsi > 0.15
+        && line[BI_NIR][column] > 1100
+        && line[BI_GREEN][column] > 1000)
+    {
+        result = true;
+    }
+
+    /* If we are using thermal, then the original test was and'ing the thermal
+       test */
+    if (result && use_thermal)
+    {
+        if (line[BI_THERMAL][column] < 1000)
+        {
+            result = true;
+        }
+        else
+        {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+
+bool zhe_water_test
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    float ndvi       /* I: NDVI value */
+)
+{
+    if ((ndvi < 0.01 && line[BI_NIR][column] < 1100)
+        || (ndvi < 0.1 && ndvi > 0.0 && line[BI_NIR][column] < 500))
+    {
+        return true;
+    }
+
+    return false;
+}
+
+
+/*****************************************************************************
+MODULE:  spectral_test_row_scalar
+
+PURPOSE: Apply the spectral tests of the first pass to the columns of a line,
+         setting the fill bit alone, or the cloud, snow and water bits, for
+         each column.  This is the reference implementation of the tests.
+
+NOTES:
+1. The saturated values of the line are expected to be replaced already.
+*****************************************************************************/
+void spectral_test_row_scalar
+(
+    Input_t *input,           /* I: input structure */
+    int16 **line,             /* I: band data for the line, indexed by band */
+    int first_col,            /* I: first column to test */
+    int ncols,                /* I: number of columns in the line */
+    bool use_cirrus,          /* I: use the cirrus data or not */
+    bool use_thermal,         /* I: use the thermal data or not */
+    unsigned char *test_bits  /* O: spectral test bits for each column */
+)
+{
+    int col;
+    float ndvi, ndsi;        /* NDVI and NDSI values */
+    float visi_mean;         /* mean of visible bands */
+    float whiteness = 0.0;   /* whiteness value */
+    float hot;               /* hot value for hot test */
+    int satu_bv;             /* sum of saturated bands 1, 2, 3 value */
+    unsigned char bits;
+
+    for (col = first_col; col < ncols; col++)
+    {
+        if (is_fill_data(line, col, use_cirrus, use_thermal))
+        {
+            test_bits[col] = CF_FILL_BIT;
+            continue;
+        }
+        bits = CF_NO_BITS;
+
+        if ((line[BI_RED][col] + line[BI_NIR][col]) != 0)
+        {
+            ndvi = (float)(line[BI_NIR][col] - line[BI_RED][col])
+                   / (float)(line[BI_NIR][col] + line[BI_RED][col]);
+        }
+        else
+            ndvi = 0.01;
+
+        if ((line[BI_GREEN][col] + line[BI_SWIR_1][col]) != 0)
+        {
+            ndsi = (float)(line[BI_GREEN][col] - line[BI_SWIR_1][col])
+                   / (float)(line[BI_GREEN][col] + line[BI_SWIR_1][col]);
+        }
+        else
+            ndsi = 0.01;
+
+        /* Basic cloud test, equation 1 */
+        if (basic_cloud_test(line, col, ndvi, ndsi, use_thermal))
+            bits |= CF_CLOUD_BIT;
+
+        /* It takes every snow pixel including snow pixels under thin or icy
+           clouds, equation 20 */
+        if (basic_snow_test(line, col, ndsi, use_thermal))
+            bits |= CF_SNOW_BIT;
+
+        /* Zhe's water test (works over thin cloud), equation 5 */
+        if (zhe_water_test(line, col, ndvi))
+            bits |= CF_WATER_BIT;
+
+        /* visible bands flatness (sum(abs)/mean < 0.6 => bright and dark
+           cloud), equation 2 */
+        if (bits & CF_CLOUD_BIT)
+        {
+            visi_mean = (float)(line[BI_BLUE][col]
+                                + line[BI_GREEN][col]
+                                + line[BI_RED][col]) / 3.0;
+            if (visi_mean != 0)
+            {
+                whiteness = ((fabs ((float)line[BI_BLUE][col] - visi_mean)
+                              + fabs ((float)line[BI_GREEN][col] - visi_mean)
+                              + fabs ((float)line[BI_RED][col]
+                                      - visi_mean))) / visi_mean;
+            }
+            else
+            {
+                /* Just put a large value to remove them from cloud pixel
+                   identification */
+                whiteness = 100.0;
+            }
+        }
+
+        satu_bv = 0;
+        if (input->satellite != IS_LANDSAT_8)
+        {
+            /* Landsat 8 doesn't have saturation issues */
+            /* Update cloud_mask,  if one visible band is saturated,
+               whiteness = 0, due to data type conversion, pixel value
+               difference of 1 is possible */
+            if ((line[BI_BLUE][col]
+                 >= (input->meta.satu_value_max[BI_BLUE] - 1))
+                ||
+                (line[BI_GREEN][col]
+                 >= (input->meta.satu_value_max[BI_GREEN] - 1))
+                ||
+                (line[BI_RED][col]
+                 >= (input->meta.satu_value_max[BI_RED] - 1)))
+            {
+                whiteness = 0.0;
+                satu_bv = 1;
+            }
+        }
+
+        if (!(whiteness < 0.7))
+            bits &= ~CF_CLOUD_BIT;
+
+        /* Haze test, equation 3 */
+        hot = (float)line[BI_BLUE][col]
+              - 0.5 * (float)line[BI_RED][col]
+              - 800.0;
+        if (!(hot > 0.0 || satu_bv == 1))
+            bits &= ~CF_CLOUD_BIT;
+
+        /* Ratio 4/5 > 0.75 test, equation 4 */
+        if ((bits & CF_CLOUD_BIT) && line[BI_SWIR_1][col] != 0)
+        {
+            if (!((float)line[BI_NIR][col] / (float)line[BI_SWIR_1][col]
+                  > 0.75))
+            {
+                bits &= ~CF_CLOUD_BIT;
+            }
+        }
+        else
+            bits &= ~CF_CLOUD_BIT;
+
+        /* Cirrus cloud test */
+        if (use_cirrus)
+        {
+            if ((float)(line[BI_CIRRUS][col] / 400.0 - 0.25) > 0.0)
+                bits |= CF_CLOUD_BIT;
+        }
+
+        test_bits[col] = bits;
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  float_below
+
+PURPOSE: Find the float threshold t where (x < t) matches (x < value) for
+         every float x, value being a double
+
+RETURN: the threshold
+*****************************************************************************/
+static float float_below
+(
+    double value  /* I: double threshold */
+)
+{
+    float threshold = (float)value;
+
+    if ((double)threshold < value)
+        threshold = nextafterf(threshold, INFINITY);
+
+    return threshold;
+}
+
+
+/*****************************************************************************
+MODULE:  float_above
+
+PURPOSE: Find the float threshold t where (x > t) matches (x > value) for
+         every float x, value being a double
+
+RETURN: the threshold
+*****************************************************************************/
+static float float_above
+(
+    double value  /* I: double threshold */
+)
+{
+    float threshold = (float)value;
+
+    if ((double)threshold > value)
+        threshold = nextafterf(threshold, -INFINITY);
+
+    return threshold;
+}
+
+
+/* Load KERNEL_WIDTH values of a band line as 32 bit integers, using a
+   v8hi temporary */
+#define LOAD_BAND(temp, band_line, col) \
+    (memcpy(&(temp), (band_line) + (col), sizeof(temp)), \
+     __builtin_convertvector((temp), v8si))
+
+/* Choose the float values of a where mask is set and b elsewhere */
+#define SELECT_FLOAT(mask, a, b) \
+    ((v8sf)(((mask) & (v8si)(a)) | (~(mask) & (v8si)(b))))
+
+/* Absolute difference of a band from the visible mean, as a double */
+#define ABS_DEVIATION(band, visi_mean) \
+    __builtin_convertvector( \
+        (v8sf)((v8si)(__builtin_convertvector((band), v8sf) - (visi_mean)) \
+               & 0x7fffffff), v8df)
+
+
+/*****************************************************************************
+MODULE:  spectral_test_block
+
+PURPOSE: Vector version of spectral_test_row_scalar for KERNEL_WIDTH
+         columns.  The arithmetic is done in the same precision as the scalar
+         code, so the results are identical.
+
+NOTES:
+1. The float/double comparisons of the scalar code are done against the
+   matching float thresholds in the kernel parameters.
+2. hot > 0.0 is 2 * blue - red > 1600 and the cirrus test is cirrus > 100,
+   which are exact in integers.
+3. The whiteness is calculated in double, as the scalar code does.
+*****************************************************************************/
+static inline __attribute__ ((always_inline)) void spectral_test_block
+(
+    const Kernel_params_t *params, /* I: kernel parameters for the line */
+    int16 **line,                  /* I: band data for the line */
+    int col,                       /* I: first column of the block */
+    unsigned char *test_bits       /* O: spectral test bits */
+)
+{
+    const v8si zero = {0};
+    const v8sf zero_f = {0};
+    v8hi values;
+    v8si blue = LOAD_BAND(values, line[BI_BLUE], col);
+    v8si green = LOAD_BAND(values, line[BI_GREEN], col);
+    v8si red = LOAD_BAND(values, line[BI_RED], col);
+    v8si nir = LOAD_BAND(values, line[BI_NIR], col);
+    v8si swir1 = LOAD_BAND(values, line[BI_SWIR_1], col);
+    v8si swir2 = LOAD_BAND(values, line[BI_SWIR_2], col);
+    v8si thermal = zero;
+    v8si fill;
+    v8si sum;
+    v8si cloud;
+    v8si snow;
+    v8si water;
+    v8si satu;
+    v8si bits;
+    v8sf ndvi;
+    v8sf ndsi;
+    v8sf visi_mean;
+    v8sf whiteness;
+    v8df deviation;
+    int lane;
+
+    fill = (blue == FILL_PIXEL) | (green == FILL_PIXEL) | (red == FILL_PIXEL)
+           | (nir == FILL_PIXEL) | (swir1 == FILL_PIXEL)
+           | (swir2 == FILL_PIXEL);
+    if (params->use_cirrus)
+        fill |= (LOAD_BAND(values, line[BI_CIRRUS], col) == FILL_PIXEL);
+    if (params->use_thermal)
+    {
+        thermal = LOAD_BAND(values, line[BI_THERMAL], col);
+        fill |= (thermal <= FILL_PIXEL);
+    }
+
+    /* The sums are exact as floats, so this matches the scalar division */
+    sum = nir + red;
+    ndvi = SELECT_FLOAT(sum != 0,
+                        __builtin_convertvector(nir - red, v8sf)
+                        / __builtin_convertvector(sum, v8sf),
+                        zero_f + (float)0.01);
+    sum = green + swir1;
+    ndsi = SELECT_FLOAT(sum != 0,
+                        __builtin_convertvector(green - swir1, v8sf)
+                        / __builtin_convertvector(sum, v8sf),
+                        zero_f + (float)0.01);
+
+    /* Basic cloud test, equation 1 */
+    cloud = (ndsi < params->ndsi_lt_0_8) & (ndvi < params->ndvi_lt_0_8)
+            & (swir2 > 300);
+
+    /* Basic snow test, equation 20 */
+    snow = (ndsi > params->ndsi_gt_0_15) & (nir > 1100) & (green > 1000);
+
+    if (params->use_thermal)
+    {
+        cloud &= (thermal < 2700);
+        snow &= (thermal < 1000);
+    }
+
+    /* Zhe's water test, equation 5 */
+    water = ((ndvi < params->ndvi_lt_0_01) & (nir < 1100))
+            | ((ndvi < params->ndvi_lt_0_1) & (ndvi > zero_f) & (nir < 500));
+
+    /* Visible bands flatness, equation 2; the double rounding of the
+       scalar code's division by 3.0 can't differ from a float division */
+    visi_mean = __builtin_convertvector(blue + green + red, v8sf) / 3.0f;
+    deviation = ABS_DEVIATION(blue, visi_mean);
+    deviation += ABS_DEVIATION(green, visi_mean);
+    deviation += ABS_DEVIATION(red, visi_mean);
+    whiteness = __builtin_convertvector(
+                    deviation / __builtin_convertvector(visi_mean, v8df),
+                    v8sf);
+
+    satu = zero;
+    if (params->test_saturation)
+    {
+        satu = (blue >= params->satu_blue) | (green >= params->satu_green)
+               | (red >= params->satu_red);
+    }
+
+    cloud &= satu
+             | ((visi_mean != zero_f)
+                & (whiteness < params->whiteness_lt_0_7));
+
+    /* Haze test, equation 3 */
+    cloud &= satu | ((blue + blue - red) > 1600);
+
+    /* Ratio 4/5 > 0.75 test, equation 4 */
+    cloud &= (swir1 != 0)
+             & (__builtin_convertvector(nir, v8sf)
+                / __builtin_convertvector(swir1, v8sf) > 0.75f);
+
+    /* Cirrus cloud test */
+    if (params->use_cirrus)
+        cloud |= (LOAD_BAND(values, line[BI_CIRRUS], col) > 100);
+
+    bits = (cloud & CF_CLOUD_BIT) | (snow & CF_SNOW_BIT)
+           | (water & CF_WATER_BIT);
+    bits = (fill & CF_FILL_BIT) | (~fill & bits);
+
+    for (lane = 0; lane < KERNEL_WIDTH; lane++)
+        test_bits[col + lane] = bits[lane];
+}
+
+
+/*****************************************************************************
+MODULE:  spectral_test_row_default
+
+PURPOSE: Vector kernel compiled for the base instruction set of the target,
+         SSE2 on x86-64 and NEON on AArch64
+
+RETURN: the first column which was not tested
+*****************************************************************************/
+static int spectral_test_row_default
+(
+    const Kernel_params_t *params, /* I: kernel parameters for the line */
+    int16 **line,                  /* I: band data for the line */
+    int ncols,                     /* I: number of columns in the line */
+    unsigned char *test_bits       /* O: spectral test bits */
+)
+{
+    int col;
+
+    for (col = 0; col + KERNEL_WIDTH <= ncols; col += KERNEL_WIDTH)
+        spectral_test_block(params, line, col, test_bits);
+
+    return col;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/*****************************************************************************
+MODULE:  spectral_test_row_avx2
+
+PURPOSE: Vector kernel compiled for AVX2
+
+RETURN: the first column which was not tested
+*****************************************************************************/
+__attribute__ ((target ("avx2")))
+static int spectral_test_row_avx2
+(
+    const Kernel_params_t *params, /* I: kernel parameters for the line */
+    int16 **line,                  /* I: band data for the line */
+    int ncols,                     /* I: number of columns in the line */
+    unsigned char *test_bits       /* O: spectral test bits */
+)
+{
+    int col;
+
+    for (col = 0; col + KERNEL_WIDTH <= ncols; col += KERNEL_WIDTH)
+        spectral_test_block(params, line, col, test_bits);
+
+    return col;
+}
+#endif
+
+
+/*****************************************************************************
+MODULE:  spectral_test_row
+
+PURPOSE: Apply the spectral tests of the first pass to a line, selecting the
+         vector kernel supported by the processor and testing the remaining
+         columns with the scalar version
+
+NOTES:
+1. The saturated values of the line are expected to be replaced already.
+*****************************************************************************/
+void spectral_test_row
+(
+    Input_t *input,           /* I: input structure */
+    int16 **line,             /* I: band data for the line, indexed by band */
+    int ncols,                /* I: number of columns in the line */
+    bool use_cirrus,          /* I: use the cirrus data or not */
+    bool use_thermal,         /* I: use the thermal data or not */
+    unsigned char *test_bits  /* O: spectral test bits for each column */
+)
+{
+    Kernel_params_t params;
+    int col;
+
+    params.use_cirrus = use_cirrus;
+    params.use_thermal = use_thermal;
+    params.test_saturation = (input->satellite != IS_LANDSAT_8);
+    params.satu_blue = input->meta.satu_value_max[BI_BLUE] - 1;
+    params.satu_green = input->meta.satu_value_max[BI_GREEN] - 1;
+    params.satu_red = input->meta.satu_value_max[BI_RED] - 1;
+    params.ndvi_lt_0_8 = float_below(0.8);
+    params.ndsi_lt_0_8 = float_below(0.8);
+    params.ndsi_gt_0_15 = float_above(0.15);
+    params.ndvi_lt_0_01 = float_below(0.01);
+    params.ndvi_lt_0_1 = float_below(0.1);
+    params.whiteness_lt_0_7 = float_below(0.7);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        col = spectral_test_row_avx2(&params, line, ncols, test_bits);
+    else
+#endif
+        col = spectral_test_row_default(&params, line, ncols, test_bits);
+
+    spectral_test_row_scalar(input, line, col, ncols, use_cirrus,
+                             use_thermal, test_bits);
+}
@@ -0,0 +1,70 @@
+#ifndef SPECTRAL_TESTS_H
+#define SPECTRAL_TESTS_H
+
+
+#include <stdbool.h>
+
+
+#include "input.h"
+
+
+bool is_fill_data
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    bool use_cirrus, /* I: use the cirrus data or not */
+    bool use_thermal /* I: use the thermal data or not */
+);
+
+
+bool basic_cloud_test
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    float ndvi,      /* I: NDVI value */
+    float ndsi,      /* I: NDSI value */
+    bool use_thermal /* I: use the thermal data or not */
+);
+
+
+bool basic_snow_test
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    float ndsi,      /* I: NDSI value */
+    bool use_thermal /* I: use the thermal data or not */
+);
+
+
+bool zhe_water_test
+(
+    int16 **line,    /* I: band data for the line, indexed by band */
+    int column,      /* I: column in the input data array */
+    float ndvi       /* I: NDVI value */
+);
+
+
+void spectral_test_row_scalar
+(
+    Input_t *input,           /* I: input structure */
+    int16 **line,             /* I: band data for the line, indexed by band */
+    int first_col,            /* I: first column to test */
+    int ncols,                /* I: number of columns in the line */
+    bool use_cirrus,          /* I: use the cirrus data or not */
+    bool use_thermal,         /* I: use the thermal data or not */
+    unsigned char *test_bits  /* O: spectral test bits for each column */
+);
+
+
+void spectral_test_row
+(
+    Input_t *input,           /* I: input structure */
+    int16 **line,             /* I: band data for the line, indexed by band */
+    int ncols,                /* I: number of columns in the line */
+    bool use_cirrus,          /* I: use the cirrus data or not */
+    bool use_thermal,         /* I: use the thermal data or not */
+    unsigned char *test_bits  /* O: spectral test bits for each column */
+);
+
+
+#endif
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+
+#include "espa_geoloc.h"
+
+
+#include "const.h"
+#include "error.h"
+#include "input.h"
+#include "bit_mask.h"
+#include "stage_cache.h"
+
+
+/* First bytes of a stage cache file */
+#define STAGE_CACHE_MAGIC "CFMSTAGE"
+#define STAGE_CACHE_MAGIC_BYTES 8
+
+/* Offset basis and prime of the 64 bit FNV-1a hash */
+#define INPUT_HASH_BASIS 14695981039346656037ULL
+#define INPUT_HASH_PRIME 1099511628211ULL
+
+
+/*****************************************************************************
+MODULE:  hash_bytes
+
+PURPOSE: Add bytes to an FNV-1a hash
+
+RETURN: the updated hash
+*****************************************************************************/
+static uint64_t hash_bytes
+(
+    uint64_t hash,      /* I: hash of the previous bytes */
+    const void *bytes,  /* I: bytes to add */
+    size_t count        /* I: number of bytes */
+)
+{
+    const unsigned char *byte = bytes;
+    size_t index;
+
+    for (index = 0; index < count; index++)
+    {
+        hash ^= byte[index];
+        hash *= INPUT_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+
+/*****************************************************************************
+MODULE:  hash_input
+
+PURPOSE: Hash the metadata the masking uses and the size and modification
+         time of each band file of a scene
+
+RETURN: the hash of the input
+
+NOTES:
+1. The band files are hashed by their size and time, not their contents, so
+   the key is found without reading the bands.  The XML file isn't hashed
+   since cfmask appends its own bands to it.
+*****************************************************************************/
+static uint64_t hash_input
+(
+    const Input_t *input    /* I: opened input of the scene */
+)
+{
+    const Input_meta_t *meta = &input->meta;
+    uint64_t hash = INPUT_HASH_BASIS;
+    int band_index;
+
+    hash = hash_bytes(hash, &input->sensor, sizeof(input->sensor));
+    hash = hash_bytes(hash, &meta->sun_zen, sizeof(meta->sun_zen));
+    hash = hash_bytes(hash, &meta->sun_az, sizeof(meta->sun_az));
+    hash = hash_bytes(hash, &meta->fill, sizeof(meta->fill));
+    hash = hash_bytes(hash, meta->pixel_size, sizeof(meta->pixel_size));
+    hash = hash_bytes(hash, &meta->ul_corner.lat, sizeof(double));
+    hash = hash_bytes(hash, &meta->ul_corner.lon, sizeof(double));
+    hash = hash_bytes(hash, &meta->lr_corner.lat, sizeof(double));
+    hash = hash_bytes(hash, &meta->lr_corner.lon, sizeof(double));
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        struct stat band_stat;
+        int64_t band_size;
+        int64_t band_time;
+
+        /* Only the values of the bands of the scene are set */
+        if (!input->open[band_index] || input->file_name[band_index] == NULL)
+            continue;
+
+        hash = hash_bytes(hash, &meta->satu_value_ref[band_index],
+                          sizeof(meta->satu_value_ref[band_index]));
+        hash = hash_bytes(hash, &meta->satu_value_max[band_index],
+                          sizeof(meta->satu_value_max[band_index]));
+        hash = hash_bytes(hash, &meta->gain[band_index],
+                          sizeof(meta->gain[band_index]));
+        hash = hash_bytes(hash, &meta->bias[band_index],
+                          sizeof(meta->bias[band_index]));
+        if (band_index == BI_THERMAL)
+        {
+            hash = hash_bytes(hash, &meta->therm_scale_fact,
+                              sizeof(meta->therm_scale_fact));
+
+            /* The constants of the other satellites aren't in the
+               metadata */
+            if (input->satellite == IS_LANDSAT_8)
+            {
+                hash = hash_bytes(hash, &meta->k1, sizeof(meta->k1));
+                hash = hash_bytes(hash, &meta->k2, sizeof(meta->k2));
+            }
+        }
+        hash = hash_bytes(hash, input->file_name[band_index],
+                          strlen(input->file_name[band_index]));
+        if (stat(input->file_name[band_index], &band_stat) != 0)
+            continue;
+        band_size = band_stat.st_size;
+        band_time = band_stat.st_mtime;
+        hash = hash_bytes(hash, &band_size, sizeof(band_size));
+        hash = hash_bytes(hash, &band_time, sizeof(band_time));
+    }
+
+    return hash;
+}
+
+
+/*****************************************************************************
+MODULE:  read_stage_file
+
+PURPOSE: Read the stages kept in a stage cache file, when the file is for
+         the same version and inputs
+
+RETURN: true when the stages were read, false when the file is missing, is
+        for other inputs or can't be read
+
+NOTES:
+1. The file is in the byte order of the machine that wrote it, another byte
+   order doesn't match the magic and the version and the file is ignored.
+*****************************************************************************/
+static bool read_stage_file
+(
+    Stage_cache_t *cache    /* I/O: stages kept for the scene */
+)
+{
+    FILE *fd;
+    char magic[STAGE_CACHE_MAGIC_BYTES];
+    int32_t version;
+    Potential_key_t potential_key;
+    int32_t have_stage[2];
+    int32_t all_cloud;
+    float values[5];
+    size_t pixel_count = cache->pixel_count;
+    size_t mask_words = bit_mask_bytes(cache->potential_key.nrows,
+                                       cache->potential_key.ncols)
+                        / sizeof(uint64_t);
+    bool ok;
+
+    fd = fopen(cache->file_name, "rb");
+    if (fd == NULL)
+        return false;
+
+    ok = fread(magic, 1, sizeof(magic), fd) == sizeof(magic)
+         && memcmp(magic, STAGE_CACHE_MAGIC, sizeof(magic)) == 0
+         && fread(&version, sizeof(version), 1, fd) == 1
+         && version == STAGE_CACHE_VERSION
+         && fread(&potential_key, sizeof(potential_key), 1, fd) == 1
+         && memcmp(&potential_key, &cache->potential_key,
+                   sizeof(potential_key)) == 0
+         && fread(have_stage, sizeof(int32_t), 2, fd) == 2;
+
+    if (ok && have_stage[0])
+    {
+        Potential_stage_t *potential = &cache->potential;
+
+        ok = fread(&all_cloud, sizeof(all_cloud), 1, fd) == 1
+             && fread(values, sizeof(float), 5, fd) == 5
+             && fread(potential->pixel_mask, 1, pixel_count, fd)
+                == pixel_count;
+        if (ok && !all_cloud)
+        {
+            ok = fread(potential->cloud_score, sizeof(float), pixel_count,
+                       fd) == pixel_count;
+        }
+        potential->all_cloud = all_cloud;
+        potential->clear_ptm = values[0];
+        potential->t_templ = values[1];
+        potential->t_temph = values[2];
+        potential->land_threshold = values[3];
+        potential->water_threshold = values[4];
+        cache->have_potential = ok;
+    }
+
+    /* The match stage is only of use with the potential stage it was
+       matched from */
+    if (ok && have_stage[0] && have_stage[1])
+    {
+        ok = fread(&cache->match_key, sizeof(cache->match_key), 1, fd) == 1
+             && fread(cache->match.cloud_words, sizeof(uint64_t), mask_words,
+                      fd) == mask_words
+             && fread(cache->match.shadow_words, sizeof(uint64_t),
+                      mask_words, fd) == mask_words;
+        cache->have_match = ok;
+    }
+    fclose(fd);
+
+    if (!ok)
+    {
+        cache->have_potential = false;
+        cache->have_match = false;
+    }
+
+    return ok;
+}
+
+
+/*****************************************************************************
+MODULE:  open_stage_cache
+
+PURPOSE: Set up the stages kept for a scene and read the ones its stage
+         cache file has for the same inputs
+
+RETURN: SUCCESS
+        FAILURE when the memory of the stages can't be allocated
+
+NOTES:
+1. A missing file, or a file for other inputs or of another version, isn't
+   an error.  All of the stages are run and the file is replaced by
+   write_stage_cache.
+2. The stages take five bytes per pixel for the potential mask and a
+   quarter byte for the calibration masks, in memory and in the file.
+*****************************************************************************/
+int open_stage_cache
+(
+    const char *file_name,  /* I: sidecar file of the stages */
+    const Input_t *input,   /* I: opened input of the scene */
+    bool use_cirrus,        /* I: the Cirrus band is used */
+    bool use_thermal,       /* I: the thermal band is used */
+    Stage_cache_t *cache    /* O: stages kept for the scene */
+)
+{
+    char *FUNC_NAME = "open_stage_cache";
+    int nrows = input->size.l;
+    int ncols = input->size.s;
+    size_t mask_bytes = bit_mask_bytes(nrows, ncols);
+
+    memset(cache, 0, sizeof(*cache));
+    cache->potential_key.nrows = nrows;
+    cache->potential_key.ncols = ncols;
+    cache->potential_key.satellite = input->satellite;
+    cache->potential_key.use_cirrus = use_cirrus;
+    cache->potential_key.use_thermal = use_thermal;
+    cache->potential_key.input_hash = hash_input(input);
+    cache->pixel_count = nrows * ncols;
+
+    cache->file_name = strdup(file_name);
+    cache->potential.pixel_mask = calloc(cache->pixel_count,
+                                         sizeof(unsigned char));
+    cache->potential.cloud_score = calloc(cache->pixel_count, sizeof(float));
+    cache->match.cloud_words = calloc(1, mask_bytes);
+    cache->match.shadow_words = calloc(1, mask_bytes);
+    if (cache->file_name == NULL || cache->potential.pixel_mask == NULL
+        || cache->potential.cloud_score == NULL
+        || cache->match.cloud_words == NULL
+        || cache->match.shadow_words == NULL)
+    {
+        free_stage_cache(cache);
+        RETURN_ERROR("Allocating the stage cache", FUNC_NAME, FAILURE);
+    }
+
+    if (read_stage_file(cache))
+    {
+        printf("Stage cache %s read, potential mask %s, shadow match %s\n",
+               file_name, cache->have_potential ? "kept" : "not kept",
+               cache->have_match ? "kept" : "not kept");
+    }
+    else
+    {
+        printf("No stage cache for these inputs in %s, all of the stages"
+               " are run\n", file_name);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  keep_potential_stage
+
+PURPOSE: Record that the potential stage was run, which also discards the
+         match stage matched from the previous potential stage
+*****************************************************************************/
+void keep_potential_stage
+(
+    Stage_cache_t *cache    /* I/O: stages kept for the scene */
+)
+{
+    cache->have_potential = true;
+    cache->have_match = false;
+    cache->modified = true;
+}
+
+
+/*****************************************************************************
+MODULE:  find_match_stage
+
+PURPOSE: Find whether the match stage kept for the scene was matched with
+         the same parameters.  Otherwise the stage is taken over for the
+         match about to be run with the new parameters.
+
+RETURN: true when the kept match stage can be used
+*****************************************************************************/
+bool find_match_stage
+(
+    Stage_cache_t *cache,   /* I/O: stages kept for the scene */
+    float cloud_prob,       /* I: cloud probability threshold */
+    bool fast_height_search, /* I: subsampled height search */
+    int pyramid_factor      /* I: reduction of the first height search */
+)
+{
+    Match_key_t match_key;
+
+    memset(&match_key, 0, sizeof(match_key));
+    match_key.cloud_prob = cloud_prob;
+    match_key.fast_height_search = fast_height_search;
+    match_key.pyramid_factor = pyramid_factor;
+
+    if (cache->have_match
+        && memcmp(&match_key, &cache->match_key, sizeof(match_key)) == 0)
+    {
+        return true;
+    }
+
+    cache->match_key = match_key;
+    cache->have_match = true;
+    cache->modified = true;
+
+    return false;
+}
+
+
+/*****************************************************************************
+MODULE:  write_stage_cache
+
+PURPOSE: Write the stages kept for a scene to its stage cache file, when a
+         stage was run since the file was read
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The stages are written to a temporary file which then replaces the
+   cache file, so an interrupted write never leaves a partial cache.
+*****************************************************************************/
+int write_stage_cache
+(
+    Stage_cache_t *cache    /* I/O: stages kept for the scene */
+)
+{
+    char *FUNC_NAME = "write_stage_cache";
+    char errstr[MAX_STR_LEN];    /* error string */
+    char temp_file[MAX_STR_LEN]; /* file the stages are written to */
+    FILE *fd;
+    int32_t version = STAGE_CACHE_VERSION;
+    int32_t have_stage[2];
+    int32_t all_cloud = cache->potential.all_cloud;
+    float values[5];
+    size_t pixel_count = cache->pixel_count;
+    size_t mask_words = bit_mask_bytes(cache->potential_key.nrows,
+                                       cache->potential_key.ncols)
+                        / sizeof(uint64_t);
+    bool ok;
+
+    if (!cache->modified)
+        return SUCCESS;
+
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", cache->file_name);
+    fd = fopen(temp_file, "wb");
+    if (fd == NULL)
+    {
+        snprintf(errstr, sizeof(errstr), "Opening the stage cache %s",
+                 temp_file);
+        RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+    }
+
+    have_stage[0] = cache->have_potential;
+    have_stage[1] = cache->have_potential && cache->have_match;
+    values[0] = cache->potential.clear_ptm;
+    values[1] = cache->potential.t_templ;
+    values[2] = cache->potential.t_temph;
+    values[3] = cache->potential.land_threshold;
+    values[4] = cache->potential.water_threshold;
+
+    ok = fwrite(STAGE_CACHE_MAGIC, 1, STAGE_CACHE_MAGIC_BYTES, fd)
+         == STAGE_CACHE_MAGIC_BYTES
+         && fwrite(&version, sizeof(version), 1, fd) == 1
+         && fwrite(&cache->potential_key, sizeof(cache->potential_key), 1,
+                   fd) == 1
+         && fwrite(have_stage, sizeof(int32_t), 2, fd) == 2;
+
+    if (ok && have_stage[0])
+    {
+        ok = fwrite(&all_cloud, sizeof(all_cloud), 1, fd) == 1
+             && fwrite(values, sizeof(float), 5, fd) == 5
+             && fwrite(cache->potential.pixel_mask, 1, pixel_count, fd)
+                == pixel_count;
+        if (ok && !all_cloud)
+        {
+            ok = fwrite(cache->potential.cloud_score, sizeof(float),
+                        pixel_count, fd) == pixel_count;
+        }
+    }
+
+    if (ok && have_stage[1])
+    {
+        ok = fwrite(&cache->match_key, sizeof(cache->match_key), 1, fd) == 1
+             && fwrite(cache->match.cloud_words, sizeof(uint64_t),
+                       mask_words, fd) == mask_words
+             && fwrite(cache->match.shadow_words, sizeof(uint64_t),
+                       mask_words, fd) == mask_words;
+    }
+
+    if (fclose(fd) != 0)
+        ok = false;
+    if (!ok || rename(temp_file, cache->file_name) != 0)
+    {
+        remove(temp_file);
+        snprintf(errstr, sizeof(errstr), "Writing the stage cache %s",
+                 cache->file_name);
+        RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+    }
+    cache->modified = false;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  free_stage_cache
+
+PURPOSE: Release the memory of the stages kept for a scene
+*****************************************************************************/
+void free_stage_cache
+(
+    Stage_cache_t *cache    /* I/O: stages to release */
+)
+{
+    free(cache->file_name);
+    cache->file_name = NULL;
+    free(cache->potential.pixel_mask);
+    cache->potential.pixel_mask = NULL;
+    free(cache->potential.cloud_score);
+    cache->potential.cloud_score = NULL;
+    free(cache->match.cloud_words);
+    cache->match.cloud_words = NULL;
+    free(cache->match.shadow_words);
+    cache->match.shadow_words = NULL;
+    cache->have_potential = false;
+    cache->have_match = false;
+}
@@ -0,0 +1,115 @@
+#ifndef STAGE_CACHE_H
+#define STAGE_CACHE_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "input.h"
+
+
+/* Version of the stage cache files, changed with the layout of the file or
+   the meaning of a kept stage so older files are ignored */
+#define STAGE_CACHE_VERSION 1
+
+
+/* Intermediates of the potential mask, which don't depend on the cloud
+   probability threshold */
+typedef struct
+{
+    bool all_cloud;         /* too few clear pixels, the pixel mask is final
+                               and there are no cloud scores */
+    float clear_ptm;        /* percent of clear-sky pixels */
+    float t_templ;          /* percentile of low background temperature */
+    float t_temph;          /* percentile of high background temperature */
+    float land_threshold;   /* dynamic land probability threshold, before
+                               the cloud probability threshold is added */
+    float water_threshold;  /* dynamic water probability threshold, before
+                               the cloud probability threshold is added */
+    unsigned char *pixel_mask; /* pixel mask with the potential shadow bits,
+                                  before the cloud confidence */
+    float *cloud_score;     /* cloud score of each non-fill pixel */
+} Potential_stage_t;
+
+/* Calibration masks of the shadow match, before the dilate */
+typedef struct
+{
+    uint64_t *cloud_words;  /* words of the calibration cloud mask */
+    uint64_t *shadow_words; /* words of the calibration shadow mask */
+} Match_stage_t;
+
+/* Inputs the potential mask depends on */
+typedef struct
+{
+    int64_t nrows;          /* number of lines */
+    int64_t ncols;          /* number of samples */
+    int64_t satellite;      /* satellite of the scene */
+    int64_t use_cirrus;     /* the Cirrus band is used */
+    int64_t use_thermal;    /* the thermal band is used */
+    uint64_t input_hash;    /* hash of the metadata and of the size and
+                               modification time of the band files */
+} Potential_key_t;
+
+/* Parameters the shadow match depends on, besides the potential mask */
+typedef struct
+{
+    float cloud_prob;           /* cloud probability threshold */
+    int32_t fast_height_search; /* subsampled height search */
+    int32_t pyramid_factor;     /* reduction of the first height search */
+} Match_key_t;
+
+/* Intermediates of the stages of a scene kept in a sidecar file, so a run
+   with other parameters only has to run the stages whose inputs changed */
+typedef struct
+{
+    char *file_name;              /* sidecar file of the stages */
+    Potential_key_t potential_key;
+    bool have_potential;          /* the potential stage is kept */
+    Potential_stage_t potential;
+    Match_key_t match_key;
+    bool have_match;              /* the match stage is kept */
+    Match_stage_t match;
+    int pixel_count;              /* number of pixels of the scene */
+    bool modified;                /* a stage was run since the file was
+                                     read */
+} Stage_cache_t;
+
+
+int open_stage_cache
+(
+    const char *file_name,  /* I: sidecar file of the stages */
+    const Input_t *input,   /* I: opened input of the scene */
+    bool use_cirrus,        /* I: the Cirrus band is used */
+    bool use_thermal,       /* I: the thermal band is used */
+    Stage_cache_t *cache    /* O: stages kept for the scene */
+);
+
+
+void keep_potential_stage
+(
+    Stage_cache_t *cache    /* I/O: stages kept for the scene */
+);
+
+
+bool find_match_stage
+(
+    Stage_cache_t *cache,   /* I/O: stages kept for the scene */
+    float cloud_prob,       /* I: cloud probability threshold */
+    bool fast_height_search, /* I: subsampled height search */
+    int pyramid_factor      /* I: reduction of the first height search */
+);
+
+
+int write_stage_cache
+(
+    Stage_cache_t *cache    /* I/O: stages kept for the scene */
+);
+
+
+void free_stage_cache
+(
+    Stage_cache_t *cache    /* I/O: stages to release */
+);
+
+
+#endif
@@ -0,0 +1,184 @@
+#ifdef __linux__
+    #define _GNU_SOURCE
+    #include <sched.h>
+#endif
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+
+#include "const.h"
+#include "error.h"
+#include "threads.h"
+
+
+/*****************************************************************************
+MODULE:  pin_threads_to_cpus
+
+PURPOSE: Pin each thread of the OpenMP team to its own CPU, spread evenly
+         over the CPUs the process may run on
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The threads are spread in order, so with the CPUs of each socket numbered
+   together the low numbered threads share a socket.  The parallel loops
+   give each thread a contiguous part of the scene, so with first_touch the
+   part of each thread is in the memory of its own socket.
+2. The OpenMP runtime keeps the threads of the team for the later parallel
+   regions of the same size, so they stay pinned.
+*****************************************************************************/
+static int pin_threads_to_cpus
+(
+    bool verbose /* I: print the CPU of each thread */
+)
+{
+#if defined(_OPENMP) && defined(__linux__)
+    char *FUNC_NAME = "pin_threads_to_cpus";
+    cpu_set_t allowed;         /* CPUs the process may run on */
+    int *cpus;                 /* numbers of the allowed CPUs */
+    int cpu_count = 0;
+    int cpu;
+    bool failed = false;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        RETURN_ERROR("Reading the CPU affinity", FUNC_NAME, FAILURE);
+    }
+
+    cpus = malloc(CPU_SETSIZE * sizeof(int));
+    if (cpus == NULL)
+    {
+        RETURN_ERROR("Allocating the CPU list", FUNC_NAME, FAILURE);
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[cpu_count++] = cpu;
+    }
+
+    #pragma omp parallel
+    {
+        int thread = omp_get_thread_num();
+        int thread_count = omp_get_num_threads();
+        int thread_cpu = cpus[(long)thread * cpu_count / thread_count];
+        cpu_set_t thread_set;
+
+        CPU_ZERO(&thread_set);
+        CPU_SET(thread_cpu, &thread_set);
+
+        /* On Linux the process id 0 is the calling thread */
+        if (sched_setaffinity(0, sizeof(thread_set), &thread_set) != 0)
+            failed = true;
+        else if (verbose)
+            printf("Thread %d pinned to CPU %d\n", thread, thread_cpu);
+    }
+    free(cpus);
+
+    if (failed)
+    {
+        RETURN_ERROR("Pinning the threads to the CPUs", FUNC_NAME, FAILURE);
+    }
+#else
+    printf("Thread pinning isn't available in this build, the threads"
+           " aren't pinned\n");
+#endif
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  configure_threads
+
+PURPOSE: Set the number of threads of the parallel loops and optionally pin
+         them to the CPUs
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. Without a thread count the OpenMP default is used, which follows
+   OMP_NUM_THREADS.
+2. This has to be called before the scene buffers are touched, see
+   first_touch.
+*****************************************************************************/
+int configure_threads
+(
+    int thread_count, /* I: number of threads, 0 for the OpenMP default */
+    bool pin_threads, /* I: pin each thread to a CPU */
+    bool verbose      /* I: print the placement of the threads */
+)
+{
+#ifdef _OPENMP
+    if (thread_count > 0)
+        omp_set_num_threads(thread_count);
+
+    /* The schedule of the threads has to stay the same for the pinning and
+       the first touch to match the compute loops */
+    if (pin_threads)
+        omp_set_dynamic(0);
+
+    if (verbose)
+        printf("Number of threads: %d\n", omp_get_max_threads());
+#else
+    if (thread_count > 1)
+    {
+        printf("Threading isn't enabled in this build, using one thread\n");
+    }
+#endif
+
+    if (pin_threads && pin_threads_to_cpus(verbose) != SUCCESS)
+    {
+        RETURN_ERROR("Placing the threads", "configure_threads", FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  first_touch
+
+PURPOSE: Fill a scene buffer with the threads writing the same parts of it
+         the parallel pixel loops give them, so on a NUMA system the pages
+         of each part are placed in the memory of the thread using them
+
+NOTES:
+1. The buffer is split into one contiguous block for each thread, the same
+   as the static schedule of the pixel loops.  Pages are placed when they
+   are first written, so this only places memory which hasn't been written
+   yet, such as a new allocation.
+*****************************************************************************/
+void first_touch
+(
+    void *buffer,       /* O: memory to fill */
+    size_t bytes,       /* I: number of bytes to fill */
+    unsigned char value /* I: value of each byte */
+)
+{
+#ifdef _OPENMP
+    #pragma omp parallel
+    {
+        size_t thread = omp_get_thread_num();
+        size_t thread_count = omp_get_num_threads();
+        size_t start = bytes / thread_count * thread
+                       + (thread < bytes % thread_count
+                          ? thread : bytes % thread_count);
+        size_t count = bytes / thread_count
+                       + (thread < bytes % thread_count ? 1 : 0);
+
+        memset((unsigned char *)buffer + start, value, count);
+    }
+#else
+    memset(buffer, value, bytes);
+#endif
+}
@@ -0,0 +1,25 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+int configure_threads
+(
+    int thread_count, /* I: number of threads, 0 for the OpenMP default */
+    bool pin_threads, /* I: pin each thread to a CPU */
+    bool verbose      /* I: print the placement of the threads */
+);
+
+
+void first_touch
+(
+    void *buffer,       /* O: memory to fill */
+    size_t bytes,       /* I: number of bytes to fill */
+    unsigned char value /* I: value of each byte */
+);
+
+
+#endif
@@ -0,0 +1,371 @@
+/*****************************************************************************
+!File: tiff_output.c
+
+Writes an 8-bit mask as an internally tiled, deflate compressed TIFF.
+*****************************************************************************/
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <zlib.h>
+
+
+#include "const.h"
+#include "error.h"
+#include "profile.h"
+#include "tiff_output.h"
+
+
+/* TIFF tags written, in the ascending order TIFF requires */
+#define TIFF_TAG_IMAGE_WIDTH        256
+#define TIFF_TAG_IMAGE_LENGTH       257
+#define TIFF_TAG_BITS_PER_SAMPLE    258
+#define TIFF_TAG_COMPRESSION        259
+#define TIFF_TAG_PHOTOMETRIC        262
+#define TIFF_TAG_SAMPLES_PER_PIXEL  277
+#define TIFF_TAG_PLANAR_CONFIG      284
+#define TIFF_TAG_TILE_WIDTH         322
+#define TIFF_TAG_TILE_LENGTH        323
+#define TIFF_TAG_TILE_OFFSETS       324
+#define TIFF_TAG_TILE_BYTE_COUNTS   325
+#define TIFF_TAG_SAMPLE_FORMAT      339
+#define TIFF_TAG_GDAL_NODATA        42113
+
+/* TIFF field types */
+#define TIFF_TYPE_ASCII 2
+#define TIFF_TYPE_SHORT 3
+#define TIFF_TYPE_LONG  4
+
+/* Adobe deflate compression, which is a zlib stream */
+#define TIFF_COMPRESSION_DEFLATE 8
+
+/* Maximum number of IFD entries written */
+#define MAX_TIFF_ENTRIES 13
+
+/* zlib compression level of the tiles */
+#define TIFF_DEFLATE_LEVEL 6
+
+
+/* One IFD entry, with the value or the offset of the values */
+typedef struct
+{
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    unsigned char value[4];
+} Tiff_entry_t;
+
+
+/*****************************************************************************
+MODULE:  put_u16, put_u32
+
+PURPOSE: Store a value in little endian byte order
+*****************************************************************************/
+static void put_u16
+(
+    unsigned char *bytes, /* O: two bytes */
+    uint16_t value        /* I: value to store */
+)
+{
+    bytes[0] = value & 0xff;
+    bytes[1] = (value >> 8) & 0xff;
+}
+
+static void put_u32
+(
+    unsigned char *bytes, /* O: four bytes */
+    uint32_t value        /* I: value to store */
+)
+{
+    bytes[0] = value & 0xff;
+    bytes[1] = (value >> 8) & 0xff;
+    bytes[2] = (value >> 16) & 0xff;
+    bytes[3] = (value >> 24) & 0xff;
+}
+
+
+/*****************************************************************************
+MODULE:  add_entry
+
+PURPOSE: Add an IFD entry with a single SHORT or LONG value, or with the
+         offset of its values
+*****************************************************************************/
+static void add_entry
+(
+    Tiff_entry_t *entries, /* I/O: IFD entries */
+    int *entry_count,      /* I/O: number of entries */
+    uint16_t tag,          /* I: tag of the entry */
+    uint16_t type,         /* I: TIFF_TYPE_SHORT or TIFF_TYPE_LONG */
+    uint32_t count,        /* I: number of values */
+    uint32_t value         /* I: value, or the offset of the values */
+)
+{
+    Tiff_entry_t *entry = &entries[*entry_count];
+
+    entry->tag = tag;
+    entry->type = type;
+    entry->count = count;
+    memset(entry->value, 0, sizeof(entry->value));
+    if (type == TIFF_TYPE_SHORT && count == 1)
+        put_u16(entry->value, value);
+    else
+        put_u32(entry->value, value);
+    (*entry_count)++;
+}
+
+
+/*****************************************************************************
+MODULE:  write_tiled_tiff
+
+PURPOSE: Write an 8-bit image as a tiled TIFF with each tile deflate
+         compressed
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+
+NOTES:
+1. The IFD and the tile offsets come first, followed by the tiles in row
+   major order, which is the layout of a cloud optimized GeoTIFF without the
+   overviews.  The tiles are written first and the IFD at the start of the
+   file once the tile sizes are known.
+2. The tiles of each row of tiles are compressed in parallel, the partial
+   tiles at the right and bottom edges are padded with zero.
+3. The fill value is stored in the GDAL_NODATA tag.
+*****************************************************************************/
+bool write_tiled_tiff
+(
+    FILE *fp,                   /* I: file opened for binary write */
+    const unsigned char *image, /* I: 8-bit image to write */
+    int nrows,                  /* I: number of rows */
+    int ncols,                  /* I: number of columns */
+    int nodata                  /* I: fill value, -1 for none */
+)
+{
+    char *FUNC_NAME = "write_tiled_tiff";
+    int tiles_across = (ncols + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    int tiles_down = (nrows + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    int tile_count = tiles_across * tiles_down;
+    size_t tile_bytes = TIFF_TILE_SIZE * TIFF_TILE_SIZE;
+    uLong packed_bound = compressBound(tile_bytes);
+    Tiff_entry_t entries[MAX_TIFF_ENTRIES];
+    int entry_count = 0;
+    uint32_t *tile_offsets = NULL;   /* file offset of each tile */
+    uint32_t *tile_sizes = NULL;     /* compressed size of each tile */
+    unsigned char *tile_data = NULL; /* uncompressed tiles of a tile row */
+    unsigned char *packed = NULL;    /* compressed tiles of a tile row */
+    uLongf *packed_sizes = NULL;     /* compressed size of each tile */
+    unsigned char *header = NULL;    /* header, IFD and tile arrays */
+    size_t header_size;
+    size_t arrays_offset;            /* offset of the tile arrays */
+    unsigned long long file_offset;  /* offset of the next tile */
+    unsigned long long bytes_written = 0;
+    bool failed = false;
+    int tile_row;
+    int entry_index;
+    int index;
+
+    tile_offsets = malloc(tile_count * sizeof(*tile_offsets));
+    tile_sizes = malloc(tile_count * sizeof(*tile_sizes));
+    tile_data = malloc(tiles_across * tile_bytes);
+    packed = malloc(tiles_across * packed_bound);
+    packed_sizes = malloc(tiles_across * sizeof(*packed_sizes));
+    if (tile_offsets == NULL || tile_sizes == NULL || tile_data == NULL
+        || packed == NULL || packed_sizes == NULL)
+    {
+        free(tile_offsets);
+        free(tile_sizes);
+        free(tile_data);
+        free(packed);
+        free(packed_sizes);
+        RETURN_ERROR("allocating the TIFF tile buffers", FUNC_NAME, false);
+    }
+
+    /* The IFD entries, the tile arrays are after the IFD unless there is
+       only one tile, which is stored in the entries */
+    entry_count = (nodata >= 0) ? 13 : 12;
+    arrays_offset = 8 + 2 + 12 * entry_count + 4;
+    header_size = arrays_offset;
+    if (tile_count > 1)
+        header_size += 2 * tile_count * sizeof(uint32_t);
+    entry_count = 0;
+
+    /* Write the tiles after the space for the header */
+    file_offset = header_size;
+    if (fseek(fp, header_size, SEEK_SET) != 0)
+        failed = true;
+
+    for (tile_row = 0; tile_row < tiles_down && !failed; tile_row++)
+    {
+        int tile_col;
+
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (tile_col = 0; tile_col < tiles_across; tile_col++)
+        {
+            unsigned char *tile = &tile_data[tile_col * tile_bytes];
+            int first_col = tile_col * TIFF_TILE_SIZE;
+            int first_row = tile_row * TIFF_TILE_SIZE;
+            int tile_cols = ncols - first_col;
+            int row;
+
+            if (tile_cols > TIFF_TILE_SIZE)
+                tile_cols = TIFF_TILE_SIZE;
+
+            memset(tile, 0, tile_bytes);
+            for (row = 0; row < TIFF_TILE_SIZE && first_row + row < nrows;
+                 row++)
+            {
+                memcpy(&tile[row * TIFF_TILE_SIZE],
+                       &image[(size_t)(first_row + row) * ncols + first_col],
+                       tile_cols);
+            }
+
+            packed_sizes[tile_col] = packed_bound;
+            if (compress2(&packed[tile_col * packed_bound],
+                          &packed_sizes[tile_col], tile, tile_bytes,
+                          TIFF_DEFLATE_LEVEL) != Z_OK)
+            {
+                packed_sizes[tile_col] = 0;
+            }
+        }
+
+        for (tile_col = 0; tile_col < tiles_across; tile_col++)
+        {
+            index = tile_row * tiles_across + tile_col;
+            if (packed_sizes[tile_col] == 0 || file_offset > UINT32_MAX
+                || fwrite(&packed[tile_col * packed_bound], 1,
+                          packed_sizes[tile_col], fp)
+                   != packed_sizes[tile_col])
+            {
+                failed = true;
+                break;
+            }
+            tile_offsets[index] = file_offset;
+            tile_sizes[index] = packed_sizes[tile_col];
+            file_offset += packed_sizes[tile_col];
+            bytes_written += packed_sizes[tile_col];
+        }
+    }
+
+    free(tile_data);
+    free(packed);
+    free(packed_sizes);
+
+    if (failed || file_offset > UINT32_MAX)
+    {
+        free(tile_offsets);
+        free(tile_sizes);
+        RETURN_ERROR("writing the TIFF tiles", FUNC_NAME, false);
+    }
+
+    /* Build the IFD */
+    add_entry(entries, &entry_count, TIFF_TAG_IMAGE_WIDTH, TIFF_TYPE_LONG, 1,
+              ncols);
+    add_entry(entries, &entry_count, TIFF_TAG_IMAGE_LENGTH, TIFF_TYPE_LONG, 1,
+              nrows);
+    add_entry(entries, &entry_count, TIFF_TAG_BITS_PER_SAMPLE,
+              TIFF_TYPE_SHORT, 1, 8);
+    add_entry(entries, &entry_count, TIFF_TAG_COMPRESSION, TIFF_TYPE_SHORT, 1,
+              TIFF_COMPRESSION_DEFLATE);
+    add_entry(entries, &entry_count, TIFF_TAG_PHOTOMETRIC, TIFF_TYPE_SHORT, 1,
+              1);
+    add_entry(entries, &entry_count, TIFF_TAG_SAMPLES_PER_PIXEL,
+              TIFF_TYPE_SHORT, 1, 1);
+    add_entry(entries, &entry_count, TIFF_TAG_PLANAR_CONFIG, TIFF_TYPE_SHORT,
+              1, 1);
+    add_entry(entries, &entry_count, TIFF_TAG_TILE_WIDTH, TIFF_TYPE_SHORT, 1,
+              TIFF_TILE_SIZE);
+    add_entry(entries, &entry_count, TIFF_TAG_TILE_LENGTH, TIFF_TYPE_SHORT, 1,
+              TIFF_TILE_SIZE);
+    if (tile_count > 1)
+    {
+        add_entry(entries, &entry_count, TIFF_TAG_TILE_OFFSETS,
+                  TIFF_TYPE_LONG, tile_count, arrays_offset);
+        add_entry(entries, &entry_count, TIFF_TAG_TILE_BYTE_COUNTS,
+                  TIFF_TYPE_LONG, tile_count,
+                  arrays_offset + tile_count * sizeof(uint32_t));
+    }
+    else
+    {
+        add_entry(entries, &entry_count, TIFF_TAG_TILE_OFFSETS,
+                  TIFF_TYPE_LONG, 1, tile_offsets[0]);
+        add_entry(entries, &entry_count, TIFF_TAG_TILE_BYTE_COUNTS,
+                  TIFF_TYPE_LONG, 1, tile_sizes[0]);
+    }
+    add_entry(entries, &entry_count, TIFF_TAG_SAMPLE_FORMAT, TIFF_TYPE_SHORT,
+              1, 1);
+    if (nodata >= 0)
+    {
+        /* The fill value as up to three digits, which fits in the entry */
+        Tiff_entry_t *entry = &entries[entry_count];
+
+        entry->tag = TIFF_TAG_GDAL_NODATA;
+        entry->type = TIFF_TYPE_ASCII;
+        memset(entry->value, 0, sizeof(entry->value));
+        snprintf((char *)entry->value, sizeof(entry->value), "%d",
+                 nodata % 1000);
+        entry->count = strlen((char *)entry->value) + 1;
+        entry_count++;
+    }
+
+    /* Write the header, the IFD and the tile arrays at the start */
+    header = calloc(header_size, 1);
+    if (header == NULL)
+    {
+        free(tile_offsets);
+        free(tile_sizes);
+        RETURN_ERROR("allocating the TIFF header", FUNC_NAME, false);
+    }
+
+    header[0] = 'I';
+    header[1] = 'I';
+    put_u16(&header[2], 42);
+    put_u32(&header[4], 8);
+    put_u16(&header[8], entry_count);
+    for (entry_index = 0; entry_index < entry_count; entry_index++)
+    {
+        unsigned char *bytes = &header[10 + 12 * entry_index];
+
+        put_u16(&bytes[0], entries[entry_index].tag);
+        put_u16(&bytes[2], entries[entry_index].type);
+        put_u32(&bytes[4], entries[entry_index].count);
+        memcpy(&bytes[8], entries[entry_index].value, 4);
+    }
+    put_u32(&header[10 + 12 * entry_count], 0);
+
+    if (tile_count > 1)
+    {
+        for (index = 0; index < tile_count; index++)
+        {
+            put_u32(&header[arrays_offset + 4 * index], tile_offsets[index]);
+            put_u32(&header[arrays_offset + 4 * (tile_count + index)],
+                    tile_sizes[index]);
+        }
+    }
+    free(tile_offsets);
+    free(tile_sizes);
+
+    if (fseek(fp, 0, SEEK_SET) != 0
+        || fwrite(header, 1, header_size, fp) != header_size)
+    {
+        free(header);
+        RETURN_ERROR("writing the TIFF header", FUNC_NAME, false);
+    }
+    free(header);
+    bytes_written += header_size;
+
+    profile_add_bytes_written(bytes_written);
+
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef TIFF_OUTPUT_H
+#define TIFF_OUTPUT_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+
+
+/* Width and height of the tiles of the TIFF output */
+#define TIFF_TILE_SIZE 256
+
+
+bool write_tiled_tiff
+(
+    FILE *fp,                   /* I: file opened for binary write */
+    const unsigned char *image, /* I: 8-bit image to write */
+    int nrows,                  /* I: number of rows */
+    int ncols,                  /* I: number of columns */
+    int nodata                  /* I: fill value, -1 for none */
+);
+
+
+#endif